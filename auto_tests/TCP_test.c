@@ -15,6 +15,9 @@
 
 #define NUM_PORTS 3
 
+/* Number of packets test_basic sends to the server in a single write. */
+#define NUM_COALESCED_REQUESTS 3
+
 #ifndef USE_IPV6
 #define USE_IPV6 1
 #endif
@@ -166,6 +169,32 @@ START_TEST(test_basic)
     ck_assert_msg(packet_resp_plain[1] == 0, "Server did not refuse the connection.");
     ck_assert_msg(public_key_cmp(packet_resp_plain + 2, f_public_key) == 0, "Server sent the wrong public key.");
 
+    // Sending several requests in a single write, all of which must be answered.
+    uint8_t r_reqs[NUM_COALESCED_REQUESTS * sizeof(r_req)];
+    size = net_htons(1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_MAC_SIZE);
+
+    for (uint32_t i = 0; i < NUM_COALESCED_REQUESTS; ++i) {
+        memcpy(r_reqs + i * sizeof(r_req), &size, 2);
+        encrypt_data_symmetric(f_shared_key, f_nonce, r_req_p, 1 + CRYPTO_PUBLIC_KEY_SIZE, r_reqs + i * sizeof(r_req) + 2);
+        increment_nonce(f_nonce);
+    }
+
+    ck_assert_msg(net_send(sock, r_reqs, sizeof(r_reqs)) == sizeof(r_reqs), "Failed to send coalesced requests.");
+    c_sleep(50);
+    mono_time_update(mono_time);
+    do_TCP_server(tcp_s, mono_time);
+    c_sleep(50);
+
+    for (uint32_t i = 0; i < NUM_COALESCED_REQUESTS; ++i) {
+        recv_data_len = net_recv(sock, packet_resp, 2 + 2 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_MAC_SIZE);
+        ck_assert_msg(recv_data_len == 2 + 2 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_MAC_SIZE,
+                      "Failed to receive server response to coalesced request %u. %d", i, recv_data_len);
+        ret = decrypt_data_symmetric(f_shared_key, f_nonce_r, packet_resp + 2, recv_data_len - 2, packet_resp_plain);
+        ck_assert_msg(ret != -1, "Failed to decrypt the TCP server's response.");
+        increment_nonce(f_nonce_r);
+        ck_assert_msg(packet_resp_plain[0] == 1, "Server sent the wrong packet id: %u", packet_resp_plain[0]);
+    }
+
     // Closing connections.
     kill_sock(sock);
     kill_TCP_server(tcp_s);
@@ -455,7 +484,21 @@ static int oob_data_callback(void *object, const uint8_t *public_key, const uint
     return 1;
 }
 
-START_TEST(test_client)
+// Handshake workers finish in the background. Without worker threads, their
+// results are only picked up by the next do_TCP_server().
+static void run_server(TCP_Server *tcp_s, Mono_Time *mono_time, uint32_t num_handshake_workers)
+{
+    do_TCP_server_delay(tcp_s, mono_time, 50);
+
+    if (num_handshake_workers != 0) {
+        mono_time_update(mono_time);
+        do_TCP_server(tcp_s, mono_time);
+    }
+}
+
+// With num_workers > 0, the server runs on worker threads of its own. With
+// num_handshake_workers > 0, it computes handshakes on threads of their own.
+static void check_client(uint32_t num_workers, uint32_t num_handshake_workers)
 {
     Mono_Time *mono_time = mono_time_new();
 
@@ -466,6 +509,17 @@ START_TEST(test_client)
     ck_assert_msg(tcp_s != nullptr, "Failed to create a TCP relay server.");
     ck_assert_msg(tcp_server_listen_count(tcp_s) == NUM_PORTS, "Failed to bind the relay server to all ports.");
 
+    if (num_workers != 0) {
+        ck_assert_msg(tcp_server_start_workers(tcp_s, num_workers), "Failed to start %u worker threads.", num_workers);
+        ck_assert(tcp_server_num_workers(tcp_s) == num_workers);
+    }
+
+    if (num_handshake_workers != 0) {
+        ck_assert_msg(tcp_server_start_handshake_workers(tcp_s, num_handshake_workers),
+                      "Failed to start %u handshake workers.", num_handshake_workers);
+        ck_assert(tcp_server_num_handshake_workers(tcp_s) == num_handshake_workers);
+    }
+
     uint8_t f_public_key[CRYPTO_PUBLIC_KEY_SIZE];
     uint8_t f_secret_key[CRYPTO_SECRET_KEY_SIZE];
     crypto_new_keypair(f_public_key, f_secret_key);
@@ -480,11 +534,13 @@ START_TEST(test_client)
     c_sleep(50);
 
     // The connection status should be unconfirmed here because we have finished
-    // sending our data and are awaiting a response.
-    ck_assert_msg(tcp_con_status(conn) == TCP_CLIENT_UNCONFIRMED, "Wrong connection status. Expected: %d, is: %d.",
-                  TCP_CLIENT_UNCONFIRMED, tcp_con_status(conn));
+    // sending our data and are awaiting a response. Worker threads may have
+    // already responded.
+    ck_assert_msg(tcp_con_status(conn) == TCP_CLIENT_UNCONFIRMED
+                  || (num_workers != 0 && tcp_con_status(conn) == TCP_CLIENT_CONFIRMED),
+                  "Wrong connection status. Expected: %d, is: %d.", TCP_CLIENT_UNCONFIRMED, tcp_con_status(conn));
 
-    do_TCP_server_delay(tcp_s, mono_time, 50); // Now let the server handle requests...
+    run_server(tcp_s, mono_time, num_handshake_workers); // Now let the server handle requests...
 
     const uint8_t LOOP_SIZE = 3;
 
@@ -499,7 +555,7 @@ START_TEST(test_client)
         c_sleep(i == LOOP_SIZE - 1 ? 0 : 500); // Sleep for 500ms on all except third loop.
     }
 
-    do_TCP_server_delay(tcp_s, mono_time, 50);
+    run_server(tcp_s, mono_time, num_handshake_workers);
 
     // And still after the server runs again.
     ck_assert_msg(tcp_con_status(conn) == TCP_CLIENT_CONFIRMED, "Wrong status. Expected: %d, is: %d", TCP_CLIENT_CONFIRMED,
@@ -527,7 +583,7 @@ START_TEST(test_client)
     do_TCP_connection(mono_time, conn, nullptr);
     do_TCP_connection(mono_time, conn2, nullptr);
 
-    do_TCP_server_delay(tcp_s, mono_time, 50);
+    run_server(tcp_s, mono_time, num_handshake_workers);
 
     do_TCP_connection(mono_time, conn, nullptr);
     do_TCP_connection(mono_time, conn2, nullptr);
@@ -539,7 +595,7 @@ START_TEST(test_client)
     send_routing_request(conn, f2_public_key);
     send_routing_request(conn2, f_public_key);
 
-    do_TCP_server_delay(tcp_s, mono_time, 50);
+    run_server(tcp_s, mono_time, num_handshake_workers);
 
     do_TCP_connection(mono_time, conn, nullptr);
     do_TCP_connection(mono_time, conn2, nullptr);
@@ -553,11 +609,11 @@ START_TEST(test_client)
     ck_assert_msg(status_callback_connection_id == response_callback_connection_id,
                   "Status and response callback connection IDs are not equal.");
 
-    do_TCP_server_delay(tcp_s, mono_time, 50);
+    run_server(tcp_s, mono_time, num_handshake_workers);
 
     ck_assert_msg(send_data(conn2, 0, data, 5) == 1, "Failed a send_data() call.");
 
-    do_TCP_server_delay(tcp_s, mono_time, 50);
+    run_server(tcp_s, mono_time, num_handshake_workers);
 
     do_TCP_connection(mono_time, conn, nullptr);
     do_TCP_connection(mono_time, conn2, nullptr);
@@ -565,7 +621,7 @@ START_TEST(test_client)
     status_callback_good = 0;
     send_disconnect_request(conn2, 0);
 
-    do_TCP_server_delay(tcp_s, mono_time, 50);
+    run_server(tcp_s, mono_time, num_handshake_workers);
 
     do_TCP_connection(mono_time, conn, nullptr);
     do_TCP_connection(mono_time, conn2, nullptr);
@@ -579,8 +635,30 @@ START_TEST(test_client)
 
     mono_time_free(mono_time);
 }
+
+START_TEST(test_client)
+{
+    check_client(0, 0);
+}
+END_TEST
+
+#ifdef TCP_SERVER_USE_EPOLL
+// Each worker hands accepted sockets to the next worker in turn, so with two
+// workers the two clients always end up on different workers.
+START_TEST(test_client_workers)
+{
+    check_client(2, 0);
+}
 END_TEST
 
+START_TEST(test_client_handshake_workers)
+{
+    check_client(0, 2);
+    check_client(2, 2);
+}
+END_TEST
+#endif
+
 // Test how the client handles servers that don't respond.
 START_TEST(test_client_invalid)
 {
@@ -844,6 +922,10 @@ static Suite *TCP_suite(void)
     DEFTESTCASE_SLOW(basic, 5);
     DEFTESTCASE_SLOW(some, 10);
     DEFTESTCASE_SLOW(client, 10);
+#ifdef TCP_SERVER_USE_EPOLL
+    DEFTESTCASE_SLOW(client_workers, 10);
+    DEFTESTCASE_SLOW(client_handshake_workers, 20);
+#endif
     DEFTESTCASE_SLOW(client_invalid, 15);
     DEFTESTCASE_SLOW(tcp_connection, 20);
     DEFTESTCASE_SLOW(tcp_connection2, 20);
@@ -448,6 +448,127 @@ static void test_add_to_list(uint8_t cmp_list[][CRYPTO_PUBLIC_KEY_SIZE + 1],
     }
 }
 
+#define NUM_CLOSE_NODES_TEST_KEYS 256
+
+/* Make a public key sharing exactly prefix leading bits with base_key. */
+static void random_key_with_prefix(uint8_t *public_key, const uint8_t *base_key, uint32_t prefix)
+{
+    random_bytes(public_key, CRYPTO_PUBLIC_KEY_SIZE);
+
+    for (uint32_t i = 0; i <= prefix && i < CRYPTO_PUBLIC_KEY_SIZE * 8; ++i) {
+        const uint8_t mask = 0x80 >> (i % 8);
+        const uint8_t bit = (base_key[i / 8] & mask) ^ (i == prefix ? mask : 0);
+        public_key[i / 8] = (public_key[i / 8] & ~mask) | bit;
+    }
+}
+
+static void brute_force_add_node(const Mono_Time *mono_time, const Client_data *client, const uint8_t *public_key,
+                                 Node_format *nodes, uint32_t *num_nodes)
+{
+    if (mono_time_is_timeout(mono_time, client->assoc4.timestamp, BAD_NODE_TIMEOUT)
+            || index_of_node_pk(nodes, *num_nodes, client->public_key) != UINT32_MAX) {
+        return;
+    }
+
+    if (*num_nodes == MAX_SENT_NODES) {
+        add_to_list(nodes, MAX_SENT_NODES, client->public_key, client->assoc4.ip_port, public_key);
+        return;
+    }
+
+    uint32_t i = *num_nodes;
+
+    while (i > 0 && id_closest(public_key, client->public_key, nodes[i - 1].public_key) == 1) {
+        nodes[i] = nodes[i - 1];
+        --i;
+    }
+
+    memcpy(nodes[i].public_key, client->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    nodes[i].ip_port = client->assoc4.ip_port;
+    ++*num_nodes;
+}
+
+/* Find the MAX_SENT_NODES nodes closest to public_key by looking at every
+ * node in the close list and the friends' client lists. */
+static uint32_t brute_force_close_nodes(const DHT *dht, const uint8_t *public_key, Node_format *nodes)
+{
+    uint32_t num_nodes = 0;
+
+    for (uint32_t i = 0; i < dht_get_num_close_clients(dht); ++i) {
+        brute_force_add_node(dht->mono_time, &dht->close_clientlist[i], public_key, nodes, &num_nodes);
+    }
+
+    for (uint32_t i = 0; i < dht->num_friends; ++i) {
+        for (uint32_t j = 0; j < MAX_FRIEND_CLIENTS; ++j) {
+            brute_force_add_node(dht->mono_time, &dht->friends_list[i].client_list[j], public_key, nodes, &num_nodes);
+        }
+    }
+
+    return num_nodes;
+}
+
+static void test_close_nodes_bucket_size(uint16_t bucket_size)
+{
+    Logger *log = logger_new();
+    Mono_Time *mono_time = mono_time_new();
+    ck_assert(mono_time != nullptr);
+
+    IP ip;
+    ip_init(&ip, 0);
+    Networking_Core *net = new_networking(log, ip, DHT_DEFAULT_PORT);
+    ck_assert_msg(net != nullptr, "Failed to create Networking_Core");
+
+    DHT *dht = new_dht(log, mono_time, net, true);
+    ck_assert_msg(dht != nullptr, "Failed to create DHT");
+    ck_assert(dht_get_num_close_clients(dht) == LCLIENT_LIST);
+    ck_assert(!dht_set_close_bucket_size(dht, 0));
+    ck_assert(!dht_set_close_bucket_size(dht, DHT_MAX_CLOSE_BUCKET_SIZE + 1));
+    ck_assert(dht_set_close_bucket_size(dht, bucket_size));
+    ck_assert(dht_get_num_close_clients(dht) == LCLIENT_LENGTH * bucket_size);
+
+    IP_Port ip_port;
+    ip_port.ip = ip;
+    ip_port.ip.ip.v4 = get_ip4_loopback();
+
+    for (uint32_t i = 0; i < NUM_CLOSE_NODES_TEST_KEYS; ++i) {
+        uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+        random_key_with_prefix(public_key, dht->self_public_key, random_u32() % 64);
+        ip_port.port = net_htons(1 + i);
+        addto_lists(dht, ip_port, public_key);
+    }
+
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+
+        if (i % 2 == 0) {
+            random_bytes(public_key, sizeof(public_key));
+        } else {
+            random_key_with_prefix(public_key, dht->self_public_key, random_u32() % 64);
+        }
+
+        Node_format nodes[MAX_SENT_NODES];
+        Node_format expected[MAX_SENT_NODES];
+        const int num_nodes = get_close_nodes(dht, public_key, nodes, net_family_unspec, true, 0);
+        const uint32_t num_expected = brute_force_close_nodes(dht, public_key, expected);
+
+        ck_assert_msg(num_nodes == num_expected, "got %d close nodes, expected %u", num_nodes, num_expected);
+
+        for (uint32_t j = 0; j < num_expected; ++j) {
+            ck_assert_msg(id_equal(nodes[j].public_key, expected[j].public_key), "close node %u is not the expected one", j);
+        }
+    }
+
+    kill_dht(dht);
+    kill_networking(net);
+    mono_time_free(mono_time);
+    logger_kill(log);
+}
+
+static void test_close_nodes(void)
+{
+    test_close_nodes_bucket_size(LCLIENT_NODES);
+    test_close_nodes_bucket_size(DHT_MAX_CLOSE_BUCKET_SIZE);
+}
+
 #define NUM_DHT 100
 
 static void test_list_main(void)
@@ -813,6 +934,7 @@ int main(void)
 
     test_dht_create_packet();
     test_dht_node_packing();
+    test_close_nodes();
 
     test_list();
     test_DHT_test();
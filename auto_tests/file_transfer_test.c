@@ -10,6 +10,10 @@
 #include <string.h>
 #include <time.h>
 
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined(WIN32)
+#include <netinet/in.h>
+#endif
+
 #include "../testing/misc_tools.h"
 #include "../toxcore/ccompat.h"
 #include "../toxcore/tox.h"
@@ -264,6 +268,30 @@ static void file_transfer_test(void)
 
     printf("100MiB file sent in %lu seconds\n", (unsigned long)(time(nullptr) - f_time));
 
+    struct Tox_Transport_Stats stats;
+    Tox_Err_Friend_Query stats_err;
+    ck_assert_msg(tox_friend_get_transport_stats(tox2, 0, &stats, &stats_err), "tox_friend_get_transport_stats failed");
+    ck_assert_msg(stats_err == TOX_ERR_FRIEND_QUERY_OK, "wrong error");
+    printf("transport stats: connection %d, rtt %u ms, send rate %u/s, %llu packets sent, %llu resent, "
+           "%llu bytes sent, %llu received, path mtu %u\n", stats.connection, stats.rtt, stats.send_rate,
+           (unsigned long long)stats.packets_sent, (unsigned long long)stats.packets_resent,
+           (unsigned long long)stats.bytes_sent, (unsigned long long)stats.bytes_received, stats.path_mtu);
+    ck_assert_msg(stats.connection != TOX_CONNECTION_NONE, "friend should be connected");
+    ck_assert_msg(stats.path_mtu >= 1400, "path mtu %u below the default", stats.path_mtu);
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+    /* The loopback interface carries packets far bigger than 1400 bytes, but
+     * only platforms that can send unfragmented packets probe for that. */
+    ck_assert_msg(stats.connection != TOX_CONNECTION_UDP || stats.path_mtu > 1400,
+                  "path mtu %u not raised over UDP", stats.path_mtu);
+#endif
+    ck_assert_msg(stats.bytes_sent > 100 * 1024 * 1024, "sent %llu bytes, less than the file",
+                  (unsigned long long)stats.bytes_sent);
+    ck_assert_msg(stats.packets_sent >= (100 * 1024 * 1024) / TOX_MAX_CUSTOM_PACKET_SIZE, "too few packets counted");
+    ck_assert_msg(!tox_friend_get_transport_stats(tox2, 1, &stats, &stats_err), "stats for a missing friend");
+    ck_assert_msg(stats_err == TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND, "wrong error");
+    ck_assert_msg(!tox_friend_get_transport_stats(tox2, 0, nullptr, &stats_err), "stats into NULL");
+    ck_assert_msg(stats_err == TOX_ERR_FRIEND_QUERY_NULL, "wrong error");
+
     printf("Starting file streaming transfer test.\n");
 
     file_sending_done = 0;
@@ -21,11 +21,58 @@ typedef struct State {
     uint64_t clock;
 
     bool custom_packet_received;
+    bool unordered_packet_received;
+    bool send_queue_writable;
+    /* A write right after the writable event still failed. */
+    bool spurious_writable;
+
+    /* Order in which the held back packet and the unordered packet sent
+     * after it arrived, starting at 1. */
+    uint32_t packets_received;
+    uint32_t held_back_position;
+    uint32_t overtaking_position;
 } State;
 
 #include "run_auto_test.h"
 
 #define LOSSLESS_PACKET_FILLER 160
+#define UNORDERED_PACKET_FILLER 161
+#define OVERTAKE_PACKET_SIZE 100
+#define THROTTLED_FILLS 5
+
+/* Packets of the receiver's crypto connection are dropped while this is set. */
+static bool dropping;
+/* Every second one of them is dropped while this is set, which makes the
+ * sender lower its send rate. */
+static bool throttling;
+static uint32_t throttled_packets;
+
+/* The handlers net_crypto registered for data packets, the second one for
+ * AES-GCM encrypted packets. */
+static const uint8_t crypto_data_packet_ids[2] = {NET_PACKET_CRYPTO_DATA, NET_PACKET_CRYPTO_DATA_AESGCM};
+static packet_handler_cb *crypto_data_handlers[2];
+static void *crypto_data_objects[2];
+
+static int handle_crypto_data(void *object, IP_Port ip_port, const uint8_t *data, uint16_t length, void *userdata)
+{
+    if (dropping || (throttling && ++throttled_packets % 2 == 0)) {
+        return 0;
+    }
+
+    const uint32_t i = data[0] == NET_PACKET_CRYPTO_DATA_AESGCM;
+    return crypto_data_handlers[i](crypto_data_objects[i], ip_port, data, length, userdata);
+}
+
+static void wrap_crypto_data_handlers(Tox *tox)
+{
+    Networking_Core *net = (*(Messenger **)tox)->net;
+
+    for (uint32_t i = 0; i < 2; ++i) {
+        crypto_data_handlers[i] = networking_gethandler(net, crypto_data_packet_ids[i], &crypto_data_objects[i]);
+        ck_assert(crypto_data_handlers[i] != nullptr);
+        networking_registerhandler(net, crypto_data_packet_ids[i], &handle_crypto_data, crypto_data_objects[i]);
+    }
+}
 
 static void handle_lossless_packet(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length,
                                    void *user_data)
@@ -38,6 +85,36 @@ static void handle_lossless_packet(Tox *tox, uint32_t friend_number, const uint8
     if (length == TOX_MAX_CUSTOM_PACKET_SIZE && memcmp(data, cmp_packet, sizeof(cmp_packet)) == 0) {
         state->custom_packet_received = true;
     }
+
+    memset(cmp_packet, UNORDERED_PACKET_FILLER, sizeof(cmp_packet));
+
+    if (length == TOX_MAX_CUSTOM_PACKET_SIZE / 2 && memcmp(data, cmp_packet, length) == 0) {
+        state->unordered_packet_received = true;
+    }
+
+    if (length == OVERTAKE_PACKET_SIZE) {
+        if (data[0] == LOSSLESS_PACKET_FILLER) {
+            state->held_back_position = ++state->packets_received;
+        } else {
+            state->overtaking_position = ++state->packets_received;
+        }
+    }
+}
+
+static void handle_send_queue_writable(Tox *tox, uint32_t friend_number, void *user_data)
+{
+    State *state = (State *)user_data;
+    state->send_queue_writable = true;
+
+    uint8_t packet[TOX_MAX_CUSTOM_PACKET_SIZE];
+    memset(packet, LOSSLESS_PACKET_FILLER, sizeof(packet));
+
+    Tox_Err_Friend_Custom_Packet err;
+
+    if (!tox_friend_send_lossless_packet(tox, friend_number, packet, sizeof(packet), &err)
+            && err == TOX_ERR_FRIEND_CUSTOM_PACKET_SENDQ) {
+        state->spurious_writable = true;
+    }
 }
 
 static void test_lossless_packet(Tox **toxes, State *state)
@@ -55,6 +132,81 @@ static void test_lossless_packet(Tox **toxes, State *state)
     do {
         iterate_all_wait(2, toxes, state, ITERATION_INTERVAL);
     } while (!state[1].custom_packet_received);
+
+    memset(packet, UNORDERED_PACKET_FILLER, sizeof(packet));
+    ret = tox_friend_send_lossless_packet_unordered(toxes[0], 0, packet, sizeof(packet), nullptr);
+    ck_assert_msg(ret == false, "should not be able to send custom packets this big %i", ret);
+
+    ret = tox_friend_send_lossless_packet_unordered(toxes[0], 0, packet, TOX_MAX_CUSTOM_PACKET_SIZE / 2, nullptr);
+    ck_assert_msg(ret == true, "tox_friend_send_lossless_packet_unordered fail %i", ret);
+
+    do {
+        iterate_all_wait(2, toxes, state, ITERATION_INTERVAL);
+    } while (!state[1].unordered_packet_received);
+
+    printf("waiting for a direct connection\n");
+
+    do {
+        iterate_all_wait(2, toxes, state, ITERATION_INTERVAL);
+    } while (tox_friend_get_connection_status(toxes[0], 0, nullptr) != TOX_CONNECTION_UDP
+             || tox_friend_get_connection_status(toxes[1], 0, nullptr) != TOX_CONNECTION_UDP);
+
+    printf("dropping a lossless packet, then sending an unordered one\n");
+    wrap_crypto_data_handlers(toxes[1]);
+
+    memset(packet, LOSSLESS_PACKET_FILLER, sizeof(packet));
+    ret = tox_friend_send_lossless_packet(toxes[0], 0, packet, OVERTAKE_PACKET_SIZE, nullptr);
+    ck_assert_msg(ret == true, "tox_friend_send_lossless_packet fail %i", ret);
+
+    /* Let the sender flush the packet, then drop it before the receiver sees it. */
+    for (uint32_t i = 0; i < 3; ++i) {
+        tox_iterate(toxes[0], &state[0]);
+        state[0].clock += ITERATION_INTERVAL;
+        c_sleep(20);
+    }
+
+    dropping = true;
+    tox_iterate(toxes[1], &state[1]);
+    dropping = false;
+
+    memset(packet, UNORDERED_PACKET_FILLER, sizeof(packet));
+    ret = tox_friend_send_lossless_packet_unordered(toxes[0], 0, packet, OVERTAKE_PACKET_SIZE, nullptr);
+    ck_assert_msg(ret == true, "tox_friend_send_lossless_packet_unordered fail %i", ret);
+
+    do {
+        iterate_all_wait(2, toxes, state, ITERATION_INTERVAL);
+    } while (state[1].held_back_position == 0 || state[1].overtaking_position == 0);
+
+    ck_assert_msg(state[1].overtaking_position < state[1].held_back_position,
+                  "unordered packet waited for the lost packet sent before it");
+
+    memset(packet, LOSSLESS_PACKET_FILLER, sizeof(packet));
+
+    printf("filling the send queue while dropping every second packet\n");
+    tox_callback_friend_send_queue_writable(toxes[0], &handle_send_queue_writable);
+    throttling = true;
+
+    for (uint32_t i = 0; i < THROTTLED_FILLS; ++i) {
+        Tox_Err_Friend_Custom_Packet err;
+        uint32_t sent = 0;
+
+        while (tox_friend_send_lossless_packet(toxes[0], 0, packet, TOX_MAX_CUSTOM_PACKET_SIZE, &err)) {
+            ++sent;
+        }
+
+        ck_assert_msg(err == TOX_ERR_FRIEND_CUSTOM_PACKET_SENDQ, "wrong error %d after %u packets", err, sent);
+        printf("send queue full after %u packets, waiting for it to drain\n", sent);
+
+        state[0].send_queue_writable = false;
+
+        do {
+            iterate_all_wait(2, toxes, state, ITERATION_INTERVAL);
+        } while (!state[0].send_queue_writable);
+
+        ck_assert_msg(!state[0].spurious_writable, "writable event fired while the send queue was still blocked");
+    }
+
+    throttling = false;
 }
 
 int main(void)
@@ -165,6 +165,100 @@ START_TEST(test_ip_equal)
 }
 END_TEST
 
+#define BATCH_TEST_PACKETS 100
+
+static uint32_t batch_packets_received;
+
+static int handle_batch_test_packet(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len, void *userdata)
+{
+    ck_assert_msg(len == 3 + data[1], "Unexpected packet length %u.", len);
+    ++batch_packets_received;
+    return 0;
+}
+
+static uint32_t large_packets_received;
+
+static int handle_large_test_packet(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len, void *userdata)
+{
+    ck_assert_msg(len == NET_BATCH_PACKET_SIZE + 1, "Unexpected packet length %u.", len);
+    ++large_packets_received;
+    return 0;
+}
+
+static void poll_receiver(Networking_Core *receiver)
+{
+    for (uint32_t i = 0; i < 10; ++i) {
+        networking_poll(receiver, nullptr);
+        c_sleep(10);
+    }
+}
+
+START_TEST(test_batched_io)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip.v4 = get_ip4_loopback();
+
+    Logger *log = logger_new();
+    Networking_Core *sender = new_networking(log, ip, TOX_PORTRANGE_FROM);
+    Networking_Core *receiver = new_networking(log, ip, TOX_PORTRANGE_FROM);
+    ck_assert_msg(sender != nullptr && receiver != nullptr, "Failed to create networking objects.");
+
+#ifdef __linux__
+    ck_assert_msg(networking_set_batch_size(sender, 16), "Batched I/O should be available on Linux.");
+    ck_assert_msg(networking_set_batch_size(receiver, NET_MAX_BATCH_SIZE + 1),
+                  "Batched I/O should be available on Linux.");
+#else
+    networking_set_batch_size(sender, 16);
+    networking_set_batch_size(receiver, NET_MAX_BATCH_SIZE);
+#endif
+
+    networking_registerhandler(receiver, 0xf1, &handle_batch_test_packet, nullptr);
+
+    IP_Port receiver_ip_port;
+    receiver_ip_port.ip = ip;
+    receiver_ip_port.port = net_port(receiver);
+
+    /* More packets than the send queue holds, so it gets flushed on the way. */
+    for (uint32_t i = 0; i < BATCH_TEST_PACKETS; ++i) {
+        uint8_t packet[3 + 255] = {0xf1, (uint8_t)i};
+        const uint16_t length = 3 + packet[1];
+        ck_assert_msg(sendpacket(sender, receiver_ip_port, packet, length) == length, "Failed to send packet %u.", i);
+    }
+
+    networking_flush(sender);
+
+    for (uint32_t i = 0; i < 100 && batch_packets_received < BATCH_TEST_PACKETS; ++i) {
+        networking_poll(receiver, nullptr);
+        c_sleep(10);
+    }
+
+    ck_assert_msg(batch_packets_received == BATCH_TEST_PACKETS, "Expected %u packets, got %u.",
+                  BATCH_TEST_PACKETS, batch_packets_received);
+
+    /* Packets too large for the batch buffers are sent on their own, but
+     * only an unbatched receiver can take them. */
+    networking_registerhandler(receiver, 0xf2, &handle_large_test_packet, nullptr);
+    uint8_t large_packet[NET_BATCH_PACKET_SIZE + 1] = {0xf2};
+
+    networking_set_batch_size(receiver, 0);
+    ck_assert_msg(sendpacket(sender, receiver_ip_port, large_packet, sizeof(large_packet)) == sizeof(large_packet),
+                  "Failed to send a packet larger than the batch buffers.");
+    poll_receiver(receiver);
+    ck_assert_msg(large_packets_received == 1, "Unbatched receiver got %u large packets.", large_packets_received);
+
+    if (networking_set_batch_size(receiver, NET_MAX_BATCH_SIZE)) {
+        ck_assert(sendpacket(sender, receiver_ip_port, large_packet, sizeof(large_packet)) == sizeof(large_packet));
+        poll_receiver(receiver);
+        ck_assert_msg(large_packets_received == 1, "Batched receiver handled a truncated packet.");
+    }
+
+    kill_networking(sender);
+    kill_networking(receiver);
+    logger_kill(log);
+}
+END_TEST
+
 static Suite *network_suite(void)
 {
     Suite *s = suite_create("Network");
@@ -173,6 +267,7 @@ static Suite *network_suite(void)
 
     DEFTESTCASE(addr_resolv_localhost);
     DEFTESTCASE(ip_equal);
+    DEFTESTCASE(batched_io);
 
     return s;
 }
@@ -0,0 +1,137 @@
+/* Tests that small packets are sent together when coalescing is enabled.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../testing/misc_tools.h"
+#include "../toxcore/ccompat.h"
+#include "../toxcore/tox.h"
+#include "../toxcore/util.h"
+#include "check_compat.h"
+
+typedef struct State {
+    uint32_t index;
+    uint64_t clock;
+
+    uint32_t lossless_received;
+    bool lossless_out_of_order;
+    uint32_t lossy_received;
+} State;
+
+#include "run_auto_test.h"
+
+#define LOSSLESS_PACKET_ID 160
+#define LOSSY_PACKET_ID 200
+#define NUM_PACKETS 200
+#define PACKETS_PER_ITERATION 10
+
+/* Bytes sent on the wire for the packets, for each coalescing delay. */
+static uint64_t bytes_sent[2];
+static uint32_t run;
+
+static void handle_lossless_packet(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length,
+                                   void *user_data)
+{
+    State *state = (State *)user_data;
+    uint32_t num;
+
+    if (length != 1 + sizeof(num) || data[0] != LOSSLESS_PACKET_ID) {
+        return;
+    }
+
+    memcpy(&num, data + 1, sizeof(num));
+
+    if (num != state->lossless_received) {
+        state->lossless_out_of_order = true;
+    }
+
+    ++state->lossless_received;
+}
+
+static void handle_lossy_packet(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length, void *user_data)
+{
+    State *state = (State *)user_data;
+
+    if (length == 2 && data[0] == LOSSY_PACKET_ID) {
+        ++state->lossy_received;
+    }
+}
+
+static uint64_t get_bytes_sent(const Tox *tox)
+{
+    struct Tox_Transport_Stats stats;
+    const bool ret = tox_friend_get_transport_stats(tox, 0, &stats, nullptr);
+    ck_assert_msg(ret, "tox_friend_get_transport_stats failed");
+    return stats.bytes_sent;
+}
+
+static void test_packet_coalescing(Tox **toxes, State *state)
+{
+    tox_callback_friend_lossless_packet(toxes[1], &handle_lossless_packet);
+    tox_callback_friend_lossy_packet(toxes[1], &handle_lossy_packet);
+
+    /* Give the friends time to exchange what they support. */
+    for (uint32_t i = 0; i < 10; ++i) {
+        iterate_all_wait(2, toxes, state, ITERATION_INTERVAL);
+    }
+
+    const uint64_t bytes_before = get_bytes_sent(toxes[0]);
+    uint32_t sent = 0;
+
+    while (sent < NUM_PACKETS) {
+        for (uint32_t i = 0; i < PACKETS_PER_ITERATION && sent < NUM_PACKETS; ++i) {
+            uint8_t packet[1 + sizeof(sent)];
+            packet[0] = LOSSLESS_PACKET_ID;
+            memcpy(packet + 1, &sent, sizeof(sent));
+
+            if (!tox_friend_send_lossless_packet(toxes[0], 0, packet, sizeof(packet), nullptr)) {
+                break;
+            }
+
+            const uint8_t lossy_packet[2] = {LOSSY_PACKET_ID, 0};
+            tox_friend_send_lossy_packet(toxes[0], 0, lossy_packet, sizeof(lossy_packet), nullptr);
+            ++sent;
+        }
+
+        iterate_all_wait(2, toxes, state, ITERATION_INTERVAL);
+    }
+
+    while (state[1].lossless_received < NUM_PACKETS) {
+        iterate_all_wait(2, toxes, state, ITERATION_INTERVAL);
+    }
+
+    ck_assert_msg(!state[1].lossless_out_of_order, "lossless packets were received out of order");
+    ck_assert_msg(state[1].lossy_received > 0, "no lossy packets were received");
+
+    bytes_sent[run] = get_bytes_sent(toxes[0]) - bytes_before;
+    printf("sent %u small lossless and lossy packets in %u bytes, %u lossy packets received\n", NUM_PACKETS,
+           (unsigned)bytes_sent[run], state[1].lossy_received);
+}
+
+int main(void)
+{
+    setvbuf(stdout, nullptr, _IONBF, 0);
+
+    struct Tox_Options *options = tox_options_new(nullptr);
+    ck_assert(options != nullptr);
+
+    printf("without coalescing\n");
+    run_auto_test_with_options(2, test_packet_coalescing, false, options);
+
+    printf("with coalescing\n");
+    tox_options_set_coalescing_delay(options, 10);
+    run = 1;
+    run_auto_test_with_options(2, test_packet_coalescing, false, options);
+
+    tox_options_free(options);
+
+    ck_assert_msg(bytes_sent[1] * 2 < bytes_sent[0], "coalescing saved too little: %u bytes instead of %u",
+                  (unsigned)bytes_sent[1], (unsigned)bytes_sent[0]);
+    return 0;
+}
@@ -3,6 +3,10 @@
  * This test checks that when a tox instance is suspended for long enough that
  * its friend connections time out, those connections are promptly
  * re-established when the instance is resumed.
+ *
+ * The suspended instance still considers its connections alive when it is
+ * resumed. Its friends resume their sessions with it, so it doesn't have to
+ * time them out before reconnecting.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -14,13 +18,12 @@
 #include <time.h>
 
 #include "../testing/misc_tools.h"
-#include "../toxcore/friend_connection.h"
 #include "../toxcore/tox.h"
 #include "../toxcore/util.h"
 #include "check_compat.h"
 
 #define TOX_COUNT 2
-#define RECONNECT_TIME_MAX (FRIEND_CONNECTION_TIMEOUT + 3)
+#define RECONNECT_TIME_MAX 5
 
 typedef struct State {
     uint32_t index;
@@ -91,6 +94,7 @@ static void test_reconnect(Tox **toxes, State *state)
     } while (!all_friends_connected(TOX_COUNT, toxes));
 
     const uint64_t reconnect_time = state[0].clock - reconnect_start_time;
+    printf("reconnected after %u ms\n", (unsigned int)reconnect_time);
     ck_assert_msg(reconnect_time <= RECONNECT_TIME_MAX * 1000, "reconnection took %d seconds; expected at most %d seconds",
                   (int)(reconnect_time / 1000), RECONNECT_TIME_MAX);
 
@@ -48,7 +48,8 @@ static uint64_t get_state_clock_callback(Mono_Time *mono_time, void *user_data)
     return state->clock;
 }
 
-static void run_auto_test(uint32_t tox_count, void test(Tox **toxes, State *state), bool chain)
+static void run_auto_test_with_options(uint32_t tox_count, void test(Tox **toxes, State *state), bool chain,
+                                       struct Tox_Options *options)
 {
     printf("initialising %u toxes\n", tox_count);
     Tox **toxes = (Tox **)calloc(tox_count, sizeof(Tox *));
@@ -56,7 +57,7 @@ static void run_auto_test(uint32_t tox_count, void test(Tox **toxes, State *stat
 
     for (uint32_t i = 0; i < tox_count; i++) {
         state[i].index = i;
-        toxes[i] = tox_new_log(nullptr, nullptr, &state[i].index);
+        toxes[i] = tox_new_log(options, nullptr, &state[i].index);
         ck_assert_msg(toxes[i], "failed to create %u tox instances", i + 1);
 
         // TODO(iphydf): Don't rely on toxcore internals.
@@ -124,3 +125,8 @@ static void run_auto_test(uint32_t tox_count, void test(Tox **toxes, State *stat
     free(state);
     free(toxes);
 }
+
+static inline void run_auto_test(uint32_t tox_count, void test(Tox **toxes, State *state), bool chain)
+{
+    run_auto_test_with_options(tox_count, test, chain, nullptr);
+}
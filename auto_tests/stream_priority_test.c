@@ -0,0 +1,215 @@
+/* Tests that messages overtake lost file chunks, and that packets stay in
+ * order within the messages stream and within the file transfer.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../testing/misc_tools.h"
+#include "../toxcore/ccompat.h"
+#include "../toxcore/tox.h"
+#include "../toxcore/util.h"
+#include "check_compat.h"
+
+#define NUM_MESSAGES 4
+
+typedef struct State {
+    uint32_t index;
+    uint64_t clock;
+
+    /* Sender: end of the last chunk put in the send queue. */
+    uint64_t file_sent;
+    /* Receiver: end of the file data received so far. */
+    uint64_t file_received;
+    bool file_out_of_order;
+
+    /* Receiver: the file data received when each message arrived. */
+    uint64_t file_received_at_message[NUM_MESSAGES + 1];
+    uint8_t messages[NUM_MESSAGES + 1];
+    uint32_t messages_received;
+} State;
+
+#include "run_auto_test.h"
+
+#define FILE_SIZE (64 * 1024 * 1024)
+
+/* Packets of the receiver's crypto connection are dropped while this is set. */
+static bool dropping;
+
+/* The handlers net_crypto registered for data packets, the second one for
+ * AES-GCM encrypted packets. */
+static const uint8_t crypto_data_packet_ids[2] = {NET_PACKET_CRYPTO_DATA, NET_PACKET_CRYPTO_DATA_AESGCM};
+static packet_handler_cb *crypto_data_handlers[2];
+static void *crypto_data_objects[2];
+
+static int handle_crypto_data(void *object, IP_Port ip_port, const uint8_t *data, uint16_t length, void *userdata)
+{
+    if (dropping) {
+        return 0;
+    }
+
+    const uint32_t i = data[0] == NET_PACKET_CRYPTO_DATA_AESGCM;
+    return crypto_data_handlers[i](crypto_data_objects[i], ip_port, data, length, userdata);
+}
+
+static void wrap_crypto_data_handlers(Tox *tox)
+{
+    Networking_Core *net = (*(Messenger **)tox)->net;
+
+    for (uint32_t i = 0; i < 2; ++i) {
+        crypto_data_handlers[i] = networking_gethandler(net, crypto_data_packet_ids[i], &crypto_data_objects[i]);
+        ck_assert(crypto_data_handlers[i] != nullptr);
+        networking_registerhandler(net, crypto_data_packet_ids[i], &handle_crypto_data, crypto_data_objects[i]);
+    }
+}
+
+static void file_chunk_request(Tox *tox, uint32_t friend_number, uint32_t file_number, uint64_t position,
+                               size_t length, void *user_data)
+{
+    State *state = (State *)user_data;
+
+    if (length == 0) {
+        return;
+    }
+
+    uint8_t chunk[TOX_MAX_CUSTOM_PACKET_SIZE];
+    ck_assert(length <= sizeof(chunk));
+    memset(chunk, (uint8_t)position, length);
+
+    if (tox_file_send_chunk(tox, friend_number, file_number, position, chunk, length, nullptr)) {
+        state->file_sent = position + length;
+    }
+}
+
+static void file_receive(Tox *tox, uint32_t friend_number, uint32_t file_number, uint32_t kind, uint64_t file_size,
+                         const uint8_t *filename, size_t filename_length, void *user_data)
+{
+    ck_assert(tox_file_control(tox, friend_number, file_number, TOX_FILE_CONTROL_RESUME, nullptr));
+}
+
+static void file_recv_chunk(Tox *tox, uint32_t friend_number, uint32_t file_number, uint64_t position,
+                            const uint8_t *data, size_t length, void *user_data)
+{
+    State *state = (State *)user_data;
+
+    if (position != state->file_received || (length > 0 && data[0] != (uint8_t)position)) {
+        state->file_out_of_order = true;
+    }
+
+    state->file_received = position + length;
+}
+
+static void friend_message(Tox *tox, uint32_t friend_number, TOX_MESSAGE_TYPE type, const uint8_t *message,
+                           size_t length, void *user_data)
+{
+    State *state = (State *)user_data;
+    ck_assert(length == 1 && state->messages_received < NUM_MESSAGES + 1);
+
+    state->file_received_at_message[state->messages_received] = state->file_received;
+    state->messages[state->messages_received] = message[0];
+    ++state->messages_received;
+}
+
+static void send_message(Tox *tox, uint8_t number)
+{
+    Tox_Err_Friend_Send_Message err;
+    tox_friend_send_message(tox, 0, TOX_MESSAGE_TYPE_NORMAL, &number, 1, &err);
+    ck_assert_msg(err == TOX_ERR_FRIEND_SEND_MESSAGE_OK, "failed to send message %u: %d", number, err);
+}
+
+/* Let the sender send, then drop everything it sent before the receiver
+ * sees it. */
+static void drop_sent_packets(Tox **toxes, State *state)
+{
+    const uint64_t file_sent = state[0].file_sent;
+
+    do {
+        tox_iterate(toxes[0], &state[0]);
+        state[0].clock += ITERATION_INTERVAL;
+        c_sleep(20);
+    } while (state[0].file_sent == file_sent);
+
+    dropping = true;
+    tox_iterate(toxes[1], &state[1]);
+    state[1].clock += ITERATION_INTERVAL;
+    dropping = false;
+}
+
+static void test_stream_priority(Tox **toxes, State *state)
+{
+    do {
+        iterate_all_wait(2, toxes, state, ITERATION_INTERVAL);
+    } while (tox_friend_get_connection_status(toxes[0], 0, nullptr) != TOX_CONNECTION_UDP
+             || tox_friend_get_connection_status(toxes[1], 0, nullptr) != TOX_CONNECTION_UDP);
+
+    /* Give friend_connection time to tell the peers they both support
+     * streams. */
+    for (uint32_t i = 0; i < 20; ++i) {
+        iterate_all_wait(2, toxes, state, ITERATION_INTERVAL);
+    }
+
+    wrap_crypto_data_handlers(toxes[1]);
+
+    tox_callback_file_chunk_request(toxes[0], file_chunk_request);
+    tox_callback_file_recv(toxes[1], file_receive);
+    tox_callback_file_recv_chunk(toxes[1], file_recv_chunk);
+    tox_callback_friend_message(toxes[1], friend_message);
+
+    Tox_Err_File_Send err;
+    tox_file_send(toxes[0], 0, TOX_FILE_KIND_DATA, FILE_SIZE, nullptr, (const uint8_t *)"bulk", 4, &err);
+    ck_assert_msg(err == TOX_ERR_FILE_SEND_OK, "tox_file_send failed: %d", err);
+
+    do {
+        iterate_all_wait(2, toxes, state, ITERATION_INTERVAL);
+    } while (state[1].file_received == 0);
+
+    printf("dropping file chunks, then sending message 0\n");
+    drop_sent_packets(toxes, state);
+    const uint64_t file_lost = state[0].file_sent;
+    send_message(toxes[0], 0);
+
+    do {
+        iterate_all_wait(2, toxes, state, ITERATION_INTERVAL);
+    } while (state[1].messages_received == 0);
+
+    ck_assert_msg(state[1].file_received_at_message[0] < file_lost,
+                  "message waited for the lost file chunks: %llu of %llu bytes received",
+                  (unsigned long long)state[1].file_received_at_message[0], (unsigned long long)file_lost);
+
+    printf("dropping message 1, then sending the others\n");
+    send_message(toxes[0], 1);
+    drop_sent_packets(toxes, state);
+
+    for (uint8_t i = 2; i <= NUM_MESSAGES; ++i) {
+        send_message(toxes[0], i);
+    }
+
+    const uint64_t file_sent = state[0].file_sent;
+
+    do {
+        iterate_all_wait(2, toxes, state, ITERATION_INTERVAL);
+    } while (state[1].messages_received < NUM_MESSAGES + 1 || state[1].file_received < file_sent);
+
+    for (uint8_t i = 0; i <= NUM_MESSAGES; ++i) {
+        ck_assert_msg(state[1].messages[i] == i, "message %u received in position %u", state[1].messages[i], i);
+    }
+
+    ck_assert_msg(!state[1].file_out_of_order, "file chunks were received out of order");
+
+    printf("message 0 arrived with %llu of %llu bytes of the file before it\n",
+           (unsigned long long)state[1].file_received_at_message[0], (unsigned long long)file_lost);
+}
+
+int main(void)
+{
+    setvbuf(stdout, nullptr, _IONBF, 0);
+
+    run_auto_test(2, test_stream_priority, false);
+    return 0;
+}
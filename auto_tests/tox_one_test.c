@@ -76,6 +76,21 @@ static void test_one(void)
     ck_assert_msg(tox_self_get_status_message_size(tox1) == sizeof(status_message),
                   "Can't set status message of TOX_MAX_STATUS_MESSAGE_LENGTH");
 
+    const size_t num_fds = tox_get_fds_size(tox1);
+    ck_assert_msg(num_fds >= 1, "Tox with UDP enabled should have at least one file descriptor.");
+    int32_t fds[16];
+    ck_assert(num_fds <= sizeof(fds) / sizeof(fds[0]));
+    tox_get_fds(tox1, fds);
+
+    for (size_t i = 0; i < num_fds; ++i) {
+        ck_assert_msg(fds[i] >= 0, "Invalid file descriptor %d.", fds[i]);
+    }
+
+    ck_assert_msg(tox_get_write_fds_size(tox1) <= num_fds, "More write fds than fds.");
+
+    const uint32_t timeout = tox_iteration_timeout(tox1);
+    ck_assert_msg(timeout <= 1000, "Iteration timeout %u is longer than a second.", timeout);
+
     tox_self_get_address(tox1, address);
     size_t save_size = tox_get_savedata_size(tox1);
     VLA(uint8_t, data, save_size);
@@ -156,7 +156,18 @@ int main(int argc, char *argv[])
     }
 
     Mono_Time *mono_time = mono_time_new();
-    DHT *dht = new_dht(logger, mono_time, new_networking(logger, ip, PORT), true);
+    Networking_Core *net = new_networking(logger, ip, PORT);
+
+    if (net != nullptr) {
+        networking_set_batch_size(net, NET_MAX_BATCH_SIZE);
+    }
+
+    DHT *dht = new_dht(logger, mono_time, net, true);
+
+    if (dht != nullptr) {
+        dht_set_close_bucket_size(dht, DHT_MAX_CLOSE_BUCKET_SIZE);
+    }
+
     Onion *onion = new_onion(mono_time, dht);
     Onion_Announce *onion_a = new_onion_announce(mono_time, dht);
 
@@ -244,6 +255,7 @@ int main(int argc, char *argv[])
         do_TCP_server(tcp_s, mono_time);
 #endif
         networking_poll(dht_get_net(dht), nullptr);
+        networking_flush(dht_get_net(dht));
 
         c_sleep(1);
     }
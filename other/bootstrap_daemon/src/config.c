@@ -143,7 +143,9 @@ static void parse_tcp_relay_ports_config(config_t *cfg, uint16_t **tcp_relay_por
 
 int get_general_config(const char *cfg_file_path, char **pid_file_path, char **keys_file_path, int *port,
                        int *enable_ipv6, int *enable_ipv4_fallback, int *enable_lan_discovery, int *enable_tcp_relay,
-                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *enable_motd, char **motd)
+                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *enable_motd, char **motd,
+                       int *dht_bucket_size, int *shared_key_cache_size, int *tcp_relay_workers,
+                       int *tcp_relay_handshake_workers)
 {
     config_t cfg;
 
@@ -156,6 +158,10 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
     const char *NAME_ENABLE_TCP_RELAY     = "enable_tcp_relay";
     const char *NAME_ENABLE_MOTD          = "enable_motd";
     const char *NAME_MOTD                 = "motd";
+    const char *NAME_DHT_BUCKET_SIZE      = "dht_bucket_size";
+    const char *NAME_SHARED_KEY_CACHE_SIZE = "shared_key_cache_size";
+    const char *NAME_TCP_RELAY_WORKERS    = "tcp_relay_workers";
+    const char *NAME_TCP_RELAY_HANDSHAKE_WORKERS = "tcp_relay_handshake_workers";
 
     config_init(&cfg);
 
@@ -259,6 +265,36 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
         (*motd)[motd_length - 1] = '\0';
     }
 
+    // Get DHT bucket size
+    if (config_lookup_int(&cfg, NAME_DHT_BUCKET_SIZE, dht_bucket_size) == CONFIG_FALSE) {
+        log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_DHT_BUCKET_SIZE);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_DHT_BUCKET_SIZE, DEFAULT_DHT_BUCKET_SIZE);
+        *dht_bucket_size = DEFAULT_DHT_BUCKET_SIZE;
+    }
+
+    // Get shared key cache size
+    if (config_lookup_int(&cfg, NAME_SHARED_KEY_CACHE_SIZE, shared_key_cache_size) == CONFIG_FALSE) {
+        log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_SHARED_KEY_CACHE_SIZE);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_SHARED_KEY_CACHE_SIZE,
+                  DEFAULT_SHARED_KEY_CACHE_SIZE);
+        *shared_key_cache_size = DEFAULT_SHARED_KEY_CACHE_SIZE;
+    }
+
+    // Get number of TCP relay worker threads
+    if (config_lookup_int(&cfg, NAME_TCP_RELAY_WORKERS, tcp_relay_workers) == CONFIG_FALSE) {
+        log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_TCP_RELAY_WORKERS);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_TCP_RELAY_WORKERS, DEFAULT_TCP_RELAY_WORKERS);
+        *tcp_relay_workers = DEFAULT_TCP_RELAY_WORKERS;
+    }
+
+    // Get number of TCP relay handshake threads
+    if (config_lookup_int(&cfg, NAME_TCP_RELAY_HANDSHAKE_WORKERS, tcp_relay_handshake_workers) == CONFIG_FALSE) {
+        log_write(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_TCP_RELAY_HANDSHAKE_WORKERS);
+        log_write(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_TCP_RELAY_HANDSHAKE_WORKERS,
+                  DEFAULT_TCP_RELAY_HANDSHAKE_WORKERS);
+        *tcp_relay_handshake_workers = DEFAULT_TCP_RELAY_HANDSHAKE_WORKERS;
+    }
+
     config_destroy(&cfg);
 
     log_write(LOG_LEVEL_INFO, "Successfully read:\n");
@@ -291,6 +327,11 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
         log_write(LOG_LEVEL_INFO, "'%s': %s\n", NAME_MOTD, *motd);
     }
 
+    log_write(LOG_LEVEL_INFO, "'%s': %d\n", NAME_DHT_BUCKET_SIZE,     *dht_bucket_size);
+    log_write(LOG_LEVEL_INFO, "'%s': %d\n", NAME_SHARED_KEY_CACHE_SIZE, *shared_key_cache_size);
+    log_write(LOG_LEVEL_INFO, "'%s': %d\n", NAME_TCP_RELAY_WORKERS,   *tcp_relay_workers);
+    log_write(LOG_LEVEL_INFO, "'%s': %d\n", NAME_TCP_RELAY_HANDSHAKE_WORKERS, *tcp_relay_handshake_workers);
+
     return 1;
 }
 
@@ -38,5 +38,9 @@
 #define DEFAULT_TCP_RELAY_PORTS_COUNT 3
 #define DEFAULT_ENABLE_MOTD           1 // 1 - true, 0 - false
 #define DEFAULT_MOTD                  DAEMON_NAME
+#define DEFAULT_DHT_BUCKET_SIZE       8 // nodes per DHT close list bucket, at most DHT_MAX_CLOSE_BUCKET_SIZE
+#define DEFAULT_SHARED_KEY_CACHE_SIZE 1024 // keys per shared key cache, at most SHARED_KEY_CACHE_MAX_SIZE
+#define DEFAULT_TCP_RELAY_WORKERS     0 // TCP relay worker threads, at most TCP_SERVER_MAX_WORKERS. 0 - main thread only
+#define DEFAULT_TCP_RELAY_HANDSHAKE_WORKERS 0 // TCP relay handshake threads, at most TCP_SERVER_MAX_HANDSHAKE_WORKERS. 0 - none
 
 #endif // C_TOXCORE_OTHER_BOOTSTRAP_DAEMON_SRC_CONFIG_DEFAULTS_H
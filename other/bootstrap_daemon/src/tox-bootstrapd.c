@@ -59,6 +59,9 @@
 
 #define SLEEP_MILLISECONDS(MS) usleep(1000*MS)
 
+// How often the shared key cache statistics are logged, in seconds
+#define SHARED_KEY_CACHE_STATS_INTERVAL 3600
+
 // Uses the already existing key or creates one if it didn't exist
 //
 // returns 1 on success
@@ -123,6 +126,46 @@ static void print_public_key(const uint8_t *public_key)
     log_write(LOG_LEVEL_INFO, "Public Key: %s\n", buffer);
 }
 
+// Returns the shared key caches of the DHT, onion and onion announce, with a name for each of them
+
+static uint32_t get_shared_key_caches(DHT *dht, Onion *onion, Onion_Announce *onion_a, Shared_Key_Cache **caches,
+                                      const char **names)
+{
+    caches[0] = dht_get_shared_keys_recv(dht);
+    names[0] = "DHT received";
+    caches[1] = dht_get_shared_keys_sent(dht);
+    names[1] = "DHT sent";
+    caches[2] = onion->shared_keys_1;
+    names[2] = "onion 1";
+    caches[3] = onion->shared_keys_2;
+    names[3] = "onion 2";
+    caches[4] = onion->shared_keys_3;
+    names[4] = "onion 3";
+    caches[5] = onion_announce_get_shared_keys(onion_a);
+    names[5] = "onion announce";
+    return 6;
+}
+
+// Logs the hit rate of each shared key cache, to help size them
+
+static void log_shared_key_cache_stats(DHT *dht, Onion *onion, Onion_Announce *onion_a)
+{
+    Shared_Key_Cache *caches[6];
+    const char *names[6];
+    const uint32_t count = get_shared_key_caches(dht, onion, onion_a, caches, names);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        Shared_Key_Cache_Stats stats;
+        shared_key_cache_get_stats(caches[i], &stats);
+
+        const uint64_t lookups = stats.hits + stats.misses;
+        log_write(LOG_LEVEL_INFO, "Shared key cache '%s': %u/%u keys, %llu hits, %llu misses (%.1f%% hit rate), %llu evictions\n",
+                  names[i], shared_key_cache_count(caches[i]), shared_key_cache_capacity(caches[i]),
+                  (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+                  lookups > 0 ? 100.0 * stats.hits / lookups : 0.0, (unsigned long long)stats.evictions);
+    }
+}
+
 // Demonizes the process, appending PID to the PID file and closing file descriptors based on log backend
 // Terminates the application if the daemonization fails.
 
@@ -253,10 +296,15 @@ int main(int argc, char *argv[])
     uint16_t *tcp_relay_ports = nullptr;
     int tcp_relay_port_count;
     int enable_motd;
+    int dht_bucket_size;
+    int shared_key_cache_size;
+    int tcp_relay_workers;
+    int tcp_relay_handshake_workers;
     char *motd = nullptr;
 
     if (get_general_config(cfg_file_path, &pid_file_path, &keys_file_path, &port, &enable_ipv6, &enable_ipv4_fallback,
-                           &enable_lan_discovery, &enable_tcp_relay, &tcp_relay_ports, &tcp_relay_port_count, &enable_motd, &motd)) {
+                           &enable_lan_discovery, &enable_tcp_relay, &tcp_relay_ports, &tcp_relay_port_count, &enable_motd, &motd,
+                           &dht_bucket_size, &shared_key_cache_size, &tcp_relay_workers, &tcp_relay_handshake_workers)) {
         log_write(LOG_LEVEL_INFO, "General config read successfully\n");
     } else {
         log_write(LOG_LEVEL_ERROR, "Couldn't read config file: %s. Exiting.\n", cfg_file_path);
@@ -315,6 +363,10 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (!networking_set_batch_size(net, NET_MAX_BATCH_SIZE)) {
+        log_write(LOG_LEVEL_INFO, "Batched UDP I/O is not available, using one syscall per packet.\n");
+    }
+
     Mono_Time *const mono_time = mono_time_new();
 
     if (mono_time == nullptr) {
@@ -342,6 +394,11 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (dht_bucket_size < 1 || dht_bucket_size > DHT_MAX_CLOSE_BUCKET_SIZE
+            || !dht_set_close_bucket_size(dht, dht_bucket_size)) {
+        log_write(LOG_LEVEL_WARNING, "Couldn't set DHT bucket size to %d, using %d.\n", dht_bucket_size, LCLIENT_NODES);
+    }
+
     Onion *onion = new_onion(mono_time, dht);
 
     if (!onion) {
@@ -371,6 +428,19 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    Shared_Key_Cache *shared_key_caches[6];
+    const char *shared_key_cache_names[6];
+    const uint32_t shared_key_cache_count = get_shared_key_caches(dht, onion, onion_a, shared_key_caches,
+                                            shared_key_cache_names);
+
+    for (uint32_t i = 0; i < shared_key_cache_count; ++i) {
+        if (shared_key_cache_size < 1 || shared_key_cache_size > SHARED_KEY_CACHE_MAX_SIZE
+                || !shared_key_cache_resize(shared_key_caches[i], shared_key_cache_size)) {
+            log_write(LOG_LEVEL_WARNING, "Couldn't set size of shared key cache '%s' to %d, using %d.\n",
+                      shared_key_cache_names[i], shared_key_cache_size, SHARED_KEY_CACHE_DEFAULT_SIZE);
+        }
+    }
+
     if (enable_motd) {
         if (bootstrap_set_callbacks(dht_get_net(dht), DAEMON_VERSION_NUMBER, (uint8_t *)motd, strlen(motd) + 1) == 0) {
             log_write(LOG_LEVEL_INFO, "Set MOTD successfully.\n");
@@ -428,6 +498,27 @@ int main(int argc, char *argv[])
         if (tcp_server != nullptr) {
             log_write(LOG_LEVEL_INFO, "Initialized Tox TCP server successfully.\n");
 
+            if (tcp_relay_workers > 0) {
+                if (tcp_relay_workers <= TCP_SERVER_MAX_WORKERS && tcp_server_start_workers(tcp_server, tcp_relay_workers)) {
+                    log_write(LOG_LEVEL_INFO, "Started %d TCP relay worker threads.\n", tcp_relay_workers);
+                } else {
+                    log_write(LOG_LEVEL_WARNING, "Couldn't start %d TCP relay worker threads, running the TCP relay on the main thread.\n",
+                              tcp_relay_workers);
+                }
+            }
+
+            // After the workers: tcp_server_start_workers() refuses to run once handshake threads are running.
+            if (tcp_relay_handshake_workers > 0) {
+                if (tcp_relay_handshake_workers <= TCP_SERVER_MAX_HANDSHAKE_WORKERS
+                        && tcp_server_start_handshake_workers(tcp_server, tcp_relay_handshake_workers)) {
+                    log_write(LOG_LEVEL_INFO, "Started %d TCP relay handshake threads.\n", tcp_relay_handshake_workers);
+                } else {
+                    log_write(LOG_LEVEL_WARNING,
+                              "Couldn't start %d TCP relay handshake threads, computing handshakes on the relay threads.\n",
+                              tcp_relay_handshake_workers);
+                }
+            }
+
             struct rlimit limit;
 
             const rlim_t rlim_suggested = 32768;
@@ -480,6 +571,7 @@ int main(int argc, char *argv[])
     print_public_key(dht_get_self_public_key(dht));
 
     uint64_t last_LANdiscovery = 0;
+    uint64_t last_shared_key_cache_stats = mono_time_get(mono_time);
     const uint16_t net_htons_port = net_htons(port);
 
     int waiting_for_dht_connection = 1;
@@ -522,12 +614,18 @@ int main(int argc, char *argv[])
         }
 
         networking_poll(dht_get_net(dht), nullptr);
+        networking_flush(dht_get_net(dht));
 
         if (waiting_for_dht_connection && dht_isconnected(dht)) {
             log_write(LOG_LEVEL_INFO, "Connected to another bootstrap node successfully.\n");
             waiting_for_dht_connection = 0;
         }
 
+        if (mono_time_is_timeout(mono_time, last_shared_key_cache_stats, SHARED_KEY_CACHE_STATS_INTERVAL)) {
+            log_shared_key_cache_stats(dht, onion, onion_a);
+            last_shared_key_cache_stats = mono_time_get(mono_time);
+        }
+
         SLEEP_MILLISECONDS(30);
     }
 
@@ -544,6 +642,8 @@ int main(int argc, char *argv[])
             log_write(LOG_LEVEL_INFO, "Received (%d) signal. Exiting.\n", caught_signal);
     }
 
+    log_shared_key_cache_stats(dht, onion, onion_a);
+
     if (enable_lan_discovery) {
         lan_discovery_kill(dht);
     }
@@ -101,7 +101,7 @@ static void print_clientlist(DHT *dht)
     uint32_t i;
     printf("___________________CLOSE________________________________\n");
 
-    for (i = 0; i < LCLIENT_LIST; i++) {
+    for (i = 0; i < dht_get_num_close_clients(dht); i++) {
         const Client_data *client = dht_get_close_client(dht, i);
 
         if (public_key_cmp(client->public_key, zeroes_cid) == 0) {
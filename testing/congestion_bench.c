@@ -0,0 +1,519 @@
+/* Simulated-link benchmark for the net_crypto congestion control algorithms.
+ *
+ * Runs a bulk transfer over a simulated link with a bottleneck of fixed
+ * bandwidth, a drop-tail queue, a fixed round trip time and random loss. The
+ * sender and receiver follow what net_crypto does: packets are sent from a
+ * budget refilled at the rate congestion control picks, and the receiver
+ * periodically sends request packets listing what it is missing, which ack the
+ * rest. For each scenario and algorithm it prints the goodput and how long
+ * packets waited in the bottleneck queue.
+ *
+ * Usage: congestion_bench [seconds]
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../toxcore/ccompat.h"
+#include "../toxcore/congestion_control.h"
+
+/* Same as CRYPTO_PACKET_BUFFER_SIZE. */
+#define WINDOW_SIZE 32768
+
+/* Time in ms between request packets while data arrives. */
+#define REQUEST_INTERVAL 50
+
+/* Request packets are sent this often when nothing arrives. */
+#define IDLE_REQUEST_INTERVAL 1000
+
+/* Like DEFAULT_PING_CONNECTION. */
+#define DEFAULT_RTT 1000
+
+/* Like MIN_SLOTS_FREE in Messenger.c: file transfers leave this many packets
+ * of the send budget to other traffic. */
+#define MIN_SLOTS_FREE (CONGESTION_MIN_QUEUE_LENGTH / 4)
+
+typedef struct Scenario {
+    const char *name;
+    /* Bottleneck bandwidth in packets per second. */
+    double bandwidth;
+    /* Round trip time without queueing in ms. */
+    uint32_t rtt;
+    /* Packets the bottleneck queue holds. */
+    uint32_t queue_size;
+    /* Probability that a packet is lost in either direction. */
+    double loss;
+} Scenario;
+
+static const Scenario scenarios[] = {
+    {"lan",          5000.0,  10,  250, 0.0},
+    {"broadband",    1000.0,  60,  200, 0.0},
+    {"long rtt",     1000.0, 600,  600, 0.0},
+    {"lossy",        1000.0, 100,  100, 0.02},
+    {"deep buffer",   500.0,  80, 2000, 0.0},
+};
+
+#define NUM_SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+/* A packet or request on its way over one direction of the link. */
+typedef struct In_Flight {
+    uint64_t arrival_time;
+    uint32_t number;
+    /* Request packets only: the receiver's buffer start and received bitmap
+     * from there up to the last missing packet. */
+    uint32_t buffer_start;
+    uint32_t num_entries;
+    uint8_t *received;
+} In_Flight;
+
+typedef struct Fifo {
+    In_Flight *entries;
+    uint32_t capacity;
+    uint32_t start;
+    uint32_t size;
+} Fifo;
+
+typedef struct Sim {
+    const Scenario *scenario;
+    uint64_t now;
+    uint64_t rng;
+
+    /* Bottleneck queue of packet numbers, with their enqueue time. */
+    Fifo bottleneck;
+    double link_credit;
+    Fifo to_receiver;
+    Fifo to_sender;
+
+    /* Sender, as in Crypto_Connection. */
+    Congestion_Control congestion;
+    uint64_t sent_time[WINDOW_SIZE];
+    bool stored[WINDOW_SIZE];
+    uint32_t send_start;
+    uint32_t send_end;
+    uint32_t num_unsent;
+
+    double packet_send_rate;
+    uint32_t packets_left;
+    uint64_t last_packets_left_set;
+    double last_packets_left_rem;
+    double packet_send_rate_requested;
+    uint32_t packets_left_requested;
+    uint64_t last_packets_left_requested_set;
+    double last_packets_left_requested_rem;
+    uint32_t packets_sent;
+    uint32_t packets_resent;
+    uint64_t last_congestion_event;
+    uint64_t packet_counter_set;
+    uint64_t rtt_time;
+
+    /* Receiver. */
+    bool received[WINDOW_SIZE];
+    uint32_t recv_start;
+    uint32_t recv_end;
+    uint64_t last_request_sent;
+    uint32_t recv_counter;
+
+    /* Results. */
+    uint64_t total_sent;
+    uint64_t total_resent;
+    uint64_t queue_delay_sum;
+    uint64_t queue_delay_max;
+    uint64_t queue_samples;
+} Sim;
+
+static double sim_random(Sim *sim)
+{
+    sim->rng ^= sim->rng << 13;
+    sim->rng ^= sim->rng >> 7;
+    sim->rng ^= sim->rng << 17;
+    return (double)(sim->rng >> 11) / (double)(1ULL << 53);
+}
+
+static bool fifo_init(Fifo *fifo, uint32_t capacity)
+{
+    fifo->entries = (In_Flight *)calloc(capacity, sizeof(In_Flight));
+    fifo->capacity = capacity;
+    fifo->start = 0;
+    fifo->size = 0;
+    return fifo->entries != nullptr;
+}
+
+static void fifo_free(Fifo *fifo)
+{
+    for (uint32_t i = 0; i < fifo->size; ++i) {
+        free(fifo->entries[(fifo->start + i) % fifo->capacity].received);
+    }
+
+    free(fifo->entries);
+}
+
+static bool fifo_push(Fifo *fifo, const In_Flight *entry)
+{
+    if (fifo->size == fifo->capacity) {
+        return false;
+    }
+
+    fifo->entries[(fifo->start + fifo->size) % fifo->capacity] = *entry;
+    ++fifo->size;
+    return true;
+}
+
+static const In_Flight *fifo_peek(const Fifo *fifo)
+{
+    return fifo->size != 0 ? &fifo->entries[fifo->start] : nullptr;
+}
+
+static void fifo_pop(Fifo *fifo)
+{
+    fifo->start = (fifo->start + 1) % fifo->capacity;
+    --fifo->size;
+}
+
+static void link_send(Sim *sim, uint32_t number)
+{
+    if (sim_random(sim) < sim->scenario->loss) {
+        return;
+    }
+
+    In_Flight entry = {sim->now, number, 0, 0, nullptr};
+    fifo_push(&sim->bottleneck, &entry);
+}
+
+static void sender_send(Sim *sim, uint32_t number)
+{
+    sim->sent_time[number % WINDOW_SIZE] = sim->now;
+    ++sim->total_sent;
+    link_send(sim, number);
+}
+
+static void sender_free(Sim *sim, uint32_t number, uint32_t *packets_acked)
+{
+    const uint32_t num = number % WINDOW_SIZE;
+
+    if (!sim->stored[num]) {
+        return;
+    }
+
+    if (sim->sent_time[num] == 0) {
+        --sim->num_unsent;
+    }
+
+    sim->stored[num] = false;
+    ++*packets_acked;
+}
+
+/* What handle_data_packet_core() and handle_request_packet() do. */
+static void sender_handle_request(Sim *sim, const In_Flight *request)
+{
+    uint32_t packets_acked = 0;
+    uint64_t rtt_calc_time = 0;
+
+    if (request->buffer_start != sim->send_start) {
+        rtt_calc_time = sim->stored[sim->send_start % WINDOW_SIZE] ? sim->sent_time[sim->send_start % WINDOW_SIZE] : 0;
+
+        for (uint32_t i = sim->send_start; i != request->buffer_start; ++i) {
+            sender_free(sim, i, &packets_acked);
+        }
+
+        sim->send_start = request->buffer_start;
+    }
+
+    congestion_control_on_ack(&sim->congestion, sim->now, packets_acked);
+    packets_acked = 0;
+
+    for (uint32_t i = 0; i < request->num_entries; ++i) {
+        const uint32_t number = request->buffer_start + i;
+        const uint32_t num = number % WINDOW_SIZE;
+
+        if (request->received[i]) {
+            sender_free(sim, number, &packets_acked);
+        } else if (sim->stored[num] && sim->sent_time[num] != 0 && sim->sent_time[num] + sim->rtt_time < sim->now) {
+            sim->sent_time[num] = 0;
+            ++sim->num_unsent;
+        }
+    }
+
+    congestion_control_on_ack(&sim->congestion, sim->now, packets_acked);
+
+    /* net_crypto only gets a usable round trip time sample from the packet at
+     * the start of the send queue, and only if nothing was requested. */
+    if (request->num_entries == 0 && rtt_calc_time != 0) {
+        const uint64_t rtt = sim->now - rtt_calc_time;
+
+        if (rtt < sim->rtt_time) {
+            sim->rtt_time = rtt;
+        }
+
+        congestion_control_on_rtt(&sim->congestion, rtt);
+    }
+}
+
+/* The congestion control and send budget part of send_crypto_packets(). */
+static void sender_run(Sim *sim)
+{
+    const uint64_t temp_time = sim->now;
+
+    if (CONGESTION_INTERVAL + sim->packet_counter_set < temp_time) {
+        Congestion_Interval interval;
+        interval.time = temp_time;
+        interval.packets_sent = sim->packets_sent;
+        interval.packets_resent = sim->packets_resent;
+        interval.send_queue_size = sim->send_end - sim->send_start;
+        interval.rtt = sim->rtt_time;
+        interval.last_congestion_event = sim->last_congestion_event;
+        interval.hold_rate = false;
+
+        congestion_control_update(&sim->congestion, &interval, &sim->packet_send_rate, &sim->packet_send_rate_requested);
+
+        sim->packets_sent = 0;
+        sim->packets_resent = 0;
+        sim->packet_counter_set = temp_time;
+    }
+
+    if (sim->last_packets_left_set == 0 || sim->last_packets_left_requested_set == 0) {
+        sim->last_packets_left_requested_set = temp_time;
+        sim->last_packets_left_set = temp_time;
+        sim->packets_left_requested = CONGESTION_MIN_QUEUE_LENGTH;
+        sim->packets_left = CONGESTION_MIN_QUEUE_LENGTH;
+    } else {
+        if (((uint64_t)((1000.0 / sim->packet_send_rate) + 0.5) + sim->last_packets_left_set) <= temp_time) {
+            double n_packets = sim->packet_send_rate * (((double)(temp_time - sim->last_packets_left_set)) / 1000.0);
+            n_packets += sim->last_packets_left_rem;
+
+            uint32_t num_packets = n_packets;
+            double rem = n_packets - (double)num_packets;
+
+            if (sim->packets_left > num_packets * 4 + CONGESTION_MIN_QUEUE_LENGTH) {
+                sim->packets_left = num_packets * 4 + CONGESTION_MIN_QUEUE_LENGTH;
+            } else {
+                sim->packets_left += num_packets;
+            }
+
+            sim->last_packets_left_set = temp_time;
+            sim->last_packets_left_rem = rem;
+        }
+
+        if (((uint64_t)((1000.0 / sim->packet_send_rate_requested) + 0.5) + sim->last_packets_left_requested_set) <=
+                temp_time) {
+            double n_packets = sim->packet_send_rate_requested * (((double)(temp_time -
+                               sim->last_packets_left_requested_set)) / 1000.0);
+            n_packets += sim->last_packets_left_requested_rem;
+
+            uint32_t num_packets = n_packets;
+            double rem = n_packets - (double)num_packets;
+            sim->packets_left_requested = num_packets;
+
+            sim->last_packets_left_requested_set = temp_time;
+            sim->last_packets_left_requested_rem = rem;
+        }
+
+        if (sim->packets_left > sim->packets_left_requested) {
+            sim->packets_left_requested = sim->packets_left;
+        }
+    }
+
+    if (sim->packets_left_requested != 0) {
+        uint32_t num_sent = 0;
+
+        for (uint32_t i = sim->send_start; i != sim->send_end && sim->num_unsent != 0
+                && num_sent < sim->packets_left_requested; ++i) {
+            const uint32_t num = i % WINDOW_SIZE;
+
+            if (sim->stored[num] && sim->sent_time[num] == 0) {
+                --sim->num_unsent;
+                sender_send(sim, i);
+                ++sim->total_resent;
+                ++num_sent;
+            }
+        }
+
+        sim->packets_left_requested -= num_sent;
+        sim->packets_resent += num_sent;
+
+        if (num_sent < sim->packets_left) {
+            sim->packets_left -= num_sent;
+        } else {
+            sim->last_congestion_event = temp_time;
+            sim->packets_left = 0;
+        }
+    }
+
+    /* The application sends as much as it may, like a file transfer. */
+    while (sim->packets_left > MIN_SLOTS_FREE && sim->send_end - sim->send_start < WINDOW_SIZE - MIN_SLOTS_FREE) {
+        const uint32_t number = sim->send_end;
+        ++sim->send_end;
+        sim->stored[number % WINDOW_SIZE] = true;
+        sender_send(sim, number);
+        --sim->packets_left;
+        --sim->packets_left_requested;
+        ++sim->packets_sent;
+    }
+}
+
+static void receiver_send_request(Sim *sim)
+{
+    uint32_t num_entries = 0;
+
+    for (uint32_t i = sim->recv_start; i != sim->recv_end; ++i) {
+        if (!sim->received[i % WINDOW_SIZE]) {
+            num_entries = i - sim->recv_start + 1;
+        }
+    }
+
+    In_Flight request = {sim->now + sim->scenario->rtt / 2, 0, sim->recv_start, num_entries, nullptr};
+
+    if (num_entries != 0) {
+        request.received = (uint8_t *)malloc(num_entries);
+
+        if (request.received == nullptr) {
+            return;
+        }
+
+        for (uint32_t i = 0; i < num_entries; ++i) {
+            request.received[i] = sim->received[(sim->recv_start + i) % WINDOW_SIZE];
+        }
+    }
+
+    sim->last_request_sent = sim->now;
+
+    if (sim_random(sim) < sim->scenario->loss || !fifo_push(&sim->to_sender, &request)) {
+        free(request.received);
+    }
+}
+
+static void receiver_receive(Sim *sim, uint32_t number)
+{
+    if (number - sim->recv_start >= WINDOW_SIZE) {
+        return;
+    }
+
+    sim->received[number % WINDOW_SIZE] = true;
+    ++sim->recv_counter;
+
+    if (number - sim->recv_start >= sim->recv_end - sim->recv_start) {
+        sim->recv_end = number + 1;
+    }
+
+    while (sim->recv_start != sim->recv_end && sim->received[sim->recv_start % WINDOW_SIZE]) {
+        sim->received[sim->recv_start % WINDOW_SIZE] = false;
+        ++sim->recv_start;
+    }
+}
+
+static void sim_step(Sim *sim)
+{
+    const In_Flight *entry;
+
+    /* Bottleneck. */
+    sim->link_credit += sim->scenario->bandwidth / 1000.0;
+
+    while (sim->link_credit >= 1.0 && (entry = fifo_peek(&sim->bottleneck)) != nullptr) {
+        const uint64_t delay = sim->now - entry->arrival_time;
+        sim->queue_delay_sum += delay;
+        ++sim->queue_samples;
+
+        if (delay > sim->queue_delay_max) {
+            sim->queue_delay_max = delay;
+        }
+
+        In_Flight delivered = {sim->now + sim->scenario->rtt / 2, entry->number, 0, 0, nullptr};
+        fifo_pop(&sim->bottleneck);
+        fifo_push(&sim->to_receiver, &delivered);
+        sim->link_credit -= 1.0;
+    }
+
+    if (sim->bottleneck.size == 0 && sim->link_credit > 1.0) {
+        sim->link_credit = 1.0;
+    }
+
+    while ((entry = fifo_peek(&sim->to_receiver)) != nullptr && entry->arrival_time <= sim->now) {
+        receiver_receive(sim, entry->number);
+        fifo_pop(&sim->to_receiver);
+    }
+
+    const uint64_t request_interval = sim->recv_counter != 0 ? REQUEST_INTERVAL : IDLE_REQUEST_INTERVAL;
+
+    if (sim->last_request_sent + request_interval <= sim->now) {
+        sim->recv_counter = 0;
+        receiver_send_request(sim);
+    }
+
+    while ((entry = fifo_peek(&sim->to_sender)) != nullptr && entry->arrival_time <= sim->now) {
+        sender_handle_request(sim, entry);
+        free(entry->received);
+        fifo_pop(&sim->to_sender);
+    }
+
+    sender_run(sim);
+}
+
+static void run_scenario(const Scenario *scenario, Congestion_Algorithm algorithm, uint32_t seconds)
+{
+    Sim *sim = (Sim *)calloc(1, sizeof(Sim));
+
+    if (sim == nullptr) {
+        return;
+    }
+
+    sim->scenario = scenario;
+    sim->now = 1;
+    sim->rng = 0x9e3779b97f4a7c15ULL;
+    sim->packet_send_rate = CONGESTION_MIN_RATE;
+    sim->packet_send_rate_requested = CONGESTION_MIN_RATE;
+    sim->packets_left = CONGESTION_MIN_QUEUE_LENGTH;
+    sim->rtt_time = DEFAULT_RTT;
+    sim->packet_counter_set = sim->now;
+    congestion_control_init(&sim->congestion, algorithm);
+
+    /* Packets in flight on each direction are bounded by the fastest rate
+     * times the longest delay. */
+    if (fifo_init(&sim->bottleneck, scenario->queue_size)
+            && fifo_init(&sim->to_receiver, WINDOW_SIZE)
+            && fifo_init(&sim->to_sender, WINDOW_SIZE)) {
+        const uint64_t end = sim->now + (uint64_t)seconds * 1000;
+
+        while (sim->now < end) {
+            sim_step(sim);
+            ++sim->now;
+        }
+
+        const double goodput = (double)sim->recv_start / (double)seconds;
+        printf("%-12s %-6s %9.0f %5.1f%% %9.1f %9llu %7.2f%%\n", scenario->name,
+               congestion_algorithm_to_string(algorithm), goodput, 100.0 * goodput / scenario->bandwidth,
+               sim->queue_samples != 0 ? (double)sim->queue_delay_sum / (double)sim->queue_samples : 0.0,
+               (unsigned long long)sim->queue_delay_max,
+               sim->total_sent != 0 ? 100.0 * (double)sim->total_resent / (double)sim->total_sent : 0.0);
+    }
+
+    fifo_free(&sim->bottleneck);
+    fifo_free(&sim->to_receiver);
+    fifo_free(&sim->to_sender);
+    free(sim);
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t seconds = argc > 1 ? (uint32_t)atoi(argv[1]) : 60;
+
+    if (seconds == 0) {
+        fprintf(stderr, "usage: %s [seconds]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%u simulated seconds per run\n\n", seconds);
+    printf("%-12s %-6s %9s %6s %9s %9s %8s\n", "scenario", "algo", "goodput/s", "link", "queue ms", "max ms",
+           "resent");
+
+    for (uint32_t i = 0; i < NUM_SCENARIOS; ++i) {
+        run_scenario(&scenarios[i], CONGESTION_ALGORITHM_QUEUE, seconds);
+        run_scenario(&scenarios[i], CONGESTION_ALGORITHM_DELAY, seconds);
+    }
+
+    return 0;
+}
@@ -0,0 +1,169 @@
+/* Throughput benchmark for the ciphers net_crypto encrypts data packets with.
+ *
+ * Compares XSalsa20-Poly1305 (encrypt_data_symmetric) with AES-256-GCM
+ * (encrypt_data_aesgcm) for the data packet sizes net_crypto sends, one packet
+ * at a time and in batches of BATCH_SIZE packets.
+ *
+ * Usage: crypto_bench [megabytes]
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../toxcore/ccompat.h"
+#include "../toxcore/crypto_core.h"
+#include "../toxcore/net_crypto.h"
+
+/* As many packets as net_crypto encrypts at once. */
+#define BATCH_SIZE 8
+
+typedef int32_t crypt_cb(const uint8_t *key, const uint8_t *nonce, const uint8_t *in, size_t length, uint8_t *out);
+typedef uint32_t crypt_batch_cb(const uint8_t *key, Crypto_Batch_Entry *entries, uint32_t count);
+
+typedef struct Cipher {
+    const char *name;
+    crypt_cb *encrypt;
+    crypt_cb *decrypt;
+    crypt_batch_cb *encrypt_batch;
+    crypt_batch_cb *decrypt_batch;
+} Cipher;
+
+static double elapsed_mib_s(clock_t start, uint64_t bytes)
+{
+    const double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    return seconds > 0 ? bytes / seconds / (1024 * 1024) : 0;
+}
+
+/* Encrypt packets of the given size until megabytes of data went through,
+ * then decrypt them again, the way net_crypto does for each data packet.
+ * With batch, BATCH_SIZE packets are passed to the cipher at once. */
+static bool bench_cipher(const Cipher *cipher, bool batch, uint16_t length, uint32_t megabytes)
+{
+    const uint64_t batches = (uint64_t)megabytes * 1024 * 1024 / length / BATCH_SIZE + 1;
+    const uint64_t bytes = batches * BATCH_SIZE * length;
+
+    uint8_t key[CRYPTO_SYMMETRIC_KEY_SIZE];
+    uint8_t nonces[BATCH_SIZE][CRYPTO_NONCE_SIZE];
+    new_symmetric_key(key);
+    random_nonce(nonces[0]);
+
+    for (uint32_t i = 1; i < BATCH_SIZE; ++i) {
+        memcpy(nonces[i], nonces[i - 1], CRYPTO_NONCE_SIZE);
+        increment_nonce(nonces[i]);
+    }
+
+    uint8_t *plain = (uint8_t *)malloc(length);
+    uint8_t *encrypted = (uint8_t *)malloc((size_t)BATCH_SIZE * (length + CRYPTO_MAC_SIZE));
+    uint8_t *decrypted = (uint8_t *)malloc((size_t)BATCH_SIZE * length);
+
+    if (plain == nullptr || encrypted == nullptr || decrypted == nullptr) {
+        free(plain);
+        free(encrypted);
+        free(decrypted);
+        return false;
+    }
+
+    random_bytes(plain, length);
+
+    Crypto_Batch_Entry encrypt_entries[BATCH_SIZE];
+    Crypto_Batch_Entry decrypt_entries[BATCH_SIZE];
+
+    for (uint32_t i = 0; i < BATCH_SIZE; ++i) {
+        encrypt_entries[i].nonce = nonces[i];
+        encrypt_entries[i].input = plain;
+        encrypt_entries[i].length = length;
+        encrypt_entries[i].output = encrypted + i * (length + CRYPTO_MAC_SIZE);
+        decrypt_entries[i].nonce = nonces[i];
+        decrypt_entries[i].input = encrypted + i * (length + CRYPTO_MAC_SIZE);
+        decrypt_entries[i].length = length + CRYPTO_MAC_SIZE;
+        decrypt_entries[i].output = decrypted + i * length;
+    }
+
+    bool ok = true;
+    clock_t start = clock();
+
+    for (uint64_t b = 0; b < batches; ++b) {
+        if (batch) {
+            ok &= cipher->encrypt_batch(key, encrypt_entries, BATCH_SIZE) == BATCH_SIZE;
+            continue;
+        }
+
+        for (uint32_t i = 0; i < BATCH_SIZE; ++i) {
+            const Crypto_Batch_Entry *const e = &encrypt_entries[i];
+            ok &= cipher->encrypt(key, e->nonce, e->input, e->length, e->output) == length + CRYPTO_MAC_SIZE;
+        }
+    }
+
+    const double encrypt_speed = elapsed_mib_s(start, bytes);
+    start = clock();
+
+    for (uint64_t b = 0; b < batches; ++b) {
+        if (batch) {
+            ok &= cipher->decrypt_batch(key, decrypt_entries, BATCH_SIZE) == BATCH_SIZE;
+            continue;
+        }
+
+        for (uint32_t i = 0; i < BATCH_SIZE; ++i) {
+            const Crypto_Batch_Entry *const e = &decrypt_entries[i];
+            ok &= cipher->decrypt(key, e->nonce, e->input, e->length, e->output) == length;
+        }
+    }
+
+    const double decrypt_speed = elapsed_mib_s(start, bytes);
+
+    for (uint32_t i = 0; i < BATCH_SIZE; ++i) {
+        ok &= memcmp(plain, decrypted + i * length, length) == 0;
+    }
+
+    printf("  %-17s %-7s %5u bytes %9.1f MiB/s encrypt %9.1f MiB/s decrypt%s\n", cipher->name,
+           batch ? "batch" : "single", length, encrypt_speed, decrypt_speed, ok ? "" : " (FAILED)");
+
+    free(plain);
+    free(encrypted);
+    free(decrypted);
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t megabytes = argc > 1 ? (uint32_t)atoi(argv[1]) : 256;
+    const uint16_t sizes[] = {64, MAX_CRYPTO_DATA_SIZE, MAX_CRYPTO_PMTU_DATA_SIZE};
+    const bool aesgcm = crypto_aesgcm_available();
+    bool ok = true;
+
+    printf("%u MiB per cipher and packet size\n", megabytes);
+
+    const Cipher ciphers[] = {
+        {
+            "xsalsa20-poly1305", encrypt_data_symmetric, decrypt_data_symmetric,
+            encrypt_data_symmetric_batch, decrypt_data_symmetric_batch
+        },
+        {
+            "aes-256-gcm", encrypt_data_aesgcm, decrypt_data_aesgcm,
+            encrypt_data_aesgcm_batch, decrypt_data_aesgcm_batch
+        },
+    };
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        for (size_t j = 0; j < sizeof(ciphers) / sizeof(ciphers[0]); ++j) {
+            if (ciphers[j].encrypt == encrypt_data_aesgcm && !aesgcm) {
+                continue;
+            }
+
+            ok &= bench_cipher(&ciphers[j], false, sizes[i], megabytes);
+            ok &= bench_cipher(&ciphers[j], true, sizes[i], megabytes);
+        }
+    }
+
+    if (!aesgcm) {
+        printf("aes-256-gcm: not supported\n");
+    }
+
+    return ok ? 0 : 1;
+}
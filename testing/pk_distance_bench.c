@@ -0,0 +1,279 @@
+/* Microbenchmark for the public key distance functions used by the DHT.
+ *
+ * Compares the byte at a time code the DHT used before with each distance
+ * implementation supported by this CPU.
+ *
+ * Usage: pk_distance_bench [rounds]
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../toxcore/ccompat.h"
+#include "../toxcore/crypto_core.h"
+#include "../toxcore/pk_distance.h"
+
+#define NUM_KEYS 1024
+#define NUM_TARGETS 64
+#define NUM_CLOSEST 4
+
+typedef struct Bench_Entry {
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t other_data[64];
+} Bench_Entry;
+
+static int bytewise_cmp(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2)
+{
+    for (size_t i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; ++i) {
+        const uint8_t distance1 = pk[i] ^ pk1[i];
+        const uint8_t distance2 = pk[i] ^ pk2[i];
+
+        if (distance1 < distance2) {
+            return 1;
+        }
+
+        if (distance1 > distance2) {
+            return 2;
+        }
+    }
+
+    return 0;
+}
+
+static unsigned int bitwise_common_prefix(const uint8_t *pk1, const uint8_t *pk2)
+{
+    unsigned int i;
+    unsigned int j = 0;
+
+    for (i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; ++i) {
+        if (pk1[i] == pk2[i]) {
+            continue;
+        }
+
+        for (j = 0; j < 8; ++j) {
+            const uint8_t mask = 1 << (7 - j);
+
+            if ((pk1[i] & mask) != (pk2[i] & mask)) {
+                break;
+            }
+        }
+
+        break;
+    }
+
+    return i * 8 + j;
+}
+
+typedef int cmp_cb(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2);
+
+/* Keep the NUM_CLOSEST entries closest to target in closest, as the DHT does
+ * when answering a get nodes request. */
+static uint32_t find_closest(cmp_cb *cmp, const uint8_t *target, const Bench_Entry *entries, const uint8_t **closest)
+{
+    uint32_t num = 0;
+
+    for (uint32_t i = 0; i < NUM_KEYS; ++i) {
+        const uint8_t *pk = entries[i].public_key;
+        uint32_t j = num < NUM_CLOSEST ? num++ : NUM_CLOSEST;
+
+        while (j > 0 && cmp(target, pk, closest[j - 1]) == 1) {
+            if (j < NUM_CLOSEST) {
+                closest[j] = closest[j - 1];
+            }
+
+            --j;
+        }
+
+        if (j < NUM_CLOSEST) {
+            closest[j] = pk;
+        }
+    }
+
+    return num;
+}
+
+/* Same as find_closest, but skip entries further than the furthest one kept by
+ * comparing the batch computed distance prefixes first. */
+static uint32_t find_closest_batch(const uint8_t *target, const Bench_Entry *entries, const uint8_t **closest)
+{
+    uint64_t prefixes[NUM_KEYS];
+    pk_distance_prefixes(target, entries[0].public_key, sizeof(Bench_Entry), NUM_KEYS, prefixes);
+
+    uint32_t num = 0;
+
+    for (uint32_t i = 0; i < NUM_KEYS; ++i) {
+        if (num == NUM_CLOSEST && prefixes[i] > pk_distance_prefix(target, closest[NUM_CLOSEST - 1])) {
+            continue;
+        }
+
+        const uint8_t *pk = entries[i].public_key;
+        uint32_t j = num < NUM_CLOSEST ? num++ : NUM_CLOSEST;
+
+        while (j > 0 && pk_distance_cmp(target, pk, closest[j - 1]) == 1) {
+            if (j < NUM_CLOSEST) {
+                closest[j] = closest[j - 1];
+            }
+
+            --j;
+        }
+
+        if (j < NUM_CLOSEST) {
+            closest[j] = pk;
+        }
+    }
+
+    return num;
+}
+
+static double elapsed_ns(clock_t start, uint64_t ops)
+{
+    return (double)(clock() - start) * 1e9 / CLOCKS_PER_SEC / ops;
+}
+
+/* The sum is printed so the compiler can't drop the work. */
+static uint64_t sink;
+
+static void bench_cmp(const char *name, cmp_cb *cmp, const Bench_Entry *entries, uint32_t rounds)
+{
+    const clock_t start = clock();
+
+    for (uint32_t r = 0; r < rounds; ++r) {
+        for (uint32_t i = 0; i + 2 < NUM_KEYS; ++i) {
+            sink += cmp(entries[i].public_key, entries[i + 1].public_key, entries[i + 2].public_key);
+        }
+    }
+
+    printf("  %-28s %8.2f ns/op\n", name, elapsed_ns(start, (uint64_t)rounds * (NUM_KEYS - 2)));
+}
+
+static void bench_prefix(const char *name, unsigned int (*prefix)(const uint8_t *, const uint8_t *),
+                         const Bench_Entry *entries, uint32_t rounds)
+{
+    const clock_t start = clock();
+
+    for (uint32_t r = 0; r < rounds; ++r) {
+        for (uint32_t i = 0; i + 1 < NUM_KEYS; ++i) {
+            sink += prefix(entries[i].public_key, entries[i + 1].public_key);
+        }
+    }
+
+    printf("  %-28s %8.2f ns/op\n", name, elapsed_ns(start, (uint64_t)rounds * (NUM_KEYS - 1)));
+}
+
+static unsigned int common_prefix(const uint8_t *pk1, const uint8_t *pk2)
+{
+    return pk_common_prefix(pk1, pk2);
+}
+
+static void bench_closest(const char *name, cmp_cb *cmp, const Bench_Entry *entries, const uint8_t *targets,
+                          uint32_t rounds)
+{
+    const uint8_t *closest[NUM_CLOSEST];
+    const clock_t start = clock();
+
+    for (uint32_t r = 0; r < rounds / 16 + 1; ++r) {
+        for (uint32_t t = 0; t < NUM_TARGETS; ++t) {
+            const uint8_t *target = targets + t * CRYPTO_PUBLIC_KEY_SIZE;
+            const uint32_t num = cmp != nullptr
+                                 ? find_closest(cmp, target, entries, closest)
+                                 : find_closest_batch(target, entries, closest);
+            sink += closest[num - 1][0];
+        }
+    }
+
+    printf("  %-28s %8.2f us/lookup\n", name, elapsed_ns(start, (uint64_t)(rounds / 16 + 1) * NUM_TARGETS) / 1000);
+}
+
+/* Make keys share min_shared to min_shared + 3 leading bytes with base, the way
+ * keys in a DHT node's close list share a prefix with its own key. */
+static void make_keys(Bench_Entry *entries, const uint8_t *base, uint32_t min_shared)
+{
+    for (uint32_t i = 0; i < NUM_KEYS; ++i) {
+        random_bytes(entries[i].public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        memcpy(entries[i].public_key, base, min_shared + random_u32() % 4);
+    }
+}
+
+static const char *impl_name(Pk_Distance_Impl impl)
+{
+    switch (impl) {
+        case PK_DISTANCE_IMPL_SCALAR:
+            return "scalar";
+
+        case PK_DISTANCE_IMPL_SSE2:
+            return "sse2";
+
+        case PK_DISTANCE_IMPL_AVX2:
+            return "avx2";
+    }
+
+    return "<unknown>";
+}
+
+static void bench_all(const Bench_Entry *entries, const uint8_t *targets, uint32_t rounds)
+{
+    printf("bytewise (previous DHT code):\n");
+    bench_cmp("id_closest", bytewise_cmp, entries, rounds);
+    bench_prefix("bit_by_bit_cmp", bitwise_common_prefix, entries, rounds);
+    bench_closest("closest 4 of 1024", bytewise_cmp, entries, targets, rounds);
+
+    const Pk_Distance_Impl default_impl = pk_distance_get_impl();
+    const Pk_Distance_Impl impls[] = {PK_DISTANCE_IMPL_SCALAR, PK_DISTANCE_IMPL_SSE2, PK_DISTANCE_IMPL_AVX2};
+
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); ++i) {
+        if (!pk_distance_set_impl(impls[i])) {
+            printf("%s: not supported\n", impl_name(impls[i]));
+            continue;
+        }
+
+        printf("%s%s:\n", impl_name(impls[i]), impls[i] == default_impl ? " (default)" : "");
+        bench_cmp("pk_distance_cmp", pk_distance_cmp, entries, rounds);
+        bench_prefix("pk_common_prefix", common_prefix, entries, rounds);
+        bench_closest("closest 4 of 1024", pk_distance_cmp, entries, targets, rounds);
+        bench_closest("closest 4 of 1024 (batch)", nullptr, entries, targets, rounds);
+    }
+
+    pk_distance_set_impl(default_impl);
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t rounds = argc > 1 ? (uint32_t)atoi(argv[1]) : 2000;
+
+    Bench_Entry *entries = (Bench_Entry *)calloc(NUM_KEYS, sizeof(Bench_Entry));
+
+    if (entries == nullptr) {
+        return 1;
+    }
+
+    uint8_t base[CRYPTO_PUBLIC_KEY_SIZE];
+    random_bytes(base, sizeof(base));
+
+    /* Lookup targets are close to our key too, or we wouldn't be asked. */
+    uint8_t targets[NUM_TARGETS * CRYPTO_PUBLIC_KEY_SIZE];
+    random_bytes(targets, sizeof(targets));
+
+    printf("=== keys sharing 0-3 leading bytes ===\n");
+    make_keys(entries, base, 0);
+    bench_all(entries, targets, rounds);
+
+    printf("\n=== keys sharing 8-11 leading bytes ===\n");
+    make_keys(entries, base, 8);
+
+    for (uint32_t t = 0; t < NUM_TARGETS; ++t) {
+        memcpy(targets + t * CRYPTO_PUBLIC_KEY_SIZE, base, 8);
+    }
+
+    bench_all(entries, targets, rounds);
+
+    printf("(checksum %llu)\n", (unsigned long long)sink);
+
+    free(entries);
+    return 0;
+}
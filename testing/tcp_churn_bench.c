@@ -0,0 +1,217 @@
+/* Microbenchmark for the index a TCP relay keeps of its accepted clients.
+ *
+ * Simulates clients connecting and disconnecting from a relay that already
+ * has some number of clients, comparing the sorted list the relay used before
+ * with the hash map it uses now.
+ *
+ * Usage: tcp_churn_bench [rounds]
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../toxcore/ccompat.h"
+#include "../toxcore/crypto_core.h"
+#include "../toxcore/list.h"
+#include "../toxcore/pk_map.h"
+
+typedef struct Churn_Index {
+    const char *name;
+    void *(*create)(void);
+    void (*destroy)(void *index);
+    bool (*add)(void *index, const uint8_t *public_key, uint32_t value);
+    bool (*find)(const void *index, const uint8_t *public_key, uint32_t *value);
+    bool (*remove)(void *index, const uint8_t *public_key, uint32_t value);
+} Churn_Index;
+
+static void *list_create(void)
+{
+    BS_List *list = (BS_List *)calloc(1, sizeof(BS_List));
+
+    if (list == nullptr || !bs_list_init(list, CRYPTO_PUBLIC_KEY_SIZE, 8)) {
+        free(list);
+        return nullptr;
+    }
+
+    return list;
+}
+
+static void list_destroy(void *index)
+{
+    bs_list_free((BS_List *)index);
+    free(index);
+}
+
+static bool list_add(void *index, const uint8_t *public_key, uint32_t value)
+{
+    return bs_list_add((BS_List *)index, public_key, value) != 0;
+}
+
+static bool list_find(const void *index, const uint8_t *public_key, uint32_t *value)
+{
+    const int ret = bs_list_find((const BS_List *)index, public_key);
+
+    if (ret == -1) {
+        return false;
+    }
+
+    *value = ret;
+    return true;
+}
+
+static bool list_remove(void *index, const uint8_t *public_key, uint32_t value)
+{
+    return bs_list_remove((BS_List *)index, public_key, value) != 0;
+}
+
+static void *map_create(void)
+{
+    return pk_map_new();
+}
+
+static void map_destroy(void *index)
+{
+    pk_map_kill((PK_Map *)index);
+}
+
+static bool map_add(void *index, const uint8_t *public_key, uint32_t value)
+{
+    return pk_map_add((PK_Map *)index, public_key, value);
+}
+
+static bool map_find(const void *index, const uint8_t *public_key, uint32_t *value)
+{
+    return pk_map_find((const PK_Map *)index, public_key, value);
+}
+
+static bool map_remove(void *index, const uint8_t *public_key, uint32_t value)
+{
+    return pk_map_remove((PK_Map *)index, public_key);
+}
+
+static const Churn_Index indexes[] = {
+    {"bs_list (previous)", list_create, list_destroy, list_add, list_find, list_remove},
+    {"pk_map", map_create, map_destroy, map_add, map_find, map_remove},
+};
+
+static double elapsed_ns(clock_t start, uint64_t ops)
+{
+    return (double)(clock() - start) * 1e9 / CLOCKS_PER_SEC / ops;
+}
+
+/* The sum is printed so the compiler can't drop the work. */
+static uint64_t sink;
+
+/* Cheap random client picker, so the time goes to the index rather than to
+ * the system random number generator. */
+static uint64_t pick_state;
+
+static uint32_t pick_client(uint32_t num_clients)
+{
+    pick_state ^= pick_state << 13;
+    pick_state ^= pick_state >> 7;
+    pick_state ^= pick_state << 17;
+    return (uint32_t)(pick_state >> 32) % num_clients;
+}
+
+/* Fill the index with num_clients clients, then for each round let one of them
+ * disconnect, a new one connect in its place, and look up the client a packet
+ * came from, as the relay does for every incoming packet. */
+static bool bench_churn(const Churn_Index *impl, uint8_t *keys, uint32_t num_clients, const uint8_t *new_keys,
+                        uint32_t rounds)
+{
+    void *index = impl->create();
+
+    if (index == nullptr) {
+        return false;
+    }
+
+    const clock_t fill_start = clock();
+
+    for (uint32_t i = 0; i < num_clients; ++i) {
+        if (!impl->add(index, keys + i * CRYPTO_PUBLIC_KEY_SIZE, i)) {
+            impl->destroy(index);
+            return false;
+        }
+    }
+
+    const double fill_ns = elapsed_ns(fill_start, num_clients);
+    const clock_t start = clock();
+
+    for (uint32_t r = 0; r < rounds; ++r) {
+        const uint32_t i = pick_client(num_clients);
+        uint8_t *public_key = keys + i * CRYPTO_PUBLIC_KEY_SIZE;
+
+        if (!impl->remove(index, public_key, i)) {
+            impl->destroy(index);
+            return false;
+        }
+
+        memcpy(public_key, new_keys + r * CRYPTO_PUBLIC_KEY_SIZE, CRYPTO_PUBLIC_KEY_SIZE);
+
+        if (!impl->add(index, public_key, i)) {
+            impl->destroy(index);
+            return false;
+        }
+
+        uint32_t value = 0;
+        impl->find(index, keys + pick_client(num_clients) * CRYPTO_PUBLIC_KEY_SIZE, &value);
+        sink += value;
+    }
+
+    printf("  %-20s %10.1f ns/connect %10.1f ns/churn round\n", impl->name, fill_ns,
+           elapsed_ns(start, rounds));
+
+    impl->destroy(index);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t rounds = argc > 1 ? (uint32_t)atoi(argv[1]) : 100000;
+    const uint32_t sizes[] = {1000, 10000, 50000};
+
+    pick_state = random_u64() | 1;
+
+    /* Keys of the clients that connect during the rounds, made up front so
+     * that making them isn't measured. */
+    uint8_t *new_keys = (uint8_t *)malloc((size_t)rounds * CRYPTO_PUBLIC_KEY_SIZE);
+
+    if (new_keys == nullptr) {
+        return 1;
+    }
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        const uint32_t num_clients = sizes[s];
+        uint8_t *keys = (uint8_t *)malloc((size_t)num_clients * CRYPTO_PUBLIC_KEY_SIZE);
+
+        if (keys == nullptr) {
+            free(new_keys);
+            return 1;
+        }
+
+        printf("=== %u clients ===\n", num_clients);
+
+        for (size_t i = 0; i < sizeof(indexes) / sizeof(indexes[0]); ++i) {
+            random_bytes(keys, (size_t)num_clients * CRYPTO_PUBLIC_KEY_SIZE);
+            random_bytes(new_keys, (size_t)rounds * CRYPTO_PUBLIC_KEY_SIZE);
+
+            if (!bench_churn(&indexes[i], keys, num_clients, new_keys, rounds)) {
+                printf("  %-20s failed\n", indexes[i].name);
+            }
+        }
+
+        free(keys);
+    }
+
+    printf("(checksum %llu)\n", (unsigned long long)sink);
+
+    free(new_keys);
+    return 0;
+}
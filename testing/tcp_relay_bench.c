@@ -0,0 +1,507 @@
+/* Load test for the TCP relay server.
+ *
+ * Connects pairs of TCP clients through a relay on the loopback interface,
+ * routes the clients of each pair to each other and has them send data packets
+ * to each other as fast as the relay forwards them. This runs once with the
+ * relay on a single thread calling do_TCP_server(), then with 1, 2, 4, ...
+ * worker threads up to max_workers, to show how forwarding scales with cores.
+ *
+ * With storm_threads > 0, those threads keep opening connections to the relay
+ * while it forwards, like a crowd of clients reconnecting after an outage.
+ * Each configuration then runs without and with handshake workers, to show
+ * how much the key exchange of new connections holds up forwarding.
+ *
+ * Usage: tcp_relay_bench [pairs] [seconds] [max_workers] [client_threads] [storm_threads]
+ */
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../testing/misc_tools.h"
+#include "../toxcore/TCP_client.h"
+#include "../toxcore/TCP_server.h"
+#include "../toxcore/ccompat.h"
+#include "../toxcore/mono_time.h"
+#include "../toxcore/util.h"
+
+#define BENCH_PORT 33545
+#define PACKET_SIZE 1024
+/* Packets a client sends per iteration at most. */
+#define BURST_SIZE 8
+/* Milliseconds to sleep at most when no socket is ready. */
+#define POLL_TIMEOUT 10
+/* Seconds to wait for all pairs to be routed to each other. */
+#define SETUP_TIMEOUT 30
+
+/* How often client threads publish their counters, in milliseconds. */
+#define REPORT_INTERVAL 50
+
+/* Connections a storm thread has open at once. */
+#define STORM_CONNECTIONS 16
+
+typedef struct Bench_Client {
+    TCP_Client_Connection *con;
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+    struct Bench_Client *peer;
+    bool routed;
+    int con_id;
+    bool online;
+    uint64_t received;
+} Bench_Client;
+
+typedef struct Bench {
+    pthread_mutex_t mutex;
+    bool stop;
+    uint32_t online;
+    uint64_t received;
+    uint64_t handshakes;
+
+    IP_Port relay;
+    uint8_t relay_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+} Bench;
+
+typedef struct Bench_Thread {
+    pthread_t thread;
+    Bench *bench;
+    Bench_Client *clients;
+    uint32_t num_clients;
+} Bench_Thread;
+
+typedef struct Storm_Thread {
+    pthread_t thread;
+    Bench *bench;
+} Storm_Thread;
+
+typedef struct Server_Thread {
+    pthread_t thread;
+    Bench *bench;
+    TCP_Server *tcp_server;
+} Server_Thread;
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool bench_stopped(Bench *bench)
+{
+    pthread_mutex_lock(&bench->mutex);
+    const bool stop = bench->stop;
+    pthread_mutex_unlock(&bench->mutex);
+    return stop;
+}
+
+static int response_callback(void *object, uint8_t connection_id, const uint8_t *public_key)
+{
+    Bench_Client *client = (Bench_Client *)object;
+    client->con_id = connection_id;
+    return set_tcp_connection_number(client->con, connection_id, 0);
+}
+
+static int status_callback(void *object, uint32_t number, uint8_t connection_id, uint8_t status)
+{
+    Bench_Client *client = (Bench_Client *)object;
+    client->online = status == 2;
+    return 0;
+}
+
+static int data_callback(void *object, uint32_t number, uint8_t connection_id, const uint8_t *data, uint16_t length,
+                         void *userdata)
+{
+    Bench_Client *client = (Bench_Client *)object;
+    client->received += length;
+    return 0;
+}
+
+/* Run the clients of a thread: route them to their peers once connected and
+ * keep their send buffers full. */
+static void *client_thread(void *arg)
+{
+    Bench_Thread *thread = (Bench_Thread *)arg;
+    Bench *bench = thread->bench;
+    Mono_Time *mono_time = mono_time_new();
+    uint8_t packet[PACKET_SIZE];
+    memset(packet, 0x2a, sizeof(packet));
+
+    if (mono_time == nullptr) {
+        return nullptr;
+    }
+
+    for (uint32_t i = 0; i < thread->num_clients; ++i) {
+        Bench_Client *client = &thread->clients[i];
+        client->con = new_TCP_connection(mono_time, bench->relay, bench->relay_public_key, client->public_key,
+                                         client->secret_key, nullptr);
+
+        if (client->con == nullptr) {
+            continue;
+        }
+
+        routing_response_handler(client->con, response_callback, client);
+        routing_status_handler(client->con, status_callback, client);
+        routing_data_handler(client->con, data_callback, client);
+    }
+
+    struct pollfd *pfds = (struct pollfd *)calloc(thread->num_clients, sizeof(struct pollfd));
+    uint64_t last_received = 0;
+    uint32_t last_online = 0;
+    uint64_t last_report = 0;
+    bool stop = false;
+
+    while (pfds != nullptr && !stop) {
+        uint32_t num_pfds = 0;
+
+        for (uint32_t i = 0; i < thread->num_clients; ++i) {
+            const Bench_Client *client = &thread->clients[i];
+            Net_Poll_Fd fd;
+
+            if (client->con != nullptr && tcp_con_get_fds(client->con, &fd, 1) == 1) {
+                pfds[num_pfds].fd = fd.sock.socket;
+                pfds[num_pfds].events = POLLIN | (fd.want_write || client->online ? POLLOUT : 0);
+                ++num_pfds;
+            }
+        }
+
+        poll(pfds, num_pfds, POLL_TIMEOUT);
+
+        mono_time_update(mono_time);
+        uint64_t received = 0;
+        uint32_t online = 0;
+
+        for (uint32_t i = 0; i < thread->num_clients; ++i) {
+            Bench_Client *client = &thread->clients[i];
+
+            if (client->con == nullptr) {
+                continue;
+            }
+
+            do_TCP_connection(mono_time, client->con, nullptr);
+
+            if (!client->routed && tcp_con_status(client->con) == TCP_CLIENT_CONFIRMED) {
+                client->routed = send_routing_request(client->con, client->peer->public_key) == 1;
+            }
+
+            if (client->online) {
+                for (uint32_t j = 0; j < BURST_SIZE; ++j) {
+                    if (send_data(client->con, client->con_id, packet, sizeof(packet)) != 1) {
+                        break;
+                    }
+                }
+
+                ++online;
+            }
+
+            received += client->received;
+        }
+
+        if (now_ms() - last_report < REPORT_INTERVAL) {
+            continue;
+        }
+
+        pthread_mutex_lock(&bench->mutex);
+        bench->received += received - last_received;
+        bench->online += online - last_online;
+        stop = bench->stop;
+        pthread_mutex_unlock(&bench->mutex);
+        last_received = received;
+        last_online = online;
+        last_report = now_ms();
+    }
+
+    for (uint32_t i = 0; i < thread->num_clients; ++i) {
+        if (thread->clients[i].con != nullptr) {
+            kill_TCP_connection(thread->clients[i].con);
+        }
+    }
+
+    free(pfds);
+    mono_time_free(mono_time);
+    return nullptr;
+}
+
+/* Connect to the relay and send a handshake from a random key, which the relay
+ * only rejects after the key exchange.
+ *
+ * return an invalid socket on failure.
+ */
+static Socket storm_connect(const IP_Port *relay)
+{
+    Socket sock = net_socket(net_family_ipv4, TOX_SOCK_STREAM, TOX_PROTO_TCP);
+
+    if (!sock_valid(sock)) {
+        return net_invalid_socket;
+    }
+
+    uint8_t handshake[TCP_CLIENT_HANDSHAKE_SIZE];
+    random_bytes(handshake, sizeof(handshake));
+
+    if (net_connect(sock, *relay) != 0 || net_send(sock, handshake, sizeof(handshake)) != sizeof(handshake)) {
+        kill_sock(sock);
+        return net_invalid_socket;
+    }
+
+    return sock;
+}
+
+/* Keep STORM_CONNECTIONS handshakes waiting for the relay, and count the ones
+ * it closed. */
+static void *storm_thread(void *arg)
+{
+    Storm_Thread *thread = (Storm_Thread *)arg;
+    Bench *bench = thread->bench;
+    Socket socks[STORM_CONNECTIONS];
+    struct pollfd pfds[STORM_CONNECTIONS];
+
+    for (uint32_t i = 0; i < STORM_CONNECTIONS; ++i) {
+        socks[i] = net_invalid_socket;
+    }
+
+    while (!bench_stopped(bench)) {
+        for (uint32_t i = 0; i < STORM_CONNECTIONS; ++i) {
+            if (!sock_valid(socks[i])) {
+                socks[i] = storm_connect(&bench->relay);
+            }
+
+            pfds[i].fd = socks[i].socket;
+            pfds[i].events = POLLIN;
+            pfds[i].revents = 0;
+        }
+
+        poll(pfds, STORM_CONNECTIONS, POLL_TIMEOUT);
+        uint32_t closed = 0;
+
+        for (uint32_t i = 0; i < STORM_CONNECTIONS; ++i) {
+            if (sock_valid(socks[i]) && pfds[i].revents != 0) {
+                kill_sock(socks[i]);
+                socks[i] = net_invalid_socket;
+                ++closed;
+            }
+        }
+
+        pthread_mutex_lock(&bench->mutex);
+        bench->handshakes += closed;
+        pthread_mutex_unlock(&bench->mutex);
+    }
+
+    for (uint32_t i = 0; i < STORM_CONNECTIONS; ++i) {
+        if (sock_valid(socks[i])) {
+            kill_sock(socks[i]);
+        }
+    }
+
+    return nullptr;
+}
+
+/* Run a relay without worker threads the way a main loop would. */
+static void *server_thread(void *arg)
+{
+    Server_Thread *thread = (Server_Thread *)arg;
+    Mono_Time *mono_time = mono_time_new();
+
+    if (mono_time == nullptr) {
+        return nullptr;
+    }
+
+    while (!bench_stopped(thread->bench)) {
+        Net_Poll_Fd fd;
+        struct pollfd pfd;
+
+        if (tcp_server_get_fds(thread->tcp_server, &fd, 1) == 1) {
+            pfd.fd = fd.sock.socket;
+            pfd.events = POLLIN;
+            poll(&pfd, 1, POLL_TIMEOUT);
+        }
+
+        mono_time_update(mono_time);
+        do_TCP_server(thread->tcp_server, mono_time);
+    }
+
+    mono_time_free(mono_time);
+    return nullptr;
+}
+
+static uint64_t bench_received(Bench *bench, uint32_t *online, uint64_t *handshakes)
+{
+    pthread_mutex_lock(&bench->mutex);
+    const uint64_t received = bench->received;
+    *online = bench->online;
+    *handshakes = bench->handshakes;
+    pthread_mutex_unlock(&bench->mutex);
+    return received;
+}
+
+/* Forward data between pairs of clients for the given number of seconds.
+ *
+ * return false if the relay could not be started or the clients could not be
+ * routed to each other.
+ */
+static bool bench_relay(uint32_t num_workers, uint32_t num_handshake_workers, uint16_t port, uint32_t pairs,
+                        uint32_t seconds, uint32_t num_client_threads, uint32_t num_storm_threads)
+{
+    Bench bench = {0};
+    pthread_mutex_init(&bench.mutex, nullptr);
+
+    uint8_t relay_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(bench.relay_public_key, relay_secret_key);
+    ip_init(&bench.relay.ip, false);
+    bench.relay.ip.ip.v4 = get_ip4_loopback();
+    bench.relay.port = net_htons(port);
+
+    TCP_Server *tcp_server = new_TCP_server(false, 1, &port, relay_secret_key, nullptr);
+
+    if (tcp_server == nullptr || (num_workers != 0 && !tcp_server_start_workers(tcp_server, num_workers))
+            || (num_handshake_workers != 0 && !tcp_server_start_handshake_workers(tcp_server, num_handshake_workers))) {
+        printf("  %2u workers: could not start the relay\n", num_workers);
+
+        if (tcp_server != nullptr) {
+            kill_TCP_server(tcp_server);
+        }
+
+        return false;
+    }
+
+    Server_Thread server = {0};
+    server.bench = &bench;
+    server.tcp_server = tcp_server;
+    pthread_create(&server.thread, nullptr, server_thread, &server);
+
+    Bench_Client *clients = (Bench_Client *)calloc(2 * pairs, sizeof(Bench_Client));
+    Bench_Thread *threads = (Bench_Thread *)calloc(num_client_threads, sizeof(Bench_Thread));
+    Storm_Thread *storm = (Storm_Thread *)calloc(num_storm_threads + 1, sizeof(Storm_Thread));
+
+    if (clients == nullptr || threads == nullptr || storm == nullptr) {
+        free(clients);
+        free(threads);
+        free(storm);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < 2 * pairs; ++i) {
+        crypto_new_keypair(clients[i].public_key, clients[i].secret_key);
+        clients[i].peer = &clients[i ^ 1];
+    }
+
+    /* Both clients of a pair live on the same thread. */
+    uint32_t first = 0;
+
+    for (uint32_t i = 0; i < num_client_threads; ++i) {
+        const uint32_t thread_pairs = pairs / num_client_threads + (i < pairs % num_client_threads);
+        threads[i].bench = &bench;
+        threads[i].clients = &clients[first];
+        threads[i].num_clients = 2 * thread_pairs;
+        first += 2 * thread_pairs;
+        pthread_create(&threads[i].thread, nullptr, client_thread, &threads[i]);
+    }
+
+    const uint64_t setup_start = now_ms();
+    uint32_t online = 0;
+    uint64_t handshakes = 0;
+
+    while (online < 2 * pairs && now_ms() - setup_start < SETUP_TIMEOUT * 1000) {
+        c_sleep(100);
+        bench_received(&bench, &online, &handshakes);
+    }
+
+    const bool ok = online == 2 * pairs;
+
+    if (ok) {
+        for (uint32_t i = 0; i < num_storm_threads; ++i) {
+            storm[i].bench = &bench;
+            pthread_create(&storm[i].thread, nullptr, storm_thread, &storm[i]);
+        }
+
+        const uint64_t start = now_ms();
+        uint64_t start_handshakes;
+        const uint64_t start_received = bench_received(&bench, &online, &start_handshakes);
+        c_sleep(seconds * 1000);
+        const uint64_t received = bench_received(&bench, &online, &handshakes) - start_received;
+        const double elapsed = (double)(now_ms() - start) / 1000;
+
+        printf("  %2u workers", num_workers);
+
+        if (num_storm_threads != 0) {
+            printf(", %2u handshake workers", num_handshake_workers);
+        }
+
+        printf(": %9.1f MiB/s %10.0f packets/s forwarded", received / elapsed / (1024 * 1024),
+               received / elapsed / PACKET_SIZE);
+
+        if (num_storm_threads != 0) {
+            printf(", %8.0f handshakes/s", (handshakes - start_handshakes) / elapsed);
+        }
+
+        printf("\n");
+    } else {
+        printf("  %2u workers: only %u of %u clients got routed\n", num_workers, online, 2 * pairs);
+    }
+
+    pthread_mutex_lock(&bench.mutex);
+    bench.stop = true;
+    pthread_mutex_unlock(&bench.mutex);
+
+    for (uint32_t i = 0; i < num_client_threads; ++i) {
+        pthread_join(threads[i].thread, nullptr);
+    }
+
+    for (uint32_t i = 0; ok && i < num_storm_threads; ++i) {
+        pthread_join(storm[i].thread, nullptr);
+    }
+
+    pthread_join(server.thread, nullptr);
+    kill_TCP_server(tcp_server);
+
+    free(storm);
+    free(threads);
+    free(clients);
+    pthread_mutex_destroy(&bench.mutex);
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const uint32_t pairs = argc > 1 ? (uint32_t)atoi(argv[1]) : 64;
+    const uint32_t seconds = argc > 2 ? (uint32_t)atoi(argv[2]) : 5;
+    const uint32_t max_workers = argc > 3 ? (uint32_t)atoi(argv[3]) : (cpus > 0 ? (uint32_t)cpus : 1);
+    const uint32_t num_client_threads = argc > 4 ? (uint32_t)atoi(argv[4]) : (cpus > 1 ? (uint32_t)cpus : 2);
+    const uint32_t num_storm_threads = argc > 5 ? (uint32_t)atoi(argv[5]) : 0;
+    const uint32_t num_handshake_workers = cpus > 1 ? min_u32((uint32_t)cpus / 2, TCP_SERVER_MAX_HANDSHAKE_WORKERS) : 1;
+
+    if (pairs == 0 || num_client_threads == 0) {
+        printf("Usage: %s [pairs] [seconds] [max_workers] [client_threads] [storm_threads]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%u client pairs on %u threads, %u byte packets, %ld cpus\n", pairs, num_client_threads, PACKET_SIZE, cpus);
+
+    if (num_storm_threads != 0) {
+        printf("%u threads opening %u connections at a time\n", num_storm_threads, STORM_CONNECTIONS);
+    }
+
+    bool ok = true;
+    uint16_t port = BENCH_PORT;
+
+    for (uint32_t workers = 0; workers <= max_workers && workers <= TCP_SERVER_MAX_WORKERS; workers = workers ? workers * 2 : 1) {
+        ok &= bench_relay(workers, 0, port++, pairs, seconds, num_client_threads, num_storm_threads);
+
+        if (num_storm_threads != 0) {
+            ok &= bench_relay(workers, num_handshake_workers, port++, pairs, seconds, num_client_threads, num_storm_threads);
+        }
+    }
+
+    return ok ? 0 : 1;
+}
@@ -32,6 +32,7 @@
 #include "mono_time.h"
 #include "network.h"
 #include "ping.h"
+#include "pk_distance.h"
 #include "state.h"
 #include "util.h"
 
@@ -98,7 +99,9 @@ struct DHT {
 
     bool hole_punching_enabled;
 
-    Client_data    close_clientlist[LCLIENT_LIST];
+    /* LCLIENT_LENGTH buckets of close_bucket_size nodes each. */
+    Client_data   *close_clientlist;
+    uint16_t       close_bucket_size;
     uint64_t       close_lastgetnodes;
     uint32_t       close_bootstrap_times;
 
@@ -113,8 +116,8 @@ struct DHT {
     uint32_t       loaded_num_nodes;
     unsigned int   loaded_nodes_index;
 
-    Shared_Keys shared_keys_recv;
-    Shared_Keys shared_keys_sent;
+    Shared_Key_Cache *shared_keys_recv;
+    Shared_Key_Cache *shared_keys_sent;
 
     struct Ping   *ping;
     Ping_Array    *dht_ping_array;
@@ -169,9 +172,13 @@ const Client_data *dht_get_close_clientlist(const DHT *dht)
 }
 const Client_data *dht_get_close_client(const DHT *dht, uint32_t client_num)
 {
-    assert(client_num < sizeof(dht->close_clientlist) / sizeof(dht->close_clientlist[0]));
+    assert(client_num < dht_get_num_close_clients(dht));
     return &dht->close_clientlist[client_num];
 }
+uint32_t dht_get_num_close_clients(const DHT *dht)
+{
+    return LCLIENT_LENGTH * dht->close_bucket_size;
+}
 uint16_t dht_get_num_friends(const DHT *dht)
 {
     return dht->num_friends;
@@ -196,97 +203,34 @@ const uint8_t *dht_get_friend_public_key(const DHT *dht, uint32_t friend_num)
  */
 int id_closest(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2)
 {
-    for (size_t i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; ++i) {
-        const uint8_t distance1 = pk[i] ^ pk1[i];
-        const uint8_t distance2 = pk[i] ^ pk2[i];
-
-        if (distance1 < distance2) {
-            return 1;
-        }
-
-        if (distance1 > distance2) {
-            return 2;
-        }
-    }
-
-    return 0;
+    return pk_distance_cmp(pk, pk1, pk2);
 }
 
 /* Return index of first unequal bit number.
  */
 static unsigned int bit_by_bit_cmp(const uint8_t *pk1, const uint8_t *pk2)
 {
-    unsigned int i;
-    unsigned int j = 0;
-
-    for (i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; ++i) {
-        if (pk1[i] == pk2[i]) {
-            continue;
-        }
-
-        for (j = 0; j < 8; ++j) {
-            const uint8_t mask = 1 << (7 - j);
-
-            if ((pk1[i] & mask) != (pk2[i] & mask)) {
-                break;
-            }
-        }
-
-        break;
-    }
-
-    return i * 8 + j;
+    return pk_common_prefix(pk1, pk2);
 }
 
-/* Shared key generations are costly, it is therefore smart to store commonly used
- * ones so that they can re used later without being computed again.
- *
- * If shared key is already in shared_keys, copy it to shared_key.
- * else generate it into shared_key and copy it to shared_keys
+/* Return the index of the close list bucket for public_key: the number of
+ * leading bits it shares with self_public_key, capped at the last bucket.
  */
-void get_shared_key(const Mono_Time *mono_time, Shared_Keys *shared_keys, uint8_t *shared_key,
-                    const uint8_t *secret_key, const uint8_t *public_key)
+static uint32_t close_bucket_index(const uint8_t *self_public_key, const uint8_t *public_key)
 {
-    uint32_t num = ~0;
-    uint32_t curr = 0;
-
-    for (uint32_t i = 0; i < MAX_KEYS_PER_SLOT; ++i) {
-        const int index = public_key[30] * MAX_KEYS_PER_SLOT + i;
-        Shared_Key *const key = &shared_keys->keys[index];
-
-        if (key->stored) {
-            if (id_equal(public_key, key->public_key)) {
-                memcpy(shared_key, key->shared_key, CRYPTO_SHARED_KEY_SIZE);
-                ++key->times_requested;
-                key->time_last_requested = mono_time_get(mono_time);
-                return;
-            }
-
-            if (num != 0) {
-                if (mono_time_is_timeout(mono_time, key->time_last_requested, KEYS_TIMEOUT)) {
-                    num = 0;
-                    curr = index;
-                } else if (num > key->times_requested) {
-                    num = key->times_requested;
-                    curr = index;
-                }
-            }
-        } else if (num != 0) {
-            num = 0;
-            curr = index;
-        }
-    }
+    const unsigned int index = bit_by_bit_cmp(public_key, self_public_key);
+    return index < LCLIENT_LENGTH ? index : LCLIENT_LENGTH - 1;
+}
 
-    encrypt_precompute(public_key, secret_key, shared_key);
+static Client_data *close_bucket(const DHT *dht, uint32_t index)
+{
+    return &dht->close_clientlist[index * dht->close_bucket_size];
+}
 
-    if (num != UINT32_MAX) {
-        Shared_Key *const key = &shared_keys->keys[curr];
-        key->stored = true;
-        key->times_requested = 1;
-        memcpy(key->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
-        memcpy(key->shared_key, shared_key, CRYPTO_SHARED_KEY_SIZE);
-        key->time_last_requested = mono_time_get(mono_time);
-    }
+const Client_data *dht_get_close_bucket(const DHT *dht, const uint8_t *public_key, uint16_t *length)
+{
+    *length = dht->close_bucket_size;
+    return close_bucket(dht, close_bucket_index(dht->self_public_key, public_key));
 }
 
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
@@ -294,7 +238,7 @@ void get_shared_key(const Mono_Time *mono_time, Shared_Keys *shared_keys, uint8_
  */
 void dht_get_shared_key_recv(DHT *dht, uint8_t *shared_key, const uint8_t *public_key)
 {
-    get_shared_key(dht->mono_time, &dht->shared_keys_recv, shared_key, dht->self_secret_key, public_key);
+    shared_key_cache_lookup(dht->shared_keys_recv, shared_key, dht->self_secret_key, public_key);
 }
 
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
@@ -302,7 +246,24 @@ void dht_get_shared_key_recv(DHT *dht, uint8_t *shared_key, const uint8_t *publi
  */
 void dht_get_shared_key_sent(DHT *dht, uint8_t *shared_key, const uint8_t *public_key)
 {
-    get_shared_key(dht->mono_time, &dht->shared_keys_sent, shared_key, dht->self_secret_key, public_key);
+    shared_key_cache_lookup(dht->shared_keys_sent, shared_key, dht->self_secret_key, public_key);
+}
+
+bool dht_get_shared_key_recv_async(DHT *dht, uint8_t *shared_key, const uint8_t *public_key, IP_Port source,
+                                   const uint8_t *packet, uint16_t length)
+{
+    return networking_get_shared_key(dht->net, dht->shared_keys_recv, shared_key, dht->self_secret_key, public_key,
+                                     source, packet, length);
+}
+
+Shared_Key_Cache *dht_get_shared_keys_recv(const DHT *dht)
+{
+    return dht->shared_keys_recv;
+}
+
+Shared_Key_Cache *dht_get_shared_keys_sent(const DHT *dht)
+{
+    return dht->shared_keys_sent;
 }
 
 #define CRYPTO_SIZE 1 + CRYPTO_PUBLIC_KEY_SIZE * 2 + CRYPTO_NONCE_SIZE
@@ -806,9 +767,19 @@ static void get_close_nodes_inner(const Mono_Time *mono_time, const uint8_t *pub
 
     uint32_t num_nodes = *num_nodes_ptr;
 
+    /* Compute the leading bits of the distance of all clients at once, so
+     * clients further than all the nodes we already have are skipped cheaply. */
+    VLA(uint64_t, distances, client_list_length);
+    pk_distance_prefixes(public_key, client_list[0].public_key, sizeof(Client_data), client_list_length, distances);
+
     for (uint32_t i = 0; i < client_list_length; ++i) {
         const Client_data *const client = &client_list[i];
 
+        if (num_nodes == MAX_SENT_NODES
+                && distances[i] > pk_distance_prefix(public_key, nodes_list[MAX_SENT_NODES - 1].public_key)) {
+            continue;
+        }
+
         /* node already in list? */
         if (index_of_node_pk(nodes_list, MAX_SENT_NODES, client->public_key) != UINT32_MAX) {
             continue;
@@ -842,8 +813,16 @@ static void get_close_nodes_inner(const Mono_Time *mono_time, const uint8_t *pub
         }
 
         if (num_nodes < MAX_SENT_NODES) {
-            memcpy(nodes_list[num_nodes].public_key, client->public_key, CRYPTO_PUBLIC_KEY_SIZE);
-            nodes_list[num_nodes].ip_port = ipptp->ip_port;
+            /* keep nodes_list sorted by distance so add_to_list() drops the furthest node */
+            uint32_t index = num_nodes;
+
+            while (index > 0 && id_closest(public_key, client->public_key, nodes_list[index - 1].public_key) == 1) {
+                nodes_list[index] = nodes_list[index - 1];
+                --index;
+            }
+
+            memcpy(nodes_list[index].public_key, client->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+            nodes_list[index].ip_port = ipptp->ip_port;
             ++num_nodes;
         } else {
             add_to_list(nodes_list, MAX_SENT_NODES, client->public_key, ipptp->ip_port, public_key);
@@ -853,6 +832,76 @@ static void get_close_nodes_inner(const Mono_Time *mono_time, const uint8_t *pub
     *num_nodes_ptr = num_nodes;
 }
 
+/* Add the nodes of close list bucket index to nodes_list.
+ *
+ * return true if nodes_list is now full.
+ */
+static bool get_close_nodes_bucket(const DHT *dht, uint32_t index, const uint8_t *public_key, Node_format *nodes_list,
+                                   Family sa_family, uint32_t *num_nodes_ptr, bool is_LAN)
+{
+    get_close_nodes_inner(dht->mono_time, public_key, nodes_list, sa_family, close_bucket(dht, index),
+                          dht->close_bucket_size, num_nodes_ptr, is_LAN, 0);
+    return *num_nodes_ptr >= MAX_SENT_NODES;
+}
+
+/* Return whether bit number bit of the distance between pk1 and pk2 is set. */
+static bool distance_bit_set(const uint8_t *pk1, const uint8_t *pk2, uint32_t bit)
+{
+    return ((pk1[bit / 8] ^ pk2[bit / 8]) & (0x80 >> (bit % 8))) != 0;
+}
+
+/* Find the nodes in the close list closest to public_key.
+ *
+ * Nodes in bucket i share exactly i leading bits with our key, so the
+ * buckets can be visited in order of increasing distance to public_key
+ * without looking at the nodes themselves, with p being the bucket
+ * public_key itself would go in:
+ *
+ * - bucket p, whose nodes share at least p + 1 bits with public_key;
+ * - the buckets deeper than p: their nodes share exactly p bits with
+ *   public_key and are ordered by the bits of the distance between public_key
+ *   and our key. Bucket i comes before all deeper buckets if that distance
+ *   has bit i set, and after them otherwise;
+ * - buckets p - 1 down to 0, sharing exactly i bits with public_key.
+ *
+ * Nodes from later buckets are always further away than those of earlier ones,
+ * so we can stop as soon as nodes_list is full.
+ */
+static void get_close_nodes_close_list(const DHT *dht, const uint8_t *public_key, Node_format *nodes_list,
+                                       Family sa_family, uint32_t *num_nodes_ptr, bool is_LAN)
+{
+    const uint32_t last = LCLIENT_LENGTH - 1;
+    const uint32_t prefix = close_bucket_index(dht->self_public_key, public_key);
+
+    if (get_close_nodes_bucket(dht, prefix, public_key, nodes_list, sa_family, num_nodes_ptr, is_LAN)) {
+        return;
+    }
+
+    for (uint32_t i = prefix + 1; i < last; ++i) {
+        if (distance_bit_set(dht->self_public_key, public_key, i)
+                && get_close_nodes_bucket(dht, i, public_key, nodes_list, sa_family, num_nodes_ptr, is_LAN)) {
+            return;
+        }
+    }
+
+    if (prefix < last && get_close_nodes_bucket(dht, last, public_key, nodes_list, sa_family, num_nodes_ptr, is_LAN)) {
+        return;
+    }
+
+    for (uint32_t i = last - 1; i > prefix; --i) {
+        if (!distance_bit_set(dht->self_public_key, public_key, i)
+                && get_close_nodes_bucket(dht, i, public_key, nodes_list, sa_family, num_nodes_ptr, is_LAN)) {
+            return;
+        }
+    }
+
+    for (uint32_t i = prefix; i > 0; --i) {
+        if (get_close_nodes_bucket(dht, i - 1, public_key, nodes_list, sa_family, num_nodes_ptr, is_LAN)) {
+            return;
+        }
+    }
+}
+
 /* Find MAX_SENT_NODES nodes closest to the public_key for the send nodes request:
  * put them in the nodes_list and return how many were found.
  *
@@ -864,9 +913,12 @@ static void get_close_nodes_inner(const Mono_Time *mono_time, const uint8_t *pub
 static int get_somewhat_close_nodes(const DHT *dht, const uint8_t *public_key, Node_format *nodes_list,
                                     Family sa_family, bool is_LAN, uint8_t want_good)
 {
+    if (!net_family_is_ipv4(sa_family) && !net_family_is_ipv6(sa_family) && !net_family_is_unspec(sa_family)) {
+        return 0;
+    }
+
     uint32_t num_nodes = 0;
-    get_close_nodes_inner(dht->mono_time, public_key, nodes_list, sa_family,
-                          dht->close_clientlist, LCLIENT_LIST, &num_nodes, is_LAN, 0);
+    get_close_nodes_close_list(dht, public_key, nodes_list, sa_family, &num_nodes, is_LAN);
 
     /* TODO(irungentoo): uncomment this when hardening is added to close friend clients */
 #if 0
@@ -1063,16 +1115,10 @@ static bool replace_all(const Mono_Time *mono_time,
  */
 static int add_to_close(DHT *dht, const uint8_t *public_key, IP_Port ip_port, bool simulate)
 {
-    unsigned int index = bit_by_bit_cmp(public_key, dht->self_public_key);
-
-    if (index >= LCLIENT_LENGTH) {
-        index = LCLIENT_LENGTH - 1;
-    }
+    Client_data *const bucket = close_bucket(dht, close_bucket_index(dht->self_public_key, public_key));
 
-    for (uint32_t i = 0; i < LCLIENT_NODES; ++i) {
-        /* TODO(iphydf): write bounds checking test to catch the case that
-         * index is left as >= LCLIENT_LENGTH */
-        Client_data *const client = &dht->close_clientlist[(index * LCLIENT_NODES) + i];
+    for (uint32_t i = 0; i < dht->close_bucket_size; ++i) {
+        Client_data *const client = &bucket[i];
 
         if (!mono_time_is_timeout(dht->mono_time, client->assoc4.timestamp, BAD_NODE_TIMEOUT) ||
                 !mono_time_is_timeout(dht->mono_time, client->assoc6.timestamp, BAD_NODE_TIMEOUT)) {
@@ -1116,14 +1162,37 @@ static bool is_pk_in_client_list(const Client_data *list, unsigned int client_li
 
 static bool is_pk_in_close_list(DHT *dht, const uint8_t *public_key, IP_Port ip_port)
 {
-    unsigned int index = bit_by_bit_cmp(public_key, dht->self_public_key);
+    const uint32_t index = close_bucket_index(dht->self_public_key, public_key);
+    return is_pk_in_client_list(close_bucket(dht, index), dht->close_bucket_size, dht->mono_time, public_key, ip_port);
+}
+
+/* Check if public_key is already in the close list, updating its ip_port if so.
+ *
+ * A node can only be in the bucket matching its public key, so only that bucket
+ * needs to be searched. If a node in another bucket has the same ip_port, it
+ * most likely changed its key: its address is dropped so the new key can be
+ * stored in its own bucket by add_to_close().
+ *
+ *  return true if public_key is in the close list.
+ */
+static bool close_list_update(DHT *dht, const uint8_t *public_key, IP_Port ip_port)
+{
+    const uint32_t index = close_bucket_index(dht->self_public_key, public_key);
 
-    if (index >= LCLIENT_LENGTH) {
-        index = LCLIENT_LENGTH - 1;
+    if (client_or_ip_port_in_list(dht->log, dht->mono_time, close_bucket(dht, index), dht->close_bucket_size,
+                                  public_key, ip_port)) {
+        return true;
     }
 
-    return is_pk_in_client_list(dht->close_clientlist + index * LCLIENT_NODES, LCLIENT_NODES, dht->mono_time, public_key,
-                                ip_port);
+    const uint32_t client_index = index_of_client_ip_port(dht->close_clientlist, dht_get_num_close_clients(dht), &ip_port);
+
+    if (client_index == UINT32_MAX) {
+        return false;
+    }
+
+    Client_data *const client = &dht->close_clientlist[client_index];
+    memset(net_family_is_ipv4(ip_port.ip.family) ? &client->assoc4 : &client->assoc6, 0, sizeof(IPPTsPng));
+    return false;
 }
 
 /* Check if the node obtained with a get_nodes with public_key should be pinged.
@@ -1210,8 +1279,7 @@ uint32_t addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key)
     /* NOTE: Current behavior if there are two clients with the same id is
      * to replace the first ip by the second.
      */
-    const bool in_close_list = client_or_ip_port_in_list(dht->log, dht->mono_time, dht->close_clientlist, LCLIENT_LIST,
-                               public_key, ip_port);
+    const bool in_close_list = close_list_update(dht, public_key, ip_port);
 
     /* add_to_close should be called only if !in_list (don't extract to variable) */
     if (in_close_list || add_to_close(dht, public_key, ip_port, 0)) {
@@ -1290,7 +1358,8 @@ static void returnedip_ports(DHT *dht, IP_Port ip_port, const uint8_t *public_ke
     }
 
     if (id_equal(public_key, dht->self_public_key)) {
-        update_client_data(dht->mono_time, dht->close_clientlist, LCLIENT_LIST, ip_port, nodepublic_key);
+        const uint32_t index = close_bucket_index(dht->self_public_key, nodepublic_key);
+        update_client_data(dht->mono_time, close_bucket(dht, index), dht->close_bucket_size, ip_port, nodepublic_key);
         return;
     }
 
@@ -1419,7 +1488,10 @@ static int handle_getnodes(void *object, IP_Port source, const uint8_t *packet,
     uint8_t plain[CRYPTO_NODE_SIZE];
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
 
-    dht_get_shared_key_recv(dht, shared_key, packet + 1);
+    if (!dht_get_shared_key_recv_async(dht, shared_key, packet + 1, source, packet, length)) {
+        return false;
+    }
+
     const int len = decrypt_data_symmetric(
                         shared_key,
                         packet + 1 + CRYPTO_PUBLIC_KEY_SIZE,
@@ -1801,8 +1873,8 @@ static void do_Close(DHT *dht)
     dht->num_to_bootstrap = 0;
 
     uint8_t not_killed = do_ping_and_sendnode_requests(
-                             dht, &dht->close_lastgetnodes, dht->self_public_key, dht->close_clientlist, LCLIENT_LIST, &dht->close_bootstrap_times,
-                             0);
+                             dht, &dht->close_lastgetnodes, dht->self_public_key, dht->close_clientlist,
+                             dht_get_num_close_clients(dht), &dht->close_bootstrap_times, 0);
 
     if (not_killed != 0) {
         return;
@@ -1816,7 +1888,7 @@ static void do_Close(DHT *dht)
      * KILL_NODE_TIMEOUT, so we at least keep trying pings */
     const uint64_t badonly = mono_time_get(dht->mono_time) - BAD_NODE_TIMEOUT;
 
-    for (size_t i = 0; i < LCLIENT_LIST; ++i) {
+    for (size_t i = 0; i < dht_get_num_close_clients(dht); ++i) {
         Client_data *const client = &dht->close_clientlist[i];
 
         IPPTsPng *const assocs[] = { &client->assoc6, &client->assoc4, nullptr };
@@ -1876,9 +1948,11 @@ int dht_bootstrap_from_address(DHT *dht, const char *address, uint8_t ipv6enable
  */
 int route_packet(const DHT *dht, const uint8_t *public_key, const uint8_t *packet, uint16_t length)
 {
-    for (uint32_t i = 0; i < LCLIENT_LIST; ++i) {
-        if (id_equal(public_key, dht->close_clientlist[i].public_key)) {
-            const Client_data *const client = &dht->close_clientlist[i];
+    const Client_data *const bucket = close_bucket(dht, close_bucket_index(dht->self_public_key, public_key));
+
+    for (uint32_t i = 0; i < dht->close_bucket_size; ++i) {
+        if (id_equal(public_key, bucket[i].public_key)) {
+            const Client_data *const client = &bucket[i];
             const IPPTsPng *const assocs[] = { &client->assoc6, &client->assoc4, nullptr };
 
             for (const IPPTsPng * const *it = assocs; *it; ++it) {
@@ -2371,20 +2445,21 @@ static int send_hardening_getnode_res(const DHT *dht, const Node_format *sendto,
     return sendpacket(dht->net, sendto->ip_port, packet, len);
 }
 
-/* TODO(irungentoo): improve */
 static IPPTsPng *get_closelist_IPPTsPng(DHT *dht, const uint8_t *public_key, Family sa_family)
 {
-    for (uint32_t i = 0; i < LCLIENT_LIST; ++i) {
-        if (!id_equal(dht->close_clientlist[i].public_key, public_key)) {
+    Client_data *const bucket = close_bucket(dht, close_bucket_index(dht->self_public_key, public_key));
+
+    for (uint32_t i = 0; i < dht->close_bucket_size; ++i) {
+        if (!id_equal(bucket[i].public_key, public_key)) {
             continue;
         }
 
         if (net_family_is_ipv4(sa_family)) {
-            return &dht->close_clientlist[i].assoc4;
+            return &bucket[i].assoc4;
         }
 
         if (net_family_is_ipv6(sa_family)) {
-            return &dht->close_clientlist[i].assoc6;
+            return &bucket[i].assoc6;
         }
     }
 
@@ -2596,13 +2671,13 @@ uint16_t randfriends_nodes(DHT *dht, Node_format *nodes, uint16_t max_num)
  */
 uint16_t closelist_nodes(DHT *dht, Node_format *nodes, uint16_t max_num)
 {
-    return list_nodes(dht->close_clientlist, LCLIENT_LIST, dht->mono_time, nodes, max_num);
+    return list_nodes(dht->close_clientlist, dht_get_num_close_clients(dht), dht->mono_time, nodes, max_num);
 }
 
 #if DHT_HARDENING
 static void do_hardening(DHT *dht)
 {
-    for (uint32_t i = 0; i < LCLIENT_LIST * 2; ++i) {
+    for (uint32_t i = 0; i < dht_get_num_close_clients(dht) * 2; ++i) {
         IPPTsPng *cur_iptspng;
         Family sa_family;
         const uint8_t *const public_key = dht->close_clientlist[i / 2].public_key;
@@ -2722,6 +2797,22 @@ DHT *new_dht(const Logger *log, Mono_Time *mono_time, Networking_Core *net, bool
 
     dht->hole_punching_enabled = holepunching_enabled;
 
+    dht->close_bucket_size = LCLIENT_NODES;
+    dht->close_clientlist = (Client_data *)calloc(LCLIENT_LIST, sizeof(Client_data));
+
+    if (dht->close_clientlist == nullptr) {
+        kill_dht(dht);
+        return nullptr;
+    }
+
+    dht->shared_keys_recv = shared_key_cache_new(SHARED_KEY_CACHE_DEFAULT_SIZE);
+    dht->shared_keys_sent = shared_key_cache_new(SHARED_KEY_CACHE_DEFAULT_SIZE);
+
+    if (dht->shared_keys_recv == nullptr || dht->shared_keys_sent == nullptr) {
+        kill_dht(dht);
+        return nullptr;
+    }
+
     dht->ping = ping_new(mono_time, dht);
 
     if (dht->ping == nullptr) {
@@ -2785,11 +2876,50 @@ void kill_dht(DHT *dht)
     ping_array_kill(dht->dht_ping_array);
     ping_array_kill(dht->dht_harden_ping_array);
     ping_kill(dht->ping);
+    shared_key_cache_kill(dht->shared_keys_recv);
+    shared_key_cache_kill(dht->shared_keys_sent);
     free(dht->friends_list);
     free(dht->loaded_nodes_list);
+    free(dht->close_clientlist);
     free(dht);
 }
 
+bool dht_set_close_bucket_size(DHT *dht, uint16_t bucket_size)
+{
+    if (bucket_size == 0 || bucket_size > DHT_MAX_CLOSE_BUCKET_SIZE) {
+        return false;
+    }
+
+    if (bucket_size == dht->close_bucket_size) {
+        return true;
+    }
+
+    Client_data *const list = (Client_data *)calloc(LCLIENT_LENGTH * bucket_size, sizeof(Client_data));
+
+    if (list == nullptr) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < LCLIENT_LENGTH; ++i) {
+        const Client_data *const bucket = close_bucket(dht, i);
+        uint16_t count = 0;
+
+        for (uint32_t j = 0; j < dht->close_bucket_size && count < bucket_size; ++j) {
+            if (bucket[j].assoc4.timestamp == 0 && bucket[j].assoc6.timestamp == 0) {
+                continue;
+            }
+
+            list[i * bucket_size + count] = bucket[j];
+            ++count;
+        }
+    }
+
+    free(dht->close_clientlist);
+    dht->close_clientlist = list;
+    dht->close_bucket_size = bucket_size;
+    return true;
+}
+
 /* new DHT format for load/save, more robust and forward compatible */
 // TODO(irungentoo): Move this closer to Messenger.
 #define DHT_STATE_COOKIE_GLOBAL 0x159000d
@@ -2810,7 +2940,7 @@ uint32_t dht_size(const DHT *dht)
         numv6 += net_family_is_ipv6(dht->loaded_nodes_list[i].ip_port.ip.family);
     }
 
-    for (uint32_t i = 0; i < LCLIENT_LIST; ++i) {
+    for (uint32_t i = 0; i < dht_get_num_close_clients(dht); ++i) {
         numv4 += (dht->close_clientlist[i].assoc4.timestamp != 0);
         numv6 += (dht->close_clientlist[i].assoc6.timestamp != 0);
     }
@@ -2830,6 +2960,20 @@ uint32_t dht_size(const DHT *dht)
     return size32 + sizesubhead + packed_node_size(net_family_ipv4) * numv4 + packed_node_size(net_family_ipv6) * numv6;
 }
 
+/* Pack a single node into data for dht_save().
+ *
+ * return the number of bytes written.
+ */
+static uint32_t save_node(uint8_t *data, const uint8_t *public_key, IP_Port ip_port)
+{
+    Node_format node;
+    memcpy(node.public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    node.ip_port = ip_port;
+
+    const int len = pack_nodes(data, sizeof(Node_format), &node, 1);
+    return len > 0 ? len : 0;
+}
+
 /* Save the DHT in data where data is an array of size dht_size(). */
 void dht_save(const DHT *dht, uint8_t *data)
 {
@@ -2841,26 +2985,23 @@ void dht_save(const DHT *dht, uint8_t *data)
     /* get right offset. we write the actual header later. */
     data = state_write_section_header(data, DHT_STATE_COOKIE_TYPE, 0, 0);
 
-    Node_format clients[MAX_SAVED_DHT_NODES];
+    /* The close list size is only known at runtime, so nodes are packed one by
+     * one instead of being collected into a Node_format array first. */
+    uint32_t len = 0;
 
-    uint32_t num = 0;
-
-    if (dht->loaded_num_nodes > 0) {
-        memcpy(clients, dht->loaded_nodes_list, sizeof(Node_format) * dht->loaded_num_nodes);
-        num += dht->loaded_num_nodes;
+    for (uint32_t i = 0; i < dht->loaded_num_nodes; ++i) {
+        len += save_node(data + len, dht->loaded_nodes_list[i].public_key, dht->loaded_nodes_list[i].ip_port);
     }
 
-    for (uint32_t i = 0; i < LCLIENT_LIST; ++i) {
-        if (dht->close_clientlist[i].assoc4.timestamp != 0) {
-            memcpy(clients[num].public_key, dht->close_clientlist[i].public_key, CRYPTO_PUBLIC_KEY_SIZE);
-            clients[num].ip_port = dht->close_clientlist[i].assoc4.ip_port;
-            ++num;
+    for (uint32_t i = 0; i < dht_get_num_close_clients(dht); ++i) {
+        const Client_data *const client = &dht->close_clientlist[i];
+
+        if (client->assoc4.timestamp != 0) {
+            len += save_node(data + len, client->public_key, client->assoc4.ip_port);
         }
 
-        if (dht->close_clientlist[i].assoc6.timestamp != 0) {
-            memcpy(clients[num].public_key, dht->close_clientlist[i].public_key, CRYPTO_PUBLIC_KEY_SIZE);
-            clients[num].ip_port = dht->close_clientlist[i].assoc6.ip_port;
-            ++num;
+        if (client->assoc6.timestamp != 0) {
+            len += save_node(data + len, client->public_key, client->assoc6.ip_port);
         }
     }
 
@@ -2869,21 +3010,16 @@ void dht_save(const DHT *dht, uint8_t *data)
 
         for (uint32_t j = 0; j < MAX_FRIEND_CLIENTS; ++j) {
             if (fr->client_list[j].assoc4.timestamp != 0) {
-                memcpy(clients[num].public_key, fr->client_list[j].public_key, CRYPTO_PUBLIC_KEY_SIZE);
-                clients[num].ip_port = fr->client_list[j].assoc4.ip_port;
-                ++num;
+                len += save_node(data + len, fr->client_list[j].public_key, fr->client_list[j].assoc4.ip_port);
             }
 
             if (fr->client_list[j].assoc6.timestamp != 0) {
-                memcpy(clients[num].public_key, fr->client_list[j].public_key, CRYPTO_PUBLIC_KEY_SIZE);
-                clients[num].ip_port = fr->client_list[j].assoc6.ip_port;
-                ++num;
+                len += save_node(data + len, fr->client_list[j].public_key, fr->client_list[j].assoc6.ip_port);
             }
         }
     }
 
-    state_write_section_header(old_data, DHT_STATE_COOKIE_TYPE, pack_nodes(data, sizeof(Node_format) * num, clients, num),
-                               DHT_STATE_TYPE_NODES);
+    state_write_section_header(old_data, DHT_STATE_COOKIE_TYPE, len, DHT_STATE_TYPE_NODES);
 }
 
 /* Bootstrap from this number of nodes every time dht_connect_after_load() is called */
@@ -2978,7 +3114,7 @@ int dht_load(DHT *dht, const uint8_t *data, uint32_t length)
  */
 bool dht_isconnected(const DHT *dht)
 {
-    for (uint32_t i = 0; i < LCLIENT_LIST; ++i) {
+    for (uint32_t i = 0; i < dht_get_num_close_clients(dht); ++i) {
         const Client_data *const client = &dht->close_clientlist[i];
 
         if (!mono_time_is_timeout(dht->mono_time, client->assoc4.timestamp, BAD_NODE_TIMEOUT) ||
@@ -2995,7 +3131,7 @@ bool dht_isconnected(const DHT *dht)
  */
 bool dht_non_lan_connected(const DHT *dht)
 {
-    for (uint32_t i = 0; i < LCLIENT_LIST; ++i) {
+    for (uint32_t i = 0; i < dht_get_num_close_clients(dht); ++i) {
         const Client_data *const client = &dht->close_clientlist[i];
 
         if (!mono_time_is_timeout(dht->mono_time, client->assoc4.timestamp, BAD_NODE_TIMEOUT)
@@ -29,18 +29,25 @@
 #include "mono_time.h"
 #include "network.h"
 #include "ping_array.h"
+#include "shared_key_cache.h"
 
 #include <stdbool.h>
 
 /* Maximum number of clients stored per friend. */
 #define MAX_FRIEND_CLIENTS 8
 
+/* Default number of nodes kept in each bucket of the close list. */
 #define LCLIENT_NODES (MAX_FRIEND_CLIENTS)
+/* Number of buckets in the close list, indexed by the length of the prefix a
+ * node's public key shares with ours. */
 #define LCLIENT_LENGTH 128
 
-/* A list of the clients mathematically closest to ours. */
+/* A list of the clients mathematically closest to ours (default size). */
 #define LCLIENT_LIST (LCLIENT_LENGTH * LCLIENT_NODES)
 
+/* Maximum number of nodes per close list bucket, see dht_set_close_bucket_size(). */
+#define DHT_MAX_CLOSE_BUCKET_SIZE 32
+
 #define MAX_CLOSE_TO_BOOTSTRAP_NODES 8
 
 /* The max number of nodes to send with send nodes. */
@@ -194,25 +201,6 @@ int unpack_nodes(Node_format *nodes, uint16_t max_num_nodes, uint16_t *processed
                  uint16_t length, bool tcp_enabled);
 
 
-/*----------------------------------------------------------------------------------*/
-/* struct to store some shared keys so we don't have to regenerate them for each request. */
-#define MAX_KEYS_PER_SLOT 4
-#define KEYS_TIMEOUT 600
-
-typedef struct Shared_Key {
-    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
-    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    uint32_t times_requested;
-    bool stored;
-    uint64_t time_last_requested;
-} Shared_Key;
-
-typedef struct Shared_Keys {
-    Shared_Key keys[256 * MAX_KEYS_PER_SLOT];
-} Shared_Keys;
-
-/*----------------------------------------------------------------------------------*/
-
 typedef int cryptopacket_handler_cb(void *object, IP_Port ip_port, const uint8_t *source_pubkey,
                                     const uint8_t *data, uint16_t len, void *userdata);
 
@@ -228,6 +216,12 @@ Networking_Core *dht_get_net(const DHT *dht);
 struct Ping *dht_get_ping(const DHT *dht);
 const Client_data *dht_get_close_clientlist(const DHT *dht);
 const Client_data *dht_get_close_client(const DHT *dht, uint32_t client_num);
+/* Return the number of entries in the close list (LCLIENT_LENGTH times the bucket size). */
+uint32_t dht_get_num_close_clients(const DHT *dht);
+/* Return the close list bucket a node with public_key belongs in, and put the
+ * number of entries in it in length.
+ */
+const Client_data *dht_get_close_bucket(const DHT *dht, const uint8_t *public_key, uint16_t *length);
 uint16_t dht_get_num_friends(const DHT *dht);
 
 DHT_Friend *dht_get_friend(DHT *dht, uint32_t friend_num);
@@ -235,15 +229,6 @@ const uint8_t *dht_get_friend_public_key(const DHT *dht, uint32_t friend_num);
 
 /*----------------------------------------------------------------------------------*/
 
-/* Shared key generations are costly, it is therefore smart to store commonly used
- * ones so that they can re used later without being computed again.
- *
- * If shared key is already in shared_keys, copy it to shared_key.
- * else generate it into shared_key and copy it to shared_keys
- */
-void get_shared_key(const Mono_Time *mono_time, Shared_Keys *shared_keys, uint8_t *shared_key,
-                    const uint8_t *secret_key, const uint8_t *public_key);
-
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
  * for packets that we receive.
  */
@@ -254,6 +239,21 @@ void dht_get_shared_key_recv(DHT *dht, uint8_t *shared_key, const uint8_t *publi
  */
 void dht_get_shared_key_sent(DHT *dht, uint8_t *shared_key, const uint8_t *public_key);
 
+/* Like dht_get_shared_key_recv(), for the received packet that needs the key.
+ * See networking_get_shared_key().
+ *
+ * return true with the key in shared_key.
+ * return false if the packet was parked until the key is computed.
+ */
+bool dht_get_shared_key_recv_async(DHT *dht, uint8_t *shared_key, const uint8_t *public_key, IP_Port source,
+                                   const uint8_t *packet, uint16_t length);
+
+/* The caches behind dht_get_shared_key_recv() and dht_get_shared_key_sent(), to
+ * resize them or read their statistics.
+ */
+Shared_Key_Cache *dht_get_shared_keys_recv(const DHT *dht);
+Shared_Key_Cache *dht_get_shared_keys_sent(const DHT *dht);
+
 void dht_getnodes(DHT *dht, const IP_Port *from_ipp, const uint8_t *from_id, const uint8_t *which_id);
 
 typedef void dht_ip_cb(void *object, int32_t number, IP_Port ip_port);
@@ -409,6 +409,17 @@ DHT *new_dht(const Logger *log, Mono_Time *mono_time, Networking_Core *net, bool
 
 void kill_dht(DHT *dht);
 
+/* Set the number of nodes kept in each close list bucket. The default is
+ * LCLIENT_NODES; high-capacity bootstrap nodes may raise it up to
+ * DHT_MAX_CLOSE_BUCKET_SIZE to know (and answer get nodes requests with) more
+ * of the network. Nodes already in the list are kept as long as their bucket
+ * has room for them.
+ *
+ * return true on success.
+ * return false if bucket_size is out of range or memory allocation failed.
+ */
+bool dht_set_close_bucket_size(DHT *dht, uint16_t bucket_size);
+
 /*  return false if we are not connected to the DHT.
  *  return true if we are.
  */
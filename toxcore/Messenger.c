@@ -474,6 +474,23 @@ int m_get_friend_connectionstatus(const Messenger *m, int32_t friendnumber)
     return CONNECTION_NONE;
 }
 
+int m_get_friend_transport_stats(const Messenger *m, int32_t friendnumber, Crypto_Connection_Stats *stats)
+{
+    if (friend_not_valid(m, friendnumber)) {
+        return -1;
+    }
+
+    memset(stats, 0, sizeof(Crypto_Connection_Stats));
+
+    if (m->friendlist[friendnumber].status != FRIEND_ONLINE) {
+        return 0;
+    }
+
+    const int crypt_conn_id = friend_connection_crypt_connection_id(m->fr_c, m->friendlist[friendnumber].friendcon_id);
+    crypto_connection_stats(m->net_crypto, crypt_conn_id, stats);
+    return 0;
+}
+
 int m_friend_exists(const Messenger *m, int32_t friendnumber)
 {
     if (friend_not_valid(m, friendnumber)) {
@@ -880,6 +897,11 @@ void m_callback_read_receipt(Messenger *m, m_friend_read_receipt_cb *function)
     m->read_receipt = function;
 }
 
+void m_callback_send_queue_writable(Messenger *m, m_friend_send_queue_writable_cb *function)
+{
+    m->friend_send_queue_writable = function;
+}
+
 void m_callback_connectionstatus(Messenger *m, m_friend_connection_status_cb *function)
 {
     m->friend_connectionstatuschange = function;
@@ -1911,7 +1933,8 @@ void custom_lossless_packet_registerhandler(Messenger *m, m_friend_lossless_pack
     m->lossless_packethandler = lossless_packethandler;
 }
 
-int send_custom_lossless_packet(const Messenger *m, int32_t friendnumber, const uint8_t *data, uint32_t length)
+static int send_custom_lossless(const Messenger *m, int32_t friendnumber, const uint8_t *data, uint32_t length,
+                                bool unordered)
 {
     if (friend_not_valid(m, friendnumber)) {
         return -1;
@@ -1929,14 +1952,30 @@ int send_custom_lossless_packet(const Messenger *m, int32_t friendnumber, const
         return -4;
     }
 
-    if (write_cryptpacket(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
-                          m->friendlist[friendnumber].friendcon_id), data, length, 1) == -1) {
+    const int crypt_connection_id = friend_connection_crypt_connection_id(m->fr_c,
+                                    m->friendlist[friendnumber].friendcon_id);
+    const int64_t ret = unordered
+                        ? write_cryptpacket_unordered(m->net_crypto, crypt_connection_id, data, length, 1)
+                        : write_cryptpacket(m->net_crypto, crypt_connection_id, data, length, 1);
+
+    if (ret == -1) {
         return -5;
     }
 
     return 0;
 }
 
+int send_custom_lossless_packet(const Messenger *m, int32_t friendnumber, const uint8_t *data, uint32_t length)
+{
+    return send_custom_lossless(m, friendnumber, data, length, false);
+}
+
+int send_custom_lossless_packet_unordered(const Messenger *m, int32_t friendnumber, const uint8_t *data,
+        uint32_t length)
+{
+    return send_custom_lossless(m, friendnumber, data, length, true);
+}
+
 /* Function to filter out some friend requests*/
 static int friend_already_added(const uint8_t *real_pk, void *data)
 {
@@ -2013,6 +2052,11 @@ Messenger *new_messenger(Mono_Time *mono_time, Messenger_Options *options, unsig
         return nullptr;
     }
 
+    if (!options->udp_disabled && options->udp_batch_size > 1
+            && !networking_set_batch_size(m->net, options->udp_batch_size)) {
+        LOGGER_WARNING(m->log, "batched UDP I/O is not available, sending and receiving one packet per syscall");
+    }
+
     m->dht = new_dht(m->log, m->mono_time, m->net, options->hole_punching_enabled);
 
     if (m->dht == nullptr) {
@@ -2034,6 +2078,9 @@ Messenger *new_messenger(Mono_Time *mono_time, Messenger_Options *options, unsig
         return nullptr;
     }
 
+    nc_set_congestion_algorithm(m->net_crypto, options->congestion_algorithm);
+    nc_set_coalescing_delay(m->net_crypto, options->coalescing_delay);
+
     m->onion = new_onion(m->mono_time, m->dht);
     m->onion_a = new_onion_announce(m->mono_time, m->dht);
     m->onion_c =  new_onion_client(m->mono_time, m->net_crypto);
@@ -2077,6 +2124,17 @@ Messenger *new_messenger(Mono_Time *mono_time, Messenger_Options *options, unsig
         }
     }
 
+    if (options->precompute_threads > 0) {
+        m->precompute_pool = precompute_pool_new(options->precompute_threads);
+
+        if (m->precompute_pool == nullptr) {
+            LOGGER_WARNING(m->log, "could not start %u shared key threads, computing shared keys in the main loop",
+                           options->precompute_threads);
+        }
+
+        networking_set_precompute_pool(m->net, m->precompute_pool);
+    }
+
     m->options = *options;
     friendreq_init(m->fr, m->fr_c);
     set_nospam(m->fr, random_u32());
@@ -2102,6 +2160,10 @@ void kill_messenger(Messenger *m)
 
     uint32_t i;
 
+    /* Parked packets refer to the onion and DHT, so drop them first. */
+    networking_set_precompute_pool(m->net, nullptr);
+    precompute_pool_kill(m->precompute_pool);
+
     if (m->tcp_server) {
         kill_TCP_server(m->tcp_server);
     }
@@ -2528,6 +2590,12 @@ static void do_friends(Messenger *m, void *userdata)
             do_receipts(m, i, userdata);
             do_reqchunk_filecb(m, i, userdata);
 
+            if (crypto_sendqueue_unblocked(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
+                                           m->friendlist[i].friendcon_id))
+                    && m->friend_send_queue_writable) {
+                m->friend_send_queue_writable(m, i, userdata);
+            }
+
             m->friendlist[i].last_seen_time = (uint64_t) time(nullptr);
         }
     }
@@ -2586,6 +2654,38 @@ uint32_t messenger_run_interval(const Messenger *m)
     return crypto_interval;
 }
 
+uint32_t messenger_poll_interval(const Messenger *m)
+{
+    /* The timers of the DHT, onion, friend connections, conferences and TCP
+     * client and server pings all compare mono_time_get(), which only changes
+     * once a second, so none of them is due before the next whole second.
+     * Only net_crypto has timers finer than that. */
+    const uint32_t next_second = 1000 - (uint32_t)(current_time_monotonic(m->mono_time) % 1000);
+    const uint32_t crypto_interval = crypto_run_interval(m->net_crypto);
+
+    return crypto_interval < next_second ? crypto_interval : next_second;
+}
+
+static uint32_t fds_remaining(uint32_t count, uint32_t max_fds)
+{
+    return count < max_fds ? max_fds - count : 0;
+}
+
+uint32_t messenger_get_fds(const Messenger *m, Net_Poll_Fd *fds, uint32_t max_fds)
+{
+    uint32_t count = networking_get_fds(m->net, fds, max_fds);
+
+    count += tcp_connections_get_fds(nc_get_tcp_c(m->net_crypto), fds == nullptr ? nullptr : fds + count,
+                                     fds_remaining(count, max_fds));
+
+    if (m->tcp_server) {
+        count += tcp_server_get_fds(m->tcp_server, fds == nullptr ? nullptr : fds + count,
+                                    fds_remaining(count, max_fds));
+    }
+
+    return count;
+}
+
 /* The main loop that needs to be run at least 20 times per second. */
 void do_messenger(Messenger *m, void *userdata)
 {
@@ -2625,11 +2725,13 @@ void do_messenger(Messenger *m, void *userdata)
     do_friends(m, userdata);
     connection_status_callback(m, userdata);
 
+    networking_flush(m->net);
+
     if (mono_time_get(m->mono_time) > m->lastdump + DUMPING_CLIENTS_FRIENDS_EVERY_N_SECONDS) {
         m->lastdump = mono_time_get(m->mono_time);
         uint32_t client, last_pinged;
 
-        for (client = 0; client < LCLIENT_LIST; ++client) {
+        for (client = 0; client < dht_get_num_close_clients(m->dht); ++client) {
             const Client_data *cptr = dht_get_close_client(m->dht, client);
             const IPPTsPng *const assocs[] = { &cptr->assoc4, &cptr->assoc6, nullptr };
 
@@ -79,6 +79,11 @@ typedef struct Messenger_Options {
     bool hole_punching_enabled;
     bool local_discovery_enabled;
 
+    uint16_t udp_batch_size;
+    uint8_t precompute_threads;
+    Congestion_Algorithm congestion_algorithm;
+    uint16_t coalescing_delay;
+
     logger_cb *log_callback;
     void *log_context;
     void *log_user_data;
@@ -194,6 +199,7 @@ typedef void m_friend_status_message_cb(Messenger *m, uint32_t friend_number, co
                                         void *user_data);
 typedef void m_friend_typing_cb(Messenger *m, uint32_t friend_number, bool is_typing, void *user_data);
 typedef void m_friend_read_receipt_cb(Messenger *m, uint32_t friend_number, uint32_t message_id, void *user_data);
+typedef void m_friend_send_queue_writable_cb(Messenger *m, uint32_t friend_number, void *user_data);
 typedef void m_file_recv_cb(Messenger *m, uint32_t friend_number, uint32_t file_number, uint32_t kind,
                             uint64_t file_size, const uint8_t *filename, size_t filename_length, void *user_data);
 typedef void m_file_chunk_request_cb(Messenger *m, uint32_t friend_number, uint32_t file_number, uint64_t position,
@@ -258,6 +264,7 @@ struct Messenger {
     Networking_Core *net;
     Net_Crypto *net_crypto;
     DHT *dht;
+    Precompute_Pool *precompute_pool;
 
     Onion *onion;
     Onion_Announce *onion_a;
@@ -291,6 +298,7 @@ struct Messenger {
     m_friend_status_cb *friend_userstatuschange;
     m_friend_typing_cb *friend_typingchange;
     m_friend_read_receipt_cb *read_receipt;
+    m_friend_send_queue_writable_cb *friend_send_queue_writable;
     m_friend_connection_status_cb *friend_connectionstatuschange;
     m_friend_connectionstatuschange_internal_cb *friend_connectionstatuschange_internal;
     void *friend_connectionstatuschange_internal_userdata;
@@ -384,6 +392,14 @@ int m_delfriend(Messenger *m, int32_t friendnumber);
  */
 int m_get_friend_connectionstatus(const Messenger *m, int32_t friendnumber);
 
+/* Get the transport statistics of the connection to a friend. If the friend
+ * isn't online, stats are zeroed.
+ *
+ *  return 0 on success.
+ *  return -1 on failure.
+ */
+int m_get_friend_transport_stats(const Messenger *m, int32_t friendnumber, Crypto_Connection_Stats *stats);
+
 /* Checks if there exists a friend with given friendnumber.
  *
  *  return 1 if friend exists.
@@ -548,6 +564,14 @@ void m_callback_typingchange(Messenger *m, m_friend_typing_cb *function);
  */
 void m_callback_read_receipt(Messenger *m, m_friend_read_receipt_cb *function);
 
+/* Set the callback for send queues that can take packets again.
+ *  Function(uint32_t friendnumber)
+ *
+ *  Called once after sending a lossless packet to the friend failed because
+ *  the send queue was full, as soon as there is room again.
+ */
+void m_callback_send_queue_writable(Messenger *m, m_friend_send_queue_writable_cb *function);
+
 /* Set the callback for connection status changes.
  *  function(uint32_t friendnumber, uint8_t status)
  *
@@ -746,6 +770,14 @@ void custom_lossless_packet_registerhandler(Messenger *m, m_friend_lossless_pack
  */
 int send_custom_lossless_packet(const Messenger *m, int32_t friendnumber, const uint8_t *data, uint32_t length);
 
+/* Like send_custom_lossless_packet(), but the friend may receive the packet
+ * before the ones sent earlier.
+ *
+ * return values are the same as for send_custom_lossless_packet().
+ */
+int send_custom_lossless_packet_unordered(const Messenger *m, int32_t friendnumber, const uint8_t *data,
+        uint32_t length);
+
 /**********************************************/
 
 typedef enum Messenger_Error {
@@ -778,6 +810,21 @@ void do_messenger(Messenger *m, void *userdata);
  */
 uint32_t messenger_run_interval(const Messenger *m);
 
+/* Return the time in milliseconds until something other than a packet arriving
+ * on one of the sockets from messenger_get_fds() needs do_messenger().
+ *
+ * Unlike messenger_run_interval() this is not capped, so it is only suitable
+ * for a loop that also wakes up when those sockets become ready.
+ */
+uint32_t messenger_poll_interval(const Messenger *m);
+
+/* Write the sockets do_messenger() reads from or has pending writes for into
+ * fds, see net_poll_fds_add().
+ *
+ * returns the number of sockets, which may be larger than max_fds.
+ */
+uint32_t messenger_get_fds(const Messenger *m, Net_Poll_Fd *fds, uint32_t max_fds);
+
 /* SAVING AND LOADING FUNCTIONS: */
 
 /* Registers a state plugin for saving, loadding, and getting the size of a section of the save
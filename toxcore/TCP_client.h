@@ -67,6 +67,17 @@ void tcp_con_set_custom_uint(TCP_Client_Connection *con, uint32_t value);
 TCP_Client_Connection *new_TCP_connection(const Mono_Time *mono_time, IP_Port ip_port, const uint8_t *public_key,
         const uint8_t *self_public_key, const uint8_t *self_secret_key, TCP_Proxy_Info *proxy_info);
 
+/* Write the socket of the TCP connection into fds, see net_poll_fds_add().
+ * It is watched for writability while the connection has unsent data.
+ *
+ * return the number of sockets, which may be larger than max_fds.
+ */
+uint32_t tcp_con_get_fds(const TCP_Client_Connection *con, Net_Poll_Fd *fds, uint32_t max_fds);
+
+/* Add the depth and counters of the send queue of the connection to stats.
+ */
+void tcp_con_send_queue_stats(const TCP_Client_Connection *con, TCP_Send_Queue_Stats *stats);
+
 /* Run the TCP connection
  */
 void do_TCP_connection(Mono_Time *mono_time, TCP_Client_Connection *tcp_connection, void *userdata);
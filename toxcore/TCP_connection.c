@@ -1500,6 +1500,24 @@ static void kill_nonused_tcp(TCP_Connections *tcp_c)
     }
 }
 
+uint32_t tcp_connections_get_fds(const TCP_Connections *tcp_c, Net_Poll_Fd *fds, uint32_t max_fds)
+{
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < tcp_c->tcp_connections_length; ++i) {
+        const TCP_con *tcp_con = get_tcp_connection(tcp_c, i);
+
+        if (tcp_con == nullptr || tcp_con->connection == nullptr) {
+            continue;
+        }
+
+        const uint32_t max_con_fds = count < max_fds ? max_fds - count : 0;
+        count += tcp_con_get_fds(tcp_con->connection, fds == nullptr ? nullptr : fds + count, max_con_fds);
+    }
+
+    return count;
+}
+
 void do_tcp_connections(TCP_Connections *tcp_c, void *userdata)
 {
     do_tcp_conns(tcp_c, userdata);
@@ -221,6 +221,12 @@ uint32_t tcp_copy_connected_relays(TCP_Connections *tcp_c, Node_format *tcp_rela
  */
 TCP_Connections *new_tcp_connections(Mono_Time *mono_time, const uint8_t *secret_key, TCP_Proxy_Info *proxy_info);
 
+/* Write the sockets of all active TCP relay connections into fds, see net_poll_fds_add().
+ *
+ * return the number of sockets, which may be larger than max_fds.
+ */
+uint32_t tcp_connections_get_fds(const TCP_Connections *tcp_c, Net_Poll_Fd *fds, uint32_t max_fds);
+
 void do_tcp_connections(TCP_Connections *tcp_c, void *userdata);
 void kill_tcp_connections(TCP_Connections *tcp_c);
 
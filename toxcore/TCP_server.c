@@ -27,6 +27,7 @@
 
 #include "TCP_server.h"
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,11 +36,13 @@
 #endif
 
 #ifdef TCP_SERVER_USE_EPOLL
+#include <fcntl.h>
 #include <sys/epoll.h>
 #include <unistd.h>
 #endif
 
 #include "mono_time.h"
+#include "pk_map.h"
 #include "util.h"
 
 #ifdef TCP_SERVER_USE_EPOLL
@@ -47,11 +50,33 @@
 #define TCP_SOCKET_INCOMING 1
 #define TCP_SOCKET_UNCONFIRMED 2
 #define TCP_SOCKET_CONFIRMED 3
+#define TCP_SOCKET_WAKEUP 4
+
+/* How long a worker thread sleeps in epoll_wait() at most, in milliseconds. */
+#define TCP_WORKER_POLL_TIMEOUT 1000
 #endif
 
+/* The index of an accepted connection outside of its shard has the shard in
+ * its upper bits.
+ */
+#define TCP_SHARD_INDEX_BITS 24
+#define TCP_SHARD_INDEX_MASK ((1u << TCP_SHARD_INDEX_BITS) - 1)
+
+/* Maximum number of packets waiting for a worker. Beyond this, forwarded
+ * packets are dropped like they are when the receiver's socket is full, but
+ * messages changing the routing state are still queued.
+ */
+#define TCP_MAX_QUEUED_MESSAGES 4096
+
+/* Number of entries in the hash index of the routes of a connection, a power
+ * of two at least twice NUM_CLIENT_CONNECTIONS.
+ */
+#define TCP_ROUTE_INDEX_BITS 9
+#define TCP_ROUTE_INDEX_SIZE (1 << TCP_ROUTE_INDEX_BITS)
+
 typedef struct TCP_Secure_Conn {
     uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
-    uint32_t index;
+    uint32_t index; /* Index of the other connection, including its shard. */
     // TODO(iphydf): Add an enum for this (same as in TCP_client.c, probably).
     uint8_t status; /* 0 if not used, 1 if other is offline, 2 if other is online. */
     uint8_t other_id;
@@ -63,15 +88,19 @@ typedef struct TCP_Secure_Connection {
     uint8_t recv_nonce[CRYPTO_NONCE_SIZE]; /* Nonce of received packets. */
     uint8_t sent_nonce[CRYPTO_NONCE_SIZE]; /* Nonce of sent packets. */
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    uint16_t next_packet_length;
+    TCP_Recv_Buffer recv_buffer;
     TCP_Secure_Conn connections[NUM_CLIENT_CONNECTIONS];
-    uint8_t last_packet[2 + MAX_PACKET_SIZE];
+    /* Used entries of connections, one bit each. */
+    uint64_t used_connections[(NUM_CLIENT_CONNECTIONS + 63) / 64];
+    /* Index of the used entries of connections by public key. Each entry is
+     * the connection number plus 1, 0 if the entry is empty. */
+    uint8_t route_index[TCP_ROUTE_INDEX_SIZE];
     uint8_t status;
-    uint16_t last_packet_length;
-    uint16_t last_packet_sent;
+    /* The handshake of this incoming connection is with the handshake
+     * workers. Their result carries identifier. */
+    bool handshake_pending;
 
-    TCP_Priority_List *priority_queue_start;
-    TCP_Priority_List *priority_queue_end;
+    TCP_Send_Queue send_queue;
 
     uint64_t identifier;
 
@@ -79,21 +108,94 @@ typedef struct TCP_Secure_Connection {
     uint64_t ping_id;
 } TCP_Secure_Connection;
 
+typedef enum TCP_Message_Type {
+    /* A newly accepted socket for the shard. */
+    TCP_MESSAGE_SOCKET,
+    /* The handshake packet of the incoming connection at index on its way to
+     * the handshake workers, and the TCP_Handshake they computed from it on
+     * its way back. */
+    TCP_MESSAGE_HANDSHAKE,
+    /* A new connection to the same public key replaced index. */
+    TCP_MESSAGE_KILL,
+    /* other_index asked to be routed to index. */
+    TCP_MESSAGE_ROUTE,
+    /* index agreed to be routed to other_index. */
+    TCP_MESSAGE_ROUTE_CONFIRM,
+    /* other_index is no longer routed to index. */
+    TCP_MESSAGE_ROUTE_REMOVE,
+    /* Packets to write to index. */
+    TCP_MESSAGE_DATA,
+    TCP_MESSAGE_OOB,
+    TCP_MESSAGE_ONION_RESPONSE,
+    /* An onion request from index, for the thread calling do_TCP_server(). */
+    TCP_MESSAGE_ONION_REQUEST,
+} TCP_Message_Type;
+
+/* Something to do on the connection at index, which lives on another shard
+ * than the one that wants it done.
+ */
+typedef struct TCP_Message {
+    struct TCP_Message *next;
+    TCP_Message_Type type;
 
-struct TCP_Server {
-    Onion *onion;
+    uint32_t index;
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t con_number;
+
+    uint32_t other_index;
+    uint8_t other_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t other_con_number;
+
+    uint64_t identifier;
+    Socket sock;
+
+    /* Stored right after the message when it is queued. */
+    const uint8_t *data;
+    uint16_t length;
+} TCP_Message;
+
+/* What the server needs to finish the handshake of a connection. */
+typedef struct TCP_Handshake {
+    bool ok;
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t recv_nonce[CRYPTO_NONCE_SIZE];
+    uint8_t sent_nonce[CRYPTO_NONCE_SIZE];
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    uint8_t response[TCP_SERVER_HANDSHAKE_SIZE];
+} TCP_Handshake;
+
+typedef struct TCP_Message_Queue {
+    pthread_mutex_t mutex;
+    TCP_Message *head;
+    TCP_Message *tail;
+    uint32_t size;
+    bool running;
+
+    /* Written to when the queue stops being empty. */
+    int wake_fds[2];
+} TCP_Message_Queue;
+
+/* The connections handled by one thread. Without worker threads, the server
+ * has a single shard run by do_TCP_server().
+ */
+typedef struct TCP_Shard {
+    TCP_Server *tcp_server;
+    uint32_t id;
 
 #ifdef TCP_SERVER_USE_EPOLL
     int efd;
     uint64_t last_run_pinged;
 #endif
-    Socket *socks_listening;
-    unsigned int num_listening_socks;
 
-    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
-    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
     TCP_Secure_Connection incoming_connection_queue[MAX_INCOMING_CONNECTIONS];
     uint16_t incoming_connection_queue_index;
+#ifdef TCP_SERVER_USE_EPOLL
+    /* The identifier of the handshake each incoming connection has queued
+     * with the handshake workers, 0 if none. Protected by the handshake pool
+     * mutex, so the workers can skip connections that went away. */
+    uint64_t handshake_ids[MAX_INCOMING_CONNECTIONS];
+    uint32_t num_pending_handshakes;
+#endif
     TCP_Secure_Connection unconfirmed_connection_queue[MAX_INCOMING_CONNECTIONS];
     uint16_t unconfirmed_connection_queue_index;
 
@@ -103,7 +205,68 @@ struct TCP_Server {
 
     uint64_t counter;
 
-    BS_List accepted_key_list;
+    /* Updated by do_TCP_confirmed() under the key list mutex. */
+    TCP_Send_Queue_Stats send_queue_stats;
+
+    /* Where other threads hand messages for the shard over. Only set up with
+     * worker threads or handshake workers. */
+    TCP_Message_Queue queue;
+    bool has_queue;
+
+    /* Only used by worker threads. */
+    pthread_t thread;
+    Mono_Time *mono_time;
+    uint32_t next_shard;
+} TCP_Shard;
+
+#ifdef TCP_SERVER_USE_EPOLL
+/* Threads computing the key exchange of new connections, see
+ * tcp_server_start_handshake_workers().
+ */
+typedef struct TCP_Handshake_Pool {
+    pthread_mutex_t mutex;
+    /* Signalled when a handshake is queued or the pool stops running. */
+    pthread_cond_t cond;
+    TCP_Message *head;
+    TCP_Message *tail;
+    /* Number of messages from head to tail, including those of connections
+     * that went away in the meantime. */
+    uint32_t size;
+    bool running;
+
+    pthread_t threads[TCP_SERVER_MAX_HANDSHAKE_WORKERS];
+    uint32_t num_threads;
+} TCP_Handshake_Pool;
+#endif
+
+struct TCP_Server {
+    Onion *onion;
+
+    Socket *socks_listening;
+    unsigned int num_listening_socks;
+
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+
+    TCP_Shard *shards[TCP_SERVER_MAX_WORKERS];
+    uint32_t num_shards;
+    bool workers_running;
+
+    /* Onion requests from the worker threads. */
+    TCP_Message_Queue onion_queue;
+
+#ifdef TCP_SERVER_USE_EPOLL
+    TCP_Handshake_Pool handshake_pool;
+#endif
+
+    /* Maps public keys to connection indices over all shards. Also protects
+     * the send queue stats of the shards. */
+    pthread_mutex_t key_list_mutex;
+    PK_Map *accepted_key_map;
+
+    /* Random per server, so clients can't pick keys that all land in the same
+     * slot of a route index. */
+    uint64_t route_hash_seed[2];
 };
 
 const uint8_t *tcp_server_public_key(const TCP_Server *tcp_server)
@@ -116,6 +279,80 @@ size_t tcp_server_listen_count(const TCP_Server *tcp_server)
     return tcp_server->num_listening_socks;
 }
 
+#ifndef TCP_SERVER_USE_EPOLL
+static bool tcp_con_want_write(const TCP_Secure_Connection *con)
+{
+    return !tcp_send_queue_empty(&con->send_queue);
+}
+#endif
+
+uint32_t tcp_server_num_workers(const TCP_Server *tcp_server)
+{
+    return tcp_server->workers_running ? tcp_server->num_shards : 0;
+}
+
+void tcp_server_send_queue_stats(TCP_Server *tcp_server, TCP_Send_Queue_Stats *stats)
+{
+    memset(stats, 0, sizeof(TCP_Send_Queue_Stats));
+    pthread_mutex_lock(&tcp_server->key_list_mutex);
+
+    for (uint32_t i = 0; i < tcp_server->num_shards; ++i) {
+        const TCP_Send_Queue_Stats *shard_stats = &tcp_server->shards[i]->send_queue_stats;
+        stats->backlogged_queues += shard_stats->backlogged_queues;
+        stats->queued_bytes += shard_stats->queued_bytes;
+        stats->max_queued_bytes = max_u32(stats->max_queued_bytes, shard_stats->max_queued_bytes);
+        stats->packets_queued += shard_stats->packets_queued;
+        stats->packets_dropped += shard_stats->packets_dropped;
+    }
+
+    pthread_mutex_unlock(&tcp_server->key_list_mutex);
+}
+
+uint32_t tcp_server_get_fds(const TCP_Server *tcp_server, Net_Poll_Fd *fds, uint32_t max_fds)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (tcp_server->workers_running) {
+        const Socket wake_fd = {tcp_server->onion_queue.wake_fds[0]};
+        return net_poll_fds_add(fds, max_fds, 0, wake_fd, false);
+    }
+
+    const Socket efd = {tcp_server->shards[0]->efd};
+    return net_poll_fds_add(fds, max_fds, 0, efd, false);
+#else
+    const TCP_Shard *shard = tcp_server->shards[0];
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < tcp_server->num_listening_socks; ++i) {
+        count = net_poll_fds_add(fds, max_fds, count, tcp_server->socks_listening[i], false);
+    }
+
+    for (uint32_t i = 0; i < MAX_INCOMING_CONNECTIONS; ++i) {
+        const TCP_Secure_Connection *incoming = &shard->incoming_connection_queue[i];
+
+        if (incoming->status != TCP_STATUS_NO_STATUS) {
+            count = net_poll_fds_add(fds, max_fds, count, incoming->sock, tcp_con_want_write(incoming));
+        }
+
+        const TCP_Secure_Connection *unconfirmed = &shard->unconfirmed_connection_queue[i];
+
+        if (unconfirmed->status != TCP_STATUS_NO_STATUS) {
+            count = net_poll_fds_add(fds, max_fds, count, unconfirmed->sock, tcp_con_want_write(unconfirmed));
+        }
+    }
+
+    for (uint32_t i = 0; i < shard->size_accepted_connections; ++i) {
+        const TCP_Secure_Connection *accepted = &shard->accepted_connection_array[i];
+
+        if (accepted->status != TCP_STATUS_NO_STATUS) {
+            count = net_poll_fds_add(fds, max_fds, count, accepted->sock, tcp_con_want_write(accepted));
+        }
+    }
+
+    return count;
+#endif
+}
+
 /* This is needed to compile on Android below API 21
  */
 #ifdef TCP_SERVER_USE_EPOLL
@@ -129,44 +366,35 @@ size_t tcp_server_listen_count(const TCP_Server *tcp_server)
  *  return -1 on failure
  *  return 0 on success.
  */
-static int alloc_new_connections(TCP_Server *tcp_server, uint32_t num)
+static int alloc_new_connections(TCP_Shard *shard, uint32_t num)
 {
-    const uint32_t new_size = tcp_server->size_accepted_connections + num;
+    const uint32_t new_size = shard->size_accepted_connections + num;
 
-    if (new_size < tcp_server->size_accepted_connections) {
+    if (new_size < shard->size_accepted_connections || new_size > TCP_SHARD_INDEX_MASK) {
         return -1;
     }
 
     TCP_Secure_Connection *new_connections = (TCP_Secure_Connection *)realloc(
-                tcp_server->accepted_connection_array,
+                shard->accepted_connection_array,
                 new_size * sizeof(TCP_Secure_Connection));
 
     if (new_connections == nullptr) {
         return -1;
     }
 
-    const uint32_t old_size = tcp_server->size_accepted_connections;
+    const uint32_t old_size = shard->size_accepted_connections;
     const uint32_t size_new_entries = num * sizeof(TCP_Secure_Connection);
     memset(new_connections + old_size, 0, size_new_entries);
 
-    tcp_server->accepted_connection_array = new_connections;
-    tcp_server->size_accepted_connections = new_size;
+    shard->accepted_connection_array = new_connections;
+    shard->size_accepted_connections = new_size;
     return 0;
 }
 
-void wipe_priority_list(TCP_Priority_List *p)
-{
-    while (p) {
-        TCP_Priority_List *pp = p;
-        p = p->next;
-        free(pp);
-    }
-}
-
 static void wipe_secure_connection(TCP_Secure_Connection *con)
 {
     if (con->status) {
-        wipe_priority_list(con->priority_queue_start);
+        tcp_send_queue_free(&con->send_queue);
         crypto_memzero(con, sizeof(TCP_Secure_Connection));
     }
 }
@@ -177,57 +405,206 @@ static void move_secure_connection(TCP_Secure_Connection *con_new, TCP_Secure_Co
     crypto_memzero(con_old, sizeof(TCP_Secure_Connection));
 }
 
-static void free_accepted_connection_array(TCP_Server *tcp_server)
+static void free_accepted_connection_array(TCP_Shard *shard)
 {
-    if (tcp_server->accepted_connection_array == nullptr) {
+    if (shard->accepted_connection_array == nullptr) {
         return;
     }
 
-    for (uint32_t i = 0; i < tcp_server->size_accepted_connections; ++i) {
-        wipe_secure_connection(&tcp_server->accepted_connection_array[i]);
+    for (uint32_t i = 0; i < shard->size_accepted_connections; ++i) {
+        wipe_secure_connection(&shard->accepted_connection_array[i]);
+    }
+
+    free(shard->accepted_connection_array);
+    shard->accepted_connection_array = nullptr;
+    shard->size_accepted_connections = 0;
+}
+
+/* return the index of an accepted connection outside of its shard.
+ */
+static uint32_t global_connection_index(const TCP_Shard *shard, uint32_t index)
+{
+    return (shard->id << TCP_SHARD_INDEX_BITS) | index;
+}
+
+/* return the shard of the connection with the given index on success.
+ * return NULL on failure.
+ */
+static TCP_Shard *connection_shard(const TCP_Server *tcp_server, uint32_t index)
+{
+    const uint32_t id = index >> TCP_SHARD_INDEX_BITS;
+
+    if (id >= tcp_server->num_shards) {
+        return nullptr;
     }
 
-    free(tcp_server->accepted_connection_array);
-    tcp_server->accepted_connection_array = nullptr;
-    tcp_server->size_accepted_connections = 0;
+    return tcp_server->shards[id];
 }
 
 /* return index corresponding to connection with peer on success
  * return -1 on failure.
  */
-static int get_TCP_connection_index(const TCP_Server *tcp_server, const uint8_t *public_key)
+static int get_TCP_connection_index(TCP_Server *tcp_server, const uint8_t *public_key)
+{
+    pthread_mutex_lock(&tcp_server->key_list_mutex);
+    uint32_t index;
+    const bool found = pk_map_find(tcp_server->accepted_key_map, public_key, &index);
+    pthread_mutex_unlock(&tcp_server->key_list_mutex);
+    return found ? (int)index : -1;
+}
+
+/* Remove public_key from the list if it still belongs to the connection with
+ * the given index. A newer connection with the same key may have replaced it.
+ */
+static void remove_TCP_connection_index(TCP_Server *tcp_server, const uint8_t *public_key, uint32_t index)
+{
+    pthread_mutex_lock(&tcp_server->key_list_mutex);
+
+    uint32_t found_index;
+
+    if (pk_map_find(tcp_server->accepted_key_map, public_key, &found_index) && found_index == index) {
+        pk_map_remove(tcp_server->accepted_key_map, public_key);
+    }
+
+    pthread_mutex_unlock(&tcp_server->key_list_mutex);
+}
+
+/* return the route_index entry where the search for public_key starts. */
+static uint32_t route_index_home(const TCP_Server *tcp_server, const uint8_t *public_key)
+{
+    return (uint32_t)(pk_hash(tcp_server->route_hash_seed, public_key) >> (64 - TCP_ROUTE_INDEX_BITS));
+}
+
+/* return the route_index entry for public_key, or the empty entry where it
+ * would go.
+ */
+static uint32_t route_index_entry(const TCP_Server *tcp_server, const TCP_Secure_Connection *con,
+                                  const uint8_t *public_key)
+{
+    uint32_t i = route_index_home(tcp_server, public_key);
+
+    while (con->route_index[i] != 0
+            && public_key_cmp(con->connections[con->route_index[i] - 1].public_key, public_key) != 0) {
+        i = (i + 1) % TCP_ROUTE_INDEX_SIZE;
+    }
+
+    return i;
+}
+
+/* return the connection number routed to public_key.
+ * return -1 if there is none.
+ */
+static int find_route(const TCP_Server *tcp_server, const TCP_Secure_Connection *con, const uint8_t *public_key)
+{
+    return (int)con->route_index[route_index_entry(tcp_server, con, public_key)] - 1;
+}
+
+/* return the lowest connection number that is used (used == true) or unused
+ * (used == false).
+ * return -1 if there is none.
+ */
+static int first_con_number(const TCP_Secure_Connection *con, bool used)
+{
+    for (uint32_t i = 0; i < sizeof(con->used_connections) / sizeof(uint64_t); ++i) {
+        uint64_t bits = used ? con->used_connections[i] : ~con->used_connections[i];
+
+        if (bits == 0) {
+            continue;
+        }
+
+        uint32_t con_number = i * 64;
+
+        while ((bits & 1) == 0) {
+            bits >>= 1;
+            ++con_number;
+        }
+
+        return con_number < NUM_CLIENT_CONNECTIONS ? (int)con_number : -1;
+    }
+
+    return -1;
+}
+
+/* Route con_number to public_key, which must not have a route yet. */
+static void add_route(const TCP_Server *tcp_server, TCP_Secure_Connection *con, uint8_t con_number,
+                      const uint8_t *public_key)
+{
+    memcpy(con->connections[con_number].public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    con->connections[con_number].status = 1;
+    con->used_connections[con_number / 64] |= UINT64_C(1) << (con_number % 64);
+    con->route_index[route_index_entry(tcp_server, con, public_key)] = con_number + 1;
+}
+
+/* Take con_number, which must be used, out of the route index. */
+static void remove_route(const TCP_Server *tcp_server, TCP_Secure_Connection *con, uint8_t con_number)
 {
-    return bs_list_find(&tcp_server->accepted_key_list, public_key);
+    uint32_t hole = route_index_entry(tcp_server, con, con->connections[con_number].public_key);
+
+    /* Move later entries back into the hole if it is between them and where
+     * they belong, so lookups never stop early at an empty entry. */
+    for (uint32_t i = (hole + 1) % TCP_ROUTE_INDEX_SIZE; con->route_index[i] != 0; i = (i + 1) % TCP_ROUTE_INDEX_SIZE) {
+        const uint32_t home = route_index_home(tcp_server, con->connections[con->route_index[i] - 1].public_key);
+
+        if ((i - home) % TCP_ROUTE_INDEX_SIZE >= (i - hole) % TCP_ROUTE_INDEX_SIZE) {
+            con->route_index[hole] = con->route_index[i];
+            hole = i;
+        }
+    }
+
+    con->route_index[hole] = 0;
+    con->used_connections[con_number / 64] &= ~(UINT64_C(1) << (con_number % 64));
 }
 
+static int kill_accepted(TCP_Shard *shard, int index);
+static void send_message(TCP_Shard *shard, const TCP_Message *msg);
+
+/* Kill the accepted connection with public_key at index, which may be on
+ * another shard.
+ */
+static void kill_accepted_global(TCP_Shard *shard, uint32_t index, const uint8_t *public_key)
+{
+    if (connection_shard(shard->tcp_server, index) == shard) {
+        kill_accepted(shard, index & TCP_SHARD_INDEX_MASK);
+        return;
+    }
+
+    /* Make room for the new connection right away, the other shard will
+     * notice that the key is not its own anymore. */
+    remove_TCP_connection_index(shard->tcp_server, public_key, index);
 
-static int kill_accepted(TCP_Server *tcp_server, int index);
+    TCP_Message msg = {0};
+    msg.type = TCP_MESSAGE_KILL;
+    msg.index = index;
+    memcpy(msg.public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    send_message(shard, &msg);
+}
 
 /* Add accepted TCP connection to the list.
  *
  * return index on success
  * return -1 on failure
  */
-static int add_accepted(TCP_Server *tcp_server, const Mono_Time *mono_time, TCP_Secure_Connection *con)
+static int add_accepted(TCP_Shard *shard, const Mono_Time *mono_time, TCP_Secure_Connection *con)
 {
+    TCP_Server *tcp_server = shard->tcp_server;
     int index = get_TCP_connection_index(tcp_server, con->public_key);
 
     if (index != -1) { /* If an old connection to the same public key exists, kill it. */
-        kill_accepted(tcp_server, index);
+        kill_accepted_global(shard, index, con->public_key);
         index = -1;
     }
 
-    if (tcp_server->size_accepted_connections == tcp_server->num_accepted_connections) {
-        if (alloc_new_connections(tcp_server, 4) == -1) {
+    if (shard->size_accepted_connections == shard->num_accepted_connections) {
+        if (alloc_new_connections(shard, 4) == -1) {
             return -1;
         }
 
-        index = tcp_server->num_accepted_connections;
+        index = shard->num_accepted_connections;
     } else {
         uint32_t i;
 
-        for (i = tcp_server->size_accepted_connections; i != 0; --i) {
-            if (tcp_server->accepted_connection_array[i - 1].status == TCP_STATUS_NO_STATUS) {
+        for (i = shard->size_accepted_connections; i != 0; --i) {
+            if (shard->accepted_connection_array[i - 1].status == TCP_STATUS_NO_STATUS) {
                 index = i - 1;
                 break;
             }
@@ -239,17 +616,22 @@ static int add_accepted(TCP_Server *tcp_server, const Mono_Time *mono_time, TCP_
         return -1;
     }
 
-    if (!bs_list_add(&tcp_server->accepted_key_list, con->public_key, index)) {
+    pthread_mutex_lock(&tcp_server->key_list_mutex);
+    const bool added = pk_map_add(tcp_server->accepted_key_map, con->public_key,
+                                  global_connection_index(shard, index));
+    pthread_mutex_unlock(&tcp_server->key_list_mutex);
+
+    if (!added) {
         return -1;
     }
 
-    move_secure_connection(&tcp_server->accepted_connection_array[index], con);
+    move_secure_connection(&shard->accepted_connection_array[index], con);
 
-    tcp_server->accepted_connection_array[index].status = TCP_STATUS_CONFIRMED;
-    ++tcp_server->num_accepted_connections;
-    tcp_server->accepted_connection_array[index].identifier = ++tcp_server->counter;
-    tcp_server->accepted_connection_array[index].last_pinged = mono_time_get(mono_time);
-    tcp_server->accepted_connection_array[index].ping_id = 0;
+    shard->accepted_connection_array[index].status = TCP_STATUS_CONFIRMED;
+    ++shard->num_accepted_connections;
+    shard->accepted_connection_array[index].identifier = ++shard->counter;
+    shard->accepted_connection_array[index].last_pinged = mono_time_get(mono_time);
+    shard->accepted_connection_array[index].ping_id = 0;
 
     return index;
 }
@@ -259,220 +641,254 @@ static int add_accepted(TCP_Server *tcp_server, const Mono_Time *mono_time, TCP_
  * return 0 on success
  * return -1 on failure
  */
-static int del_accepted(TCP_Server *tcp_server, int index)
+static int del_accepted(TCP_Shard *shard, int index)
 {
-    if ((uint32_t)index >= tcp_server->size_accepted_connections) {
+    if ((uint32_t)index >= shard->size_accepted_connections) {
         return -1;
     }
 
-    if (tcp_server->accepted_connection_array[index].status == TCP_STATUS_NO_STATUS) {
+    if (shard->accepted_connection_array[index].status == TCP_STATUS_NO_STATUS) {
         return -1;
     }
 
-    if (!bs_list_remove(&tcp_server->accepted_key_list, tcp_server->accepted_connection_array[index].public_key, index)) {
-        return -1;
-    }
+    remove_TCP_connection_index(shard->tcp_server, shard->accepted_connection_array[index].public_key,
+                                global_connection_index(shard, index));
 
-    wipe_secure_connection(&tcp_server->accepted_connection_array[index]);
-    --tcp_server->num_accepted_connections;
+    wipe_secure_connection(&shard->accepted_connection_array[index]);
+    --shard->num_accepted_connections;
 
-    if (tcp_server->num_accepted_connections == 0) {
-        free_accepted_connection_array(tcp_server);
+    if (shard->num_accepted_connections == 0) {
+        free_accepted_connection_array(shard);
     }
 
     return 0;
 }
 
-/* Read the next two bytes in TCP stream then convert them to
- * length (host byte order).
+/* Read length bytes from socket.
  *
  * return length on success
- * return 0 if nothing has been read from socket.
- * return ~0 on failure.
+ * return -1 on failure/no data in buffer.
  */
-uint16_t read_TCP_length(Socket sock)
+int read_TCP_packet(Socket sock, uint8_t *data, uint16_t length)
 {
-    const unsigned int count = net_socket_data_recv_buffer(sock);
+    unsigned int count = net_socket_data_recv_buffer(sock);
 
-    if (count >= sizeof(uint16_t)) {
-        uint16_t length;
-        const int len = net_recv(sock, &length, sizeof(uint16_t));
+    if (count >= length) {
+        const int len = net_recv(sock, data, length);
 
-        if (len != sizeof(uint16_t)) {
+        if (len != length) {
             fprintf(stderr, "FAIL recv packet\n");
-            return 0;
+            return -1;
         }
 
-        length = net_ntohs(length);
+        return len;
+    }
 
-        if (length > MAX_PACKET_SIZE) {
-            return ~0;
-        }
+    return -1;
+}
+
+/* Read as many bytes as there is room for in recv_buffer from the socket.
+ *
+ * return false if nothing could be read.
+ */
+static bool fill_recv_buffer(Socket sock, TCP_Recv_Buffer *recv_buffer)
+{
+    if (recv_buffer->start != 0) {
+        memmove(recv_buffer->data, recv_buffer->data + recv_buffer->start, recv_buffer->end - recv_buffer->start);
+        recv_buffer->end -= recv_buffer->start;
+        recv_buffer->start = 0;
+    }
 
-        return length;
+    const int len = net_recv(sock, recv_buffer->data + recv_buffer->end, sizeof(recv_buffer->data) - recv_buffer->end);
+
+    if (len <= 0) {
+        return false;
     }
 
-    return 0;
+    recv_buffer->end += len;
+    return true;
 }
 
-/* Read length bytes from socket.
- *
- * return length on success
- * return -1 on failure/no data in buffer.
+/* return the length of the packet at the start of recv_buffer.
+ * return -1 if its length hasn't been received yet.
  */
-int read_TCP_packet(Socket sock, uint8_t *data, uint16_t length)
+static int32_t recv_buffer_packet_length(const TCP_Recv_Buffer *recv_buffer)
 {
-    unsigned int count = net_socket_data_recv_buffer(sock);
+    const size_t buffered = recv_buffer->end - recv_buffer->start;
 
-    if (count >= length) {
-        const int len = net_recv(sock, data, length);
+    if (buffered < sizeof(uint16_t)) {
+        return -1;
+    }
 
-        if (len != length) {
-            fprintf(stderr, "FAIL recv packet\n");
-            return -1;
-        }
+    uint16_t length;
+    memcpy(&length, recv_buffer->data + recv_buffer->start, sizeof(uint16_t));
+    return net_ntohs(length);
+}
 
-        return len;
+static bool recv_buffer_has_packet(const TCP_Recv_Buffer *recv_buffer)
+{
+    const int32_t length = recv_buffer_packet_length(recv_buffer);
+
+    if (length == -1) {
+        return false;
     }
 
-    return -1;
+    const size_t buffered = recv_buffer->end - recv_buffer->start;
+    return buffered >= sizeof(uint16_t) + (size_t)length;
 }
 
-/* return length of received packet on success.
+/* Take the next packet out of recv_buffer, reading from the socket first
+ * only if the buffer doesn't hold a whole packet.
+ *
+ * return length of received packet on success.
  * return 0 if could not read any packet.
  * return -1 on failure (connection must be killed).
  */
-int read_packet_TCP_secure_connection(Socket sock, uint16_t *next_packet_length, const uint8_t *shared_key,
+int read_packet_TCP_secure_connection(Socket sock, TCP_Recv_Buffer *recv_buffer, const uint8_t *shared_key,
                                       uint8_t *recv_nonce, uint8_t *data, uint16_t max_len)
 {
-    if (*next_packet_length == 0) {
-        uint16_t len = read_TCP_length(sock);
-
-        if (len == (uint16_t)~0) {
-            return -1;
-        }
+    if (!recv_buffer_has_packet(recv_buffer)) {
+        fill_recv_buffer(sock, recv_buffer);
+    }
 
-        if (len == 0) {
-            return 0;
-        }
+    const int32_t length = recv_buffer_packet_length(recv_buffer);
 
-        *next_packet_length = len;
+    if (length == -1) {
+        return 0;
     }
 
-    if (max_len + CRYPTO_MAC_SIZE < *next_packet_length) {
+    if (length > MAX_PACKET_SIZE || max_len + CRYPTO_MAC_SIZE < length) {
         return -1;
     }
 
-    VLA(uint8_t, data_encrypted, *next_packet_length);
-    int len_packet = read_TCP_packet(sock, data_encrypted, *next_packet_length);
-
-    if (len_packet != *next_packet_length) {
+    if (!recv_buffer_has_packet(recv_buffer)) {
         return 0;
     }
 
-    *next_packet_length = 0;
+    const int len = decrypt_data_symmetric(shared_key, recv_nonce,
+                                           recv_buffer->data + recv_buffer->start + sizeof(uint16_t), length, data);
 
-    int len = decrypt_data_symmetric(shared_key, recv_nonce, data_encrypted, len_packet, data);
-
-    if (len + CRYPTO_MAC_SIZE != len_packet) {
+    if (len + CRYPTO_MAC_SIZE != length) {
         return -1;
     }
 
+    recv_buffer->start += sizeof(uint16_t) + length;
+
+    if (recv_buffer->start == recv_buffer->end) {
+        recv_buffer->start = 0;
+        recv_buffer->end = 0;
+    }
+
     increment_nonce(recv_nonce);
 
     return len;
 }
 
-/* return 0 if pending data was sent completely
- * return -1 if it wasn't
- */
-static int send_pending_data_nonpriority(TCP_Secure_Connection *con)
+void tcp_send_queue_free(TCP_Send_Queue *queue)
+{
+    free(queue->data);
+    queue->data = nullptr;
+    queue->start = 0;
+    queue->size = 0;
+}
+
+bool tcp_send_queue_empty(const TCP_Send_Queue *queue)
 {
-    if (con->last_packet_length == 0) {
+    return queue->size == 0;
+}
+
+int tcp_send_queue_flush(TCP_Send_Queue *queue, Socket sock)
+{
+    if (queue->size == 0) {
         return 0;
     }
 
-    const uint16_t left = con->last_packet_length - con->last_packet_sent;
-    const int len = net_send(con->sock, con->last_packet + con->last_packet_sent, left);
+    const uint32_t first = min_u32(queue->size, TCP_SEND_QUEUE_SIZE - queue->start);
+    const int len = net_send_iov(sock, queue->data + queue->start, first, queue->data, queue->size - first);
 
     if (len <= 0) {
         return -1;
     }
 
-    if (len == left) {
-        con->last_packet_length = 0;
-        con->last_packet_sent = 0;
-        return 0;
+    queue->start = (queue->start + len) % TCP_SEND_QUEUE_SIZE;
+    queue->size -= len;
+
+    if (queue->size != 0) {
+        return -1;
     }
 
-    con->last_packet_sent += len;
-    return -1;
+    queue->start = 0;
+    return 0;
 }
 
-/* return 0 if pending data was sent completely
- * return -1 if it wasn't
+/* Copy length bytes to the end of the queue.
+ *
+ * return false if there is no room for them.
  */
-static int send_pending_data(TCP_Secure_Connection *con)
+static bool tcp_send_queue_add(TCP_Send_Queue *queue, const uint8_t *data, uint16_t length, bool priority)
 {
-    /* finish sending current non-priority packet */
-    if (send_pending_data_nonpriority(con) == -1) {
-        return -1;
-    }
-
-    TCP_Priority_List *p = con->priority_queue_start;
+    const uint32_t limit = priority ? TCP_SEND_QUEUE_SIZE : TCP_SEND_QUEUE_SIZE - TCP_SEND_QUEUE_PRIORITY_RESERVE;
 
-    while (p) {
-        const uint16_t left = p->size - p->sent;
-        const int len = net_send(con->sock, p->data + p->sent, left);
+    if (queue->size + length > limit) {
+        return false;
+    }
 
-        if (len != left) {
-            if (len > 0) {
-                p->sent += len;
-            }
+    if (queue->data == nullptr) {
+        queue->data = (uint8_t *)malloc(TCP_SEND_QUEUE_SIZE);
 
-            break;
+        if (queue->data == nullptr) {
+            return false;
         }
-
-        TCP_Priority_List *pp = p;
-        p = p->next;
-        free(pp);
     }
 
-    con->priority_queue_start = p;
+    const uint32_t end = (queue->start + queue->size) % TCP_SEND_QUEUE_SIZE;
+    const uint32_t first = min_u32(length, TCP_SEND_QUEUE_SIZE - end);
+    memcpy(queue->data + end, data, first);
+    memcpy(queue->data, data + first, length - first);
+    queue->size += length;
 
-    if (!p) {
-        con->priority_queue_end = nullptr;
-        return 0;
+    if (queue->size > queue->max_size) {
+        queue->max_size = queue->size;
     }
 
-    return -1;
+    ++queue->packets_queued;
+    return true;
 }
 
-/* return 0 on failure (only if malloc fails)
- * return 1 on success
- */
-static bool add_priority(TCP_Secure_Connection *con, const uint8_t *packet, uint16_t size, uint16_t sent)
+int tcp_send_queue_write(TCP_Send_Queue *queue, Socket sock, const uint8_t *packet, uint16_t length, bool priority)
 {
-    TCP_Priority_List *p = con->priority_queue_end;
-    TCP_Priority_List *new_list = (TCP_Priority_List *)malloc(sizeof(TCP_Priority_List) + size);
+    int len = 0;
 
-    if (!new_list) {
-        return 0;
-    }
+    if (tcp_send_queue_flush(queue, sock) == 0) {
+        len = net_send(sock, packet, length);
 
-    new_list->next = nullptr;
-    new_list->size = size;
-    new_list->sent = sent;
-    memcpy(new_list->data, packet, size);
+        if (len == length) {
+            return 1;
+        }
 
-    if (p) {
-        p->next = new_list;
-    } else {
-        con->priority_queue_start = new_list;
+        if (len < 0) {
+            len = 0;
+        }
     }
 
-    con->priority_queue_end = new_list;
-    return 1;
+    if (tcp_send_queue_add(queue, packet + len, length - len, priority)) {
+        return 1;
+    }
+
+    ++queue->packets_dropped;
+    return len == 0 ? 0 : -1;
+}
+
+void tcp_send_queue_stats_add(const TCP_Send_Queue *queue, TCP_Send_Queue_Stats *stats)
+{
+    if (queue->size != 0) {
+        ++stats->backlogged_queues;
+    }
+
+    stats->queued_bytes += queue->size;
+    stats->max_queued_bytes = max_u32(stats->max_queued_bytes, queue->max_size);
+    stats->packets_queued += queue->packets_queued;
+    stats->packets_dropped += queue->packets_dropped;
 }
 
 /* return 1 on success.
@@ -486,16 +902,6 @@ static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const
         return -1;
     }
 
-    bool sendpriority = 1;
-
-    if (send_pending_data(con) == -1) {
-        if (priority) {
-            sendpriority = 0;
-        } else {
-            return 0;
-        }
-    }
-
     VLA(uint8_t, packet, sizeof(uint16_t) + length + CRYPTO_MAC_SIZE);
 
     const uint16_t c_length = net_htons(length + CRYPTO_MAC_SIZE);
@@ -506,335 +912,906 @@ static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const
         return -1;
     }
 
-    if (priority) {
-        len = sendpriority ? net_send(con->sock, packet, SIZEOF_VLA(packet)) : 0;
+    const int ret = tcp_send_queue_write(&con->send_queue, con->sock, packet, SIZEOF_VLA(packet), priority);
 
-        if (len <= 0) {
-            len = 0;
+    if (ret == 1) {
+        increment_nonce(con->sent_nonce);
+    }
+
+    return ret;
+}
+
+/* Kill a TCP_Secure_Connection
+ */
+static void kill_TCP_secure_connection(TCP_Secure_Connection *con)
+{
+    kill_sock(con->sock);
+    wipe_secure_connection(con);
+}
+
+#ifdef TCP_SERVER_USE_EPOLL
+/* Take the handshake the incoming connection at index i queued back from the
+ * handshake workers, if they didn't start on it yet.
+ */
+static void release_handshake(TCP_Shard *shard, uint32_t i)
+{
+    TCP_Handshake_Pool *pool = &shard->tcp_server->handshake_pool;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    if (shard->handshake_ids[i] != 0) {
+        shard->handshake_ids[i] = 0;
+        --shard->num_pending_handshakes;
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+#endif
+
+static void kill_incoming(TCP_Shard *shard, uint32_t i)
+{
+    TCP_Secure_Connection *con = &shard->incoming_connection_queue[i];
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (con->handshake_pending) {
+        release_handshake(shard, i);
+    }
+
+#endif
+
+    kill_TCP_secure_connection(con);
+}
+
+static int rm_connection_index(TCP_Shard *shard, uint32_t con_id, uint8_t con_number);
+
+/* Kill an accepted TCP_Secure_Connection
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int kill_accepted(TCP_Shard *shard, int index)
+{
+    if ((uint32_t)index >= shard->size_accepted_connections) {
+        return -1;
+    }
+
+    int con_number;
+
+    while ((con_number = first_con_number(&shard->accepted_connection_array[index], true)) != -1) {
+        rm_connection_index(shard, index, con_number);
+    }
+
+    Socket sock = shard->accepted_connection_array[index].sock;
+
+    if (del_accepted(shard, index) != 0) {
+        return -1;
+    }
+
+    kill_sock(sock);
+    return 0;
+}
+
+/* Compute the key exchange for the handshake packet a client sent. Only reads
+ * self_secret_key besides its arguments, so it can run on any thread.
+ *
+ * return true if the packet is a valid handshake.
+ */
+static bool compute_TCP_handshake(TCP_Handshake *handshake, const uint8_t *data, const uint8_t *self_secret_key)
+{
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    encrypt_precompute(data, self_secret_key, shared_key);
+    uint8_t plain[TCP_HANDSHAKE_PLAIN_SIZE];
+    int len = decrypt_data_symmetric(shared_key, data + CRYPTO_PUBLIC_KEY_SIZE,
+                                     data + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE, TCP_HANDSHAKE_PLAIN_SIZE + CRYPTO_MAC_SIZE, plain);
+
+    if (len != TCP_HANDSHAKE_PLAIN_SIZE) {
+        return false;
+    }
+
+    memcpy(handshake->public_key, data, CRYPTO_PUBLIC_KEY_SIZE);
+    uint8_t temp_secret_key[CRYPTO_SECRET_KEY_SIZE];
+    uint8_t resp_plain[TCP_HANDSHAKE_PLAIN_SIZE];
+    crypto_new_keypair(resp_plain, temp_secret_key);
+    random_nonce(handshake->sent_nonce);
+    memcpy(resp_plain + CRYPTO_PUBLIC_KEY_SIZE, handshake->sent_nonce, CRYPTO_NONCE_SIZE);
+    memcpy(handshake->recv_nonce, plain + CRYPTO_PUBLIC_KEY_SIZE, CRYPTO_NONCE_SIZE);
+
+    random_nonce(handshake->response);
+
+    len = encrypt_data_symmetric(shared_key, handshake->response, resp_plain, TCP_HANDSHAKE_PLAIN_SIZE,
+                                 handshake->response + CRYPTO_NONCE_SIZE);
+
+    if (len != TCP_HANDSHAKE_PLAIN_SIZE + CRYPTO_MAC_SIZE) {
+        return false;
+    }
+
+    encrypt_precompute(plain, temp_secret_key, handshake->shared_key);
+    return true;
+}
+
+/* Send the response to the client and switch con over to the session keys.
+ *
+ * return 1 if everything went well.
+ * return -1 if the connection must be killed.
+ */
+static int finish_TCP_handshake(TCP_Secure_Connection *con, const TCP_Handshake *handshake)
+{
+    if (!handshake->ok || con->status != TCP_STATUS_CONNECTED) {
+        return -1;
+    }
+
+    if (TCP_SERVER_HANDSHAKE_SIZE != net_send(con->sock, handshake->response, TCP_SERVER_HANDSHAKE_SIZE)) {
+        return -1;
+    }
+
+    memcpy(con->public_key, handshake->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(con->recv_nonce, handshake->recv_nonce, CRYPTO_NONCE_SIZE);
+    memcpy(con->sent_nonce, handshake->sent_nonce, CRYPTO_NONCE_SIZE);
+    memcpy(con->shared_key, handshake->shared_key, CRYPTO_SHARED_KEY_SIZE);
+    con->handshake_pending = false;
+    con->status = TCP_STATUS_UNCONFIRMED;
+    return 1;
+}
+
+/* return 1 if everything went well.
+ * return -1 if the connection must be killed.
+ */
+static int handle_TCP_handshake(TCP_Secure_Connection *con, const uint8_t *data, uint16_t length,
+                                const uint8_t *self_secret_key)
+{
+    if (length != TCP_CLIENT_HANDSHAKE_SIZE) {
+        return -1;
+    }
+
+    TCP_Handshake handshake;
+    handshake.ok = compute_TCP_handshake(&handshake, data, self_secret_key);
+    const int ret = finish_TCP_handshake(con, &handshake);
+    crypto_memzero(&handshake, sizeof(handshake));
+    return ret;
+}
+
+/* return 1 on success.
+ * return 0 if could not send packet.
+ * return -1 on failure (connection must be killed).
+ */
+static int send_routing_response(TCP_Secure_Connection *con, uint8_t rpid, const uint8_t *public_key)
+{
+    uint8_t data[1 + 1 + CRYPTO_PUBLIC_KEY_SIZE];
+    data[0] = TCP_PACKET_ROUTING_RESPONSE;
+    data[1] = rpid;
+    memcpy(data + 2, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+
+    return write_packet_TCP_secure_connection(con, data, sizeof(data), 1);
+}
+
+/* return 1 on success.
+ * return 0 if could not send packet.
+ * return -1 on failure (connection must be killed).
+ */
+static int send_connect_notification(TCP_Secure_Connection *con, uint8_t id)
+{
+    uint8_t data[2] = {TCP_PACKET_CONNECTION_NOTIFICATION, (uint8_t)(id + NUM_RESERVED_PORTS)};
+    return write_packet_TCP_secure_connection(con, data, sizeof(data), 1);
+}
+
+/* return 1 on success.
+ * return 0 if could not send packet.
+ * return -1 on failure (connection must be killed).
+ */
+static int send_disconnect_notification(TCP_Secure_Connection *con, uint8_t id)
+{
+    uint8_t data[2] = {TCP_PACKET_DISCONNECT_NOTIFICATION, (uint8_t)(id + NUM_RESERVED_PORTS)};
+    return write_packet_TCP_secure_connection(con, data, sizeof(data), 1);
+}
+
+/* return 0 on success.
+ * return -1 on failure (connection must be killed).
+ */
+static int handle_TCP_routing_req(TCP_Shard *shard, uint32_t con_id, const uint8_t *public_key)
+{
+    TCP_Secure_Connection *con = &shard->accepted_connection_array[con_id];
+
+    /* If person tries to cennect to himself we deny the request*/
+    if (public_key_cmp(con->public_key, public_key) == 0) {
+        if (send_routing_response(con, 0, public_key) == -1) {
+            return -1;
         }
 
-        increment_nonce(con->sent_nonce);
+        return 0;
+    }
 
-        if ((unsigned int)len == SIZEOF_VLA(packet)) {
-            return 1;
+    const int existing = find_route(shard->tcp_server, con, public_key);
+
+    if (existing != -1) {
+        if (send_routing_response(con, existing + NUM_RESERVED_PORTS, public_key) == -1) {
+            return -1;
         }
 
-        return add_priority(con, packet, SIZEOF_VLA(packet), len);
+        return 0;
     }
 
-    len = net_send(con->sock, packet, SIZEOF_VLA(packet));
+    const int index = first_con_number(con, false);
 
-    if (len <= 0) {
+    if (index == -1) {
+        if (send_routing_response(con, 0, public_key) == -1) {
+            return -1;
+        }
+
+        return 0;
+    }
+
+    int ret = send_routing_response(con, index + NUM_RESERVED_PORTS, public_key);
+
+    if (ret == 0) {
         return 0;
     }
 
-    increment_nonce(con->sent_nonce);
+    if (ret == -1) {
+        return -1;
+    }
+
+    add_route(shard->tcp_server, con, index, public_key);
+    int other_index = get_TCP_connection_index(shard->tcp_server, public_key);
+
+    if (other_index != -1) {
+        /* The other connection completes the route if it asked for us too. */
+        TCP_Message msg = {0};
+        msg.type = TCP_MESSAGE_ROUTE;
+        msg.index = other_index;
+        memcpy(msg.public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        msg.other_index = global_connection_index(shard, con_id);
+        memcpy(msg.other_public_key, con->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        msg.other_con_number = index;
+        send_message(shard, &msg);
+    }
+
+    return 0;
+}
+
+/* return 0 on success.
+ * return -1 on failure (connection must be killed).
+ */
+static int handle_TCP_oob_send(TCP_Shard *shard, uint32_t con_id, const uint8_t *public_key, const uint8_t *data,
+                               uint16_t length)
+{
+    if (length == 0 || length > TCP_MAX_OOB_DATA_LENGTH) {
+        return -1;
+    }
+
+    TCP_Secure_Connection *con = &shard->accepted_connection_array[con_id];
+
+    int other_index = get_TCP_connection_index(shard->tcp_server, public_key);
+
+    if (other_index != -1) {
+        VLA(uint8_t, resp_packet, 1 + CRYPTO_PUBLIC_KEY_SIZE + length);
+        resp_packet[0] = TCP_PACKET_OOB_RECV;
+        memcpy(resp_packet + 1, con->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        memcpy(resp_packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, data, length);
+
+        TCP_Message msg = {0};
+        msg.type = TCP_MESSAGE_OOB;
+        msg.index = other_index;
+        memcpy(msg.public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        msg.data = resp_packet;
+        msg.length = SIZEOF_VLA(resp_packet);
+        send_message(shard, &msg);
+    }
+
+    return 0;
+}
+
+/* Remove connection with con_number from the connections array of the
+ * accepted connection at con_id.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int rm_connection_index(TCP_Shard *shard, uint32_t con_id, uint8_t con_number)
+{
+    if (con_number >= NUM_CLIENT_CONNECTIONS) {
+        return -1;
+    }
+
+    TCP_Secure_Conn *connection = &shard->accepted_connection_array[con_id].connections[con_number];
+
+    if (connection->status) {
+        if (connection->status == 2) {
+            TCP_Message msg = {0};
+            msg.type = TCP_MESSAGE_ROUTE_REMOVE;
+            msg.index = connection->index;
+            memcpy(msg.public_key, connection->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+            msg.con_number = connection->other_id;
+            msg.other_index = global_connection_index(shard, con_id);
+            msg.other_con_number = con_number;
+            send_message(shard, &msg);
+        }
+
+        remove_route(shard->tcp_server, &shard->accepted_connection_array[con_id], con_number);
+        connection->index = 0;
+        connection->other_id = 0;
+        connection->status = 0;
+        return 0;
+    }
+
+    return -1;
+}
+
+/* return the accepted connection with the given index if it is on shard and,
+ * unless public_key is NULL, belongs to public_key.
+ * return NULL otherwise.
+ */
+static TCP_Secure_Connection *message_connection(TCP_Shard *shard, uint32_t index, const uint8_t *public_key)
+{
+    index &= TCP_SHARD_INDEX_MASK;
+
+    if (index >= shard->size_accepted_connections) {
+        return nullptr;
+    }
+
+    TCP_Secure_Connection *con = &shard->accepted_connection_array[index];
+
+    if (con->status != TCP_STATUS_CONFIRMED) {
+        return nullptr;
+    }
+
+    if (public_key != nullptr && public_key_cmp(con->public_key, public_key) != 0) {
+        return nullptr;
+    }
+
+    return con;
+}
+
+/* Route the connection in msg to msg->other_index if it asked for it. */
+static void handle_route_message(TCP_Shard *shard, const TCP_Message *msg)
+{
+    TCP_Secure_Connection *con = message_connection(shard, msg->index, msg->public_key);
+
+    if (con == nullptr) {
+        return;
+    }
+
+    const int i = find_route(shard->tcp_server, con, msg->other_public_key);
+
+    if (i != -1) {
+        TCP_Secure_Conn *connection = &con->connections[i];
+
+        if (connection->status == 2 && connection->index == msg->other_index
+                && connection->other_id == msg->other_con_number) {
+            /* Both asked at the same time, and the other side already did this. */
+            return;
+        }
+
+        /* If still routed to an older connection with the same key, its
+         * remove message will not match anymore. */
+        connection->status = 2;
+        connection->index = msg->other_index;
+        connection->other_id = msg->other_con_number;
+        // TODO(irungentoo): return values?
+        send_connect_notification(con, i);
+
+        TCP_Message reply = {0};
+        reply.type = TCP_MESSAGE_ROUTE_CONFIRM;
+        reply.index = msg->other_index;
+        memcpy(reply.public_key, msg->other_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        reply.con_number = msg->other_con_number;
+        reply.other_index = global_connection_index(shard, (uint32_t)(con - shard->accepted_connection_array));
+        memcpy(reply.other_public_key, con->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        reply.other_con_number = i;
+        send_message(shard, &reply);
+        return;
+    }
+}
+
+/* Complete the route the connection in msg asked for. */
+static void handle_route_confirm_message(TCP_Shard *shard, const TCP_Message *msg)
+{
+    TCP_Secure_Connection *con = message_connection(shard, msg->index, msg->public_key);
+    TCP_Secure_Conn *connection = con == nullptr ? nullptr : &con->connections[msg->con_number];
+
+    if (connection != nullptr && public_key_cmp(connection->public_key, msg->other_public_key) == 0) {
+        if (connection->status == 1) {
+            connection->status = 2;
+            connection->index = msg->other_index;
+            connection->other_id = msg->other_con_number;
+            // TODO(irungentoo): return values?
+            send_connect_notification(con, msg->con_number);
+            return;
+        }
+
+        if (connection->status == 2 && connection->index == msg->other_index
+                && connection->other_id == msg->other_con_number) {
+            return;
+        }
+    }
+
+    /* The route was removed while the other side completed it. */
+    TCP_Message reply = {0};
+    reply.type = TCP_MESSAGE_ROUTE_REMOVE;
+    reply.index = msg->other_index;
+    memcpy(reply.public_key, msg->other_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    reply.con_number = msg->other_con_number;
+    reply.other_index = msg->index;
+    reply.other_con_number = msg->con_number;
+    send_message(shard, &reply);
+}
+
+static void handle_route_remove_message(TCP_Shard *shard, const TCP_Message *msg)
+{
+    TCP_Secure_Connection *con = message_connection(shard, msg->index, msg->public_key);
+
+    if (con == nullptr) {
+        return;
+    }
+
+    TCP_Secure_Conn *connection = &con->connections[msg->con_number];
+
+    if (connection->status != 2 || connection->index != msg->other_index
+            || connection->other_id != msg->other_con_number) {
+        return;
+    }
+
+    connection->other_id = 0;
+    connection->index = 0;
+    connection->status = 1;
+    // TODO(irungentoo): return values?
+    send_disconnect_notification(con, msg->con_number);
+}
+
+#ifdef TCP_SERVER_USE_EPOLL
+static void add_incoming(TCP_Shard *shard, Socket sock);
+static void handle_handshake_message(TCP_Shard *shard, const TCP_Message *msg);
+#endif
+
+static void handle_message(TCP_Shard *shard, const TCP_Message *msg)
+{
+    if (msg->con_number >= NUM_CLIENT_CONNECTIONS) {
+        return;
+    }
+
+    switch (msg->type) {
+        case TCP_MESSAGE_SOCKET: {
+#ifdef TCP_SERVER_USE_EPOLL
+            add_incoming(shard, msg->sock);
+#endif
+            break;
+        }
+
+        case TCP_MESSAGE_HANDSHAKE: {
+#ifdef TCP_SERVER_USE_EPOLL
+            handle_handshake_message(shard, msg);
+#endif
+            break;
+        }
+
+        case TCP_MESSAGE_KILL: {
+            if (message_connection(shard, msg->index, msg->public_key) != nullptr) {
+                kill_accepted(shard, msg->index & TCP_SHARD_INDEX_MASK);
+            }
+
+            break;
+        }
+
+        case TCP_MESSAGE_ROUTE: {
+            handle_route_message(shard, msg);
+            break;
+        }
+
+        case TCP_MESSAGE_ROUTE_CONFIRM: {
+            handle_route_confirm_message(shard, msg);
+            break;
+        }
+
+        case TCP_MESSAGE_ROUTE_REMOVE: {
+            handle_route_remove_message(shard, msg);
+            break;
+        }
+
+        case TCP_MESSAGE_DATA: {
+            TCP_Secure_Connection *con = message_connection(shard, msg->index, msg->public_key);
+
+            if (con == nullptr || con->connections[msg->con_number].status != 2
+                    || con->connections[msg->con_number].index != msg->other_index) {
+                break;
+            }
+
+            if (write_packet_TCP_secure_connection(con, msg->data, msg->length, 0) == -1) {
+                kill_accepted(shard, msg->index & TCP_SHARD_INDEX_MASK);
+            }
+
+            break;
+        }
+
+        case TCP_MESSAGE_OOB: {
+            TCP_Secure_Connection *con = message_connection(shard, msg->index, msg->public_key);
+
+            if (con != nullptr && write_packet_TCP_secure_connection(con, msg->data, msg->length, 0) == -1) {
+                kill_accepted(shard, msg->index & TCP_SHARD_INDEX_MASK);
+            }
+
+            break;
+        }
+
+        case TCP_MESSAGE_ONION_RESPONSE: {
+            TCP_Secure_Connection *con = message_connection(shard, msg->index, nullptr);
+
+            if (con != nullptr && con->identifier == msg->identifier
+                    && write_packet_TCP_secure_connection(con, msg->data, msg->length, 0) == -1) {
+                kill_accepted(shard, msg->index & TCP_SHARD_INDEX_MASK);
+            }
+
+            break;
+        }
+
+        case TCP_MESSAGE_ONION_REQUEST: {
+            // only handled by do_TCP_server()
+            break;
+        }
+    }
+}
+
+static void send_onion_request(const TCP_Server *tcp_server, const TCP_Message *msg)
+{
+    IP_Port source;
+    source.port = 0;  // dummy initialise
+    source.ip.family = net_family_tcp_onion;
+    source.ip.ip.v6.uint32[0] = msg->index;
+    source.ip.ip.v6.uint32[1] = 0;
+    source.ip.ip.v6.uint64[1] = msg->identifier;
+    onion_send_1(tcp_server->onion, msg->data + 1 + CRYPTO_NONCE_SIZE, msg->length - (1 + CRYPTO_NONCE_SIZE), source,
+                 msg->data + 1);
+}
+
+#ifdef TCP_SERVER_USE_EPOLL
+static void wake_queue(const TCP_Message_Queue *queue)
+{
+    const uint8_t byte = 0;
+    /* If the pipe is full the reader has a wakeup pending anyway. */
+    const ssize_t ret = write(queue->wake_fds[1], &byte, 1);
+    (void)ret;
+}
+
+static void drain_queue_wakeups(const TCP_Message_Queue *queue)
+{
+    uint8_t buf[64];
+
+    while (read(queue->wake_fds[0], buf, sizeof(buf)) > 0) {
+        continue;
+    }
+}
+
+static bool queue_init(TCP_Message_Queue *queue)
+{
+    if (pipe(queue->wake_fds) != 0) {
+        return false;
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        if (fcntl(queue->wake_fds[i], F_SETFL, O_NONBLOCK) != 0
+                || fcntl(queue->wake_fds[i], F_SETFD, FD_CLOEXEC) != 0) {
+            close(queue->wake_fds[0]);
+            close(queue->wake_fds[1]);
+            return false;
+        }
+    }
+
+    if (pthread_mutex_init(&queue->mutex, nullptr) != 0) {
+        close(queue->wake_fds[0]);
+        close(queue->wake_fds[1]);
+        return false;
+    }
+
+    queue->head = nullptr;
+    queue->tail = nullptr;
+    queue->size = 0;
+    queue->running = true;
+    return true;
+}
+
+static void free_messages(TCP_Message *msg)
+{
+    while (msg != nullptr) {
+        TCP_Message *next = msg->next;
+
+        if (msg->type == TCP_MESSAGE_SOCKET) {
+            kill_sock(msg->sock);
+        }
 
-    if ((unsigned int)len == SIZEOF_VLA(packet)) {
-        return 1;
+        free(msg);
+        msg = next;
     }
-
-    memcpy(con->last_packet, packet, SIZEOF_VLA(packet));
-    con->last_packet_length = SIZEOF_VLA(packet);
-    con->last_packet_sent = len;
-    return 1;
 }
 
-/* Kill a TCP_Secure_Connection
- */
-static void kill_TCP_secure_connection(TCP_Secure_Connection *con)
+static void queue_kill(TCP_Message_Queue *queue)
 {
-    kill_sock(con->sock);
-    wipe_secure_connection(con);
+    free_messages(queue->head);
+    pthread_mutex_destroy(&queue->mutex);
+    close(queue->wake_fds[0]);
+    close(queue->wake_fds[1]);
 }
 
-static int rm_connection_index(TCP_Server *tcp_server, TCP_Secure_Connection *con, uint8_t con_number);
+static bool message_is_droppable(TCP_Message_Type type)
+{
+    return type == TCP_MESSAGE_DATA || type == TCP_MESSAGE_OOB || type == TCP_MESSAGE_ONION_RESPONSE
+           || type == TCP_MESSAGE_ONION_REQUEST;
+}
 
-/* Kill an accepted TCP_Secure_Connection
- *
- * return -1 on failure.
- * return 0 on success.
+/* return a copy of msg with its data stored right after it.
+ * return NULL on allocation failure.
  */
-static int kill_accepted(TCP_Server *tcp_server, int index)
+static TCP_Message *copy_message(const TCP_Message *msg)
 {
-    if ((uint32_t)index >= tcp_server->size_accepted_connections) {
-        return -1;
-    }
-
-    uint32_t i;
+    TCP_Message *copy = (TCP_Message *)malloc(sizeof(TCP_Message) + msg->length);
 
-    for (i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
-        rm_connection_index(tcp_server, &tcp_server->accepted_connection_array[index], i);
+    if (copy == nullptr) {
+        return nullptr;
     }
 
-    Socket sock = tcp_server->accepted_connection_array[index].sock;
+    memcpy(copy, msg, sizeof(TCP_Message));
+    copy->next = nullptr;
 
-    if (del_accepted(tcp_server, index) != 0) {
-        return -1;
+    if (msg->length != 0) {
+        memcpy(copy + 1, msg->data, msg->length);
+        copy->data = (const uint8_t *)(copy + 1);
     }
 
-    kill_sock(sock);
-    return 0;
+    return copy;
 }
 
-/* return 1 if everything went well.
- * return -1 if the connection must be killed.
+/* Queue a copy of msg and its data.
+ *
+ * return true on success.
+ * return false if the queue is full or on allocation failure.
  */
-static int handle_TCP_handshake(TCP_Secure_Connection *con, const uint8_t *data, uint16_t length,
-                                const uint8_t *self_secret_key)
+static bool queue_push(TCP_Message_Queue *queue, const TCP_Message *msg)
 {
-    if (length != TCP_CLIENT_HANDSHAKE_SIZE) {
-        return -1;
-    }
+    TCP_Message *copy = copy_message(msg);
 
-    if (con->status != TCP_STATUS_CONNECTED) {
-        return -1;
-    }
-
-    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    encrypt_precompute(data, self_secret_key, shared_key);
-    uint8_t plain[TCP_HANDSHAKE_PLAIN_SIZE];
-    int len = decrypt_data_symmetric(shared_key, data + CRYPTO_PUBLIC_KEY_SIZE,
-                                     data + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE, TCP_HANDSHAKE_PLAIN_SIZE + CRYPTO_MAC_SIZE, plain);
-
-    if (len != TCP_HANDSHAKE_PLAIN_SIZE) {
-        return -1;
+    if (copy == nullptr) {
+        return false;
     }
 
-    memcpy(con->public_key, data, CRYPTO_PUBLIC_KEY_SIZE);
-    uint8_t temp_secret_key[CRYPTO_SECRET_KEY_SIZE];
-    uint8_t resp_plain[TCP_HANDSHAKE_PLAIN_SIZE];
-    crypto_new_keypair(resp_plain, temp_secret_key);
-    random_nonce(con->sent_nonce);
-    memcpy(resp_plain + CRYPTO_PUBLIC_KEY_SIZE, con->sent_nonce, CRYPTO_NONCE_SIZE);
-    memcpy(con->recv_nonce, plain + CRYPTO_PUBLIC_KEY_SIZE, CRYPTO_NONCE_SIZE);
-
-    uint8_t response[TCP_SERVER_HANDSHAKE_SIZE];
-    random_nonce(response);
-
-    len = encrypt_data_symmetric(shared_key, response, resp_plain, TCP_HANDSHAKE_PLAIN_SIZE,
-                                 response + CRYPTO_NONCE_SIZE);
+    pthread_mutex_lock(&queue->mutex);
 
-    if (len != TCP_HANDSHAKE_PLAIN_SIZE + CRYPTO_MAC_SIZE) {
-        return -1;
+    if (queue->size >= TCP_MAX_QUEUED_MESSAGES && message_is_droppable(msg->type)) {
+        pthread_mutex_unlock(&queue->mutex);
+        free(copy);
+        return false;
     }
 
-    if (TCP_SERVER_HANDSHAKE_SIZE != net_send(con->sock, response, TCP_SERVER_HANDSHAKE_SIZE)) {
-        return -1;
+    if (queue->tail != nullptr) {
+        queue->tail->next = copy;
+    } else {
+        queue->head = copy;
+        wake_queue(queue);
     }
 
-    encrypt_precompute(plain, temp_secret_key, con->shared_key);
-    con->status = TCP_STATUS_UNCONFIRMED;
-    return 1;
+    queue->tail = copy;
+    ++queue->size;
+    pthread_mutex_unlock(&queue->mutex);
+    return true;
 }
 
-/* return 1 if connection handshake was handled correctly.
- * return 0 if we didn't get it yet.
- * return -1 if the connection must be killed.
- */
-static int read_connection_handshake(TCP_Secure_Connection *con, const uint8_t *self_secret_key)
+/* return all queued messages, oldest first. */
+static TCP_Message *queue_take(TCP_Message_Queue *queue)
 {
-    uint8_t data[TCP_CLIENT_HANDSHAKE_SIZE];
-    const int len = read_TCP_packet(con->sock, data, TCP_CLIENT_HANDSHAKE_SIZE);
+    drain_queue_wakeups(queue);
 
-    if (len != -1) {
-        return handle_TCP_handshake(con, data, len, self_secret_key);
-    }
+    pthread_mutex_lock(&queue->mutex);
+    TCP_Message *const head = queue->head;
+    queue->head = nullptr;
+    queue->tail = nullptr;
+    queue->size = 0;
+    pthread_mutex_unlock(&queue->mutex);
 
-    return 0;
+    return head;
 }
 
-/* return 1 on success.
- * return 0 if could not send packet.
- * return -1 on failure (connection must be killed).
- */
-static int send_routing_response(TCP_Secure_Connection *con, uint8_t rpid, const uint8_t *public_key)
+static bool queue_running(TCP_Message_Queue *queue)
 {
-    uint8_t data[1 + 1 + CRYPTO_PUBLIC_KEY_SIZE];
-    data[0] = TCP_PACKET_ROUTING_RESPONSE;
-    data[1] = rpid;
-    memcpy(data + 2, public_key, CRYPTO_PUBLIC_KEY_SIZE);
-
-    return write_packet_TCP_secure_connection(con, data, sizeof(data), 1);
+    pthread_mutex_lock(&queue->mutex);
+    const bool running = queue->running;
+    pthread_mutex_unlock(&queue->mutex);
+    return running;
 }
 
-/* return 1 on success.
- * return 0 if could not send packet.
- * return -1 on failure (connection must be killed).
- */
-static int send_connect_notification(TCP_Secure_Connection *con, uint8_t id)
+static void queue_stop(TCP_Message_Queue *queue)
 {
-    uint8_t data[2] = {TCP_PACKET_CONNECTION_NOTIFICATION, (uint8_t)(id + NUM_RESERVED_PORTS)};
-    return write_packet_TCP_secure_connection(con, data, sizeof(data), 1);
+    pthread_mutex_lock(&queue->mutex);
+    queue->running = false;
+    wake_queue(queue);
+    pthread_mutex_unlock(&queue->mutex);
 }
 
-/* return 1 on success.
- * return 0 if could not send packet.
- * return -1 on failure (connection must be killed).
- */
-static int send_disconnect_notification(TCP_Secure_Connection *con, uint8_t id)
+static bool init_handshake_pool(TCP_Handshake_Pool *pool)
 {
-    uint8_t data[2] = {TCP_PACKET_DISCONNECT_NOTIFICATION, (uint8_t)(id + NUM_RESERVED_PORTS)};
-    return write_packet_TCP_secure_connection(con, data, sizeof(data), 1);
+    if (pthread_mutex_init(&pool->mutex, nullptr) != 0) {
+        return false;
+    }
+
+    if (pthread_cond_init(&pool->cond, nullptr) != 0) {
+        pthread_mutex_destroy(&pool->mutex);
+        return false;
+    }
+
+    return true;
 }
 
-/* return 0 on success.
- * return -1 on failure (connection must be killed).
+/* Queue a copy of the handshake packet in msg, which the incoming connection
+ * at index i of shard sent, for the handshake workers.
+ *
+ * return 1 on success.
+ * return 0 if there are no handshake workers or on allocation failure.
+ * return -1 if the shard has too many handshakes queued already.
  */
-static int handle_TCP_routing_req(TCP_Server *tcp_server, uint32_t con_id, const uint8_t *public_key)
+static int handshake_pool_push(TCP_Handshake_Pool *pool, TCP_Shard *shard, uint32_t i, const TCP_Message *msg)
 {
-    uint32_t i;
-    uint32_t index = ~0;
-    TCP_Secure_Connection *con = &tcp_server->accepted_connection_array[con_id];
-
-    /* If person tries to cennect to himself we deny the request*/
-    if (public_key_cmp(con->public_key, public_key) == 0) {
-        if (send_routing_response(con, 0, public_key) == -1) {
-            return -1;
-        }
+    pthread_mutex_lock(&pool->mutex);
 
+    if (!pool->running) {
+        pthread_mutex_unlock(&pool->mutex);
         return 0;
     }
 
-    for (i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
-        if (con->connections[i].status != 0) {
-            if (public_key_cmp(public_key, con->connections[i].public_key) == 0) {
-                if (send_routing_response(con, i + NUM_RESERVED_PORTS, public_key) == -1) {
-                    return -1;
-                }
-
-                return 0;
-            }
-        } else if (index == (uint32_t)~0) {
-            index = i;
-        }
+    if (shard->num_pending_handshakes >= TCP_SERVER_MAX_PENDING_HANDSHAKES
+            || pool->size >= TCP_SERVER_MAX_PENDING_HANDSHAKES * shard->tcp_server->num_shards) {
+        pthread_mutex_unlock(&pool->mutex);
+        return -1;
     }
 
-    if (index == (uint32_t)~0) {
-        if (send_routing_response(con, 0, public_key) == -1) {
-            return -1;
-        }
+    TCP_Message *copy = copy_message(msg);
 
+    if (copy == nullptr) {
+        pthread_mutex_unlock(&pool->mutex);
         return 0;
     }
 
-    int ret = send_routing_response(con, index + NUM_RESERVED_PORTS, public_key);
+    shard->handshake_ids[i] = msg->identifier;
+    ++shard->num_pending_handshakes;
+    ++pool->size;
 
-    if (ret == 0) {
-        return 0;
+    if (pool->tail != nullptr) {
+        pool->tail->next = copy;
+    } else {
+        pool->head = copy;
     }
 
-    if (ret == -1) {
-        return -1;
-    }
+    pool->tail = copy;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    return 1;
+}
+
+/* Wait for the next queued handshake packet whose connection is still
+ * waiting for it. The others are dropped without computing them.
+ *
+ * return NULL once the pool stops running.
+ */
+static TCP_Message *handshake_pool_take(TCP_Server *tcp_server)
+{
+    TCP_Handshake_Pool *pool = &tcp_server->handshake_pool;
+    TCP_Message *msg = nullptr;
 
-    con->connections[index].status = 1;
-    memcpy(con->connections[index].public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
-    int other_index = get_TCP_connection_index(tcp_server, public_key);
+    pthread_mutex_lock(&pool->mutex);
 
-    if (other_index != -1) {
-        uint32_t other_id = ~0;
-        TCP_Secure_Connection *other_conn = &tcp_server->accepted_connection_array[other_index];
+    while (pool->running) {
+        if (pool->head == nullptr) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+            continue;
+        }
 
-        for (i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
-            if (other_conn->connections[i].status == 1
-                    && public_key_cmp(other_conn->connections[i].public_key, con->public_key) == 0) {
-                other_id = i;
-                break;
-            }
+        msg = pool->head;
+        pool->head = msg->next;
+        --pool->size;
+
+        if (pool->head == nullptr) {
+            pool->tail = nullptr;
         }
 
-        if (other_id != (uint32_t)~0) {
-            con->connections[index].status = 2;
-            con->connections[index].index = other_index;
-            con->connections[index].other_id = other_id;
-            other_conn->connections[other_id].status = 2;
-            other_conn->connections[other_id].index = con_id;
-            other_conn->connections[other_id].other_id = index;
-            // TODO(irungentoo): return values?
-            send_connect_notification(con, index);
-            send_connect_notification(other_conn, other_id);
+        const TCP_Shard *shard = connection_shard(tcp_server, msg->index);
+
+        if (shard != nullptr && shard->handshake_ids[msg->index & TCP_SHARD_INDEX_MASK] == msg->identifier) {
+            break;
         }
+
+        free(msg);
+        msg = nullptr;
     }
 
-    return 0;
+    pthread_mutex_unlock(&pool->mutex);
+    return msg;
 }
 
-/* return 0 on success.
- * return -1 on failure (connection must be killed).
- */
-static int handle_TCP_oob_send(TCP_Server *tcp_server, uint32_t con_id, const uint8_t *public_key, const uint8_t *data,
-                               uint16_t length)
+static void *tcp_handshake_thread(void *arg)
 {
-    if (length == 0 || length > TCP_MAX_OOB_DATA_LENGTH) {
-        return -1;
-    }
+    TCP_Server *const tcp_server = (TCP_Server *)arg;
+    TCP_Message *msg;
 
-    TCP_Secure_Connection *con = &tcp_server->accepted_connection_array[con_id];
+    while ((msg = handshake_pool_take(tcp_server)) != nullptr) {
+        TCP_Handshake handshake;
+        handshake.ok = compute_TCP_handshake(&handshake, msg->data, tcp_server->secret_key);
 
-    int other_index = get_TCP_connection_index(tcp_server, public_key);
+        TCP_Message done = *msg;
+        done.next = nullptr;
+        done.data = (const uint8_t *)&handshake;
+        done.length = sizeof(handshake);
 
-    if (other_index != -1) {
-        VLA(uint8_t, resp_packet, 1 + CRYPTO_PUBLIC_KEY_SIZE + length);
-        resp_packet[0] = TCP_PACKET_OOB_RECV;
-        memcpy(resp_packet + 1, con->public_key, CRYPTO_PUBLIC_KEY_SIZE);
-        memcpy(resp_packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, data, length);
-        write_packet_TCP_secure_connection(&tcp_server->accepted_connection_array[other_index], resp_packet,
-                                           SIZEOF_VLA(resp_packet), 0);
+        TCP_Shard *shard = connection_shard(tcp_server, msg->index);
+
+        if (shard != nullptr) {
+            queue_push(&shard->queue, &done);
+        }
+
+        crypto_memzero(&handshake, sizeof(handshake));
+        free(msg);
     }
 
-    return 0;
+    return nullptr;
 }
 
-/* Remove connection with con_number from the connections array of con.
- *
- * return -1 on failure.
- * return 0 on success.
- */
-static int rm_connection_index(TCP_Server *tcp_server, TCP_Secure_Connection *con, uint8_t con_number)
+/* Stop the handshake workers and drop the handshakes they didn't get to. */
+static void stop_handshake_workers(TCP_Handshake_Pool *pool)
 {
-    if (con_number >= NUM_CLIENT_CONNECTIONS) {
-        return -1;
+    pthread_mutex_lock(&pool->mutex);
+    pool->running = false;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (uint32_t i = 0; i < pool->num_threads; ++i) {
+        pthread_join(pool->threads[i], nullptr);
     }
 
-    if (con->connections[con_number].status) {
-        uint32_t index = con->connections[con_number].index;
-        uint8_t other_id = con->connections[con_number].other_id;
+    pool->num_threads = 0;
+    free_messages(pool->head);
+    pool->head = nullptr;
+    pool->tail = nullptr;
+    pool->size = 0;
+}
+#endif
 
-        if (con->connections[con_number].status == 2) {
+/* Handle msg on the shard owning msg->index, right away if that is shard
+ * itself. Onion requests go to the thread calling do_TCP_server().
+ */
+static void send_message(TCP_Shard *shard, const TCP_Message *msg)
+{
+    TCP_Server *tcp_server = shard->tcp_server;
 
-            if (index >= tcp_server->size_accepted_connections) {
-                return -1;
-            }
+    if (msg->type == TCP_MESSAGE_ONION_REQUEST) {
+#ifdef TCP_SERVER_USE_EPOLL
 
-            tcp_server->accepted_connection_array[index].connections[other_id].other_id = 0;
-            tcp_server->accepted_connection_array[index].connections[other_id].index = 0;
-            tcp_server->accepted_connection_array[index].connections[other_id].status = 1;
-            // TODO(irungentoo): return values?
-            send_disconnect_notification(&tcp_server->accepted_connection_array[index], other_id);
+        if (tcp_server->workers_running) {
+            queue_push(&tcp_server->onion_queue, msg);
+            return;
         }
 
-        con->connections[con_number].index = 0;
-        con->connections[con_number].other_id = 0;
-        con->connections[con_number].status = 0;
-        return 0;
+#endif
+        send_onion_request(tcp_server, msg);
+        return;
     }
 
-    return -1;
+    TCP_Shard *target = connection_shard(tcp_server, msg->index);
+
+    if (target == shard) {
+        handle_message(shard, msg);
+        return;
+    }
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (target != nullptr && !queue_push(&target->queue, msg) && msg->type == TCP_MESSAGE_SOCKET) {
+        kill_sock(msg->sock);
+    }
+
+#endif
 }
 
 static int handle_onion_recv_1(void *object, IP_Port dest, const uint8_t *data, uint16_t length)
 {
     TCP_Server *tcp_server = (TCP_Server *)object;
-    uint32_t index = dest.ip.ip.v6.uint32[0];
+    const uint32_t index = dest.ip.ip.v6.uint32[0];
+    TCP_Shard *shard = connection_shard(tcp_server, index);
 
-    if (index >= tcp_server->size_accepted_connections) {
-        return 1;
-    }
-
-    TCP_Secure_Connection *con = &tcp_server->accepted_connection_array[index];
-
-    if (con->identifier != dest.ip.ip.v6.uint64[1]) {
+    if (shard == nullptr) {
         return 1;
     }
 
@@ -842,6 +1819,27 @@ static int handle_onion_recv_1(void *object, IP_Port dest, const uint8_t *data,
     memcpy(packet + 1, data, length);
     packet[0] = TCP_PACKET_ONION_RESPONSE;
 
+    TCP_Message msg = {0};
+    msg.type = TCP_MESSAGE_ONION_RESPONSE;
+    msg.index = index;
+    msg.identifier = dest.ip.ip.v6.uint64[1];
+    msg.data = packet;
+    msg.length = SIZEOF_VLA(packet);
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (tcp_server->workers_running) {
+        return queue_push(&shard->queue, &msg) ? 0 : 1;
+    }
+
+#endif
+
+    TCP_Secure_Connection *con = message_connection(shard, index, nullptr);
+
+    if (con == nullptr || con->identifier != msg.identifier) {
+        return 1;
+    }
+
     if (write_packet_TCP_secure_connection(con, packet, SIZEOF_VLA(packet), 0) != 1) {
         return 1;
     }
@@ -852,13 +1850,13 @@ static int handle_onion_recv_1(void *object, IP_Port dest, const uint8_t *data,
 /* return 0 on success
  * return -1 on failure
  */
-static int handle_TCP_packet(TCP_Server *tcp_server, uint32_t con_id, const uint8_t *data, uint16_t length)
+static int handle_TCP_packet(TCP_Shard *shard, uint32_t con_id, const uint8_t *data, uint16_t length)
 {
     if (length == 0) {
         return -1;
     }
 
-    TCP_Secure_Connection *con = &tcp_server->accepted_connection_array[con_id];
+    TCP_Secure_Connection *con = &shard->accepted_connection_array[con_id];
 
     switch (data[0]) {
         case TCP_PACKET_ROUTING_REQUEST: {
@@ -866,7 +1864,7 @@ static int handle_TCP_packet(TCP_Server *tcp_server, uint32_t con_id, const uint
                 return -1;
             }
 
-            return handle_TCP_routing_req(tcp_server, con_id, data + 1);
+            return handle_TCP_routing_req(shard, con_id, data + 1);
         }
 
         case TCP_PACKET_CONNECTION_NOTIFICATION: {
@@ -882,7 +1880,7 @@ static int handle_TCP_packet(TCP_Server *tcp_server, uint32_t con_id, const uint
                 return -1;
             }
 
-            return rm_connection_index(tcp_server, con, data[1] - NUM_RESERVED_PORTS);
+            return rm_connection_index(shard, con_id, data[1] - NUM_RESERVED_PORTS);
         }
 
         case TCP_PACKET_PING: {
@@ -921,24 +1919,23 @@ static int handle_TCP_packet(TCP_Server *tcp_server, uint32_t con_id, const uint
                 return -1;
             }
 
-            return handle_TCP_oob_send(tcp_server, con_id, data + 1, data + 1 + CRYPTO_PUBLIC_KEY_SIZE,
+            return handle_TCP_oob_send(shard, con_id, data + 1, data + 1 + CRYPTO_PUBLIC_KEY_SIZE,
                                        length - (1 + CRYPTO_PUBLIC_KEY_SIZE));
         }
 
         case TCP_PACKET_ONION_REQUEST: {
-            if (tcp_server->onion) {
+            if (shard->tcp_server->onion) {
                 if (length <= 1 + CRYPTO_NONCE_SIZE + ONION_SEND_BASE * 2) {
                     return -1;
                 }
 
-                IP_Port source;
-                source.port = 0;  // dummy initialise
-                source.ip.family = net_family_tcp_onion;
-                source.ip.ip.v6.uint32[0] = con_id;
-                source.ip.ip.v6.uint32[1] = 0;
-                source.ip.ip.v6.uint64[1] = con->identifier;
-                onion_send_1(tcp_server->onion, data + 1 + CRYPTO_NONCE_SIZE, length - (1 + CRYPTO_NONCE_SIZE), source,
-                             data + 1);
+                TCP_Message msg = {0};
+                msg.type = TCP_MESSAGE_ONION_REQUEST;
+                msg.index = global_connection_index(shard, con_id);
+                msg.identifier = con->identifier;
+                msg.data = data;
+                msg.length = length;
+                send_message(shard, &msg);
             }
 
             return 0;
@@ -967,17 +1964,19 @@ static int handle_TCP_packet(TCP_Server *tcp_server, uint32_t con_id, const uint
                 return 0;
             }
 
-            uint32_t index = con->connections[c_id].index;
-            uint8_t other_c_id = con->connections[c_id].other_id + NUM_RESERVED_PORTS;
             VLA(uint8_t, new_data, length);
             memcpy(new_data, data, length);
-            new_data[0] = other_c_id;
-            int ret = write_packet_TCP_secure_connection(&tcp_server->accepted_connection_array[index], new_data, length, 0);
-
-            if (ret == -1) {
-                return -1;
-            }
-
+            new_data[0] = con->connections[c_id].other_id + NUM_RESERVED_PORTS;
+
+            TCP_Message msg = {0};
+            msg.type = TCP_MESSAGE_DATA;
+            msg.index = con->connections[c_id].index;
+            memcpy(msg.public_key, con->connections[c_id].public_key, CRYPTO_PUBLIC_KEY_SIZE);
+            msg.con_number = con->connections[c_id].other_id;
+            msg.other_index = global_connection_index(shard, con_id);
+            msg.data = new_data;
+            msg.length = length;
+            send_message(shard, &msg);
             return 0;
         }
     }
@@ -986,11 +1985,11 @@ static int handle_TCP_packet(TCP_Server *tcp_server, uint32_t con_id, const uint
 }
 
 
-static int confirm_TCP_connection(TCP_Server *tcp_server, const Mono_Time *mono_time, TCP_Secure_Connection *con,
+static int confirm_TCP_connection(TCP_Shard *shard, const Mono_Time *mono_time, TCP_Secure_Connection *con,
                                   const uint8_t *data,
                                   uint16_t length)
 {
-    int index = add_accepted(tcp_server, mono_time, con);
+    int index = add_accepted(shard, mono_time, con);
 
     if (index == -1) {
         kill_TCP_secure_connection(con);
@@ -999,8 +1998,8 @@ static int confirm_TCP_connection(TCP_Server *tcp_server, const Mono_Time *mono_
 
     wipe_secure_connection(con);
 
-    if (handle_TCP_packet(tcp_server, index, data, length) == -1) {
-        kill_accepted(tcp_server, index);
+    if (handle_TCP_packet(shard, index, data, length) == -1) {
+        kill_accepted(shard, index);
         return -1;
     }
 
@@ -1010,7 +2009,7 @@ static int confirm_TCP_connection(TCP_Server *tcp_server, const Mono_Time *mono_
 /* return index on success
  * return -1 on failure
  */
-static int accept_connection(TCP_Server *tcp_server, Socket sock)
+static int accept_connection(TCP_Shard *shard, Socket sock)
 {
     if (!sock_valid(sock)) {
         return -1;
@@ -1026,19 +2025,20 @@ static int accept_connection(TCP_Server *tcp_server, Socket sock)
         return -1;
     }
 
-    uint16_t index = tcp_server->incoming_connection_queue_index % MAX_INCOMING_CONNECTIONS;
+    uint16_t index = shard->incoming_connection_queue_index % MAX_INCOMING_CONNECTIONS;
 
-    TCP_Secure_Connection *conn = &tcp_server->incoming_connection_queue[index];
+    TCP_Secure_Connection *conn = &shard->incoming_connection_queue[index];
 
     if (conn->status != TCP_STATUS_NO_STATUS) {
-        kill_TCP_secure_connection(conn);
+        kill_incoming(shard, index);
     }
 
     conn->status = TCP_STATUS_CONNECTED;
     conn->sock = sock;
-    conn->next_packet_length = 0;
+    conn->recv_buffer.start = 0;
+    conn->recv_buffer.end = 0;
 
-    ++tcp_server->incoming_connection_queue_index;
+    ++shard->incoming_connection_queue_index;
     return index;
 }
 
@@ -1070,6 +2070,71 @@ static Socket new_listening_TCP_socket(Family family, uint16_t port)
     return sock;
 }
 
+static TCP_Shard *new_TCP_shard(TCP_Server *tcp_server, uint32_t id)
+{
+    TCP_Shard *shard = (TCP_Shard *)calloc(1, sizeof(TCP_Shard));
+
+    if (shard == nullptr) {
+        return nullptr;
+    }
+
+    shard->tcp_server = tcp_server;
+    shard->id = id;
+    shard->next_shard = id;
+
+#ifdef TCP_SERVER_USE_EPOLL
+    shard->efd = epoll_create(8);
+
+    if (shard->efd == -1) {
+        free(shard);
+        return nullptr;
+    }
+
+#endif
+
+    return shard;
+}
+
+static void kill_TCP_shard(TCP_Shard *shard)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+    close(shard->efd);
+#endif
+
+    for (uint32_t i = 0; i < MAX_INCOMING_CONNECTIONS; ++i) {
+        wipe_secure_connection(&shard->incoming_connection_queue[i]);
+        wipe_secure_connection(&shard->unconfirmed_connection_queue[i]);
+    }
+
+    free_accepted_connection_array(shard);
+    free(shard);
+}
+
+#ifdef TCP_SERVER_USE_EPOLL
+/* Add the listening sockets to the epoll set of shard.
+ *
+ * return the number of sockets added.
+ */
+static uint32_t shard_listen(TCP_Shard *shard, const Socket *socks, uint32_t num_socks)
+{
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < num_socks; ++i) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = socks[i].socket | ((uint64_t)TCP_SOCKET_LISTENING << 32);
+
+        if (epoll_ctl(shard->efd, EPOLL_CTL_ADD, socks[i].socket, &ev) == -1) {
+            continue;
+        }
+
+        ++count;
+    }
+
+    return count;
+}
+#endif
+
 TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports, const uint8_t *secret_key,
                            Onion *onion)
 {
@@ -1088,16 +2153,31 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
     }
 
     temp->socks_listening = (Socket *)calloc(num_sockets, sizeof(Socket));
+    temp->accepted_key_map = pk_map_new();
+
+    if (temp->socks_listening == nullptr || temp->accepted_key_map == nullptr) {
+        pk_map_kill(temp->accepted_key_map);
+        free(temp->socks_listening);
+        free(temp);
+        return nullptr;
+    }
+
+    temp->shards[0] = new_TCP_shard(temp, 0);
 
-    if (temp->socks_listening == nullptr) {
+    if (temp->shards[0] == nullptr) {
+        pk_map_kill(temp->accepted_key_map);
+        free(temp->socks_listening);
         free(temp);
         return nullptr;
     }
 
+    temp->num_shards = 1;
+
 #ifdef TCP_SERVER_USE_EPOLL
-    temp->efd = epoll_create(8);
 
-    if (temp->efd == -1) {
+    if (!init_handshake_pool(&temp->handshake_pool)) {
+        kill_TCP_shard(temp->shards[0]);
+        pk_map_kill(temp->accepted_key_map);
         free(temp->socks_listening);
         free(temp);
         return nullptr;
@@ -1108,19 +2188,14 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
     const Family family = ipv6_enabled ? net_family_ipv6 : net_family_ipv4;
 
     uint32_t i;
-#ifdef TCP_SERVER_USE_EPOLL
-    struct epoll_event ev;
-#endif
 
     for (i = 0; i < num_sockets; ++i) {
         Socket sock = new_listening_TCP_socket(family, ports[i]);
 
         if (sock_valid(sock)) {
 #ifdef TCP_SERVER_USE_EPOLL
-            ev.events = EPOLLIN | EPOLLET;
-            ev.data.u64 = sock.socket | ((uint64_t)TCP_SOCKET_LISTENING << 32);
 
-            if (epoll_ctl(temp->efd, EPOLL_CTL_ADD, sock.socket, &ev) == -1) {
+            if (shard_listen(temp->shards[0], &sock, 1) == 0) {
                 continue;
             }
 
@@ -1129,9 +2204,19 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
             temp->socks_listening[temp->num_listening_socks] = sock;
             ++temp->num_listening_socks;
         }
-    }
+    }
+
+    if (temp->num_listening_socks == 0 || pthread_mutex_init(&temp->key_list_mutex, nullptr) != 0) {
+        for (i = 0; i < temp->num_listening_socks; ++i) {
+            kill_sock(temp->socks_listening[i]);
+        }
 
-    if (temp->num_listening_socks == 0) {
+        kill_TCP_shard(temp->shards[0]);
+#ifdef TCP_SERVER_USE_EPOLL
+        pthread_cond_destroy(&temp->handshake_pool.cond);
+        pthread_mutex_destroy(&temp->handshake_pool.mutex);
+#endif
+        pk_map_kill(temp->accepted_key_map);
         free(temp->socks_listening);
         free(temp);
         return nullptr;
@@ -1144,65 +2229,134 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
 
     memcpy(temp->secret_key, secret_key, CRYPTO_SECRET_KEY_SIZE);
     crypto_derive_public_key(temp->public_key, temp->secret_key);
-
-    bs_list_init(&temp->accepted_key_list, CRYPTO_PUBLIC_KEY_SIZE, 8);
+    temp->route_hash_seed[0] = random_u64();
+    temp->route_hash_seed[1] = random_u64();
 
     return temp;
 }
 
 #ifndef TCP_SERVER_USE_EPOLL
-static void do_TCP_accept_new(TCP_Server *tcp_server)
+static void do_TCP_accept_new(TCP_Shard *shard)
 {
     uint32_t i;
 
-    for (i = 0; i < tcp_server->num_listening_socks; ++i) {
+    for (i = 0; i < shard->tcp_server->num_listening_socks; ++i) {
         Socket sock;
 
         do {
-            sock = net_accept(tcp_server->socks_listening[i]);
-        } while (accept_connection(tcp_server, sock) != -1);
+            sock = net_accept(shard->tcp_server->socks_listening[i]);
+        } while (accept_connection(shard, sock) != -1);
+    }
+}
+#endif
+
+/* Move the incoming connection at index i, whose handshake is done, to the
+ * unconfirmed connections.
+ *
+ * return its index there.
+ */
+static int move_to_unconfirmed(TCP_Shard *shard, uint32_t i)
+{
+    int index_new = shard->unconfirmed_connection_queue_index % MAX_INCOMING_CONNECTIONS;
+    TCP_Secure_Connection *conn_old = &shard->incoming_connection_queue[i];
+    TCP_Secure_Connection *conn_new = &shard->unconfirmed_connection_queue[index_new];
+
+    if (conn_new->status != TCP_STATUS_NO_STATUS) {
+        kill_TCP_secure_connection(conn_new);
+    }
+
+    move_secure_connection(conn_new, conn_old);
+    ++shard->unconfirmed_connection_queue_index;
+
+    return index_new;
+}
+
+#ifdef TCP_SERVER_USE_EPOLL
+/* Hand the handshake packet of the incoming connection at index i to the
+ * handshake workers.
+ *
+ * return 1 on success.
+ * return 0 if the handshake must be handled right away.
+ * return -1 if the connection must be killed because too many handshakes
+ *   are waiting for the workers.
+ */
+static int queue_handshake(TCP_Shard *shard, uint32_t i, const uint8_t *data, uint16_t length)
+{
+    if (length != TCP_CLIENT_HANDSHAKE_SIZE) {
+        return 0;
+    }
+
+    TCP_Message msg = {0};
+    msg.type = TCP_MESSAGE_HANDSHAKE;
+    msg.index = global_connection_index(shard, i);
+    msg.identifier = ++shard->counter;
+    msg.data = data;
+    msg.length = length;
+
+    const int ret = handshake_pool_push(&shard->tcp_server->handshake_pool, shard, i, &msg);
+
+    if (ret != 1) {
+        return ret;
     }
+
+    TCP_Secure_Connection *con = &shard->incoming_connection_queue[i];
+    con->identifier = msg.identifier;
+    con->handshake_pending = true;
+    return 1;
 }
 #endif
 
-static int do_incoming(TCP_Server *tcp_server, uint32_t i)
+/* return the index of the connection among the unconfirmed connections if its
+ * handshake was handled.
+ * return -1 otherwise.
+ */
+static int do_incoming(TCP_Shard *shard, uint32_t i)
 {
-    if (tcp_server->incoming_connection_queue[i].status != TCP_STATUS_CONNECTED) {
+    TCP_Secure_Connection *con = &shard->incoming_connection_queue[i];
+
+    if (con->status != TCP_STATUS_CONNECTED || con->handshake_pending) {
+        return -1;
+    }
+
+    uint8_t data[TCP_CLIENT_HANDSHAKE_SIZE];
+    const int len = read_TCP_packet(con->sock, data, TCP_CLIENT_HANDSHAKE_SIZE);
+
+    if (len == -1) {
         return -1;
     }
 
-    int ret = read_connection_handshake(&tcp_server->incoming_connection_queue[i], tcp_server->secret_key);
+#ifdef TCP_SERVER_USE_EPOLL
+    const int queued = queue_handshake(shard, i, data, len);
 
-    if (ret == -1) {
-        kill_TCP_secure_connection(&tcp_server->incoming_connection_queue[i]);
-    } else if (ret == 1) {
-        int index_new = tcp_server->unconfirmed_connection_queue_index % MAX_INCOMING_CONNECTIONS;
-        TCP_Secure_Connection *conn_old = &tcp_server->incoming_connection_queue[i];
-        TCP_Secure_Connection *conn_new = &tcp_server->unconfirmed_connection_queue[index_new];
-
-        if (conn_new->status != TCP_STATUS_NO_STATUS) {
-            kill_TCP_secure_connection(conn_new);
-        }
+    if (queued == -1) {
+        kill_TCP_secure_connection(con);
+        return -1;
+    }
 
-        move_secure_connection(conn_new, conn_old);
-        ++tcp_server->unconfirmed_connection_queue_index;
+    if (queued == 1) {
+        return -1;
+    }
+
+#endif
 
-        return index_new;
+    if (handle_TCP_handshake(con, data, len, shard->tcp_server->secret_key) == -1) {
+        kill_TCP_secure_connection(con);
+        return -1;
     }
 
-    return -1;
+    return move_to_unconfirmed(shard, i);
 }
 
-static int do_unconfirmed(TCP_Server *tcp_server, const Mono_Time *mono_time, uint32_t i)
+static int do_unconfirmed(TCP_Shard *shard, const Mono_Time *mono_time, uint32_t i)
 {
-    TCP_Secure_Connection *conn = &tcp_server->unconfirmed_connection_queue[i];
+    TCP_Secure_Connection *conn = &shard->unconfirmed_connection_queue[i];
 
     if (conn->status != TCP_STATUS_UNCONFIRMED) {
         return -1;
     }
 
     uint8_t packet[MAX_PACKET_SIZE];
-    int len = read_packet_TCP_secure_connection(conn->sock, &conn->next_packet_length, conn->shared_key, conn->recv_nonce,
+    int len = read_packet_TCP_secure_connection(conn->sock, &conn->recv_buffer, conn->shared_key, conn->recv_nonce,
               packet, sizeof(packet));
 
     if (len == 0) {
@@ -1214,15 +2368,15 @@ static int do_unconfirmed(TCP_Server *tcp_server, const Mono_Time *mono_time, ui
         return -1;
     }
 
-    return confirm_TCP_connection(tcp_server, mono_time, conn, packet, len);
+    return confirm_TCP_connection(shard, mono_time, conn, packet, len);
 }
 
-static bool tcp_process_secure_packet(TCP_Server *tcp_server, uint32_t i)
+static bool tcp_process_secure_packet(TCP_Shard *shard, uint32_t i)
 {
-    TCP_Secure_Connection *const conn = &tcp_server->accepted_connection_array[i];
+    TCP_Secure_Connection *const conn = &shard->accepted_connection_array[i];
 
     uint8_t packet[MAX_PACKET_SIZE];
-    int len = read_packet_TCP_secure_connection(conn->sock, &conn->next_packet_length, conn->shared_key,
+    int len = read_packet_TCP_secure_connection(conn->sock, &conn->recv_buffer, conn->shared_key,
               conn->recv_nonce, packet, sizeof(packet));
 
     if (len == 0) {
@@ -1230,56 +2384,57 @@ static bool tcp_process_secure_packet(TCP_Server *tcp_server, uint32_t i)
     }
 
     if (len == -1) {
-        kill_accepted(tcp_server, i);
+        kill_accepted(shard, i);
         return false;
     }
 
-    if (handle_TCP_packet(tcp_server, i, packet, len) == -1) {
-        kill_accepted(tcp_server, i);
+    if (handle_TCP_packet(shard, i, packet, len) == -1) {
+        kill_accepted(shard, i);
         return false;
     }
 
     return true;
 }
 
-static void do_confirmed_recv(TCP_Server *tcp_server, uint32_t i)
+static void do_confirmed_recv(TCP_Shard *shard, uint32_t i)
 {
-    while (tcp_process_secure_packet(tcp_server, i)) {
+    while (tcp_process_secure_packet(shard, i)) {
         // Keep reading until an error occurs or there is no more data to read.
         continue;
     }
 }
 
 #ifndef TCP_SERVER_USE_EPOLL
-static void do_TCP_incoming(TCP_Server *tcp_server)
+static void do_TCP_incoming(TCP_Shard *shard)
 {
     for (uint32_t i = 0; i < MAX_INCOMING_CONNECTIONS; ++i) {
-        do_incoming(tcp_server, i);
+        do_incoming(shard, i);
     }
 }
 
-static void do_TCP_unconfirmed(TCP_Server *tcp_server, const Mono_Time *mono_time)
+static void do_TCP_unconfirmed(TCP_Shard *shard, const Mono_Time *mono_time)
 {
     for (uint32_t i = 0; i < MAX_INCOMING_CONNECTIONS; ++i) {
-        do_unconfirmed(tcp_server, mono_time, i);
+        do_unconfirmed(shard, mono_time, i);
     }
 }
 #endif
 
-static void do_TCP_confirmed(TCP_Server *tcp_server, const Mono_Time *mono_time)
+static void do_TCP_confirmed(TCP_Shard *shard, const Mono_Time *mono_time)
 {
 #ifdef TCP_SERVER_USE_EPOLL
 
-    if (tcp_server->last_run_pinged == mono_time_get(mono_time)) {
+    if (shard->last_run_pinged == mono_time_get(mono_time)) {
         return;
     }
 
-    tcp_server->last_run_pinged = mono_time_get(mono_time);
+    shard->last_run_pinged = mono_time_get(mono_time);
 #endif
+    TCP_Send_Queue_Stats send_queue_stats = {0};
     uint32_t i;
 
-    for (i = 0; i < tcp_server->size_accepted_connections; ++i) {
-        TCP_Secure_Connection *conn = &tcp_server->accepted_connection_array[i];
+    for (i = 0; i < shard->size_accepted_connections; ++i) {
+        TCP_Secure_Connection *conn = &shard->accepted_connection_array[i];
 
         if (conn->status != TCP_STATUS_CONFIRMED) {
             continue;
@@ -1302,33 +2457,133 @@ static void do_TCP_confirmed(TCP_Server *tcp_server, const Mono_Time *mono_time)
                 conn->ping_id = ping_id;
             } else {
                 if (mono_time_is_timeout(mono_time, conn->last_pinged, TCP_PING_FREQUENCY + TCP_PING_TIMEOUT)) {
-                    kill_accepted(tcp_server, i);
+                    kill_accepted(shard, i);
                     continue;
                 }
             }
         }
 
         if (conn->ping_id && mono_time_is_timeout(mono_time, conn->last_pinged, TCP_PING_TIMEOUT)) {
-            kill_accepted(tcp_server, i);
+            kill_accepted(shard, i);
             continue;
         }
 
-        send_pending_data(conn);
+        tcp_send_queue_flush(&conn->send_queue, conn->sock);
+        tcp_send_queue_stats_add(&conn->send_queue, &send_queue_stats);
 
 #ifndef TCP_SERVER_USE_EPOLL
 
-        do_confirmed_recv(tcp_server, i);
+        do_confirmed_recv(shard, i);
 
 #endif
     }
+
+    pthread_mutex_lock(&shard->tcp_server->key_list_mutex);
+    shard->send_queue_stats = send_queue_stats;
+    pthread_mutex_unlock(&shard->tcp_server->key_list_mutex);
 }
 
 #ifdef TCP_SERVER_USE_EPOLL
-static bool tcp_epoll_process(TCP_Server *tcp_server, const Mono_Time *mono_time)
+static void add_incoming(TCP_Shard *shard, Socket sock)
+{
+    const int index_new = accept_connection(shard, sock);
+
+    if (index_new == -1) {
+        return;
+    }
+
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+
+    ev.data.u64 = sock.socket | ((uint64_t)TCP_SOCKET_INCOMING << 32) | ((uint64_t)index_new << 40);
+
+    if (epoll_ctl(shard->efd, EPOLL_CTL_ADD, sock.socket, &ev) == -1) {
+        kill_TCP_secure_connection(&shard->incoming_connection_queue[index_new]);
+    }
+}
+
+/* Switch the epoll set of shard over to the unconfirmed connection at index,
+ * which was an incoming connection before.
+ */
+static void watch_unconfirmed(TCP_Shard *shard, int index)
+{
+    const Socket sock = shard->unconfirmed_connection_queue[index].sock;
+
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+
+    ev.data.u64 = sock.socket | ((uint64_t)TCP_SOCKET_UNCONFIRMED << 32) | ((uint64_t)index << 40);
+
+    if (epoll_ctl(shard->efd, EPOLL_CTL_MOD, sock.socket, &ev) == -1) {
+        kill_TCP_secure_connection(&shard->unconfirmed_connection_queue[index]);
+    }
+}
+
+/* Finish the handshake the handshake workers computed for an incoming
+ * connection, unless the connection went away in the meantime.
+ */
+static void handle_handshake_message(TCP_Shard *shard, const TCP_Message *msg)
+{
+    const uint32_t i = msg->index & TCP_SHARD_INDEX_MASK;
+
+    if (i >= MAX_INCOMING_CONNECTIONS || msg->length != sizeof(TCP_Handshake)) {
+        return;
+    }
+
+    TCP_Secure_Connection *con = &shard->incoming_connection_queue[i];
+
+    if (!con->handshake_pending || con->identifier != msg->identifier) {
+        return;
+    }
+
+    release_handshake(shard, i);
+
+    if (finish_TCP_handshake(con, (const TCP_Handshake *)msg->data) == -1) {
+        kill_TCP_secure_connection(con);
+        return;
+    }
+
+    watch_unconfirmed(shard, move_to_unconfirmed(shard, i));
+}
+
+/* Give an accepted socket to the next shard in turn. */
+static void distribute_incoming(TCP_Shard *shard, Socket sock)
+{
+    const TCP_Server *tcp_server = shard->tcp_server;
+    TCP_Shard *target = tcp_server->shards[shard->next_shard % tcp_server->num_shards];
+    ++shard->next_shard;
+
+    if (target == shard) {
+        add_incoming(shard, sock);
+        return;
+    }
+
+    TCP_Message msg = {0};
+    msg.type = TCP_MESSAGE_SOCKET;
+    msg.index = global_connection_index(target, 0);
+    msg.sock = sock;
+    send_message(shard, &msg);
+}
+
+static void run_shard_queue(TCP_Shard *shard)
+{
+    TCP_Message *msg = queue_take(&shard->queue);
+
+    while (msg != nullptr) {
+        TCP_Message *next = msg->next;
+        handle_message(shard, msg);
+        free(msg);
+        msg = next;
+    }
+}
+
+static bool tcp_epoll_process(TCP_Shard *shard, const Mono_Time *mono_time, int timeout)
 {
 #define MAX_EVENTS 16
     struct epoll_event events[MAX_EVENTS];
-    const int nfds = epoll_wait(tcp_server->efd, events, MAX_EVENTS, 0);
+    const int nfds = epoll_wait(shard->efd, events, MAX_EVENTS, timeout);
 #undef MAX_EVENTS
 
     for (int n = 0; n < nfds; ++n) {
@@ -1338,23 +2593,24 @@ static bool tcp_epoll_process(TCP_Server *tcp_server, const Mono_Time *mono_time
 
         if ((events[n].events & EPOLLERR) || (events[n].events & EPOLLHUP) || (events[n].events & EPOLLRDHUP)) {
             switch (status) {
-                case TCP_SOCKET_LISTENING: {
+                case TCP_SOCKET_LISTENING:
+                case TCP_SOCKET_WAKEUP: {
                     // should never happen
                     break;
                 }
 
                 case TCP_SOCKET_INCOMING: {
-                    kill_TCP_secure_connection(&tcp_server->incoming_connection_queue[index]);
+                    kill_incoming(shard, index);
                     break;
                 }
 
                 case TCP_SOCKET_UNCONFIRMED: {
-                    kill_TCP_secure_connection(&tcp_server->unconfirmed_connection_queue[index]);
+                    kill_TCP_secure_connection(&shard->unconfirmed_connection_queue[index]);
                     break;
                 }
 
                 case TCP_SOCKET_CONFIRMED: {
-                    kill_accepted(tcp_server, index);
+                    kill_accepted(shard, index);
                     break;
                 }
             }
@@ -1362,6 +2618,11 @@ static bool tcp_epoll_process(TCP_Server *tcp_server, const Mono_Time *mono_time
             continue;
         }
 
+        if ((events[n].events & EPOLLOUT) && status == TCP_SOCKET_CONFIRMED) {
+            // The socket has room again, send what has been waiting for it.
+            TCP_Secure_Connection *conn = &shard->accepted_connection_array[index];
+            tcp_send_queue_flush(&conn->send_queue, conn->sock);
+        }
 
         if (!(events[n].events & EPOLLIN)) {
             continue;
@@ -1377,62 +2638,49 @@ static bool tcp_epoll_process(TCP_Server *tcp_server, const Mono_Time *mono_time
                         break;
                     }
 
-                    int index_new = accept_connection(tcp_server, sock_new);
-
-                    if (index_new == -1) {
-                        continue;
-                    }
-
-                    struct epoll_event ev;
-
-                    ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
-
-                    ev.data.u64 = sock_new.socket | ((uint64_t)TCP_SOCKET_INCOMING << 32) | ((uint64_t)index_new << 40);
-
-                    if (epoll_ctl(tcp_server->efd, EPOLL_CTL_ADD, sock_new.socket, &ev) == -1) {
-                        kill_TCP_secure_connection(&tcp_server->incoming_connection_queue[index_new]);
-                        continue;
-                    }
+                    distribute_incoming(shard, sock_new);
                 }
 
                 break;
             }
 
             case TCP_SOCKET_INCOMING: {
-                const int index_new = do_incoming(tcp_server, index);
+                const int index_new = do_incoming(shard, index);
 
                 if (index_new != -1) {
-                    events[n].events = EPOLLIN | EPOLLET | EPOLLRDHUP;
-                    events[n].data.u64 = sock.socket | ((uint64_t)TCP_SOCKET_UNCONFIRMED << 32) | ((uint64_t)index_new << 40);
-
-                    if (epoll_ctl(tcp_server->efd, EPOLL_CTL_MOD, sock.socket, &events[n]) == -1) {
-                        kill_TCP_secure_connection(&tcp_server->unconfirmed_connection_queue[index_new]);
-                        break;
-                    }
+                    watch_unconfirmed(shard, index_new);
                 }
 
                 break;
             }
 
             case TCP_SOCKET_UNCONFIRMED: {
-                const int index_new = do_unconfirmed(tcp_server, mono_time, index);
+                const int index_new = do_unconfirmed(shard, mono_time, index);
 
                 if (index_new != -1) {
-                    events[n].events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+                    events[n].events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
                     events[n].data.u64 = sock.socket | ((uint64_t)TCP_SOCKET_CONFIRMED << 32) | ((uint64_t)index_new << 40);
 
-                    if (epoll_ctl(tcp_server->efd, EPOLL_CTL_MOD, sock.socket, &events[n]) == -1) {
+                    if (epoll_ctl(shard->efd, EPOLL_CTL_MOD, sock.socket, &events[n]) == -1) {
                         // remove from confirmed connections
-                        kill_accepted(tcp_server, index_new);
+                        kill_accepted(shard, index_new);
                         break;
                     }
+
+                    // Packets sent right after the first one may already be buffered.
+                    do_confirmed_recv(shard, index_new);
                 }
 
                 break;
             }
 
             case TCP_SOCKET_CONFIRMED: {
-                do_confirmed_recv(tcp_server, index);
+                do_confirmed_recv(shard, index);
+                break;
+            }
+
+            case TCP_SOCKET_WAKEUP: {
+                run_shard_queue(shard);
                 break;
             }
         }
@@ -1441,31 +2689,273 @@ static bool tcp_epoll_process(TCP_Server *tcp_server, const Mono_Time *mono_time
     return nfds > 0;
 }
 
-static void do_TCP_epoll(TCP_Server *tcp_server, const Mono_Time *mono_time)
+static void do_TCP_epoll(TCP_Shard *shard, const Mono_Time *mono_time)
 {
-    while (tcp_epoll_process(tcp_server, mono_time)) {
+    while (tcp_epoll_process(shard, mono_time, 0)) {
         // Keep processing packets until there are no more FDs ready for reading.
         continue;
     }
 }
+
+static void *tcp_worker_thread(void *arg)
+{
+    TCP_Shard *const shard = (TCP_Shard *)arg;
+
+    while (queue_running(&shard->queue)) {
+        tcp_epoll_process(shard, shard->mono_time, TCP_WORKER_POLL_TIMEOUT);
+        mono_time_update(shard->mono_time);
+        do_TCP_epoll(shard, shard->mono_time);
+        do_TCP_confirmed(shard, shard->mono_time);
+    }
+
+    return nullptr;
+}
+
+/* Set up the queue of shard, and wake up its epoll set when it stops being
+ * empty.
+ */
+static bool init_shard_queue(TCP_Shard *shard)
+{
+    if (!queue_init(&shard->queue)) {
+        return false;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.u64 = shard->queue.wake_fds[0] | ((uint64_t)TCP_SOCKET_WAKEUP << 32);
+
+    if (epoll_ctl(shard->efd, EPOLL_CTL_ADD, shard->queue.wake_fds[0], &ev) == -1) {
+        queue_kill(&shard->queue);
+        return false;
+    }
+
+    shard->has_queue = true;
+    return true;
+}
+
+static void kill_shard_queue(TCP_Shard *shard)
+{
+    if (!shard->has_queue) {
+        return;
+    }
+
+    epoll_ctl(shard->efd, EPOLL_CTL_DEL, shard->queue.wake_fds[0], nullptr);
+    queue_kill(&shard->queue);
+    shard->has_queue = false;
+}
+
+/* Set up what shard needs to run on a worker thread of its own. */
+static bool init_worker(TCP_Shard *shard)
+{
+    shard->mono_time = mono_time_new();
+
+    if (shard->mono_time == nullptr) {
+        return false;
+    }
+
+    if (!init_shard_queue(shard)) {
+        mono_time_free(shard->mono_time);
+        shard->mono_time = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+static void kill_worker(TCP_Shard *shard)
+{
+    if (shard->mono_time == nullptr) {
+        return;
+    }
+
+    kill_shard_queue(shard);
+    mono_time_free(shard->mono_time);
+    shard->mono_time = nullptr;
+}
+
+static void stop_workers(TCP_Server *tcp_server, uint32_t num_started)
+{
+    for (uint32_t i = 0; i < num_started; ++i) {
+        queue_stop(&tcp_server->shards[i]->queue);
+    }
+
+    for (uint32_t i = 0; i < num_started; ++i) {
+        pthread_join(tcp_server->shards[i]->thread, nullptr);
+    }
+}
+
+static void run_onion_queue(TCP_Server *tcp_server)
+{
+    TCP_Message *msg = queue_take(&tcp_server->onion_queue);
+
+    while (msg != nullptr) {
+        TCP_Message *next = msg->next;
+        send_onion_request(tcp_server, msg);
+        free(msg);
+        msg = next;
+    }
+}
+#endif
+
+bool tcp_server_start_workers(TCP_Server *tcp_server, uint32_t num_workers)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+    const TCP_Shard *first = tcp_server->shards[0];
+
+    if (tcp_server->workers_running || tcp_server->handshake_pool.num_threads != 0
+            || num_workers == 0 || num_workers > TCP_SERVER_MAX_WORKERS
+            || first->incoming_connection_queue_index != 0 || first->num_accepted_connections != 0) {
+        return false;
+    }
+
+    if (!queue_init(&tcp_server->onion_queue)) {
+        return false;
+    }
+
+    bool ok = true;
+
+    while (ok && tcp_server->num_shards < num_workers) {
+        TCP_Shard *shard = new_TCP_shard(tcp_server, tcp_server->num_shards);
+        ok = shard != nullptr;
+
+        if (ok) {
+            shard_listen(shard, tcp_server->socks_listening, tcp_server->num_listening_socks);
+            tcp_server->shards[tcp_server->num_shards] = shard;
+            ++tcp_server->num_shards;
+        }
+    }
+
+    for (uint32_t i = 0; ok && i < tcp_server->num_shards; ++i) {
+        ok = init_worker(tcp_server->shards[i]);
+    }
+
+    uint32_t num_started = 0;
+
+    while (ok && num_started < tcp_server->num_shards) {
+        TCP_Shard *shard = tcp_server->shards[num_started];
+        ok = pthread_create(&shard->thread, nullptr, tcp_worker_thread, shard) == 0;
+
+        if (ok) {
+            ++num_started;
+        }
+    }
+
+    if (!ok) {
+        stop_workers(tcp_server, num_started);
+
+        for (uint32_t i = 0; i < tcp_server->num_shards; ++i) {
+            kill_worker(tcp_server->shards[i]);
+        }
+
+        while (tcp_server->num_shards > 1) {
+            --tcp_server->num_shards;
+            kill_TCP_shard(tcp_server->shards[tcp_server->num_shards]);
+            tcp_server->shards[tcp_server->num_shards] = nullptr;
+        }
+
+        queue_kill(&tcp_server->onion_queue);
+        return false;
+    }
+
+    tcp_server->workers_running = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool tcp_server_start_handshake_workers(TCP_Server *tcp_server, uint32_t num_workers)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+    TCP_Handshake_Pool *pool = &tcp_server->handshake_pool;
+
+    if (pool->num_threads != 0 || num_workers == 0 || num_workers > TCP_SERVER_MAX_HANDSHAKE_WORKERS) {
+        return false;
+    }
+
+    /* Without worker threads, finished handshakes go back to do_TCP_server()
+     * through the queue of the only shard. */
+    TCP_Shard *first = tcp_server->shards[0];
+
+    if (!tcp_server->workers_running && !init_shard_queue(first)) {
+        return false;
+    }
+
+    pool->running = true;
+
+    while (pool->num_threads < num_workers) {
+        if (pthread_create(&pool->threads[pool->num_threads], nullptr, tcp_handshake_thread, tcp_server) != 0) {
+            stop_handshake_workers(pool);
+
+            if (!tcp_server->workers_running) {
+                kill_shard_queue(first);
+            }
+
+            return false;
+        }
+
+        ++pool->num_threads;
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+uint32_t tcp_server_num_handshake_workers(const TCP_Server *tcp_server)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+    return tcp_server->handshake_pool.num_threads;
+#else
+    return 0;
 #endif
+}
 
 void do_TCP_server(TCP_Server *tcp_server, Mono_Time *mono_time)
 {
+    TCP_Shard *shard = tcp_server->shards[0];
+
 #ifdef TCP_SERVER_USE_EPOLL
-    do_TCP_epoll(tcp_server, mono_time);
+
+    if (tcp_server->workers_running) {
+        run_onion_queue(tcp_server);
+        return;
+    }
+
+    do_TCP_epoll(shard, mono_time);
 
 #else
-    do_TCP_accept_new(tcp_server);
-    do_TCP_incoming(tcp_server);
-    do_TCP_unconfirmed(tcp_server, mono_time);
+    do_TCP_accept_new(shard);
+    do_TCP_incoming(shard);
+    do_TCP_unconfirmed(shard, mono_time);
 #endif
 
-    do_TCP_confirmed(tcp_server, mono_time);
+    do_TCP_confirmed(shard, mono_time);
 }
 
 void kill_TCP_server(TCP_Server *tcp_server)
 {
+#ifdef TCP_SERVER_USE_EPOLL
+    // Handshake workers hand their results to the shards, so they go first.
+    stop_handshake_workers(&tcp_server->handshake_pool);
+
+    if (tcp_server->workers_running) {
+        stop_workers(tcp_server, tcp_server->num_shards);
+
+        for (uint32_t i = 0; i < tcp_server->num_shards; ++i) {
+            kill_worker(tcp_server->shards[i]);
+        }
+
+        queue_kill(&tcp_server->onion_queue);
+    } else {
+        kill_shard_queue(tcp_server->shards[0]);
+    }
+
+    pthread_cond_destroy(&tcp_server->handshake_pool.cond);
+    pthread_mutex_destroy(&tcp_server->handshake_pool.mutex);
+#endif
+
     for (uint32_t i = 0; i < tcp_server->num_listening_socks; ++i) {
         kill_sock(tcp_server->socks_listening[i]);
     }
@@ -1474,19 +2964,13 @@ void kill_TCP_server(TCP_Server *tcp_server)
         set_callback_handle_recv_1(tcp_server->onion, nullptr, nullptr);
     }
 
-    bs_list_free(&tcp_server->accepted_key_list);
-
-#ifdef TCP_SERVER_USE_EPOLL
-    close(tcp_server->efd);
-#endif
+    pk_map_kill(tcp_server->accepted_key_map);
+    pthread_mutex_destroy(&tcp_server->key_list_mutex);
 
-    for (uint32_t i = 0; i < MAX_INCOMING_CONNECTIONS; ++i) {
-        wipe_secure_connection(&tcp_server->incoming_connection_queue[i]);
-        wipe_secure_connection(&tcp_server->unconfirmed_connection_queue[i]);
+    for (uint32_t i = 0; i < tcp_server->num_shards; ++i) {
+        kill_TCP_shard(tcp_server->shards[i]);
     }
 
-    free_accepted_connection_array(tcp_server);
-
     free(tcp_server->socks_listening);
     free(tcp_server);
 }
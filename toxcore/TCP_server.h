@@ -28,6 +28,10 @@
 #include "list.h"
 #include "onion.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define MAX_INCOMING_CONNECTIONS 256
 
 #define TCP_MAX_BACKLOG MAX_INCOMING_CONNECTIONS
@@ -59,6 +63,17 @@
 #define TCP_PING_FREQUENCY 30
 #define TCP_PING_TIMEOUT 10
 
+/* Maximum number of worker threads a TCP server can be sharded across. */
+#define TCP_SERVER_MAX_WORKERS 64
+
+/* Maximum number of threads a TCP server can compute handshakes on. */
+#define TCP_SERVER_MAX_HANDSHAKE_WORKERS 16
+
+/* Maximum number of handshakes the connections of each worker thread may have
+ * waiting for the handshake workers. Connections sending handshakes beyond
+ * that are killed. */
+#define TCP_SERVER_MAX_PENDING_HANDSHAKES 64
+
 typedef enum TCP_Status {
     TCP_STATUS_NO_STATUS,
     TCP_STATUS_CONNECTED,
@@ -66,16 +81,79 @@ typedef enum TCP_Status {
     TCP_STATUS_CONFIRMED,
 } TCP_Status;
 
-typedef struct TCP_Priority_List TCP_Priority_List;
+/* Bytes read from a TCP connection that haven't been made into packets yet.
+ * The buffer always has room for a whole packet and its length, so a packet
+ * never has to wait for the bytes before it to be consumed.
+ */
+#define TCP_RECV_BUFFER_SIZE (2 * (sizeof(uint16_t) + MAX_PACKET_SIZE))
+
+typedef struct TCP_Recv_Buffer {
+    uint8_t data[TCP_RECV_BUFFER_SIZE];
+    uint16_t start;
+    uint16_t end;
+} TCP_Recv_Buffer;
+
+/* The most bytes a TCP connection can have waiting to be sent. Only priority
+ * packets can use the last TCP_SEND_QUEUE_PRIORITY_RESERVE bytes, so there is
+ * always room for pings and routing responses when data is backing up.
+ */
+#define TCP_SEND_QUEUE_SIZE (8 * (sizeof(uint16_t) + MAX_PACKET_SIZE))
+#define TCP_SEND_QUEUE_PRIORITY_RESERVE (2 * (sizeof(uint16_t) + MAX_PACKET_SIZE))
 
-struct TCP_Priority_List {
-    TCP_Priority_List *next;
-    uint16_t size;
-    uint16_t sent;
-    uint8_t data[];
-};
+/* Bytes waiting to be sent on a TCP connection. This is a ring buffer of
+ * TCP_SEND_QUEUE_SIZE bytes, allocated the first time a send would block and
+ * kept until the connection is killed.
+ */
+typedef struct TCP_Send_Queue {
+    uint8_t *data;
+    uint32_t start;
+    uint32_t size;
+
+    uint32_t max_size;
+    uint64_t packets_queued;
+    uint64_t packets_dropped;
+} TCP_Send_Queue;
+
+typedef struct TCP_Send_Queue_Stats {
+    /* Number of send queues that have bytes waiting. */
+    uint32_t backlogged_queues;
+    /* Bytes waiting in all queues. */
+    uint64_t queued_bytes;
+    /* The most bytes any of the queues has had waiting at once. */
+    uint32_t max_queued_bytes;
+    /* Packets that were queued because they couldn't be sent right away. */
+    uint64_t packets_queued;
+    /* Packets that couldn't be sent because their queue was full. */
+    uint64_t packets_dropped;
+} TCP_Send_Queue_Stats;
+
+/* Free the buffer of a send queue, dropping anything still in it.
+ */
+void tcp_send_queue_free(TCP_Send_Queue *queue);
 
-void wipe_priority_list(TCP_Priority_List *p);
+/* return true if nothing is waiting to be sent.
+ */
+bool tcp_send_queue_empty(const TCP_Send_Queue *queue);
+
+/* Send as much of the queue as the socket takes.
+ *
+ * return 0 if the queue was sent completely.
+ * return -1 if it wasn't.
+ */
+int tcp_send_queue_flush(TCP_Send_Queue *queue, Socket sock);
+
+/* Send a packet, or queue it behind what is already waiting.
+ *
+ * return 1 if the packet was sent or queued.
+ * return 0 if the queue was too full to take it.
+ * return -1 if part of the packet was sent and the rest could not be queued
+ *   (connection must be killed).
+ */
+int tcp_send_queue_write(TCP_Send_Queue *queue, Socket sock, const uint8_t *packet, uint16_t length, bool priority);
+
+/* Add the depth and counters of a send queue to stats.
+ */
+void tcp_send_queue_stats_add(const TCP_Send_Queue *queue, TCP_Send_Queue_Stats *stats);
 
 typedef struct TCP_Server TCP_Server;
 
@@ -87,6 +165,62 @@ size_t tcp_server_listen_count(const TCP_Server *tcp_server);
 TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports, const uint8_t *secret_key,
                            Onion *onion);
 
+/* Shard the connections of the server across num_workers threads of its own.
+ * Each worker has its own epoll set and accepts, handshakes and forwards
+ * packets for the connections assigned to it. Packets for clients on another
+ * worker are handed over to it.
+ *
+ * Must be called before the first do_TCP_server(). do_TCP_server() must still
+ * be called regularly to pass onion packets to and from the onion.
+ *
+ * Only supported with epoll.
+ *
+ * return true on success.
+ * return false on failure.
+ */
+bool tcp_server_start_workers(TCP_Server *tcp_server, uint32_t num_workers);
+
+/* Return the number of worker threads the server runs on, 0 if it runs on the
+ * thread calling do_TCP_server().
+ */
+uint32_t tcp_server_num_workers(const TCP_Server *tcp_server);
+
+/* Compute the key exchange of new connections on num_workers threads of their
+ * own instead of on the threads forwarding packets, so that many clients
+ * connecting at once don't hold up the packets of connected clients. The
+ * response to a handshake is sent by the thread owning the connection once the
+ * key exchange is done.
+ *
+ * Must be called before the first do_TCP_server(), and after
+ * tcp_server_start_workers() if both are used.
+ *
+ * Only supported with epoll.
+ *
+ * return true on success.
+ * return false on failure.
+ */
+bool tcp_server_start_handshake_workers(TCP_Server *tcp_server, uint32_t num_workers);
+
+/* Return the number of threads the server computes handshakes on, 0 if it
+ * computes them on the threads forwarding packets.
+ */
+uint32_t tcp_server_num_handshake_workers(const TCP_Server *tcp_server);
+
+/* Fill stats with the send queues of the connections the server has. This is
+ * updated each time the server checks on its connections, at least once a
+ * second.
+ */
+void tcp_server_send_queue_stats(TCP_Server *tcp_server, TCP_Send_Queue_Stats *stats);
+
+/* Write the sockets the TCP server needs to be woken up for into fds, see
+ * net_poll_fds_add(). With epoll, this is the single epoll file descriptor.
+ * With worker threads, this is where they signal onion packets for
+ * do_TCP_server().
+ *
+ * return the number of sockets, which may be larger than max_fds.
+ */
+uint32_t tcp_server_get_fds(const TCP_Server *tcp_server, Net_Poll_Fd *fds, uint32_t max_fds);
+
 /* Run the TCP_server
  */
 void do_TCP_server(TCP_Server *tcp_server, Mono_Time *mono_time);
@@ -95,15 +229,6 @@ void do_TCP_server(TCP_Server *tcp_server, Mono_Time *mono_time);
  */
 void kill_TCP_server(TCP_Server *tcp_server);
 
-/* Read the next two bytes in TCP stream then convert them to
- * length (host byte order).
- *
- * return length on success
- * return 0 if nothing has been read from socket.
- * return ~0 on failure.
- */
-uint16_t read_TCP_length(Socket sock);
-
 /* Read length bytes from socket.
  *
  * return length on success
@@ -111,12 +236,18 @@ uint16_t read_TCP_length(Socket sock);
  */
 int read_TCP_packet(Socket sock, uint8_t *data, uint16_t length);
 
-/* return length of received packet on success.
+/* Take the next packet out of recv_buffer, reading from the socket first
+ * only if the buffer doesn't hold a whole packet.
+ *
+ * return length of received packet on success.
  * return 0 if could not read any packet.
  * return -1 on failure (connection must be killed).
  */
-int read_packet_TCP_secure_connection(Socket sock, uint16_t *next_packet_length, const uint8_t *shared_key,
+int read_packet_TCP_secure_connection(Socket sock, TCP_Recv_Buffer *recv_buffer, const uint8_t *shared_key,
                                       uint8_t *recv_nonce, uint8_t *data, uint16_t max_len);
 
+#ifdef __cplusplus
+}  // extern "C"
+#endif
 
 #endif
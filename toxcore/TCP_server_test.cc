@@ -0,0 +1,158 @@
+#include "TCP_server.h"
+
+#include <cstdint>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+// The tests connect the queue to a socketpair(), which only POSIX has.
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined(WIN32)
+
+#include <sys/socket.h>
+
+namespace {
+
+constexpr uint16_t kPacketSize = 1000;
+
+class TcpSendQueue : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    sender_.socket = fds[0];
+    receiver_.socket = fds[1];
+    ASSERT_TRUE(set_socket_nonblock(sender_));
+    ASSERT_TRUE(set_socket_nonblock(receiver_));
+  }
+
+  void TearDown() override {
+    tcp_send_queue_free(&queue_);
+    kill_sock(sender_);
+    kill_sock(receiver_);
+  }
+
+  /** Write the next numbered packet and remember it if it was accepted. */
+  int write_packet(bool priority) {
+    std::vector<uint8_t> packet(kPacketSize);
+
+    for (uint16_t i = 0; i < kPacketSize; ++i) {
+      packet[i] = static_cast<uint8_t>(packets_ * 7 + i);
+    }
+
+    ++packets_;
+    const int ret = tcp_send_queue_write(&queue_, sender_, packet.data(), packet.size(), priority);
+
+    if (ret == 1) {
+      expected_.insert(expected_.end(), packet.begin(), packet.end());
+    }
+
+    return ret;
+  }
+
+  /** Read everything the receiving end has been sent so far. */
+  void drain() {
+    uint8_t buf[4096];
+    int len;
+
+    while ((len = net_recv(receiver_, buf, sizeof(buf))) > 0) {
+      received_.insert(received_.end(), buf, buf + len);
+    }
+  }
+
+  TCP_Send_Queue_Stats stats() const {
+    TCP_Send_Queue_Stats stats{};
+    tcp_send_queue_stats_add(&queue_, &stats);
+    return stats;
+  }
+
+  Socket sender_;
+  Socket receiver_;
+  TCP_Send_Queue queue_{};
+  uint32_t packets_ = 0;
+  std::vector<uint8_t> expected_;
+  std::vector<uint8_t> received_;
+};
+
+TEST_F(TcpSendQueue, SendsDirectlyWhileTheSocketHasRoom) {
+  ASSERT_EQ(write_packet(false), 1);
+  EXPECT_TRUE(tcp_send_queue_empty(&queue_));
+  EXPECT_EQ(queue_.data, nullptr);
+
+  drain();
+  EXPECT_EQ(received_, expected_);
+}
+
+TEST_F(TcpSendQueue, QueuesUpToTheLimitAndSendsInOrder) {
+  // Fill the socket until packets start waiting in the queue.
+  for (uint32_t i = 0; i < 100000 && tcp_send_queue_empty(&queue_); ++i) {
+    ASSERT_EQ(write_packet(false), 1);
+  }
+
+  ASSERT_FALSE(tcp_send_queue_empty(&queue_));
+
+  // Other packets are dropped once only the priority reserve is left.
+  while (write_packet(false) == 1) {
+  }
+
+  EXPECT_LE(stats().queued_bytes, TCP_SEND_QUEUE_SIZE - TCP_SEND_QUEUE_PRIORITY_RESERVE);
+  EXPECT_GT(stats().queued_bytes + kPacketSize, TCP_SEND_QUEUE_SIZE - TCP_SEND_QUEUE_PRIORITY_RESERVE);
+  EXPECT_EQ(stats().packets_dropped, 1u);
+
+  // Priority packets still fit.
+  ASSERT_EQ(write_packet(true), 1);
+  EXPECT_EQ(stats().backlogged_queues, 1u);
+
+  // Everything that was accepted arrives in the order it was written.
+  for (uint32_t i = 0; i < 1000 && !tcp_send_queue_empty(&queue_); ++i) {
+    drain();
+    tcp_send_queue_flush(&queue_, sender_);
+  }
+
+  drain();
+  EXPECT_TRUE(tcp_send_queue_empty(&queue_));
+  EXPECT_EQ(received_, expected_);
+  EXPECT_EQ(stats().queued_bytes, 0u);
+  EXPECT_GE(stats().max_queued_bytes, TCP_SEND_QUEUE_SIZE - TCP_SEND_QUEUE_PRIORITY_RESERVE - kPacketSize);
+}
+
+TEST_F(TcpSendQueue, WrapsAroundTheEndOfTheBuffer) {
+  // With a small socket buffer, each flush only sends part of the queue.
+  const int sndbuf = 4096;
+  ASSERT_EQ(setsockopt(sender_.socket, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)), 0);
+
+  for (uint32_t i = 0; i < 100000 && tcp_send_queue_empty(&queue_); ++i) {
+    ASSERT_EQ(write_packet(false), 1);
+  }
+
+  // Keep making a little room in the socket and filling the queue up again,
+  // so that the start of the queue moves forward.
+  bool wrapped = false;
+
+  for (uint32_t round = 0; round < 16 && !wrapped; ++round) {
+    uint8_t buf[4096];
+    const int len = net_recv(receiver_, buf, sizeof(buf));
+    ASSERT_GT(len, 0);
+    received_.insert(received_.end(), buf, buf + len);
+    tcp_send_queue_flush(&queue_, sender_);
+
+    for (uint32_t i = 0; i < 100000 && queue_.size + kPacketSize <= TCP_SEND_QUEUE_SIZE; ++i) {
+      ASSERT_EQ(write_packet(true), 1);
+    }
+
+    wrapped = queue_.start + queue_.size > TCP_SEND_QUEUE_SIZE;
+  }
+
+  EXPECT_TRUE(wrapped);
+
+  for (uint32_t i = 0; i < 1000 && !tcp_send_queue_empty(&queue_); ++i) {
+    drain();
+    tcp_send_queue_flush(&queue_, sender_);
+  }
+
+  drain();
+  EXPECT_EQ(received_, expected_);
+}
+
+}  // namespace
+
+#endif
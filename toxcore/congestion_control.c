@@ -0,0 +1,522 @@
+/*
+ * Congestion control for crypto connections: decides how many packets per
+ * second a connection may send.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "congestion_control.h"
+
+#include <string.h>
+
+#include "ccompat.h"
+
+typedef struct Congestion_Control_Ops {
+    const char *name;
+    void (*init)(Congestion_Control *cc);
+    void (*on_ack)(Congestion_Control *cc, uint64_t time, uint32_t packets_acked);
+    void (*on_rtt)(Congestion_Control *cc, uint64_t rtt);
+    void (*update)(Congestion_Control *cc, const Congestion_Interval *interval, double *send_rate,
+                   double *send_rate_requested);
+} Congestion_Control_Ops;
+
+/** BEGIN: Queue based congestion control **/
+
+/* If the send queue is SEND_QUEUE_RATIO times larger than the
+ * calculated link speed the packet send speed will be reduced
+ * by a value depending on this number.
+ */
+#define SEND_QUEUE_RATIO 2.0
+
+static void queue_init(Congestion_Control *cc)
+{
+    memset(&cc->state.queue, 0, sizeof(cc->state.queue));
+}
+
+static void queue_on_ack(Congestion_Control *cc, uint64_t time, uint32_t packets_acked)
+{
+    // The queue algorithm sees acks through the size of the send queue.
+}
+
+static void queue_on_rtt(Congestion_Control *cc, uint64_t rtt)
+{
+    // The queue algorithm uses the lowest round trip time it is given.
+}
+
+static void queue_update(Congestion_Control *cc, const Congestion_Interval *interval, double *send_rate,
+                         double *send_rate_requested)
+{
+    Congestion_Queue_State *const queue = &cc->state.queue;
+
+    unsigned int pos = queue->last_sendqueue_counter % CONGESTION_QUEUE_ARRAY_SIZE;
+    queue->last_sendqueue_size[pos] = interval->send_queue_size;
+
+    long signed int sum = 0;
+    sum = (long signed int)queue->last_sendqueue_size[pos] -
+          (long signed int)queue->last_sendqueue_size[(pos + 1) % CONGESTION_QUEUE_ARRAY_SIZE];
+
+    unsigned int n_p_pos = queue->last_sendqueue_counter % CONGESTION_LAST_SENT_ARRAY_SIZE;
+    queue->last_num_packets_sent[n_p_pos] = interval->packets_sent;
+    queue->last_num_packets_resent[n_p_pos] = interval->packets_resent;
+
+    queue->last_sendqueue_counter = (queue->last_sendqueue_counter + 1) %
+                                    (CONGESTION_QUEUE_ARRAY_SIZE * CONGESTION_LAST_SENT_ARRAY_SIZE);
+
+    if (interval->hold_rate) {
+        return;
+    }
+
+    long signed int total_sent = 0, total_resent = 0;
+
+    // TODO(irungentoo): use real delay
+    unsigned int delay = (unsigned int)((interval->rtt / CONGESTION_INTERVAL) + 0.5);
+    unsigned int packets_set_rem_array = (CONGESTION_LAST_SENT_ARRAY_SIZE - CONGESTION_QUEUE_ARRAY_SIZE);
+
+    if (delay > packets_set_rem_array) {
+        delay = packets_set_rem_array;
+    }
+
+    for (unsigned j = 0; j < CONGESTION_QUEUE_ARRAY_SIZE; ++j) {
+        unsigned int ind = (j + (packets_set_rem_array  - delay) + n_p_pos) % CONGESTION_LAST_SENT_ARRAY_SIZE;
+        total_sent += queue->last_num_packets_sent[ind];
+        total_resent += queue->last_num_packets_resent[ind];
+    }
+
+    if (sum > 0) {
+        total_sent -= sum;
+    } else {
+        if (total_resent > -sum) {
+            total_resent = -sum;
+        }
+    }
+
+    /* if queue is too big only allow resending packets. */
+    uint32_t npackets = interval->send_queue_size;
+    double min_speed = 1000.0 * (((double)(total_sent)) / ((double)(CONGESTION_QUEUE_ARRAY_SIZE) *
+                                 CONGESTION_INTERVAL));
+
+    double min_speed_request = 1000.0 * (((double)(total_sent + total_resent)) / ((double)(
+            CONGESTION_QUEUE_ARRAY_SIZE) * CONGESTION_INTERVAL));
+
+    if (min_speed < CONGESTION_MIN_RATE) {
+        min_speed = CONGESTION_MIN_RATE;
+    }
+
+    double send_array_ratio = (((double)npackets) / min_speed);
+
+    // TODO(irungentoo): Improve formula?
+    if (send_array_ratio > SEND_QUEUE_RATIO && CONGESTION_MIN_QUEUE_LENGTH < npackets) {
+        *send_rate = min_speed * (1.0 / (send_array_ratio / SEND_QUEUE_RATIO));
+    } else if (interval->last_congestion_event + CONGESTION_EVENT_TIMEOUT < interval->time) {
+        *send_rate = min_speed * 1.2;
+    } else {
+        *send_rate = min_speed * 0.9;
+    }
+
+    *send_rate_requested = min_speed_request * 1.2;
+
+    if (*send_rate < CONGESTION_MIN_RATE) {
+        *send_rate = CONGESTION_MIN_RATE;
+    }
+
+    if (*send_rate_requested < *send_rate) {
+        *send_rate_requested = *send_rate;
+    }
+}
+
+/** END: Queue based congestion control **/
+
+/** BEGIN: Delay based congestion control **/
+
+typedef enum Delay_Mode {
+    /* Double the rate every round trip until the delivery rate stops growing or
+     * the round trip time grows. */
+    DELAY_MODE_STARTUP,
+    /* Send slower than the link for a while to empty the queue startup built. */
+    DELAY_MODE_DRAIN,
+    /* Send at the link speed, probing for more bandwidth now and then. */
+    DELAY_MODE_PROBE_BANDWIDTH,
+    /* Empty the queue for a couple of round trips to measure the round trip
+     * time again. */
+    DELAY_MODE_PROBE_RTT,
+} Delay_Mode;
+
+/* Rate multiplier while looking for the link speed. */
+#define DELAY_STARTUP_GAIN 2.0
+#define DELAY_DRAIN_GAIN 0.5
+
+/* Startup ends after this many rounds without the bandwidth growing by
+ * DELAY_FULL_BANDWIDTH_GROWTH. */
+#define DELAY_FULL_BANDWIDTH_ROUNDS 3
+#define DELAY_FULL_BANDWIDTH_GROWTH 1.25
+
+/* Once the round trip time grew this much over the lowest one seen, plus some
+ * ms to allow for the acks being late, the link is queueing our packets and
+ * the rate is lowered until the queue is gone. */
+#define DELAY_QUEUEING_RTT_RATIO 1.25
+#define DELAY_QUEUEING_RTT_SLACK CONGESTION_INTERVAL
+
+#define DELAY_BACKOFF_GAIN 0.75
+
+/* The send queue may hold this many times the bandwidth-delay product before
+ * the rate is lowered. */
+#define DELAY_MAX_QUEUE_BDP 2.0
+
+static const double delay_cycle_gains[] = {1.25, 0.75, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0};
+
+#define DELAY_CYCLE_LENGTH (sizeof(delay_cycle_gains) / sizeof(delay_cycle_gains[0]))
+
+static void delay_init(Congestion_Control *cc)
+{
+    memset(&cc->state.delay, 0, sizeof(cc->state.delay));
+    cc->state.delay.mode = DELAY_MODE_STARTUP;
+    cc->state.delay.gain = DELAY_STARTUP_GAIN;
+}
+
+static void delay_on_ack(Congestion_Control *cc, uint64_t time, uint32_t packets_acked)
+{
+    Congestion_Delay_State *const delay = &cc->state.delay;
+    const uint32_t slot = delay->interval_count % CONGESTION_DELAY_SAMPLE_INTERVALS;
+
+    if (packets_acked == 0) {
+        return;
+    }
+
+    if (delay->acked[slot] == 0) {
+        delay->first_ack_time[slot] = time;
+    }
+
+    if (delay->first_ack_time[slot] == time) {
+        delay->first_acked[slot] += packets_acked;
+    }
+
+    delay->acked[slot] += packets_acked;
+    delay->last_ack_time[slot] = time;
+}
+
+static void delay_on_rtt(Congestion_Control *cc, uint64_t rtt)
+{
+    Congestion_Delay_State *const delay = &cc->state.delay;
+
+    uint64_t *const sample = &delay->rtt[delay->interval_count % CONGESTION_DELAY_SAMPLE_INTERVALS];
+
+    if (*sample == 0 || rtt < *sample) {
+        *sample = rtt;
+    }
+}
+
+static double delay_bandwidth(const Congestion_Delay_State *delay)
+{
+    double bandwidth = 0.0;
+
+    for (uint32_t i = 0; i < CONGESTION_DELAY_BANDWIDTH_WINDOW; ++i) {
+        if (delay->bandwidth[i] > bandwidth) {
+            bandwidth = delay->bandwidth[i];
+        }
+    }
+
+    return bandwidth;
+}
+
+/* Length in ms of one round of the algorithm: one round trip, but at least
+ * one interval. */
+static uint64_t delay_round_length(const Congestion_Delay_State *delay, const Congestion_Interval *interval)
+{
+    const uint64_t rtt = delay->min_rtt != 0 ? delay->min_rtt : interval->rtt;
+    return rtt > CONGESTION_INTERVAL ? rtt : CONGESTION_INTERVAL;
+}
+
+/* Return true if the last round trip time samples show that the link queues
+ * our packets. */
+static bool delay_queueing(const Congestion_Delay_State *delay)
+{
+    return delay->latest_rtt > delay->min_rtt * DELAY_QUEUEING_RTT_RATIO + DELAY_QUEUEING_RTT_SLACK;
+}
+
+static void delay_update_rtt(Congestion_Delay_State *delay, uint64_t time)
+{
+    const uint64_t sample = delay->rtt[delay->interval_count % CONGESTION_DELAY_SAMPLE_INTERVALS];
+
+    if (sample == 0) {
+        return;
+    }
+
+    delay->latest_rtt = 0;
+
+    for (uint32_t i = 0; i < CONGESTION_DELAY_SAMPLE_INTERVALS; ++i) {
+        if (delay->rtt[i] != 0 && (delay->latest_rtt == 0 || delay->rtt[i] < delay->latest_rtt)) {
+            delay->latest_rtt = delay->rtt[i];
+        }
+    }
+
+    if (delay->min_rtt == 0 || sample <= delay->min_rtt) {
+        delay->min_rtt = sample;
+        delay->min_rtt_time = time;
+    }
+
+    if (delay->probe_rtt_min == 0 || sample < delay->probe_rtt_min) {
+        delay->probe_rtt_min = sample;
+    }
+}
+
+/* Return the rate in packets per second at which acks came in the last
+ * intervals. Acks mostly come with request packets, so the rate is taken
+ * between the first and the last ack rather than over whole intervals, which
+ * would see one request packet more or less depending on where they fall. If
+ * there were too few acks for that, they are spread over the intervals.
+ */
+static double delay_ack_rate(const Congestion_Delay_State *delay, uint32_t intervals)
+{
+    uint32_t total_acked = 0;
+    uint32_t acked = 0;
+    uint64_t first_ack_time = 0;
+    uint64_t last_ack_time = 0;
+
+    for (uint32_t i = 0; i < CONGESTION_DELAY_SAMPLE_INTERVALS; ++i) {
+        const uint32_t slot = (delay->interval_count + 1 + i) % CONGESTION_DELAY_SAMPLE_INTERVALS;
+
+        if (delay->acked[slot] == 0) {
+            continue;
+        }
+
+        total_acked += delay->acked[slot];
+        acked += delay->acked[slot];
+        last_ack_time = delay->last_ack_time[slot];
+
+        if (first_ack_time == 0) {
+            first_ack_time = delay->first_ack_time[slot];
+            acked -= delay->first_acked[slot];
+        }
+    }
+
+    if (last_ack_time < first_ack_time + CONGESTION_INTERVAL) {
+        return 1000.0 * (double)total_acked / (double)(intervals * CONGESTION_INTERVAL);
+    }
+
+    return 1000.0 * (double)acked / (double)(last_ack_time - first_ack_time);
+}
+
+/* Record the delivery rate of the last CONGESTION_DELAY_SAMPLE_INTERVALS
+ * intervals. Acks for packets that arrived after a lost one come in a burst
+ * once it is resent, so the rate is capped at the rate we sent new packets at.
+ * Intervals in which we deliberately sent slower than the link or didn't use
+ * half the rate we were allowed don't say anything about the link, so they can
+ * only raise the estimate. Backing off from a full queue isn't deliberate: the
+ * link is what limits us then.
+ */
+static void delay_update_bandwidth(Congestion_Delay_State *delay, const Congestion_Interval *interval,
+                                   double send_rate, bool *app_limited)
+{
+    const uint32_t intervals = delay->interval_count + 1 < CONGESTION_DELAY_SAMPLE_INTERVALS
+                               ? delay->interval_count + 1 : CONGESTION_DELAY_SAMPLE_INTERVALS;
+    const uint32_t slot = delay->interval_count % CONGESTION_DELAY_SAMPLE_INTERVALS;
+    delay->sent[slot] = interval->packets_sent;
+
+    uint32_t sent = 0;
+
+    for (uint32_t i = 0; i < CONGESTION_DELAY_SAMPLE_INTERVALS; ++i) {
+        sent += delay->sent[i];
+    }
+
+    const double sent_rate = 1000.0 * (double)sent / (double)(intervals * CONGESTION_INTERVAL);
+    const double ack_rate = delay_ack_rate(delay, intervals);
+    const double sample = ack_rate < sent_rate ? ack_rate : sent_rate;
+
+    const uint32_t sent_total = interval->packets_sent + interval->packets_resent;
+    *app_limited = 1000.0 * (double)sent_total / CONGESTION_INTERVAL < send_rate / 2.0;
+    const bool limited = *app_limited || (delay->gain < 1.0 && !delay->backing_off);
+
+    if (!limited || sample > delay_bandwidth(delay)) {
+        delay->bandwidth[delay->interval_count % CONGESTION_DELAY_BANDWIDTH_WINDOW] = sample;
+    }
+
+    ++delay->interval_count;
+
+    const uint32_t next = delay->interval_count % CONGESTION_DELAY_SAMPLE_INTERVALS;
+    delay->acked[next] = 0;
+    delay->first_acked[next] = 0;
+    delay->rtt[next] = 0;
+}
+
+static void delay_enter_probe_bandwidth(Congestion_Delay_State *delay, uint64_t time)
+{
+    delay->mode = DELAY_MODE_PROBE_BANDWIDTH;
+    delay->cycle_index = 2;
+    delay->cycle_start = time;
+}
+
+static void delay_update(Congestion_Control *cc, const Congestion_Interval *interval, double *send_rate,
+                         double *send_rate_requested)
+{
+    Congestion_Delay_State *const delay = &cc->state.delay;
+    const uint64_t time = interval->time;
+
+    bool app_limited;
+    delay_update_rtt(delay, time);
+    delay_update_bandwidth(delay, interval, *send_rate, &app_limited);
+
+    if (interval->hold_rate) {
+        return;
+    }
+
+    const double bandwidth = delay_bandwidth(delay);
+    const uint64_t round_length = delay_round_length(delay, interval);
+    const double bdp = bandwidth * (double)round_length / 1000.0;
+
+    if (delay->round_start == 0) {
+        delay->round_start = time;
+    }
+
+    if (delay->mode == DELAY_MODE_STARTUP) {
+        if (delay->round_start + round_length <= time) {
+            delay->round_start = time;
+
+            if (bandwidth >= delay->full_bandwidth * DELAY_FULL_BANDWIDTH_GROWTH) {
+                delay->full_bandwidth = bandwidth;
+                delay->full_bandwidth_rounds = 0;
+            } else if (!app_limited) {
+                ++delay->full_bandwidth_rounds;
+            }
+        }
+
+        if (delay->full_bandwidth_rounds >= DELAY_FULL_BANDWIDTH_ROUNDS || delay_queueing(delay)) {
+            delay->mode = DELAY_MODE_DRAIN;
+        }
+    }
+
+    if (delay->mode == DELAY_MODE_DRAIN && interval->send_queue_size <= bdp) {
+        delay_enter_probe_bandwidth(delay, time);
+    }
+
+    if (delay->mode == DELAY_MODE_PROBE_BANDWIDTH && delay->min_rtt_time + CONGESTION_DELAY_MIN_RTT_WINDOW < time) {
+        delay->mode = DELAY_MODE_PROBE_RTT;
+        delay->probe_rtt_start = time;
+        delay->probe_rtt_min = 0;
+    }
+
+    if (delay->mode == DELAY_MODE_PROBE_RTT && delay->probe_rtt_start + round_length * 2 <= time) {
+        if (delay->probe_rtt_min != 0) {
+            delay->min_rtt = delay->probe_rtt_min;
+        }
+
+        delay->min_rtt_time = time;
+        delay_enter_probe_bandwidth(delay, time);
+    }
+
+    double gain = 1.0;
+    delay->backing_off = false;
+
+    switch ((Delay_Mode)delay->mode) {
+        case DELAY_MODE_STARTUP: {
+            gain = DELAY_STARTUP_GAIN;
+            break;
+        }
+
+        case DELAY_MODE_DRAIN:
+        case DELAY_MODE_PROBE_RTT: {
+            gain = DELAY_DRAIN_GAIN;
+            break;
+        }
+
+        case DELAY_MODE_PROBE_BANDWIDTH: {
+            if (delay->cycle_start + round_length <= time) {
+                delay->cycle_index = (delay->cycle_index + 1) % DELAY_CYCLE_LENGTH;
+                delay->cycle_start = time;
+            }
+
+            gain = delay_cycle_gains[delay->cycle_index];
+
+            const bool queueing = delay_queueing(delay)
+                                  || interval->send_queue_size > bdp * DELAY_MAX_QUEUE_BDP + CONGESTION_MIN_QUEUE_LENGTH;
+
+            delay->backing_off = queueing;
+
+            if (queueing && gain > DELAY_BACKOFF_GAIN) {
+                gain = DELAY_BACKOFF_GAIN;
+            }
+
+            break;
+        }
+    }
+
+    delay->gain = gain;
+    *send_rate = bandwidth * gain;
+
+    if (*send_rate < CONGESTION_MIN_RATE) {
+        *send_rate = CONGESTION_MIN_RATE;
+    }
+
+    /* Resent packets are part of what the link can carry, so they don't get a
+     * rate of their own. */
+    *send_rate_requested = *send_rate;
+}
+
+/** END: Delay based congestion control **/
+
+static const Congestion_Control_Ops congestion_control_ops[] = {
+    {"queue", queue_init, queue_on_ack, queue_on_rtt, queue_update},
+    {"delay", delay_init, delay_on_ack, delay_on_rtt, delay_update},
+};
+
+#define NUM_CONGESTION_ALGORITHMS (sizeof(congestion_control_ops) / sizeof(congestion_control_ops[0]))
+
+static const Congestion_Control_Ops *get_ops(Congestion_Algorithm algorithm)
+{
+    if ((unsigned int)algorithm >= NUM_CONGESTION_ALGORITHMS) {
+        return nullptr;
+    }
+
+    return &congestion_control_ops[algorithm];
+}
+
+void congestion_control_init(Congestion_Control *cc, Congestion_Algorithm algorithm)
+{
+    if (get_ops(algorithm) == nullptr) {
+        algorithm = CONGESTION_ALGORITHM_QUEUE;
+    }
+
+    cc->algorithm = algorithm;
+    get_ops(algorithm)->init(cc);
+}
+
+void congestion_control_on_ack(Congestion_Control *cc, uint64_t time, uint32_t packets_acked)
+{
+    get_ops(cc->algorithm)->on_ack(cc, time, packets_acked);
+}
+
+void congestion_control_on_rtt(Congestion_Control *cc, uint64_t rtt)
+{
+    get_ops(cc->algorithm)->on_rtt(cc, rtt);
+}
+
+void congestion_control_update(Congestion_Control *cc, const Congestion_Interval *interval, double *send_rate,
+                               double *send_rate_requested)
+{
+    get_ops(cc->algorithm)->update(cc, interval, send_rate, send_rate_requested);
+}
+
+const char *congestion_algorithm_to_string(Congestion_Algorithm algorithm)
+{
+    const Congestion_Control_Ops *const ops = get_ops(algorithm);
+    return ops != nullptr ? ops->name : "<unknown>";
+}
@@ -0,0 +1,185 @@
+/*
+ * Congestion control for crypto connections: decides how many packets per
+ * second a connection may send.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef C_TOXCORE_TOXCORE_CONGESTION_CONTROL_H
+#define C_TOXCORE_TOXCORE_CONGESTION_CONTROL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Minimum packet rate per second. */
+#define CONGESTION_MIN_RATE 4.0
+
+/* Minimum packet queue max length. */
+#define CONGESTION_MIN_QUEUE_LENGTH 64
+
+/* Interval in ms at which congestion_control_update() is called. */
+#define CONGESTION_INTERVAL 50
+
+/* Timeout for increasing speed after congestion event (in ms). */
+#define CONGESTION_EVENT_TIMEOUT 1000
+
+/* Base current transfer speed on last CONGESTION_QUEUE_ARRAY_SIZE number of points taken
+   every CONGESTION_INTERVAL ms. */
+#define CONGESTION_QUEUE_ARRAY_SIZE 12
+#define CONGESTION_LAST_SENT_ARRAY_SIZE (CONGESTION_QUEUE_ARRAY_SIZE * 2)
+
+/* Number of intervals the delivery rate is averaged over, to smooth out acks
+ * arriving in bursts. */
+#define CONGESTION_DELAY_SAMPLE_INTERVALS 4
+
+/* Number of intervals the delay algorithm keeps delivery rates for. The
+ * bottleneck bandwidth is the highest of them. */
+#define CONGESTION_DELAY_BANDWIDTH_WINDOW 20
+
+/* Time in ms after which the lowest round trip time seen is measured again,
+ * so route changes are noticed. */
+#define CONGESTION_DELAY_MIN_RTT_WINDOW 10000
+
+typedef enum Congestion_Algorithm {
+    /* Infer the link speed from how the send queue grows and how many
+     * packets were sent and resent. */
+    CONGESTION_ALGORITHM_QUEUE = 0,
+    /* Estimate the bottleneck bandwidth from the delivery rate and the round
+     * trip time, send at that rate and back off when the round trip time
+     * grows. */
+    CONGESTION_ALGORITHM_DELAY = 1,
+} Congestion_Algorithm;
+
+/* What happened on a connection during the last interval. */
+typedef struct Congestion_Interval {
+    /* Current time in ms. */
+    uint64_t time;
+    /* New packets sent during the interval. */
+    uint32_t packets_sent;
+    /* Packets resent during the interval. */
+    uint32_t packets_resent;
+    /* Packets in the send queue, sent or not, that weren't acked yet. */
+    uint32_t send_queue_size;
+    /* Lowest round trip time in ms seen on the connection. */
+    uint64_t rtt;
+    /* Last time the connection ran out of packets it was allowed to send. */
+    uint64_t last_congestion_event;
+    /* Keep the current rates, e.g. because the connection just switched from
+     * TCP to UDP. */
+    bool hold_rate;
+} Congestion_Interval;
+
+typedef struct Congestion_Queue_State {
+    uint32_t last_sendqueue_size[CONGESTION_QUEUE_ARRAY_SIZE];
+    uint32_t last_sendqueue_counter;
+    long signed int last_num_packets_sent[CONGESTION_LAST_SENT_ARRAY_SIZE];
+    long signed int last_num_packets_resent[CONGESTION_LAST_SENT_ARRAY_SIZE];
+} Congestion_Queue_State;
+
+typedef struct Congestion_Delay_State {
+    uint8_t mode;
+
+    /* Packets acked in the current and the last few intervals, when the
+     * first and the last ack of each interval came and how many packets the
+     * first one acked. */
+    uint32_t acked[CONGESTION_DELAY_SAMPLE_INTERVALS];
+    uint32_t first_acked[CONGESTION_DELAY_SAMPLE_INTERVALS];
+    uint64_t first_ack_time[CONGESTION_DELAY_SAMPLE_INTERVALS];
+    uint64_t last_ack_time[CONGESTION_DELAY_SAMPLE_INTERVALS];
+    /* New packets sent in the current and the last few intervals. */
+    uint32_t sent[CONGESTION_DELAY_SAMPLE_INTERVALS];
+    /* Delivery rates in packets per second of the last intervals. */
+    double bandwidth[CONGESTION_DELAY_BANDWIDTH_WINDOW];
+    uint32_t interval_count;
+
+    /* Lowest round trip time samples of the current and the last few
+     * intervals, 0 if none. */
+    uint64_t rtt[CONGESTION_DELAY_SAMPLE_INTERVALS];
+    /* Lowest of them. Acks wait for the next request packet, so single
+     * samples vary by up to CONGESTION_INTERVAL. */
+    uint64_t latest_rtt;
+    /* Lowest round trip time, forgotten after CONGESTION_DELAY_MIN_RTT_WINDOW
+     * ms without a sample as low, when it is measured again. */
+    uint64_t min_rtt;
+    uint64_t min_rtt_time;
+    uint64_t probe_rtt_start;
+    uint64_t probe_rtt_min;
+
+    /* Startup ends when the bandwidth stops growing for a few rounds. */
+    double full_bandwidth;
+    uint8_t full_bandwidth_rounds;
+    uint64_t round_start;
+
+    uint8_t cycle_index;
+    uint64_t cycle_start;
+
+    /* Multiplier of the bandwidth used for the current rate, and whether it
+     * was lowered because packets queue up. */
+    double gain;
+    bool backing_off;
+} Congestion_Delay_State;
+
+typedef struct Congestion_Control {
+    Congestion_Algorithm algorithm;
+
+    union {
+        Congestion_Queue_State queue;
+        Congestion_Delay_State delay;
+    } state;
+} Congestion_Control;
+
+/**
+ * Reset cc to the start of a connection using algorithm. Unknown algorithms
+ * are replaced by CONGESTION_ALGORITHM_QUEUE.
+ */
+void congestion_control_init(Congestion_Control *cc, Congestion_Algorithm algorithm);
+
+/**
+ * Tell the controller that the peer acknowledged packets_acked packets at
+ * time, in ms.
+ */
+void congestion_control_on_ack(Congestion_Control *cc, uint64_t time, uint32_t packets_acked);
+
+/**
+ * Tell the controller about a round trip time sample in ms.
+ */
+void congestion_control_on_rtt(Congestion_Control *cc, uint64_t rtt);
+
+/**
+ * Update send_rate, the rate in packets per second at which new packets may
+ * be sent, and send_rate_requested, the rate including resent packets. Called
+ * every CONGESTION_INTERVAL ms.
+ */
+void congestion_control_update(Congestion_Control *cc, const Congestion_Interval *interval, double *send_rate,
+                               double *send_rate_requested);
+
+/**
+ * Return a short lowercase name for algorithm.
+ */
+const char *congestion_algorithm_to_string(Congestion_Algorithm algorithm);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif // C_TOXCORE_TOXCORE_CONGESTION_CONTROL_H
@@ -0,0 +1,179 @@
+#include "congestion_control.h"
+
+#include <algorithm>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+struct Rates {
+  double send_rate = CONGESTION_MIN_RATE;
+  double send_rate_requested = CONGESTION_MIN_RATE;
+};
+
+Congestion_Interval make_interval(uint64_t time, uint32_t packets_sent, uint32_t send_queue_size) {
+  Congestion_Interval interval{};
+  interval.time = time;
+  interval.packets_sent = packets_sent;
+  interval.send_queue_size = send_queue_size;
+  interval.rtt = 20;
+  return interval;
+}
+
+// Run the delay algorithm against a link that delivers at most bandwidth
+// packets per second, with the given round trip time once the link is full.
+void run_link(Congestion_Control *cc, Rates *rates, uint64_t *time, int intervals, double bandwidth,
+              uint64_t rtt) {
+  const uint32_t capacity = static_cast<uint32_t>(bandwidth * CONGESTION_INTERVAL / 1000);
+  double budget = 0;
+
+  for (int i = 0; i < intervals; ++i) {
+    budget += rates->send_rate * CONGESTION_INTERVAL / 1000;
+    const uint32_t sent = static_cast<uint32_t>(budget);
+    budget -= sent;
+    congestion_control_on_ack(cc, *time + 1, std::min(sent, capacity));
+    congestion_control_on_rtt(cc, rtt);
+    *time += CONGESTION_INTERVAL;
+    const Congestion_Interval interval = make_interval(*time, sent, 0);
+    congestion_control_update(cc, &interval, &rates->send_rate, &rates->send_rate_requested);
+  }
+}
+
+TEST(CongestionControl, UnknownAlgorithmFallsBackToQueue) {
+  Congestion_Control cc;
+  congestion_control_init(&cc, static_cast<Congestion_Algorithm>(42));
+  EXPECT_EQ(cc.algorithm, CONGESTION_ALGORITHM_QUEUE);
+}
+
+TEST(CongestionControl, AlgorithmNames) {
+  EXPECT_STREQ(congestion_algorithm_to_string(CONGESTION_ALGORITHM_QUEUE), "queue");
+  EXPECT_STREQ(congestion_algorithm_to_string(CONGESTION_ALGORITHM_DELAY), "delay");
+  EXPECT_STREQ(congestion_algorithm_to_string(static_cast<Congestion_Algorithm>(42)), "<unknown>");
+}
+
+TEST(CongestionControl, RatesNeverGoBelowMinimum) {
+  for (Congestion_Algorithm algorithm : {CONGESTION_ALGORITHM_QUEUE, CONGESTION_ALGORITHM_DELAY}) {
+    Congestion_Control cc;
+    congestion_control_init(&cc, algorithm);
+    Rates rates;
+
+    for (uint64_t time = CONGESTION_INTERVAL; time < 100 * CONGESTION_INTERVAL; time += CONGESTION_INTERVAL) {
+      const Congestion_Interval interval = make_interval(time, 0, 0);
+      congestion_control_update(&cc, &interval, &rates.send_rate, &rates.send_rate_requested);
+      EXPECT_GE(rates.send_rate, CONGESTION_MIN_RATE);
+      EXPECT_GE(rates.send_rate_requested, rates.send_rate);
+    }
+  }
+}
+
+TEST(CongestionControl, QueueSpeedsUpWhileTheQueueStaysEmpty) {
+  Congestion_Control cc;
+  congestion_control_init(&cc, CONGESTION_ALGORITHM_QUEUE);
+  Rates rates;
+  uint64_t time = 0;
+
+  for (int i = 0; i < CONGESTION_LAST_SENT_ARRAY_SIZE; ++i) {
+    time += CONGESTION_INTERVAL;
+    const Congestion_Interval interval = make_interval(time + CONGESTION_EVENT_TIMEOUT, 50, 0);
+    congestion_control_update(&cc, &interval, &rates.send_rate, &rates.send_rate_requested);
+  }
+
+  // 50 packets per interval is 1000 per second; without congestion events it
+  // asks for 20% more.
+  EXPECT_DOUBLE_EQ(rates.send_rate, 1200.0);
+}
+
+TEST(CongestionControl, QueueSlowsDownWhenTheQueueGrows) {
+  Congestion_Control cc;
+  congestion_control_init(&cc, CONGESTION_ALGORITHM_QUEUE);
+  Rates rates;
+  uint64_t time = 0;
+
+  for (int i = 0; i < CONGESTION_LAST_SENT_ARRAY_SIZE; ++i) {
+    time += CONGESTION_INTERVAL;
+    const Congestion_Interval interval = make_interval(time + CONGESTION_EVENT_TIMEOUT, 50, i * 100);
+    congestion_control_update(&cc, &interval, &rates.send_rate, &rates.send_rate_requested);
+  }
+
+  EXPECT_LT(rates.send_rate, 1000.0);
+}
+
+TEST(CongestionControl, HoldRateKeepsRates) {
+  for (Congestion_Algorithm algorithm : {CONGESTION_ALGORITHM_QUEUE, CONGESTION_ALGORITHM_DELAY}) {
+    Congestion_Control cc;
+    congestion_control_init(&cc, algorithm);
+    Rates rates;
+    rates.send_rate = 123.0;
+    rates.send_rate_requested = 456.0;
+
+    for (uint64_t time = CONGESTION_INTERVAL; time < 20 * CONGESTION_INTERVAL; time += CONGESTION_INTERVAL) {
+      congestion_control_on_ack(&cc, time, 50);
+      Congestion_Interval interval = make_interval(time, 50, 0);
+      interval.hold_rate = true;
+      congestion_control_update(&cc, &interval, &rates.send_rate, &rates.send_rate_requested);
+    }
+
+    EXPECT_EQ(rates.send_rate, 123.0);
+    EXPECT_EQ(rates.send_rate_requested, 456.0);
+  }
+}
+
+TEST(CongestionControl, DelaySettlesAtTheBottleneckBandwidth) {
+  Congestion_Control cc;
+  congestion_control_init(&cc, CONGESTION_ALGORITHM_DELAY);
+  Rates rates;
+  uint64_t time = 0;
+
+  run_link(&cc, &rates, &time, 400, 1000.0, 20);
+
+  // Averaged over a probing cycle the rate is the bottleneck bandwidth.
+  double sum = 0;
+  const int intervals = 80;
+
+  for (int i = 0; i < intervals; ++i) {
+    run_link(&cc, &rates, &time, 1, 1000.0, 20);
+    sum += rates.send_rate;
+  }
+
+  EXPECT_NEAR(sum / intervals, 1000.0, 100.0);
+}
+
+TEST(CongestionControl, DelayBacksOffWhenTheRoundTripTimeGrows) {
+  Congestion_Control cc;
+  congestion_control_init(&cc, CONGESTION_ALGORITHM_DELAY);
+  Rates rates;
+  uint64_t time = 0;
+
+  run_link(&cc, &rates, &time, 400, 1000.0, 20);
+
+  // The link now queues our packets: every sample is well over the minimum.
+  // Once the older samples are out of the window, it sends slower.
+  run_link(&cc, &rates, &time, CONGESTION_DELAY_SAMPLE_INTERVALS, 1000.0, 200);
+
+  for (int i = 0; i < 40; ++i) {
+    run_link(&cc, &rates, &time, 1, 1000.0, 200);
+    EXPECT_LE(rates.send_rate, 800.0);
+  }
+}
+
+TEST(CongestionControl, DelayKeepsItsEstimateWhileIdle) {
+  Congestion_Control cc;
+  congestion_control_init(&cc, CONGESTION_ALGORITHM_DELAY);
+  Rates rates;
+  uint64_t time = 0;
+
+  run_link(&cc, &rates, &time, 400, 1000.0, 20);
+  const double rate = rates.send_rate;
+
+  // Nothing to send for a few seconds: the intervals say nothing about the
+  // link, so the connection can resume at the old rate.
+  for (int i = 0; i < 100; ++i) {
+    time += CONGESTION_INTERVAL;
+    const Congestion_Interval interval = make_interval(time, 0, 0);
+    congestion_control_update(&cc, &interval, &rates.send_rate, &rates.send_rate_requested);
+  }
+
+  EXPECT_GE(rates.send_rate, rate * 0.75 - 1);
+}
+
+}  // namespace
@@ -79,6 +79,20 @@
 #error "CRYPTO_SHA512_SIZE should be equal to crypto_hash_sha512_BYTES"
 #endif
 
+#ifndef VANILLA_NACL
+#if CRYPTO_SYMMETRIC_KEY_SIZE != crypto_aead_aes256gcm_KEYBYTES
+#error "CRYPTO_SYMMETRIC_KEY_SIZE should be equal to crypto_aead_aes256gcm_KEYBYTES"
+#endif
+
+#if CRYPTO_MAC_SIZE != crypto_aead_aes256gcm_ABYTES
+#error "CRYPTO_MAC_SIZE should be equal to crypto_aead_aes256gcm_ABYTES"
+#endif
+
+#if CRYPTO_NONCE_SIZE < crypto_aead_aes256gcm_NPUBBYTES
+#error "CRYPTO_NONCE_SIZE should be at least crypto_aead_aes256gcm_NPUBBYTES"
+#endif
+#endif
+
 #if CRYPTO_PUBLIC_KEY_SIZE != 32
 #error "CRYPTO_PUBLIC_KEY_SIZE is required to be 32 bytes for public_key_cmp to work,"
 #endif
@@ -102,6 +116,15 @@ int32_t public_key_cmp(const uint8_t *pk1, const uint8_t *pk2)
     return crypto_verify_32(pk1, pk2);
 }
 
+uint64_t pk_hash(const uint64_t seed[2], const uint8_t *public_key)
+{
+    uint64_t lo;
+    uint64_t hi;
+    memcpy(&lo, public_key, sizeof(lo));
+    memcpy(&hi, public_key + sizeof(lo), sizeof(hi));
+    return ((lo ^ seed[0]) * UINT64_C(0x9e3779b97f4a7c15)) ^ ((hi ^ seed[1]) * UINT64_C(0xc2b2ae3d27d4eb4f));
+}
+
 uint8_t random_u08(void)
 {
     uint8_t randnum;
@@ -150,15 +173,26 @@ int32_t encrypt_precompute(const uint8_t *public_key, const uint8_t *secret_key,
     return crypto_box_beforenm(shared_key, public_key, secret_key);
 }
 
-int32_t encrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
-                               const uint8_t *plain, size_t length, uint8_t *encrypted)
+uint32_t encrypt_data_symmetric_batch(const uint8_t *secret_key, Crypto_Batch_Entry *entries, uint32_t count)
 {
-    if (length == 0 || !secret_key || !nonce || !plain || !encrypted) {
-        return -1;
+    size_t max_length = 0;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        entries[i].result = -1;
+
+        if (entries[i].length > max_length) {
+            max_length = entries[i].length;
+        }
+    }
+
+    if (max_length == 0 || !secret_key) {
+        return 0;
     }
 
-    const size_t size_temp_plain = length + crypto_box_ZEROBYTES;
-    const size_t size_temp_encrypted = length + crypto_box_MACBYTES + crypto_box_BOXZEROBYTES;
+    // The temporary buffers are big enough for the longest message, so they
+    // are only allocated once per batch.
+    const size_t size_temp_plain = max_length + crypto_box_ZEROBYTES;
+    const size_t size_temp_encrypted = max_length + crypto_box_MACBYTES + crypto_box_BOXZEROBYTES;
 
     uint8_t *temp_plain = crypto_malloc(size_temp_plain);
     uint8_t *temp_encrypted = crypto_malloc(size_temp_encrypted);
@@ -166,38 +200,57 @@ int32_t encrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
     if (temp_plain == nullptr || temp_encrypted == nullptr) {
         crypto_free(temp_plain, size_temp_plain);
         crypto_free(temp_encrypted, size_temp_encrypted);
-        return -1;
+        return 0;
     }
 
     memset(temp_plain, 0, crypto_box_ZEROBYTES);
-    // Pad the message with 32 0 bytes.
-    memcpy(temp_plain + crypto_box_ZEROBYTES, plain, length);
+    uint32_t done = 0;
 
-    if (crypto_box_afternm(temp_encrypted, temp_plain, length + crypto_box_ZEROBYTES, nonce,
-                           secret_key) != 0) {
-        crypto_free(temp_plain, size_temp_plain);
-        crypto_free(temp_encrypted, size_temp_encrypted);
-        return -1;
-    }
+    for (uint32_t i = 0; i < count; ++i) {
+        Crypto_Batch_Entry *const entry = &entries[i];
+
+        if (entry->length == 0 || !entry->nonce || !entry->input || !entry->output) {
+            continue;
+        }
+
+        // Pad the message with 32 0 bytes.
+        memcpy(temp_plain + crypto_box_ZEROBYTES, entry->input, entry->length);
 
-    // Unpad the encrypted message.
-    memcpy(encrypted, temp_encrypted + crypto_box_BOXZEROBYTES, length + crypto_box_MACBYTES);
+        if (crypto_box_afternm(temp_encrypted, temp_plain, entry->length + crypto_box_ZEROBYTES, entry->nonce,
+                               secret_key) != 0) {
+            continue;
+        }
+
+        // Unpad the encrypted message.
+        memcpy(entry->output, temp_encrypted + crypto_box_BOXZEROBYTES, entry->length + crypto_box_MACBYTES);
+        entry->result = entry->length + crypto_box_MACBYTES;
+        ++done;
+    }
 
     crypto_free(temp_plain, size_temp_plain);
     crypto_free(temp_encrypted, size_temp_encrypted);
 
-    return length + crypto_box_MACBYTES;
+    return done;
 }
 
-int32_t decrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
-                               const uint8_t *encrypted, size_t length, uint8_t *plain)
+uint32_t decrypt_data_symmetric_batch(const uint8_t *secret_key, Crypto_Batch_Entry *entries, uint32_t count)
 {
-    if (length <= crypto_box_BOXZEROBYTES || !secret_key || !nonce || !encrypted || !plain) {
-        return -1;
+    size_t max_length = 0;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        entries[i].result = -1;
+
+        if (entries[i].length > max_length) {
+            max_length = entries[i].length;
+        }
     }
 
-    const size_t size_temp_plain = length + crypto_box_ZEROBYTES;
-    const size_t size_temp_encrypted = length + crypto_box_BOXZEROBYTES;
+    if (max_length <= crypto_box_BOXZEROBYTES || !secret_key) {
+        return 0;
+    }
+
+    const size_t size_temp_plain = max_length + crypto_box_ZEROBYTES;
+    const size_t size_temp_encrypted = max_length + crypto_box_BOXZEROBYTES;
 
     uint8_t *temp_plain = crypto_malloc(size_temp_plain);
     uint8_t *temp_encrypted = crypto_malloc(size_temp_encrypted);
@@ -205,25 +258,180 @@ int32_t decrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
     if (temp_plain == nullptr || temp_encrypted == nullptr) {
         crypto_free(temp_plain, size_temp_plain);
         crypto_free(temp_encrypted, size_temp_encrypted);
-        return -1;
+        return 0;
     }
 
     memset(temp_encrypted, 0, crypto_box_BOXZEROBYTES);
-    // Pad the message with 16 0 bytes.
-    memcpy(temp_encrypted + crypto_box_BOXZEROBYTES, encrypted, length);
+    uint32_t done = 0;
 
-    if (crypto_box_open_afternm(temp_plain, temp_encrypted, length + crypto_box_BOXZEROBYTES, nonce,
-                                secret_key) != 0) {
-        crypto_free(temp_plain, size_temp_plain);
-        crypto_free(temp_encrypted, size_temp_encrypted);
-        return -1;
-    }
+    for (uint32_t i = 0; i < count; ++i) {
+        Crypto_Batch_Entry *const entry = &entries[i];
+
+        if (entry->length <= crypto_box_BOXZEROBYTES || !entry->nonce || !entry->input || !entry->output) {
+            continue;
+        }
+
+        // Pad the message with 16 0 bytes.
+        memcpy(temp_encrypted + crypto_box_BOXZEROBYTES, entry->input, entry->length);
 
-    memcpy(plain, temp_plain + crypto_box_ZEROBYTES, length - crypto_box_MACBYTES);
+        if (crypto_box_open_afternm(temp_plain, temp_encrypted, entry->length + crypto_box_BOXZEROBYTES, entry->nonce,
+                                    secret_key) != 0) {
+            continue;
+        }
+
+        memcpy(entry->output, temp_plain + crypto_box_ZEROBYTES, entry->length - crypto_box_MACBYTES);
+        entry->result = entry->length - crypto_box_MACBYTES;
+        ++done;
+    }
 
     crypto_free(temp_plain, size_temp_plain);
     crypto_free(temp_encrypted, size_temp_encrypted);
-    return length - crypto_box_MACBYTES;
+
+    return done;
+}
+
+int32_t encrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
+                               const uint8_t *plain, size_t length, uint8_t *encrypted)
+{
+    Crypto_Batch_Entry entry = {nonce, plain, length, encrypted, -1};
+    encrypt_data_symmetric_batch(secret_key, &entry, 1);
+    return entry.result;
+}
+
+int32_t decrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
+                               const uint8_t *encrypted, size_t length, uint8_t *plain)
+{
+    Crypto_Batch_Entry entry = {nonce, encrypted, length, plain, -1};
+    decrypt_data_symmetric_batch(secret_key, &entry, 1);
+    return entry.result;
+}
+
+bool crypto_aesgcm_available(void)
+{
+#ifndef VANILLA_NACL
+    /* The CPU features are detected by sodium_init(), which is safe to call
+     * more than once. */
+    if (sodium_init() == -1) {
+        return false;
+    }
+
+    return crypto_aead_aes256gcm_is_available() == 1;
+#else
+    return false;
+#endif
+}
+
+/* AES-256-GCM takes a 12 byte nonce. The last bytes of our nonces are the
+ * ones that are incremented, so they are the ones used.
+ *
+ * The key schedule is computed once per batch.
+ */
+uint32_t encrypt_data_aesgcm_batch(const uint8_t *key, Crypto_Batch_Entry *entries, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; ++i) {
+        entries[i].result = -1;
+    }
+
+#ifndef VANILLA_NACL
+
+    if (count == 0 || !key) {
+        return 0;
+    }
+
+    crypto_aead_aes256gcm_state state;
+
+    if (crypto_aead_aes256gcm_beforenm(&state, key) != 0) {
+        crypto_memzero(&state, sizeof(state));
+        return 0;
+    }
+
+    uint32_t done = 0;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        Crypto_Batch_Entry *const entry = &entries[i];
+        unsigned long long encrypted_length;
+
+        if (entry->length == 0 || !entry->nonce || !entry->input || !entry->output) {
+            continue;
+        }
+
+        if (crypto_aead_aes256gcm_encrypt_afternm(entry->output, &encrypted_length, entry->input, entry->length,
+                nullptr, 0, nullptr,
+                entry->nonce + (crypto_box_NONCEBYTES - crypto_aead_aes256gcm_NPUBBYTES), &state) != 0) {
+            continue;
+        }
+
+        entry->result = encrypted_length;
+        ++done;
+    }
+
+    crypto_memzero(&state, sizeof(state));
+    return done;
+#else
+    return 0;
+#endif
+}
+
+uint32_t decrypt_data_aesgcm_batch(const uint8_t *key, Crypto_Batch_Entry *entries, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; ++i) {
+        entries[i].result = -1;
+    }
+
+#ifndef VANILLA_NACL
+
+    if (count == 0 || !key) {
+        return 0;
+    }
+
+    crypto_aead_aes256gcm_state state;
+
+    if (crypto_aead_aes256gcm_beforenm(&state, key) != 0) {
+        crypto_memzero(&state, sizeof(state));
+        return 0;
+    }
+
+    uint32_t done = 0;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        Crypto_Batch_Entry *const entry = &entries[i];
+        unsigned long long plain_length;
+
+        if (entry->length <= crypto_aead_aes256gcm_ABYTES || !entry->nonce || !entry->input || !entry->output) {
+            continue;
+        }
+
+        if (crypto_aead_aes256gcm_decrypt_afternm(entry->output, &plain_length, nullptr, entry->input, entry->length,
+                nullptr, 0,
+                entry->nonce + (crypto_box_NONCEBYTES - crypto_aead_aes256gcm_NPUBBYTES), &state) != 0) {
+            continue;
+        }
+
+        entry->result = plain_length;
+        ++done;
+    }
+
+    crypto_memzero(&state, sizeof(state));
+    return done;
+#else
+    return 0;
+#endif
+}
+
+int32_t encrypt_data_aesgcm(const uint8_t *key, const uint8_t *nonce,
+                            const uint8_t *plain, size_t length, uint8_t *encrypted)
+{
+    Crypto_Batch_Entry entry = {nonce, plain, length, encrypted, -1};
+    encrypt_data_aesgcm_batch(key, &entry, 1);
+    return entry.result;
+}
+
+int32_t decrypt_data_aesgcm(const uint8_t *key, const uint8_t *nonce,
+                            const uint8_t *encrypted, size_t length, uint8_t *plain)
+{
+    Crypto_Batch_Entry entry = {nonce, encrypted, length, plain, -1};
+    decrypt_data_aesgcm_batch(key, &entry, 1);
+    return entry.result;
 }
 
 int32_t encrypt_data(const uint8_t *public_key, const uint8_t *secret_key, const uint8_t *nonce,
@@ -126,6 +126,15 @@ void crypto_sha512(uint8_t *hash, const uint8_t *data, size_t length);
  */
 int32_t public_key_cmp(const uint8_t *pk1, const uint8_t *pk2);
 
+/**
+ * Hash the first 16 bytes of a public key for a hash table. The seed should
+ * be random per table, so peers can't pick keys that all collide. Not a
+ * cryptographic hash.
+ *
+ * Use the high bits of the result, they are the best mixed.
+ */
+uint64_t pk_hash(const uint64_t seed[2], const uint8_t *public_key);
+
 /**
  * Return a random 8 bit integer.
  */
@@ -228,6 +237,62 @@ int32_t encrypt_data_symmetric(const uint8_t *shared_key, const uint8_t *nonce,
 int32_t decrypt_data_symmetric(const uint8_t *shared_key, const uint8_t *nonce, const uint8_t *encrypted, size_t length,
                                uint8_t *plain);
 
+/**
+ * Check if encrypt_data_aesgcm/decrypt_data_aesgcm can be used. AES-256-GCM
+ * is only provided when the CPU has hardware support for it.
+ *
+ * @return true if it can, false if it can't.
+ */
+bool crypto_aesgcm_available(void);
+
+/**
+ * Encrypts plain of length length to encrypted of length + CRYPTO_MAC_SIZE
+ * with AES-256-GCM, using a key CRYPTO_SYMMETRIC_KEY_SIZE big and the last
+ * 12 bytes of a CRYPTO_NONCE_SIZE byte nonce.
+ *
+ * @return -1 if there was a problem, length of encrypted data if everything
+ * was fine.
+ */
+int32_t encrypt_data_aesgcm(const uint8_t *key, const uint8_t *nonce, const uint8_t *plain, size_t length,
+                            uint8_t *encrypted);
+
+/**
+ * Decrypts encrypted of length length to plain of length length -
+ * CRYPTO_MAC_SIZE with AES-256-GCM, using a key CRYPTO_SYMMETRIC_KEY_SIZE
+ * big and the last 12 bytes of a CRYPTO_NONCE_SIZE byte nonce.
+ *
+ * @return -1 if there was a problem (decryption failed), length of plain data
+ * if everything was fine.
+ */
+int32_t decrypt_data_aesgcm(const uint8_t *key, const uint8_t *nonce, const uint8_t *encrypted, size_t length,
+                            uint8_t *plain);
+
+/**
+ * A message encrypted or decrypted as part of a batch.
+ */
+typedef struct Crypto_Batch_Entry {
+    /* A CRYPTO_NONCE_SIZE byte nonce. */
+    const uint8_t *nonce;
+    const uint8_t *input;
+    size_t length;
+    uint8_t *output;
+    /* Set to what the single message function returned for this entry. */
+    int32_t result;
+} Crypto_Batch_Entry;
+
+/**
+ * Encrypt or decrypt count messages with the same key. Each entry gets the
+ * same result as calling the single message function on it, e.g.
+ * encrypt_data_symmetric for encrypt_data_symmetric_batch, but the work that
+ * only depends on the key is only done once per batch.
+ *
+ * @return the number of entries that were encrypted or decrypted.
+ */
+uint32_t encrypt_data_symmetric_batch(const uint8_t *shared_key, Crypto_Batch_Entry *entries, uint32_t count);
+uint32_t decrypt_data_symmetric_batch(const uint8_t *shared_key, Crypto_Batch_Entry *entries, uint32_t count);
+uint32_t encrypt_data_aesgcm_batch(const uint8_t *key, Crypto_Batch_Entry *entries, uint32_t count);
+uint32_t decrypt_data_aesgcm_batch(const uint8_t *key, Crypto_Batch_Entry *entries, uint32_t count);
+
 /**
  * Increment the given nonce by 1 in big endian (rightmost byte incremented
  * first).
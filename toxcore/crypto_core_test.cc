@@ -91,4 +91,120 @@ TEST(CryptoCore, MemcmpTimingIsDataIndependent) {
       << "Time of the different data comparison: " << not_same_median << " clocks";
 }
 
+TEST(CryptoCore, AesgcmRoundTripsAndRejectsTamperedData) {
+  if (!crypto_aesgcm_available()) {
+    GTEST_SKIP() << "AES-256-GCM is not supported on this CPU";
+  }
+
+  uint8_t key[CRYPTO_SYMMETRIC_KEY_SIZE];
+  uint8_t nonce[CRYPTO_NONCE_SIZE];
+  new_symmetric_key(key);
+  random_nonce(nonce);
+
+  uint8_t plain[1024];
+  uint8_t encrypted[sizeof(plain) + CRYPTO_MAC_SIZE];
+  uint8_t decrypted[sizeof(plain)];
+  random_bytes(plain, sizeof(plain));
+
+  ASSERT_EQ(encrypt_data_aesgcm(key, nonce, plain, sizeof(plain), encrypted), int32_t(sizeof(encrypted)));
+  ASSERT_EQ(decrypt_data_aesgcm(key, nonce, encrypted, sizeof(encrypted), decrypted), int32_t(sizeof(plain)));
+  EXPECT_EQ(memcmp(plain, decrypted, sizeof(plain)), 0);
+
+  // Only the last 12 bytes of the nonce are used.
+  uint8_t other_nonce[CRYPTO_NONCE_SIZE];
+  memcpy(other_nonce, nonce, sizeof(nonce));
+  other_nonce[0] ^= 1;
+  EXPECT_EQ(decrypt_data_aesgcm(key, other_nonce, encrypted, sizeof(encrypted), decrypted), int32_t(sizeof(plain)));
+
+  increment_nonce(other_nonce);
+  EXPECT_EQ(decrypt_data_aesgcm(key, other_nonce, encrypted, sizeof(encrypted), decrypted), -1);
+
+  encrypted[10] ^= 1;
+  EXPECT_EQ(decrypt_data_aesgcm(key, nonce, encrypted, sizeof(encrypted), decrypted), -1);
+}
+
+using BatchFunction = uint32_t(const uint8_t *, Crypto_Batch_Entry *, uint32_t);
+using SingleFunction = int32_t(const uint8_t *, const uint8_t *, const uint8_t *, size_t, uint8_t *);
+
+/**
+ * Check that a batch gives the same results as encrypting and decrypting each
+ * message on its own, and that a bad message doesn't affect the others.
+ */
+void check_batch(BatchFunction *encrypt_batch, BatchFunction *decrypt_batch, SingleFunction *decrypt) {
+  enum { COUNT = 4, MAX_LENGTH = 300 };
+
+  uint8_t key[CRYPTO_SYMMETRIC_KEY_SIZE];
+  uint8_t nonces[COUNT][CRYPTO_NONCE_SIZE];
+  uint8_t plain[COUNT][MAX_LENGTH];
+  uint8_t encrypted[COUNT][MAX_LENGTH + CRYPTO_MAC_SIZE];
+  uint8_t decrypted[COUNT][MAX_LENGTH];
+  Crypto_Batch_Entry entries[COUNT];
+  new_symmetric_key(key);
+
+  for (uint32_t i = 0; i < COUNT; ++i) {
+    random_nonce(nonces[i]);
+    random_bytes(plain[i], MAX_LENGTH);
+    entries[i] = {nonces[i], plain[i], MAX_LENGTH - i * 50, encrypted[i], 0};
+  }
+
+  ASSERT_EQ(encrypt_batch(key, entries, COUNT), uint32_t(COUNT));
+
+  for (uint32_t i = 0; i < COUNT; ++i) {
+    const size_t length = MAX_LENGTH - i * 50;
+    ASSERT_EQ(entries[i].result, int32_t(length + CRYPTO_MAC_SIZE));
+    ASSERT_EQ(decrypt(key, nonces[i], encrypted[i], length + CRYPTO_MAC_SIZE, decrypted[i]), int32_t(length));
+    EXPECT_EQ(memcmp(plain[i], decrypted[i], length), 0);
+  }
+
+  encrypted[1][0] ^= 1;
+
+  for (uint32_t i = 0; i < COUNT; ++i) {
+    entries[i] = {nonces[i], encrypted[i], MAX_LENGTH - i * 50 + CRYPTO_MAC_SIZE, decrypted[i], 0};
+  }
+
+  memset(decrypted, 0, sizeof(decrypted));
+  EXPECT_EQ(decrypt_batch(key, entries, COUNT), uint32_t(COUNT - 1));
+  EXPECT_EQ(entries[1].result, -1);
+
+  for (uint32_t i = 0; i < COUNT; ++i) {
+    if (i != 1) {
+      EXPECT_EQ(entries[i].result, int32_t(MAX_LENGTH - i * 50));
+      EXPECT_EQ(memcmp(plain[i], decrypted[i], MAX_LENGTH - i * 50), 0);
+    }
+  }
+}
+
+TEST(CryptoCore, SymmetricBatchMatchesSingleMessages) {
+  check_batch(encrypt_data_symmetric_batch, decrypt_data_symmetric_batch, decrypt_data_symmetric);
+}
+
+TEST(CryptoCore, AesgcmBatchMatchesSingleMessages) {
+  if (!crypto_aesgcm_available()) {
+    GTEST_SKIP() << "AES-256-GCM is not supported on this CPU";
+  }
+
+  check_batch(encrypt_data_aesgcm_batch, decrypt_data_aesgcm_batch, decrypt_data_aesgcm);
+}
+
+TEST(CryptoCore, PkHashDependsOnSeedAndFirst16Bytes) {
+  uint8_t pk[CRYPTO_PUBLIC_KEY_SIZE];
+  uint8_t sk[CRYPTO_SECRET_KEY_SIZE];
+  crypto_new_keypair(pk, sk);
+
+  const uint64_t seed[2] = {random_u64(), random_u64()};
+  const uint64_t other_seed[2] = {seed[0] + 1, seed[1]};
+  const uint64_t hash = pk_hash(seed, pk);
+
+  EXPECT_EQ(pk_hash(seed, pk), hash);
+  EXPECT_NE(pk_hash(other_seed, pk), hash);
+
+  uint8_t other_pk[CRYPTO_PUBLIC_KEY_SIZE];
+  memcpy(other_pk, pk, sizeof(other_pk));
+  other_pk[CRYPTO_PUBLIC_KEY_SIZE - 1] ^= 1;
+  EXPECT_EQ(pk_hash(seed, other_pk), hash);
+
+  other_pk[15] ^= 1;
+  EXPECT_NE(pk_hash(seed, other_pk), hash);
+}
+
 }  // namespace
@@ -61,6 +61,7 @@ typedef struct Friend_Conn {
     uint64_t ping_lastrecv;
     uint64_t ping_lastsent;
     uint64_t share_relays_lastsent;
+    bool capabilities_sent;
 
     Friend_Conn_Callbacks callbacks[MAX_FRIEND_CONNECTION_CALLBACKS];
 
@@ -390,6 +391,7 @@ static int handle_status(void *object, int number, uint8_t status, void *userdat
         friend_con->status = FRIENDCONN_STATUS_CONNECTED;
         friend_con->ping_lastrecv = mono_time_get(fr_c->mono_time);
         friend_con->share_relays_lastsent = 0;
+        friend_con->capabilities_sent = 0;
         onion_set_friend_online(fr_c->onion_c, friend_con->onion_friendnum, status);
     } else {  /* Went offline. */
         if (friend_con->status != FRIENDCONN_STATUS_CONNECTING) {
@@ -473,6 +475,18 @@ static int handle_packet(void *object, int number, const uint8_t *data, uint16_t
         return 0;
     }
 
+    if (data[0] == PACKET_ID_CAPABILITIES) {
+        /* Later versions may append more. */
+        if (length < 1 + sizeof(uint32_t)) {
+            return -1;
+        }
+
+        uint32_t capabilities;
+        net_unpack_u32(data + 1, &capabilities);
+        crypto_set_peer_capabilities(fr_c->net_crypto, friend_con->crypt_connection_id, capabilities);
+        return 0;
+    }
+
     if (data[0] == PACKET_ID_SHARE_RELAYS) {
         Node_format nodes[MAX_SHARED_RELAYS];
         const int n = unpack_nodes(nodes, MAX_SHARED_RELAYS, nullptr, data + 1, length - 1, 1);
@@ -626,6 +640,31 @@ static int send_ping(const Friend_Connections *fr_c, int friendcon_id)
     return -1;
 }
 
+/* Tell the friend which net_crypto extensions we support.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_capabilities(const Friend_Connections *fr_c, int friendcon_id)
+{
+    Friend_Conn *const friend_con = get_conn(fr_c, friendcon_id);
+
+    if (!friend_con) {
+        return -1;
+    }
+
+    uint8_t packet[1 + sizeof(uint32_t)];
+    packet[0] = PACKET_ID_CAPABILITIES;
+    net_pack_u32(packet + 1, crypto_capabilities(fr_c->net_crypto));
+
+    if (write_cryptpacket(fr_c->net_crypto, friend_con->crypt_connection_id, packet, sizeof(packet), 0) == -1) {
+        return -1;
+    }
+
+    friend_con->capabilities_sent = 1;
+    return 0;
+}
+
 /* Increases lock_count for the connection with friendcon_id by 1.
  *
  * return 0 on success.
@@ -948,6 +987,10 @@ void do_friend_connections(Friend_Connections *fr_c, void *userdata)
                     send_ping(fr_c, i);
                 }
 
+                if (!friend_con->capabilities_sent) {
+                    send_capabilities(fr_c, i);
+                }
+
                 if (friend_con->share_relays_lastsent + SHARE_RELAYS_INTERVAL < temp_time) {
                     send_relays(fr_c, i);
                 }
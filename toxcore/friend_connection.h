@@ -36,6 +36,7 @@
 #define PACKET_ID_ALIVE 16
 #define PACKET_ID_SHARE_RELAYS 17
 #define PACKET_ID_FRIEND_REQUESTS 18
+#define PACKET_ID_CAPABILITIES 19
 
 /* Interval between the sending of ping packets. */
 #define FRIEND_PING_INTERVAL 8
@@ -34,16 +34,145 @@
 #include <string.h>
 
 #include "mono_time.h"
+#include "pk_map.h"
 #include "util.h"
 
 typedef struct Packet_Data {
     uint64_t sent_time;
     uint16_t length;
+    bool delivered; /* Received packet passed on ahead of the ones before it. */
     uint8_t data[MAX_CRYPTO_DATA_SIZE];
 } Packet_Data;
 
+/* PACKET_ID_UNORDERED, then the number of barrier packets sent before it. An
+ * unordered packet is only passed on ahead of its turn once the receiver has
+ * passed on as many barriers, so it can't overtake the friend going online. */
+#define CRYPTO_UNORDERED_HEADER_SIZE (1 + sizeof(uint16_t))
+
+/* Packets up to this size wait for others to be sent together with them if
+ * coalescing is enabled. */
+#define CRYPTO_COALESCE_MAX_PACKET_SIZE 256
+
+/* Each packet in a PACKET_ID_BATCH packet is preceded by its packet number
+ * and its length. */
+#define CRYPTO_BATCH_ENTRY_HEADER_SIZE (sizeof(uint32_t) + sizeof(uint16_t))
+
+/* Packet sizes path MTU discovery tries in turn: 1500 and 9000 byte frames
+ * with IPv6 and UDP headers, and one in between. */
+static const uint16_t pmtu_probe_sizes[] = {1452, 4052, MAX_CRYPTO_PMTU_PACKET_SIZE};
+
+/* PACKET_ID_PMTU_PROBE and PACKET_ID_PMTU_ACK, then the size of the probe. */
+#define CRYPTO_PMTU_PACKET_SIZE (1 + sizeof(uint16_t))
+
+/* Time in ms after which a probe without an ack is sent again, and the number
+ * of times it is sent before the size is considered too big. */
+#define PMTU_PROBE_TIMEOUT 1000
+#define PMTU_MAX_PROBES 3
+
+/* Time in ms before a larger size is tried after a probe failed. */
+#define PMTU_SEARCH_INTERVAL (10 * 60 * 1000)
+
+/* Interval in ms at which the size in use is probed again, so a path that
+ * stopped carrying it falls back to MAX_CRYPTO_PACKET_SIZE. */
+#define PMTU_CONFIRM_INTERVAL (30 * 1000)
+
+/* cookie timeout in seconds */
+#define COOKIE_TIMEOUT 15
+#define COOKIE_DATA_LENGTH (uint16_t)(CRYPTO_PUBLIC_KEY_SIZE * 2)
+#define COOKIE_CONTENTS_LENGTH (uint16_t)(sizeof(uint64_t) + COOKIE_DATA_LENGTH)
+#define COOKIE_LENGTH (uint16_t)(CRYPTO_NONCE_SIZE + COOKIE_CONTENTS_LENGTH + CRYPTO_MAC_SIZE)
+
+/* A peer we were connected to recently can send a handshake with a resumption
+ * cookie instead of asking for a cookie first. Resumption cookies are valid
+ * for this long in ms, can be used once, and a fresh one is sent every
+ * RESUME_COOKIE_INTERVAL ms while connected.
+ */
+#define RESUME_COOKIE_TIMEOUT (5 * 60 * 1000)
+#define RESUME_COOKIE_INTERVAL (60 * 1000)
+
+/* Time in ms a resumption cookie we got is used for, leaving a margin for
+ * the time it took to arrive. */
+#define RESUME_COOKIE_USE_TIMEOUT (RESUME_COOKIE_TIMEOUT - (10 * 1000))
+
+/* PACKET_ID_RESUME_COOKIE, then the cookie. */
+#define RESUME_COOKIE_PACKET_SIZE (1 + COOKIE_LENGTH)
+
+/* Number of peers resumption state is kept for. */
+#define CRYPTO_RESUME_ENTRIES 64
+
+/* What is remembered about a peer for session resumption. It outlives the
+ * connection to the peer.
+ */
+typedef struct Resume_Entry {
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    /* Time the entry was last changed, 0 if it is free. */
+    uint64_t last_used;
+    /* Resumption cookies we issued to the peer up to this time are no longer
+     * accepted. */
+    uint64_t revoked_until;
+    /* The resumption cookie the peer issued to us, the time we got it, 0 if
+     * there is none, and the dht public key the peer had then. */
+    uint8_t cookie[COOKIE_LENGTH];
+    uint64_t cookie_time;
+    uint8_t dht_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+} Resume_Entry;
+
+/* Number of slots a packet array starts with once the first packet is added.
+ * It doubles whenever it runs out of space, up to CRYPTO_PACKET_BUFFER_SIZE.
+ * Must be a power of 2.
+ */
+#define CRYPTO_PACKET_BUFFER_INITIAL_SIZE 16
+
+/* Number of packets allocated from the system at once by the packet pool. */
+#define CRYPTO_PACKET_SLAB_SIZE 32
+
+/* Where the packets in all send and receive arrays of a Net_Crypto come from.
+ * Packets are allocated while holding the connection mutex, which differs
+ * between connections, so the pool has its own mutex.
+ */
+typedef struct Packet_Pool {
+    Slab *slab;
+    pthread_mutex_t mutex;
+} Packet_Pool;
+
+/* Maximum number of data packets encrypted or decrypted in one batch. */
+#define CRYPTO_BATCH_SIZE 8
+
+/* Size of the decrypted part of a data packet. */
+#define MAX_DATA_DATA_PACKET_SIZE (MAX_CRYPTO_PMTU_PACKET_SIZE - (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE))
+
+/* A data packet received over UDP. It is decrypted together with the packets
+ * received right after it for the same connection, see
+ * handle_received_packets().
+ */
+typedef struct Received_Packet {
+    int crypt_connection_id;
+    IP_Port source;
+    uint16_t length;
+    uint8_t packet[MAX_CRYPTO_PMTU_PACKET_SIZE];
+    uint8_t plain[MAX_DATA_DATA_PACKET_SIZE];
+} Received_Packet;
+
+typedef struct Scheduled_Connection {
+    uint64_t run_time;
+    uint32_t crypt_connection_id;
+} Scheduled_Connection;
+
+/* Binary min-heap of connections ordered by the time send_crypto_packets()
+ * has something to do for them.
+ */
+typedef struct Crypto_Schedule {
+    Scheduled_Connection *heap;
+    uint32_t size;
+    uint32_t capacity;
+    /* Connections are woken up from the threads sending packets. */
+    pthread_mutex_t mutex;
+} Crypto_Schedule;
+
 typedef struct Packets_Array {
-    Packet_Data *buffer[CRYPTO_PACKET_BUFFER_SIZE];
+    /* Ring of capacity slots, nullptr until the first packet is added. */
+    Packet_Data **buffer;
+    uint32_t  capacity;
     uint32_t  buffer_start;
     uint32_t  buffer_end; /* packet numbers in array: {buffer_start, buffer_end) */
 } Packets_Array;
@@ -56,6 +185,7 @@ typedef struct Crypto_Connection {
     uint8_t sessionsecret_key[CRYPTO_SECRET_KEY_SIZE]; /* Our private key for this session. */
     uint8_t peersessionpublic_key[CRYPTO_PUBLIC_KEY_SIZE]; /* The public key of the peer. */
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE]; /* The precomputed shared key from encrypt_precompute. */
+    uint8_t aesgcm_key[CRYPTO_SYMMETRIC_KEY_SIZE]; /* The key for AES-256-GCM data packets. */
     /**
      * 0 if no connection,
      * 1 we are sending cookie request packets,
@@ -111,22 +241,78 @@ typedef struct Crypto_Connection {
     uint64_t last_packets_left_requested_set;
     double last_packets_left_requested_rem;
 
-    uint32_t last_sendqueue_size[CONGESTION_QUEUE_ARRAY_SIZE];
-    uint32_t last_sendqueue_counter;
-    long signed int last_num_packets_sent[CONGESTION_LAST_SENT_ARRAY_SIZE];
-    long signed int last_num_packets_resent[CONGESTION_LAST_SENT_ARRAY_SIZE];
+    Congestion_Control congestion;
     uint32_t packets_sent;
     uint32_t packets_resent;
     uint64_t last_congestion_event;
     uint64_t rtt_time;
 
+    /* Totals since the connection was created, see crypto_connection_stats(). */
+    uint64_t total_packets_sent;
+    uint64_t total_packets_resent;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+
     /* TCP_connection connection_number */
     unsigned int connection_number_tcp;
 
     uint8_t maximum_speed_reached;
 
+    /* A write_cryptpacket() failed because the send queue was full. */
+    bool sendqueue_blocked;
+    /* It failed because packets_left ran out. Cleared when do_net_crypto()
+     * refills packets_left, not when the queue drains. */
+    bool sendqueue_rate_limited;
+
+    /* CRYPTO_CAPABILITY_* extensions the peer supports. */
+    uint32_t peer_capabilities;
+
+    /* Stream state, see Crypto_Stream. Sequence numbers count from the first
+     * packet sent with a stream header. */
+    bool streams_sending;
+    uint16_t stream_send_seq[CRYPTO_NUM_STREAMS];
+    /* Set once the peer's first packet with a stream header was passed on. */
+    bool streams_receiving;
+    uint16_t stream_recv_seq[CRYPTO_NUM_STREAMS];
+    /* Packets of the stream received ahead of their turn, and whether one of
+     * them may be next now. */
+    uint32_t stream_waiting[CRYPTO_NUM_STREAMS];
+    bool stream_check[CRYPTO_NUM_STREAMS];
+
+    /* Number of CRYPTO_STREAM_BARRIER packets sent and passed on. */
+    uint16_t barriers_sent;
+    uint16_t barriers_received;
+
+    /* Packets waiting to be sent as one PACKET_ID_BATCH packet at
+     * coalesce_deadline. Protected by mutex. */
+    uint8_t coalesce_buffer[MAX_CRYPTO_PMTU_DATA_SIZE];
+    uint16_t coalesce_length;
+    uint64_t coalesce_deadline;
+
+    /* Path MTU discovery state, see do_pmtu_discovery(). pmtu is the largest
+     * packet size confirmed to reach the peer at pmtu_ip_port, 0 if only
+     * MAX_CRYPTO_PACKET_SIZE is used. */
+    uint16_t pmtu;
+    IP_Port pmtu_ip_port;
+    uint16_t pmtu_probe_size;
+    IP_Port pmtu_probe_ip_port;
+    uint8_t pmtu_probes_sent;
+    uint64_t pmtu_probe_time;
+    uint64_t pmtu_search_time;
+    uint64_t pmtu_confirm_time;
+
+    /* The connection was started with a resumption cookie instead of a cookie
+     * request, and when we last sent the peer a resumption cookie. */
+    bool resuming;
+    uint64_t resume_cookie_sent_time;
+
     pthread_mutex_t mutex;
 
+    /* Position in the schedule plus one, 0 if the connection isn't in it. */
+    uint32_t schedule_index;
+    /* Number of packet counter intervals in a row without any traffic. */
+    uint32_t idle_ticks;
+
     dht_pk_cb *dht_pk_callback;
     void *dht_pk_callback_object;
     uint32_t dht_pk_callback_number;
@@ -142,6 +328,10 @@ struct Net_Crypto {
     Crypto_Connection *crypto_connections;
     pthread_mutex_t tcp_mutex;
 
+    Packet_Pool packet_pool;
+
+    Crypto_Schedule schedule;
+
     pthread_mutex_t connections_mutex;
     unsigned int connection_use_counter;
 
@@ -153,6 +343,18 @@ struct Net_Crypto {
 
     /* The secret key used for cookies */
     uint8_t secret_symmetric_key[CRYPTO_SYMMETRIC_KEY_SIZE];
+    /* The secret key used for resumption cookies, so they can't be mistaken
+     * for other cookies. */
+    uint8_t resume_symmetric_key[CRYPTO_SYMMETRIC_KEY_SIZE];
+
+    Resume_Entry resume_entries[CRYPTO_RESUME_ENTRIES];
+
+    /* CRYPTO_CAPABILITY_* extensions we support. */
+    uint32_t capabilities;
+
+    /* Data packets received over UDP and not handled yet. */
+    Received_Packet received_packets[CRYPTO_BATCH_SIZE];
+    uint32_t received_packets_length;
 
     new_connection_cb *new_connection_callback;
     void *new_connection_callback_object;
@@ -160,7 +362,13 @@ struct Net_Crypto {
     /* The current optimal sleep time */
     uint32_t current_sleep_time;
 
+    Congestion_Algorithm congestion_algorithm;
+    uint16_t coalescing_delay;
+
     BS_List ip_port_list;
+
+    /* Ids of the connections by the real public key of the peer. */
+    PK_Map *real_pk_map;
 };
 
 const uint8_t *nc_get_self_public_key(const Net_Crypto *c)
@@ -183,6 +391,23 @@ DHT *nc_get_dht(const Net_Crypto *c)
     return c->dht;
 }
 
+void nc_get_packet_pool_stats(Net_Crypto *c, Slab_Stats *stats)
+{
+    pthread_mutex_lock(&c->packet_pool.mutex);
+    slab_get_stats(c->packet_pool.slab, stats);
+    pthread_mutex_unlock(&c->packet_pool.mutex);
+}
+
+void nc_set_congestion_algorithm(Net_Crypto *c, Congestion_Algorithm algorithm)
+{
+    c->congestion_algorithm = algorithm;
+}
+
+void nc_set_coalescing_delay(Net_Crypto *c, uint16_t delay)
+{
+    c->coalescing_delay = min_u32(delay, CRYPTO_MAX_COALESCING_DELAY);
+}
+
 static uint8_t crypt_connection_id_not_valid(const Net_Crypto *c, int crypt_connection_id)
 {
     if ((uint32_t)crypt_connection_id >= c->crypto_connections_length) {
@@ -200,11 +425,6 @@ static uint8_t crypt_connection_id_not_valid(const Net_Crypto *c, int crypt_conn
     return 0;
 }
 
-/* cookie timeout in seconds */
-#define COOKIE_TIMEOUT 15
-#define COOKIE_DATA_LENGTH (uint16_t)(CRYPTO_PUBLIC_KEY_SIZE * 2)
-#define COOKIE_CONTENTS_LENGTH (uint16_t)(sizeof(uint64_t) + COOKIE_DATA_LENGTH)
-#define COOKIE_LENGTH (uint16_t)(CRYPTO_NONCE_SIZE + COOKIE_CONTENTS_LENGTH + CRYPTO_MAC_SIZE)
 
 #define COOKIE_REQUEST_PLAIN_LENGTH (uint16_t)(COOKIE_DATA_LENGTH + sizeof(uint64_t))
 #define COOKIE_REQUEST_LENGTH (uint16_t)(1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE + COOKIE_REQUEST_PLAIN_LENGTH + CRYPTO_MAC_SIZE)
@@ -244,18 +464,17 @@ static int create_cookie_request(const Net_Crypto *c, uint8_t *packet, uint8_t *
     return (1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE + len);
 }
 
-/* Create cookie of length COOKIE_LENGTH from bytes of length COOKIE_DATA_LENGTH using encryption_key
+/* Create cookie of length COOKIE_LENGTH from bytes of length COOKIE_DATA_LENGTH and cookie_time
+ * using encryption_key
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int create_cookie(const Logger *log, const Mono_Time *mono_time, uint8_t *cookie, const uint8_t *bytes,
-                         const uint8_t *encryption_key)
+static int seal_cookie(uint8_t *cookie, const uint8_t *bytes, uint64_t cookie_time, const uint8_t *encryption_key)
 {
     uint8_t contents[COOKIE_CONTENTS_LENGTH];
-    const uint64_t temp_time = mono_time_get(mono_time);
-    memcpy(contents, &temp_time, sizeof(temp_time));
-    memcpy(contents + sizeof(temp_time), bytes, COOKIE_DATA_LENGTH);
+    memcpy(contents, &cookie_time, sizeof(cookie_time));
+    memcpy(contents + sizeof(cookie_time), bytes, COOKIE_DATA_LENGTH);
     random_nonce(cookie);
     int len = encrypt_data_symmetric(encryption_key, cookie, contents, sizeof(contents), cookie + CRYPTO_NONCE_SIZE);
 
@@ -266,13 +485,13 @@ static int create_cookie(const Logger *log, const Mono_Time *mono_time, uint8_t
     return 0;
 }
 
-/* Open cookie of length COOKIE_LENGTH to bytes of length COOKIE_DATA_LENGTH using encryption_key
+/* Open cookie of length COOKIE_LENGTH to bytes of length COOKIE_DATA_LENGTH and cookie_time
+ * using encryption_key
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int open_cookie(const Logger *log, const Mono_Time *mono_time, uint8_t *bytes, const uint8_t *cookie,
-                       const uint8_t *encryption_key)
+static int unseal_cookie(uint8_t *bytes, uint64_t *cookie_time, const uint8_t *cookie, const uint8_t *encryption_key)
 {
     uint8_t contents[COOKIE_CONTENTS_LENGTH];
     const int len = decrypt_data_symmetric(encryption_key, cookie, cookie + CRYPTO_NONCE_SIZE,
@@ -282,15 +501,120 @@ static int open_cookie(const Logger *log, const Mono_Time *mono_time, uint8_t *b
         return -1;
     }
 
+    memcpy(cookie_time, contents, sizeof(*cookie_time));
+    memcpy(bytes, contents + sizeof(*cookie_time), COOKIE_DATA_LENGTH);
+    return 0;
+}
+
+/* Create cookie of length COOKIE_LENGTH from bytes of length COOKIE_DATA_LENGTH using encryption_key
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int create_cookie(const Logger *log, const Mono_Time *mono_time, uint8_t *cookie, const uint8_t *bytes,
+                         const uint8_t *encryption_key)
+{
+    return seal_cookie(cookie, bytes, mono_time_get(mono_time), encryption_key);
+}
+
+/* Open cookie of length COOKIE_LENGTH to bytes of length COOKIE_DATA_LENGTH using encryption_key
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int open_cookie(const Logger *log, const Mono_Time *mono_time, uint8_t *bytes, const uint8_t *cookie,
+                       const uint8_t *encryption_key)
+{
     uint64_t cookie_time;
-    memcpy(&cookie_time, contents, sizeof(cookie_time));
+
+    if (unseal_cookie(bytes, &cookie_time, cookie, encryption_key) != 0) {
+        return -1;
+    }
+
     const uint64_t temp_time = mono_time_get(mono_time);
 
     if (cookie_time + COOKIE_TIMEOUT < temp_time || temp_time < cookie_time) {
         return -1;
     }
 
-    memcpy(bytes, contents + sizeof(cookie_time), COOKIE_DATA_LENGTH);
+    return 0;
+}
+
+/* Return the resumption state of the peer with public_key. If there is none
+ * and add is true, the least recently used entry is taken for it.
+ *
+ * return nullptr if there is none.
+ */
+static Resume_Entry *get_resume_entry(Net_Crypto *c, const uint8_t *public_key, bool add)
+{
+    Resume_Entry *oldest = &c->resume_entries[0];
+
+    for (uint32_t i = 0; i < CRYPTO_RESUME_ENTRIES; ++i) {
+        Resume_Entry *entry = &c->resume_entries[i];
+
+        if (entry->last_used != 0 && public_key_cmp(entry->public_key, public_key) == 0) {
+            return entry;
+        }
+
+        if (entry->last_used < oldest->last_used) {
+            oldest = entry;
+        }
+    }
+
+    if (!add) {
+        return nullptr;
+    }
+
+    memset(oldest, 0, sizeof(Resume_Entry));
+    memcpy(oldest->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    oldest->last_used = current_time_monotonic(c->mono_time);
+    return oldest;
+}
+
+/* Create a resumption cookie for the peer with real public key real_pk and
+ * dht public key dht_public_key.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int create_resume_cookie(Net_Crypto *c, uint8_t *cookie, const uint8_t *real_pk, const uint8_t *dht_public_key)
+{
+    Resume_Entry *entry = get_resume_entry(c, real_pk, true);
+    const uint64_t temp_time = current_time_monotonic(c->mono_time);
+    entry->last_used = temp_time;
+
+    uint8_t cookie_plain[COOKIE_DATA_LENGTH];
+    memcpy(cookie_plain, real_pk, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(cookie_plain + CRYPTO_PUBLIC_KEY_SIZE, dht_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    return seal_cookie(cookie, cookie_plain, temp_time, c->resume_symmetric_key);
+}
+
+/* Open a resumption cookie we issued. It is only accepted if it hasn't
+ * timed out and wasn't revoked.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int open_resume_cookie(Net_Crypto *c, uint8_t *bytes, const uint8_t *cookie)
+{
+    uint64_t cookie_time;
+
+    if (unseal_cookie(bytes, &cookie_time, cookie, c->resume_symmetric_key) != 0) {
+        return -1;
+    }
+
+    const uint64_t temp_time = current_time_monotonic(c->mono_time);
+
+    if (cookie_time + RESUME_COOKIE_TIMEOUT < temp_time || temp_time < cookie_time) {
+        return -1;
+    }
+
+    const Resume_Entry *entry = get_resume_entry(c, bytes, false);
+
+    if (entry == nullptr || cookie_time <= entry->revoked_until) {
+        return -1;
+    }
+
     return 0;
 }
 
@@ -507,6 +831,9 @@ static int create_crypto_handshake(const Net_Crypto *c, uint8_t *packet, const u
  * if expected_real_pk isn't NULL it denotes the real public key
  * the packet should be from.
  *
+ * if resumed isn't NULL it is set to whether the packet came with a
+ * resumption cookie instead of a cookie from a cookie response.
+ *
  * nonce must be at least CRYPTO_NONCE_SIZE
  * session_pk must be at least CRYPTO_PUBLIC_KEY_SIZE
  * peer_real_pk must be at least CRYPTO_PUBLIC_KEY_SIZE
@@ -515,17 +842,23 @@ static int create_crypto_handshake(const Net_Crypto *c, uint8_t *packet, const u
  * return -1 on failure.
  * return 0 on success.
  */
-static int handle_crypto_handshake(const Net_Crypto *c, uint8_t *nonce, uint8_t *session_pk, uint8_t *peer_real_pk,
-                                   uint8_t *dht_public_key, uint8_t *cookie, const uint8_t *packet, uint16_t length, const uint8_t *expected_real_pk)
+static int handle_crypto_handshake(Net_Crypto *c, uint8_t *nonce, uint8_t *session_pk, uint8_t *peer_real_pk,
+                                   uint8_t *dht_public_key, uint8_t *cookie, const uint8_t *packet, uint16_t length, const uint8_t *expected_real_pk,
+                                   bool *resumed)
 {
     if (length != HANDSHAKE_PACKET_LENGTH) {
         return -1;
     }
 
     uint8_t cookie_plain[COOKIE_DATA_LENGTH];
+    bool resume_cookie = false;
 
     if (open_cookie(c->log, c->mono_time, cookie_plain, packet + 1, c->secret_symmetric_key) != 0) {
-        return -1;
+        if (open_resume_cookie(c, cookie_plain, packet + 1) != 0) {
+            return -1;
+        }
+
+        resume_cookie = true;
     }
 
     if (expected_real_pk) {
@@ -556,6 +889,20 @@ static int handle_crypto_handshake(const Net_Crypto *c, uint8_t *nonce, uint8_t
     memcpy(cookie, plain + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_SHA512_SIZE, COOKIE_LENGTH);
     memcpy(peer_real_pk, cookie_plain, CRYPTO_PUBLIC_KEY_SIZE);
     memcpy(dht_public_key, cookie_plain + CRYPTO_PUBLIC_KEY_SIZE, CRYPTO_PUBLIC_KEY_SIZE);
+
+    if (resume_cookie) {
+        /* Each resumption cookie is good for one handshake. */
+        Resume_Entry *entry = get_resume_entry(c, peer_real_pk, false);
+
+        if (entry != nullptr) {
+            entry->revoked_until = current_time_monotonic(c->mono_time);
+        }
+    }
+
+    if (resumed != nullptr) {
+        *resumed = resume_cookie;
+    }
+
     return 0;
 }
 
@@ -569,6 +916,199 @@ static Crypto_Connection *get_crypto_connection(const Net_Crypto *c, int crypt_c
     return &c->crypto_connections[crypt_connection_id];
 }
 
+/* Put entry at pos in the schedule and tell its connection where it is. */
+static void schedule_set(Net_Crypto *c, uint32_t pos, Scheduled_Connection entry)
+{
+    c->schedule.heap[pos] = entry;
+    c->crypto_connections[entry.crypt_connection_id].schedule_index = pos + 1;
+}
+
+static void schedule_sift_up(Net_Crypto *c, uint32_t pos)
+{
+    const Scheduled_Connection entry = c->schedule.heap[pos];
+
+    while (pos > 0) {
+        const uint32_t parent = (pos - 1) / 2;
+
+        if (c->schedule.heap[parent].run_time <= entry.run_time) {
+            break;
+        }
+
+        schedule_set(c, pos, c->schedule.heap[parent]);
+        pos = parent;
+    }
+
+    schedule_set(c, pos, entry);
+}
+
+static void schedule_sift_down(Net_Crypto *c, uint32_t pos)
+{
+    const Scheduled_Connection entry = c->schedule.heap[pos];
+
+    while (true) {
+        uint32_t child = pos * 2 + 1;
+
+        if (child >= c->schedule.size) {
+            break;
+        }
+
+        if (child + 1 < c->schedule.size && c->schedule.heap[child + 1].run_time < c->schedule.heap[child].run_time) {
+            ++child;
+        }
+
+        if (entry.run_time <= c->schedule.heap[child].run_time) {
+            break;
+        }
+
+        schedule_set(c, pos, c->schedule.heap[child]);
+        pos = child;
+    }
+
+    schedule_set(c, pos, entry);
+}
+
+/* Make sure the schedule can hold all connections without allocating.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int schedule_reserve(Net_Crypto *c, uint32_t num)
+{
+    pthread_mutex_lock(&c->schedule.mutex);
+
+    if (num > c->schedule.capacity) {
+        const uint32_t new_capacity = max_u32(num, c->schedule.capacity * 2);
+        Scheduled_Connection *new_heap = (Scheduled_Connection *)realloc(c->schedule.heap,
+                                         new_capacity * sizeof(Scheduled_Connection));
+
+        if (new_heap == nullptr) {
+            pthread_mutex_unlock(&c->schedule.mutex);
+            return -1;
+        }
+
+        c->schedule.heap = new_heap;
+        c->schedule.capacity = new_capacity;
+    }
+
+    pthread_mutex_unlock(&c->schedule.mutex);
+    return 0;
+}
+
+/* Set the time at which send_crypto_packets() next has to look at the connection.
+ * If earlier_only is true, a connection already scheduled before run_time keeps its time.
+ * Must be called with the schedule mutex held.
+ */
+static void schedule_connection_locked(Net_Crypto *c, int crypt_connection_id, uint64_t run_time, bool earlier_only)
+{
+    Crypto_Connection *conn = &c->crypto_connections[crypt_connection_id];
+
+    if (conn->schedule_index == 0) {
+        const Scheduled_Connection entry = {run_time, (uint32_t)crypt_connection_id};
+        ++c->schedule.size;
+        schedule_set(c, c->schedule.size - 1, entry);
+        schedule_sift_up(c, c->schedule.size - 1);
+        return;
+    }
+
+    const uint32_t pos = conn->schedule_index - 1;
+    const uint64_t old_run_time = c->schedule.heap[pos].run_time;
+
+    if (earlier_only && old_run_time <= run_time) {
+        return;
+    }
+
+    c->schedule.heap[pos].run_time = run_time;
+
+    if (run_time < old_run_time) {
+        schedule_sift_up(c, pos);
+    } else {
+        schedule_sift_down(c, pos);
+    }
+}
+
+static void schedule_connection(Net_Crypto *c, int crypt_connection_id, uint64_t run_time)
+{
+    pthread_mutex_lock(&c->schedule.mutex);
+    schedule_connection_locked(c, crypt_connection_id, run_time, false);
+    pthread_mutex_unlock(&c->schedule.mutex);
+}
+
+/* Have send_crypto_packets() look at the connection the next time it runs,
+ * because something changed that may give it work to do.
+ */
+static void wake_crypto_connection(Net_Crypto *c, int crypt_connection_id)
+{
+    pthread_mutex_lock(&c->schedule.mutex);
+    schedule_connection_locked(c, crypt_connection_id, 0, true);
+    c->current_sleep_time = 0;
+    pthread_mutex_unlock(&c->schedule.mutex);
+}
+
+/* Have send_crypto_packets() look at the connection at run_time at the latest.
+ */
+static void wake_crypto_connection_at(Net_Crypto *c, int crypt_connection_id, uint64_t run_time)
+{
+    const uint64_t temp_time = current_time_monotonic(c->mono_time);
+
+    pthread_mutex_lock(&c->schedule.mutex);
+    schedule_connection_locked(c, crypt_connection_id, run_time, true);
+
+    if (run_time <= temp_time) {
+        c->current_sleep_time = 0;
+    } else if (run_time - temp_time < c->current_sleep_time) {
+        c->current_sleep_time = run_time - temp_time;
+    }
+
+    pthread_mutex_unlock(&c->schedule.mutex);
+}
+
+static void unschedule_connection(Net_Crypto *c, int crypt_connection_id)
+{
+    pthread_mutex_lock(&c->schedule.mutex);
+    Crypto_Connection *conn = &c->crypto_connections[crypt_connection_id];
+
+    if (conn->schedule_index != 0) {
+        const uint32_t pos = conn->schedule_index - 1;
+        conn->schedule_index = 0;
+        --c->schedule.size;
+
+        if (pos != c->schedule.size) {
+            schedule_set(c, pos, c->schedule.heap[c->schedule.size]);
+            schedule_sift_down(c, pos);
+            schedule_sift_up(c, pos);
+        }
+    }
+
+    pthread_mutex_unlock(&c->schedule.mutex);
+}
+
+/* Remove the connection that is due first from the schedule.
+ *
+ * return -1 if no connection is due at time.
+ * return connection id on success.
+ */
+static int schedule_pop_due(Net_Crypto *c, uint64_t time)
+{
+    pthread_mutex_lock(&c->schedule.mutex);
+
+    if (c->schedule.size == 0 || c->schedule.heap[0].run_time > time) {
+        pthread_mutex_unlock(&c->schedule.mutex);
+        return -1;
+    }
+
+    const int crypt_connection_id = c->schedule.heap[0].crypt_connection_id;
+    c->crypto_connections[crypt_connection_id].schedule_index = 0;
+    --c->schedule.size;
+
+    if (c->schedule.size > 0) {
+        schedule_set(c, 0, c->schedule.heap[c->schedule.size]);
+        schedule_sift_down(c, 0);
+    }
+
+    pthread_mutex_unlock(&c->schedule.mutex);
+    return crypt_connection_id;
+}
+
 
 /* Associate an ip_port to a connection.
  *
@@ -690,6 +1230,7 @@ static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t
 
         if (direct_connected) {
             if ((uint32_t)sendpacket(dht_get_net(c->dht), ip_port, data, length) == length) {
+                conn->bytes_sent += length;
                 pthread_mutex_unlock(&conn->mutex);
                 return 0;
             }
@@ -721,6 +1262,10 @@ static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t
         conn->last_tcp_sent = current_time_monotonic(c->mono_time);
     }
 
+    if (ret == 0 || direct_send_attempt) {
+        conn->bytes_sent += length;
+    }
+
     pthread_mutex_unlock(&conn->mutex);
 
     if (ret == 0 || direct_send_attempt) {
@@ -730,7 +1275,51 @@ static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t
     return -1;
 }
 
-/** START: Array Related functions **/
+/* Sends a packet bigger than MAX_CRYPTO_PACKET_SIZE to the peer over the
+ * direct UDP connection. Path MTU probes go to whichever IP_Port is in use,
+ * other packets only to the one their size was confirmed for.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_packet_direct(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
+                              bool probe)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return -1;
+    }
+
+    int ret = -1;
+
+    pthread_mutex_lock(&conn->mutex);
+    const IP_Port ip_port = return_ip_port_connection(c, crypt_connection_id);
+    bool direct_connected = 0;
+    crypto_connection_status(c, crypt_connection_id, &direct_connected, nullptr);
+
+    if (direct_connected) {
+        if (probe) {
+            if ((uint32_t)sendpacket_probe(dht_get_net(c->dht), ip_port, data, length) == length) {
+                conn->pmtu_probe_ip_port = ip_port;
+                ret = 0;
+            }
+        } else if (length <= conn->pmtu && ipport_equal(&ip_port, &conn->pmtu_ip_port)) {
+            if ((uint32_t)sendpacket(dht_get_net(c->dht), ip_port, data, length) == length) {
+                ret = 0;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        conn->bytes_sent += length;
+    }
+
+    pthread_mutex_unlock(&conn->mutex);
+    return ret;
+}
+
+/** START: Array Related functions **/
 
 
 /* Return number of packets in array
@@ -741,30 +1330,91 @@ static uint32_t num_packets_array(const Packets_Array *array)
     return array->buffer_end - array->buffer_start;
 }
 
+static Packet_Data *packet_pool_alloc(Packet_Pool *pool, const Packet_Data *data)
+{
+    pthread_mutex_lock(&pool->mutex);
+    Packet_Data *new_d = (Packet_Data *)slab_alloc(pool->slab);
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (new_d != nullptr) {
+        memcpy(new_d, data, sizeof(Packet_Data));
+    }
+
+    return new_d;
+}
+
+static void packet_pool_free(Packet_Pool *pool, Packet_Data *data)
+{
+    pthread_mutex_lock(&pool->mutex);
+    slab_free(pool->slab, data);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Make room for packet numbers {buffer_start, buffer_start + size) in the array.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int reserve_packets_array(Packets_Array *array, uint32_t size)
+{
+    if (size <= array->capacity) {
+        return 0;
+    }
+
+    if (size > CRYPTO_PACKET_BUFFER_SIZE) {
+        return -1;
+    }
+
+    uint32_t new_capacity = array->capacity != 0 ? array->capacity : CRYPTO_PACKET_BUFFER_INITIAL_SIZE;
+
+    while (new_capacity < size) {
+        new_capacity *= 2;
+    }
+
+    Packet_Data **new_buffer = (Packet_Data **)calloc(new_capacity, sizeof(Packet_Data *));
+
+    if (new_buffer == nullptr) {
+        return -1;
+    }
+
+    for (uint32_t i = array->buffer_start; i != array->buffer_end; ++i) {
+        new_buffer[i % new_capacity] = array->buffer[i % array->capacity];
+    }
+
+    free(array->buffer);
+    array->buffer = new_buffer;
+    array->capacity = new_capacity;
+    return 0;
+}
+
 /* Add data with packet number to array.
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int add_data_to_buffer(const Logger *log, Packets_Array *array, uint32_t number, const Packet_Data *data)
+static int add_data_to_buffer(const Logger *log, Packet_Pool *pool, Packets_Array *array, uint32_t number,
+                              const Packet_Data *data)
 {
     if (number - array->buffer_start >= CRYPTO_PACKET_BUFFER_SIZE) {
         return -1;
     }
 
-    uint32_t num = number % CRYPTO_PACKET_BUFFER_SIZE;
+    if (reserve_packets_array(array, number - array->buffer_start + 1) != 0) {
+        return -1;
+    }
+
+    uint32_t num = number % array->capacity;
 
     if (array->buffer[num]) {
         return -1;
     }
 
-    Packet_Data *new_d = (Packet_Data *)malloc(sizeof(Packet_Data));
+    Packet_Data *new_d = packet_pool_alloc(pool, data);
 
     if (new_d == nullptr) {
         return -1;
     }
 
-    memcpy(new_d, data, sizeof(Packet_Data));
     array->buffer[num] = new_d;
 
     if (number - array->buffer_start >= num_packets_array(array)) {
@@ -788,7 +1438,7 @@ static int get_data_pointer(const Logger *log, const Packets_Array *array, Packe
         return -1;
     }
 
-    uint32_t num = number % CRYPTO_PACKET_BUFFER_SIZE;
+    uint32_t num = number % array->capacity;
 
     if (!array->buffer[num]) {
         return 0;
@@ -803,7 +1453,8 @@ static int get_data_pointer(const Logger *log, const Packets_Array *array, Packe
  * return -1 on failure.
  * return packet number on success.
  */
-static int64_t add_data_end_of_buffer(const Logger *log, Packets_Array *array, const Packet_Data *data)
+static int64_t add_data_end_of_buffer(const Logger *log, Packet_Pool *pool, Packets_Array *array,
+                                      const Packet_Data *data)
 {
     const uint32_t num_spots = num_packets_array(array);
 
@@ -811,15 +1462,18 @@ static int64_t add_data_end_of_buffer(const Logger *log, Packets_Array *array, c
         return -1;
     }
 
-    Packet_Data *new_d = (Packet_Data *)malloc(sizeof(Packet_Data));
+    if (reserve_packets_array(array, num_spots + 1) != 0) {
+        return -1;
+    }
+
+    Packet_Data *new_d = packet_pool_alloc(pool, data);
 
     if (new_d == nullptr) {
         return -1;
     }
 
-    memcpy(new_d, data, sizeof(Packet_Data));
     uint32_t id = array->buffer_end;
-    array->buffer[id % CRYPTO_PACKET_BUFFER_SIZE] = new_d;
+    array->buffer[id % array->capacity] = new_d;
     ++array->buffer_end;
     return id;
 }
@@ -829,13 +1483,13 @@ static int64_t add_data_end_of_buffer(const Logger *log, Packets_Array *array, c
  * return -1 on failure.
  * return packet number on success.
  */
-static int64_t read_data_beg_buffer(const Logger *log, Packets_Array *array, Packet_Data *data)
+static int64_t read_data_beg_buffer(const Logger *log, Packet_Pool *pool, Packets_Array *array, Packet_Data *data)
 {
     if (array->buffer_end == array->buffer_start) {
         return -1;
     }
 
-    const uint32_t num = array->buffer_start % CRYPTO_PACKET_BUFFER_SIZE;
+    const uint32_t num = array->buffer_start % array->capacity;
 
     if (!array->buffer[num]) {
         return -1;
@@ -844,7 +1498,7 @@ static int64_t read_data_beg_buffer(const Logger *log, Packets_Array *array, Pac
     memcpy(data, array->buffer[num], sizeof(Packet_Data));
     uint32_t id = array->buffer_start;
     ++array->buffer_start;
-    free(array->buffer[num]);
+    packet_pool_free(pool, array->buffer[num]);
     array->buffer[num] = nullptr;
     return id;
 }
@@ -852,9 +1506,9 @@ static int64_t read_data_beg_buffer(const Logger *log, Packets_Array *array, Pac
 /* Delete all packets in array before number (but not number)
  *
  * return -1 on failure.
- * return 0 on success
+ * return the number of packets deleted on success.
  */
-static int clear_buffer_until(const Logger *log, Packets_Array *array, uint32_t number)
+static int clear_buffer_until(const Logger *log, Packet_Pool *pool, Packets_Array *array, uint32_t number)
 {
     const uint32_t num_spots = num_packets_array(array);
 
@@ -863,34 +1517,39 @@ static int clear_buffer_until(const Logger *log, Packets_Array *array, uint32_t
     }
 
     uint32_t i;
+    int deleted = 0;
 
     for (i = array->buffer_start; i != number; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        uint32_t num = i % array->capacity;
 
         if (array->buffer[num]) {
-            free(array->buffer[num]);
+            packet_pool_free(pool, array->buffer[num]);
             array->buffer[num] = nullptr;
+            ++deleted;
         }
     }
 
     array->buffer_start = i;
-    return 0;
+    return deleted;
 }
 
-static int clear_buffer(Packets_Array *array)
+static int clear_buffer(Packet_Pool *pool, Packets_Array *array)
 {
     uint32_t i;
 
     for (i = array->buffer_start; i != array->buffer_end; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        uint32_t num = i % array->capacity;
 
         if (array->buffer[num]) {
-            free(array->buffer[num]);
+            packet_pool_free(pool, array->buffer[num]);
             array->buffer[num] = nullptr;
         }
     }
 
     array->buffer_start = i;
+    free(array->buffer);
+    array->buffer = nullptr;
+    array->capacity = 0;
     return 0;
 }
 
@@ -909,6 +1568,10 @@ static int set_buffer_end(const Logger *log, Packets_Array *array, uint32_t numb
         return -1;
     }
 
+    if (reserve_packets_array(array, number - array->buffer_start) != 0) {
+        return -1;
+    }
+
     array->buffer_end = number;
     return 0;
 }
@@ -940,7 +1603,7 @@ static int generate_request_packet(const Logger *log, uint8_t *data, uint16_t le
     uint32_t i, n = 1;
 
     for (i = recv_array->buffer_start; i != recv_array->buffer_end; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        uint32_t num = i % recv_array->capacity;
 
         if (!recv_array->buffer[num]) {
             data[cur_len] = n;
@@ -967,13 +1630,15 @@ static int generate_request_packet(const Logger *log, uint8_t *data, uint16_t le
 }
 
 /* Handle a request data packet.
- * Remove all the packets the other received from the array.
+ * Remove all the packets the other received from the array and add their
+ * number to packets_acked.
  *
  * return -1 on failure.
  * return number of requested packets on success.
  */
-static int handle_request_packet(Mono_Time *mono_time, const Logger *log, Packets_Array *send_array,
-                                 const uint8_t *data, uint16_t length, uint64_t *latest_send_time, uint64_t rtt_time)
+static int handle_request_packet(Mono_Time *mono_time, const Logger *log, Packet_Pool *pool, Packets_Array *send_array,
+                                 const uint8_t *data, uint16_t length, uint64_t *latest_send_time, uint64_t rtt_time,
+                                 uint32_t *packets_acked)
 {
     if (length == 0) {
         return -1;
@@ -1001,7 +1666,7 @@ static int handle_request_packet(Mono_Time *mono_time, const Logger *log, Packet
             break;
         }
 
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        uint32_t num = i % send_array->capacity;
 
         if (n == data[0]) {
             if (send_array->buffer[num]) {
@@ -1024,8 +1689,9 @@ static int handle_request_packet(Mono_Time *mono_time, const Logger *log, Packet
                     l_sent_time = sent_time;
                 }
 
-                free(send_array->buffer[num]);
+                packet_pool_free(pool, send_array->buffer[num]);
                 send_array->buffer[num] = nullptr;
+                ++*packets_acked;
             }
         }
 
@@ -1052,228 +1718,834 @@ static int handle_request_packet(Mono_Time *mono_time, const Logger *log, Packet
 
 /** END: Array Related functions **/
 
-#define MAX_DATA_DATA_PACKET_SIZE (MAX_CRYPTO_PACKET_SIZE - (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE))
+/** START: Stream Related functions **/
 
-/* Creates and sends a data packet to the peer using the fastest route.
- *
- * return -1 on failure.
- * return 0 on success.
- */
-static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length)
+Crypto_Stream crypto_packet_stream(uint8_t packet_id)
 {
-    const uint16_t max_length = MAX_CRYPTO_PACKET_SIZE - (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE);
+    switch (packet_id) {
+        /* Messenger drops everything until the friend is online. */
+        case PACKET_ID_ONLINE:
+        case PACKET_ID_OFFLINE:
+            return CRYPTO_STREAM_BARRIER;
+
+        case PACKET_ID_NICKNAME:
+        case PACKET_ID_STATUSMESSAGE:
+        case PACKET_ID_USERSTATUS:
+        case PACKET_ID_TYPING:
+        case PACKET_ID_MSI:
+            return CRYPTO_STREAM_CONTROL;
+
+        case PACKET_ID_MESSAGE:
+        case PACKET_ID_ACTION:
+        case PACKET_ID_INVITE_CONFERENCE:
+        case PACKET_ID_ONLINE_PACKET:
+        case PACKET_ID_DIRECT_CONFERENCE:
+        case PACKET_ID_MESSAGE_CONFERENCE:
+        case PACKET_ID_REJOIN_CONFERENCE:
+            return CRYPTO_STREAM_MESSAGES;
+    }
+
+    /* The ids below are used by friend_connection for keepalives and
+     * sharing relays. */
+    if (packet_id < PACKET_ID_ONLINE) {
+        return CRYPTO_STREAM_CONTROL;
+    }
+
+    return CRYPTO_STREAM_BULK;
+}
 
-    if (length == 0 || length > max_length) {
-        return -1;
+/* Return the stream of a lossless packet, with or without a header. */
+static Crypto_Stream data_packet_stream(const uint8_t *data)
+{
+    if (data[0] == PACKET_ID_STREAM) {
+        return crypto_packet_stream(data[CRYPTO_STREAM_HEADER_SIZE]);
     }
 
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
-
-    if (conn == nullptr) {
-        return -1;
+    if (data[0] == PACKET_ID_UNORDERED) {
+        return CRYPTO_STREAM_BULK;
     }
 
-    pthread_mutex_lock(&conn->mutex);
-    VLA(uint8_t, packet, 1 + sizeof(uint16_t) + length + CRYPTO_MAC_SIZE);
-    packet[0] = NET_PACKET_CRYPTO_DATA;
-    memcpy(packet + 1, conn->sent_nonce + (CRYPTO_NONCE_SIZE - sizeof(uint16_t)), sizeof(uint16_t));
-    const int len = encrypt_data_symmetric(conn->shared_key, conn->sent_nonce, data, length, packet + 1 + sizeof(uint16_t));
+    return crypto_packet_stream(data[0]);
+}
 
-    if (len + 1 + sizeof(uint16_t) != SIZEOF_VLA(packet)) {
-        pthread_mutex_unlock(&conn->mutex);
-        return -1;
+/* Return the stream of a packet in the send or receive array. */
+static Crypto_Stream stored_packet_stream(const Packet_Data *dt)
+{
+    return data_packet_stream(dt->data);
+}
+
+/* Return the sequence number of a packet with a stream header, or the
+ * number of barriers before a packet with an unordered header. */
+static uint16_t stored_packet_seq(const Packet_Data *dt)
+{
+    uint16_t seq;
+    net_unpack_u16(dt->data + 1, &seq);
+    return seq;
+}
+
+uint16_t crypto_pack_stream_header(uint8_t *packet, uint16_t seq, const uint8_t *data, uint16_t length)
+{
+    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE - CRYPTO_STREAM_HEADER_SIZE) {
+        return 0;
     }
 
-    increment_nonce(conn->sent_nonce);
-    pthread_mutex_unlock(&conn->mutex);
+    if (crypto_packet_stream(data[0]) >= CRYPTO_NUM_STREAMS) {
+        return 0;
+    }
 
-    return send_packet_to(c, crypt_connection_id, packet, SIZEOF_VLA(packet));
+    packet[0] = PACKET_ID_STREAM;
+    net_pack_u16(packet + 1, seq);
+    memcpy(packet + CRYPTO_STREAM_HEADER_SIZE, data, length);
+    return length + CRYPTO_STREAM_HEADER_SIZE;
 }
 
-/* Creates and sends a data packet with buffer_start and num to the peer using the fastest route.
+/* Write data with a stream header into packet if the peer supports streams
+ * and the packet belongs to one.
  *
- * return -1 on failure.
- * return 0 on success.
+ * return length of the packet with the header.
+ * return 0 if data is to be sent as it is.
  */
-static int send_data_packet_helper(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
-                                   const uint8_t *data, uint16_t length)
+static uint16_t add_stream_header(const Crypto_Connection *conn, const uint8_t *data, uint16_t length, uint8_t *packet)
 {
-    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
-        return -1;
+    if (!(conn->peer_capabilities & CRYPTO_CAPABILITY_STREAMS)) {
+        return 0;
     }
 
-    num = net_htonl(num);
-    buffer_start = net_htonl(buffer_start);
-    uint16_t padding_length = (MAX_CRYPTO_DATA_SIZE - length) % CRYPTO_MAX_PADDING;
-    VLA(uint8_t, packet, sizeof(uint32_t) + sizeof(uint32_t) + padding_length + length);
-    memcpy(packet, &buffer_start, sizeof(uint32_t));
-    memcpy(packet + sizeof(uint32_t), &num, sizeof(uint32_t));
-    memset(packet + (sizeof(uint32_t) * 2), PACKET_ID_PADDING, padding_length);
-    memcpy(packet + (sizeof(uint32_t) * 2) + padding_length, data, length);
+    const Crypto_Stream stream = crypto_packet_stream(data[0]);
+
+    if (stream >= CRYPTO_NUM_STREAMS) {
+        return 0;
+    }
 
-    return send_data_packet(c, crypt_connection_id, packet, SIZEOF_VLA(packet));
+    return crypto_pack_stream_header(packet, conn->stream_send_seq[stream], data, length);
 }
 
-static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
+/* Write data with an unordered header into packet if the peer supports it.
+ *
+ * return length of the packet with the header.
+ * return 0 if data is to be sent as it is.
+ */
+static uint16_t add_unordered_header(const Crypto_Connection *conn, const uint8_t *data, uint16_t length,
+                                     uint8_t *packet)
 {
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
-
-    if (conn == nullptr) {
-        return -1;
+    if (!(conn->peer_capabilities & CRYPTO_CAPABILITY_UNORDERED)) {
+        return 0;
     }
 
-    /* If last packet send failed, try to send packet again.
-       If sending it fails we won't be able to send the new packet. */
-    if (conn->maximum_speed_reached) {
-        Packet_Data *dt = nullptr;
-        const uint32_t packet_num = conn->send_array.buffer_end - 1;
-        const int ret = get_data_pointer(c->log, &conn->send_array, &dt, packet_num);
+    if (length > MAX_CRYPTO_DATA_SIZE - CRYPTO_UNORDERED_HEADER_SIZE) {
+        return 0;
+    }
 
-        if (ret == 1 && dt->sent_time == 0) {
-            if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num,
-                                        dt->data, dt->length) != 0) {
-                return -1;
-            }
+    packet[0] = PACKET_ID_UNORDERED;
+    net_pack_u16(packet + 1, conn->barriers_sent);
+    memcpy(packet + CRYPTO_UNORDERED_HEADER_SIZE, data, length);
+    return length + CRYPTO_UNORDERED_HEADER_SIZE;
+}
 
-            dt->sent_time = current_time_monotonic(c->mono_time);
+/* Count a packet in the sequence numbers of the streams it belongs to.
+ * Packets too big for a header still take a sequence number, so later
+ * packets of their stream wait for them.
+ */
+static void count_stream_packet(uint16_t *seq, Crypto_Stream stream)
+{
+    if (stream == CRYPTO_STREAM_BARRIER) {
+        for (uint32_t i = 0; i < CRYPTO_NUM_STREAMS; ++i) {
+            ++seq[i];
         }
+    } else if (stream < CRYPTO_NUM_STREAMS) {
+        ++seq[stream];
+    }
+}
 
-        conn->maximum_speed_reached = 0;
+/* Update the stream state after data (as it was passed to
+ * add_stream_header()) was put in the send queue.
+ */
+static void stream_packet_sent(Crypto_Connection *conn, const uint8_t *data, bool has_header)
+{
+    if (crypto_packet_stream(data[0]) == CRYPTO_STREAM_BARRIER) {
+        ++conn->barriers_sent;
     }
 
-    return 0;
+    if (has_header) {
+        conn->streams_sending = true;
+    }
+
+    if (conn->streams_sending) {
+        count_stream_packet(conn->stream_send_seq, crypto_packet_stream(data[0]));
+    }
 }
 
-/*  return -1 if data could not be put in packet queue.
- *  return positive packet number if data was put into the queue.
+/* Update the stream state before passing on a received packet. The first
+ * packet with a stream header is passed on in order, and from then on the
+ * peer counts every packet.
  */
-static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
-                                    uint8_t congestion_control)
+static void stream_packet_received(Crypto_Connection *conn, const Packet_Data *dt)
 {
-    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
-        return -1;
+    const Crypto_Stream stream = stored_packet_stream(dt);
+
+    if (stream == CRYPTO_STREAM_BARRIER) {
+        ++conn->barriers_received;
     }
 
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    if (dt->data[0] == PACKET_ID_STREAM) {
+        if (!conn->streams_receiving) {
+            conn->streams_receiving = true;
 
-    if (conn == nullptr) {
-        return -1;
+            for (uint32_t i = 0; i < CRYPTO_NUM_STREAMS; ++i) {
+                conn->stream_check[i] = true;
+            }
+        }
+
+        conn->stream_recv_seq[stream] = stored_packet_seq(dt) + 1;
+        --conn->stream_waiting[stream];
+        conn->stream_check[stream] = true;
+        return;
     }
 
-    /* If last packet send failed, try to send packet again.
-       If sending it fails we won't be able to send the new packet. */
-    reset_max_speed_reached(c, crypt_connection_id);
+    if (!conn->streams_receiving || stream == CRYPTO_STREAM_BULK) {
+        return;
+    }
 
-    if (conn->maximum_speed_reached && congestion_control) {
-        return -1;
+    count_stream_packet(conn->stream_recv_seq, stream);
+
+    for (uint32_t i = 0; i < CRYPTO_NUM_STREAMS; ++i) {
+        conn->stream_check[i] = true;
     }
+}
 
-    Packet_Data dt;
-    dt.sent_time = 0;
-    dt.length = length;
-    memcpy(dt.data, data, length);
-    pthread_mutex_lock(&conn->mutex);
-    int64_t packet_num = add_data_end_of_buffer(c->log, &conn->send_array, &dt);
-    pthread_mutex_unlock(&conn->mutex);
+bool crypto_unpack_stream_header(const uint8_t *packet, uint16_t length, uint16_t *seq)
+{
+    if (length <= CRYPTO_STREAM_HEADER_SIZE || packet[0] != PACKET_ID_STREAM) {
+        return false;
+    }
 
-    if (packet_num == -1) {
-        return -1;
+    const uint8_t packet_id = packet[CRYPTO_STREAM_HEADER_SIZE];
+
+    if (packet_id < PACKET_ID_RANGE_LOSSLESS_START || packet_id > PACKET_ID_RANGE_LOSSLESS_END) {
+        return false;
     }
 
-    if (!congestion_control && conn->maximum_speed_reached) {
-        return packet_num;
+    if (crypto_packet_stream(packet_id) >= CRYPTO_NUM_STREAMS) {
+        return false;
     }
 
-    if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, data, length) == 0) {
-        Packet_Data *dt1 = nullptr;
+    net_unpack_u16(packet + 1, seq);
+    return true;
+}
 
-        if (get_data_pointer(c->log, &conn->send_array, &dt1, packet_num) == 1) {
-            dt1->sent_time = current_time_monotonic(c->mono_time);
-        }
-    } else {
-        conn->maximum_speed_reached = 1;
-        LOGGER_DEBUG(c->log, "send_data_packet failed");
+/* Check that a received packet with an unordered header is valid.
+ */
+static bool valid_unordered_packet(const uint8_t *data, uint16_t length)
+{
+    if (length <= CRYPTO_UNORDERED_HEADER_SIZE) {
+        return false;
     }
 
-    return packet_num;
+    const uint8_t packet_id = data[CRYPTO_UNORDERED_HEADER_SIZE];
+    return packet_id >= PACKET_ID_RANGE_LOSSLESS_CUSTOM_START && packet_id <= PACKET_ID_RANGE_LOSSLESS_CUSTOM_END;
 }
 
-/* Get the lowest 2 bytes from the nonce and convert
- * them to host byte format before returning them.
+/* Return the priority with which a packet in the send array is resent:
+ * CRYPTO_STREAM_CONTROL first, then CRYPTO_STREAM_MESSAGES, then
+ * CRYPTO_STREAM_BULK.
  */
-static uint16_t get_nonce_uint16(const uint8_t *nonce)
+static Crypto_Stream packet_send_priority(const Packet_Data *dt)
 {
-    uint16_t num;
-    memcpy(&num, nonce + (CRYPTO_NONCE_SIZE - sizeof(uint16_t)), sizeof(uint16_t));
-    return net_ntohs(num);
+    const Crypto_Stream stream = stored_packet_stream(dt);
+
+    if (stream == CRYPTO_STREAM_BARRIER) {
+        return CRYPTO_STREAM_CONTROL;
+    }
+
+    return stream;
 }
 
-#define DATA_NUM_THRESHOLD 21845
+/** END: Stream Related functions **/
 
-/* Handle a data packet.
- * Decrypt packet of length and put it into data.
- * data must be at least MAX_DATA_DATA_PACKET_SIZE big.
+/* Compute the keys data packets are encrypted with from our session secret
+ * key and the peer's session public key.
  *
- * return -1 on failure.
- * return length of data on success.
+ * The AES-256-GCM key is derived from the shared key instead of being the
+ * same, so no key is ever used with two different ciphers.
  */
-static int handle_data_packet(const Net_Crypto *c, int crypt_connection_id, uint8_t *data, const uint8_t *packet,
-                              uint16_t length)
+static void precompute_session_keys(Crypto_Connection *conn)
 {
-    const uint16_t crypto_packet_overhead = 1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE;
+    static const uint8_t aesgcm_label[] = "tox aes-256-gcm";
 
-    if (length <= crypto_packet_overhead || length > MAX_CRYPTO_PACKET_SIZE) {
-        return -1;
-    }
+    encrypt_precompute(conn->peersessionpublic_key, conn->sessionsecret_key, conn->shared_key);
 
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    uint8_t key_material[CRYPTO_SHARED_KEY_SIZE + sizeof(aesgcm_label)];
+    memcpy(key_material, conn->shared_key, CRYPTO_SHARED_KEY_SIZE);
+    memcpy(key_material + CRYPTO_SHARED_KEY_SIZE, aesgcm_label, sizeof(aesgcm_label));
+    crypto_sha256(conn->aesgcm_key, key_material, sizeof(key_material));
+    crypto_memzero(key_material, sizeof(key_material));
+}
 
-    if (conn == nullptr) {
-        return -1;
-    }
+/* Encrypt count data packets with consecutive nonces. The input and length of
+ * each entry must be set, the encrypted packet is put in packets, after the
+ * packet type and the last 2 bytes of the nonce.
+ *
+ * Once the peer told us it supports CRYPTO_CAPABILITY_AESGCM the packets are
+ * encrypted with AES-256-GCM.
+ */
+static void encrypt_data_packets(Crypto_Connection *conn, Crypto_Batch_Entry *entries,
+                                 uint8_t (*nonces)[CRYPTO_NONCE_SIZE], uint8_t *const *packets, uint32_t count)
+{
+    const bool aesgcm = (conn->peer_capabilities & CRYPTO_CAPABILITY_AESGCM) != 0;
 
-    uint8_t nonce[CRYPTO_NONCE_SIZE];
-    memcpy(nonce, conn->recv_nonce, CRYPTO_NONCE_SIZE);
-    uint16_t num_cur_nonce = get_nonce_uint16(nonce);
-    uint16_t num;
-    net_unpack_u16(packet + 1, &num);
-    uint16_t diff = num - num_cur_nonce;
-    increment_nonce_number(nonce, diff);
-    int len = decrypt_data_symmetric(conn->shared_key, nonce, packet + 1 + sizeof(uint16_t),
-                                     length - (1 + sizeof(uint16_t)), data);
+    pthread_mutex_lock(&conn->mutex);
 
-    if ((unsigned int)len != length - crypto_packet_overhead) {
-        return -1;
+    for (uint32_t i = 0; i < count; ++i) {
+        memcpy(nonces[i], conn->sent_nonce, CRYPTO_NONCE_SIZE);
+        increment_nonce(conn->sent_nonce);
+
+        packets[i][0] = aesgcm ? NET_PACKET_CRYPTO_DATA_AESGCM : NET_PACKET_CRYPTO_DATA;
+        memcpy(packets[i] + 1, nonces[i] + (CRYPTO_NONCE_SIZE - sizeof(uint16_t)), sizeof(uint16_t));
+        entries[i].nonce = nonces[i];
+        entries[i].output = packets[i] + 1 + sizeof(uint16_t);
     }
 
-    if (diff > DATA_NUM_THRESHOLD * 2) {
-        increment_nonce_number(conn->recv_nonce, DATA_NUM_THRESHOLD);
+    if (aesgcm) {
+        encrypt_data_aesgcm_batch(conn->aesgcm_key, entries, count);
+    } else {
+        encrypt_data_symmetric_batch(conn->shared_key, entries, count);
     }
 
-    return len;
+    pthread_mutex_unlock(&conn->mutex);
 }
 
-/* Send a request packet.
+/* Sends an encrypted data packet to the peer using the fastest route.
+ * Packets bigger than MAX_CRYPTO_PACKET_SIZE and path MTU probes are only sent
+ * over the direct UDP connection.
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int send_request_packet(Net_Crypto *c, int crypt_connection_id)
+static int send_encrypted_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *packet, uint16_t length,
+                                      bool probe)
 {
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    if (probe || length > MAX_CRYPTO_PACKET_SIZE) {
+        return send_packet_direct(c, crypt_connection_id, packet, length, probe);
+    }
 
-    if (conn == nullptr) {
+    return send_packet_to(c, crypt_connection_id, packet, length);
+}
+
+/* Creates and sends a data packet to the peer using the fastest route.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length, bool probe)
+{
+    if (length == 0 || length > MAX_DATA_DATA_PACKET_SIZE) {
         return -1;
     }
 
-    uint8_t data[MAX_CRYPTO_DATA_SIZE];
-    int len = generate_request_packet(c->log, data, sizeof(data), &conn->recv_array);
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
-    if (len == -1) {
+    if (conn == nullptr) {
         return -1;
     }
 
-    return send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end, data,
+    VLA(uint8_t, packet, 1 + sizeof(uint16_t) + length + CRYPTO_MAC_SIZE);
+    uint8_t *packets[1] = {packet};
+    uint8_t nonce[1][CRYPTO_NONCE_SIZE];
+    Crypto_Batch_Entry entry;
+    entry.input = data;
+    entry.length = length;
+    encrypt_data_packets(conn, &entry, nonce, packets, 1);
+
+    if (entry.result + 1 + sizeof(uint16_t) != SIZEOF_VLA(packet)) {
+        return -1;
+    }
+
+    return send_encrypted_data_packet(c, crypt_connection_id, packet, SIZEOF_VLA(packet), probe);
+}
+
+/* Write the decrypted part of a data packet with buffer_start and num, and
+ * padding_length bytes of padding before data, to plain.
+ *
+ * return the length of the decrypted part.
+ */
+static uint16_t build_data_packet(uint8_t *plain, uint32_t buffer_start, uint32_t num, uint16_t padding_length,
+                                  const uint8_t *data, uint16_t length)
+{
+    num = net_htonl(num);
+    buffer_start = net_htonl(buffer_start);
+    memcpy(plain, &buffer_start, sizeof(uint32_t));
+    memcpy(plain + sizeof(uint32_t), &num, sizeof(uint32_t));
+    memset(plain + (sizeof(uint32_t) * 2), PACKET_ID_PADDING, padding_length);
+    memcpy(plain + (sizeof(uint32_t) * 2) + padding_length, data, length);
+    return (sizeof(uint32_t) * 2) + padding_length + length;
+}
+
+/* Creates and sends a data packet with buffer_start and num, and
+ * padding_length bytes of padding before data.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_padded_data_packet(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
+                                   uint16_t padding_length, const uint8_t *data, uint16_t length, bool probe)
+{
+    if (length == 0 || padding_length + length > MAX_CRYPTO_PMTU_DATA_SIZE) {
+        return -1;
+    }
+
+    VLA(uint8_t, packet, sizeof(uint32_t) + sizeof(uint32_t) + padding_length + length);
+    build_data_packet(packet, buffer_start, num, padding_length, data, length);
+
+    return send_data_packet(c, crypt_connection_id, packet, SIZEOF_VLA(packet), probe);
+}
+
+/* return the number of padding bytes sent before data of the given length, so
+ * that data packets only come in a few sizes.
+ */
+static uint16_t data_packet_padding(uint16_t length)
+{
+    const uint16_t max_length = length > MAX_CRYPTO_DATA_SIZE ? MAX_CRYPTO_PMTU_DATA_SIZE : MAX_CRYPTO_DATA_SIZE;
+    return (max_length - length) % CRYPTO_MAX_PADDING;
+}
+
+/* Creates and sends a data packet with buffer_start and num to the peer using the fastest route.
+ * Only PACKET_ID_BATCH packets may be bigger than MAX_CRYPTO_DATA_SIZE, see
+ * coalesce_data_packet().
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_data_packet_helper(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
+                                   const uint8_t *data, uint16_t length)
+{
+    if (length == 0 || length > MAX_CRYPTO_PMTU_DATA_SIZE) {
+        return -1;
+    }
+
+    return send_padded_data_packet(c, crypt_connection_id, buffer_start, num, data_packet_padding(length), data, length,
+                                   false);
+}
+
+/* Creates and sends count lossless packets from the send array, which have the
+ * packet numbers in nums, encrypting them together. The sent_time of the ones
+ * that were sent is set to sent_time.
+ *
+ * return the number of packets sent.
+ */
+static uint32_t send_data_packet_batch(Net_Crypto *c, int crypt_connection_id, const uint32_t *nums,
+                                       Packet_Data *const *packets, uint32_t count, uint64_t sent_time)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr || count > CRYPTO_BATCH_SIZE) {
+        return 0;
+    }
+
+    /* Packets in the send array are at most MAX_CRYPTO_DATA_SIZE long, so they
+     * are sent as packets of at most MAX_CRYPTO_PACKET_SIZE bytes. */
+    uint8_t plain[CRYPTO_BATCH_SIZE][MAX_CRYPTO_PACKET_SIZE];
+    uint8_t encrypted[CRYPTO_BATCH_SIZE][MAX_CRYPTO_PACKET_SIZE];
+    uint8_t *encrypted_packets[CRYPTO_BATCH_SIZE];
+    uint8_t nonces[CRYPTO_BATCH_SIZE][CRYPTO_NONCE_SIZE];
+    Crypto_Batch_Entry entries[CRYPTO_BATCH_SIZE];
+    const uint32_t buffer_start = conn->recv_array.buffer_start;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        const Packet_Data *const dt = packets[i];
+        entries[i].input = plain[i];
+        entries[i].length = build_data_packet(plain[i], buffer_start, nums[i], data_packet_padding(dt->length), dt->data,
+                                              dt->length);
+        encrypted_packets[i] = encrypted[i];
+    }
+
+    encrypt_data_packets(conn, entries, nonces, encrypted_packets, count);
+
+    uint32_t num_sent = 0;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        if (entries[i].result == -1) {
+            continue;
+        }
+
+        if (send_packet_to(c, crypt_connection_id, encrypted[i], 1 + sizeof(uint16_t) + entries[i].result) == 0) {
+            packets[i]->sent_time = sent_time;
+            ++num_sent;
+        }
+    }
+
+    return num_sent;
+}
+
+/* Send a path MTU probe with a total size of size bytes.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_pmtu_probe(Net_Crypto *c, int crypt_connection_id, uint16_t size)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr || size > MAX_CRYPTO_PMTU_PACKET_SIZE
+            || size < CRYPTO_DATA_PACKET_MIN_SIZE + CRYPTO_PMTU_PACKET_SIZE) {
+        return -1;
+    }
+
+    uint8_t data[CRYPTO_PMTU_PACKET_SIZE];
+    data[0] = PACKET_ID_PMTU_PROBE;
+    net_pack_u16(data + 1, size);
+
+    const uint16_t padding_length = size - CRYPTO_DATA_PACKET_MIN_SIZE - CRYPTO_PMTU_PACKET_SIZE;
+    return send_padded_data_packet(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end,
+                                   padding_length, data, sizeof(data), true);
+}
+
+/* Send the packets waiting in the coalesce buffer as one PACKET_ID_BATCH
+ * packet. The lossless ones among them count as sent from now on, or as not
+ * sent yet if sending failed.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_coalesced_packets(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return -1;
+    }
+
+    uint8_t packet[MAX_CRYPTO_PMTU_DATA_SIZE];
+    pthread_mutex_lock(&conn->mutex);
+    const uint16_t length = conn->coalesce_length;
+    memcpy(packet, conn->coalesce_buffer, length);
+    conn->coalesce_length = 0;
+    conn->coalesce_deadline = 0;
+    const uint32_t buffer_start = conn->recv_array.buffer_start;
+    const uint32_t buffer_end = conn->send_array.buffer_end;
+    pthread_mutex_unlock(&conn->mutex);
+
+    if (length == 0) {
+        return 0;
+    }
+
+    packet[0] = PACKET_ID_BATCH;
+    const int ret = send_data_packet_helper(c, crypt_connection_id, buffer_start, buffer_end, packet, length);
+    const uint64_t sent_time = ret == 0 ? current_time_monotonic(c->mono_time) : 0;
+
+    for (uint16_t pos = 1; pos < length;) {
+        uint32_t num;
+        uint16_t entry_length;
+        net_unpack_u32(packet + pos, &num);
+        net_unpack_u16(packet + pos + sizeof(uint32_t), &entry_length);
+        const uint8_t packet_id = packet[pos + CRYPTO_BATCH_ENTRY_HEADER_SIZE];
+        pos += CRYPTO_BATCH_ENTRY_HEADER_SIZE + entry_length;
+
+        if (packet_id >= PACKET_ID_RANGE_LOSSY_START && packet_id <= PACKET_ID_RANGE_LOSSY_END) {
+            continue;
+        }
+
+        Packet_Data *dt;
+
+        if (get_data_pointer(c->log, &conn->send_array, &dt, num) == 1) {
+            dt->sent_time = sent_time;
+        }
+    }
+
+    return ret;
+}
+
+/* Return the maximum length of the coalesce buffer. It grows to the path MTU
+ * once path MTU discovery found one, leaving room for the padding.
+ */
+static uint16_t coalesce_buffer_size(const Crypto_Connection *conn)
+{
+    if (conn->pmtu == 0) {
+        return MAX_CRYPTO_DATA_SIZE;
+    }
+
+    return conn->pmtu - CRYPTO_DATA_PACKET_MIN_SIZE - (CRYPTO_MAX_PADDING - 1);
+}
+
+/* Put a packet with packet number num in the coalesce buffer if the peer
+ * supports CRYPTO_CAPABILITY_BATCH and either coalescing is enabled and the
+ * packet is small, or the path MTU is bigger than MAX_CRYPTO_PACKET_SIZE and
+ * the packet is a bulk lossless packet. The buffer is sent first if the
+ * packet doesn't fit in it anymore.
+ *
+ * return -1 if the packet has to be sent on its own.
+ * return 0 if the packet will be sent with the coalesce buffer.
+ */
+static int coalesce_data_packet(Net_Crypto *c, int crypt_connection_id, uint32_t num, const uint8_t *data,
+                                uint16_t length)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr || !(conn->peer_capabilities & CRYPTO_CAPABILITY_BATCH)) {
+        return -1;
+    }
+
+    const bool lossy = data[0] >= PACKET_ID_RANGE_LOSSY_START && data[0] <= PACKET_ID_RANGE_LOSSY_END;
+    const bool small = c->coalescing_delay != 0 && length <= CRYPTO_COALESCE_MAX_PACKET_SIZE;
+    const bool bulk = !lossy && data_packet_stream(data) == CRYPTO_STREAM_BULK;
+
+    pthread_mutex_lock(&conn->mutex);
+    const bool jumbo = conn->pmtu != 0 && bulk;
+    pthread_mutex_unlock(&conn->mutex);
+
+    if (!small && !jumbo) {
+        return -1;
+    }
+
+    const uint16_t entry_length = CRYPTO_BATCH_ENTRY_HEADER_SIZE + length;
+
+    pthread_mutex_lock(&conn->mutex);
+    const bool full = conn->coalesce_length + entry_length > coalesce_buffer_size(conn);
+    pthread_mutex_unlock(&conn->mutex);
+
+    if (full) {
+        send_coalesced_packets(c, crypt_connection_id);
+    }
+
+    pthread_mutex_lock(&conn->mutex);
+
+    /* Another thread filled the buffer again in the meantime. */
+    if (conn->coalesce_length + entry_length > coalesce_buffer_size(conn)) {
+        pthread_mutex_unlock(&conn->mutex);
+        return -1;
+    }
+
+    /* Leave room for the packet id of the batch. */
+    if (conn->coalesce_length == 0) {
+        conn->coalesce_length = 1;
+        conn->coalesce_deadline = current_time_monotonic(c->mono_time) + c->coalescing_delay;
+    }
+
+    uint8_t *entry = conn->coalesce_buffer + conn->coalesce_length;
+    net_pack_u32(entry, num);
+    net_pack_u16(entry + sizeof(uint32_t), length);
+    memcpy(entry + CRYPTO_BATCH_ENTRY_HEADER_SIZE, data, length);
+    conn->coalesce_length += entry_length;
+    const uint64_t deadline = conn->coalesce_deadline;
+    pthread_mutex_unlock(&conn->mutex);
+
+    wake_crypto_connection_at(c, crypt_connection_id, deadline);
+    return 0;
+}
+
+static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return -1;
+    }
+
+    /* If last packet send failed, try to send packet again.
+       If sending it fails we won't be able to send the new packet. */
+    if (conn->maximum_speed_reached) {
+        Packet_Data *dt = nullptr;
+        const uint32_t packet_num = conn->send_array.buffer_end - 1;
+        const int ret = get_data_pointer(c->log, &conn->send_array, &dt, packet_num);
+
+        if (ret == 1 && dt->sent_time == 0) {
+            if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num,
+                                        dt->data, dt->length) != 0) {
+                return -1;
+            }
+
+            dt->sent_time = current_time_monotonic(c->mono_time);
+        }
+
+        conn->maximum_speed_reached = 0;
+    }
+
+    return 0;
+}
+
+/*  return -1 if data could not be put in packet queue.
+ *  return positive packet number if data was put into the queue.
+ */
+static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
+                                    uint8_t congestion_control)
+{
+    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
+        return -1;
+    }
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return -1;
+    }
+
+    /* If last packet send failed, try to send packet again.
+       If sending it fails we won't be able to send the new packet. */
+    reset_max_speed_reached(c, crypt_connection_id);
+
+    if (conn->maximum_speed_reached && congestion_control) {
+        return -1;
+    }
+
+    Packet_Data dt;
+    dt.sent_time = 0;
+    dt.length = length;
+    memcpy(dt.data, data, length);
+    pthread_mutex_lock(&conn->mutex);
+    int64_t packet_num = add_data_end_of_buffer(c->log, &c->packet_pool, &conn->send_array, &dt);
+    pthread_mutex_unlock(&conn->mutex);
+
+    if (packet_num == -1) {
+        return -1;
+    }
+
+    wake_crypto_connection(c, crypt_connection_id);
+
+    if (!congestion_control && conn->maximum_speed_reached) {
+        return packet_num;
+    }
+
+    if (coalesce_data_packet(c, crypt_connection_id, packet_num, data, length) == 0) {
+        /* Not to be sent on its own in the meantime. */
+        Packet_Data *dt1 = nullptr;
+
+        if (get_data_pointer(c->log, &conn->send_array, &dt1, packet_num) == 1) {
+            dt1->sent_time = current_time_monotonic(c->mono_time);
+        }
+
+        return packet_num;
+    }
+
+    if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, data, length) == 0) {
+        Packet_Data *dt1 = nullptr;
+
+        if (get_data_pointer(c->log, &conn->send_array, &dt1, packet_num) == 1) {
+            dt1->sent_time = current_time_monotonic(c->mono_time);
+        }
+    } else {
+        conn->maximum_speed_reached = 1;
+        LOGGER_DEBUG(c->log, "send_data_packet failed");
+    }
+
+    return packet_num;
+}
+
+/* Get the lowest 2 bytes from the nonce and convert
+ * them to host byte format before returning them.
+ */
+static uint16_t get_nonce_uint16(const uint8_t *nonce)
+{
+    uint16_t num;
+    memcpy(&num, nonce + (CRYPTO_NONCE_SIZE - sizeof(uint16_t)), sizeof(uint16_t));
+    return net_ntohs(num);
+}
+
+#define DATA_NUM_THRESHOLD 21845
+
+/* Compute the nonce a data packet from the peer was encrypted with.
+ *
+ * return how far that nonce is ahead of the one expected next.
+ */
+static uint16_t data_packet_nonce(const Crypto_Connection *conn, const uint8_t *packet, uint8_t *nonce)
+{
+    memcpy(nonce, conn->recv_nonce, CRYPTO_NONCE_SIZE);
+    const uint16_t num_cur_nonce = get_nonce_uint16(nonce);
+    uint16_t num;
+    net_unpack_u16(packet + 1, &num);
+    const uint16_t diff = num - num_cur_nonce;
+    increment_nonce_number(nonce, diff);
+    return diff;
+}
+
+/* Move the nonce expected next on once a packet with a nonce diff ahead of it
+ * was decrypted.
+ */
+static void update_recv_nonce(Crypto_Connection *conn, uint16_t diff)
+{
+    if (diff > DATA_NUM_THRESHOLD * 2) {
+        increment_nonce_number(conn->recv_nonce, DATA_NUM_THRESHOLD);
+    }
+}
+
+/* Decrypt count data packets from the peer that all have the given packet
+ * type, with the cipher that type stands for.
+ */
+static void decrypt_data_packets(const Net_Crypto *c, const Crypto_Connection *conn, uint8_t packet_type,
+                                 Crypto_Batch_Entry *entries, uint32_t count)
+{
+    if (packet_type != NET_PACKET_CRYPTO_DATA_AESGCM) {
+        decrypt_data_symmetric_batch(conn->shared_key, entries, count);
+        return;
+    }
+
+    if (!(c->capabilities & CRYPTO_CAPABILITY_AESGCM)) {
+        for (uint32_t i = 0; i < count; ++i) {
+            entries[i].result = -1;
+        }
+
+        return;
+    }
+
+    decrypt_data_aesgcm_batch(conn->aesgcm_key, entries, count);
+}
+
+/* Handle a data packet.
+ * Decrypt packet of length and put it into data.
+ * data must be at least MAX_DATA_DATA_PACKET_SIZE big.
+ *
+ * return -1 on failure.
+ * return length of data on success.
+ */
+static int handle_data_packet(const Net_Crypto *c, int crypt_connection_id, uint8_t *data, const uint8_t *packet,
+                              uint16_t length)
+{
+    const uint16_t crypto_packet_overhead = 1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE;
+
+    if (length <= crypto_packet_overhead || length > MAX_CRYPTO_PMTU_PACKET_SIZE) {
+        return -1;
+    }
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return -1;
+    }
+
+    uint8_t nonce[CRYPTO_NONCE_SIZE];
+    const uint16_t diff = data_packet_nonce(conn, packet, nonce);
+    Crypto_Batch_Entry entry = {nonce, packet + 1 + sizeof(uint16_t), length - (1 + sizeof(uint16_t)), data, -1};
+    decrypt_data_packets(c, conn, packet[0], &entry, 1);
+
+    const int plain_length = length - crypto_packet_overhead;
+
+    if (entry.result != plain_length) {
+        return -1;
+    }
+
+    update_recv_nonce(conn, diff);
+    return entry.result;
+}
+
+/* Send a request packet.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_request_packet(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return -1;
+    }
+
+    uint8_t data[MAX_CRYPTO_DATA_SIZE];
+    int len = generate_request_packet(c->log, data, sizeof(data), &conn->recv_array);
+
+    if (len == -1) {
+        return -1;
+    }
+
+    return send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end, data,
                                    len);
 }
 
@@ -1295,34 +2567,66 @@ static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32
     }
 
     const uint64_t temp_time = current_time_monotonic(c->mono_time);
-    uint32_t i, num_sent = 0, array_size = num_packets_array(&conn->send_array);
+    const uint32_t array_size = num_packets_array(&conn->send_array);
+    uint32_t num_sent = 0;
+
+    /* Packets are encrypted CRYPTO_BATCH_SIZE at a time. */
+    Packet_Data *batch[CRYPTO_BATCH_SIZE];
+    uint32_t batch_nums[CRYPTO_BATCH_SIZE];
+    uint32_t batch_length = 0;
+
+    /* Control packets first, then messages, then bulk data. */
+    Crypto_Stream priority = CRYPTO_STREAM_CONTROL;
+
+    while (priority <= CRYPTO_STREAM_BULK) {
+        Crypto_Stream next_priority = CRYPTO_STREAM_BARRIER;
+
+        for (uint32_t i = 0; i < array_size; ++i) {
+            Packet_Data *dt;
+            const uint32_t packet_num = i + conn->send_array.buffer_start;
+            const int ret = get_data_pointer(c->log, &conn->send_array, &dt, packet_num);
+
+            if (ret == -1) {
+                return -1;
+            }
+
+            if (ret == 0) {
+                continue;
+            }
+
+            if (dt->sent_time) {
+                continue;
+            }
+
+            const Crypto_Stream packet_priority = packet_send_priority(dt);
+
+            if (packet_priority != priority) {
+                if (packet_priority > priority && packet_priority < next_priority) {
+                    next_priority = packet_priority;
+                }
 
-    for (i = 0; i < array_size; ++i) {
-        Packet_Data *dt;
-        const uint32_t packet_num = i + conn->send_array.buffer_start;
-        const int ret = get_data_pointer(c->log, &conn->send_array, &dt, packet_num);
+                continue;
+            }
 
-        if (ret == -1) {
-            return -1;
-        }
+            batch[batch_length] = dt;
+            batch_nums[batch_length] = packet_num;
+            ++batch_length;
 
-        if (ret == 0) {
-            continue;
-        }
+            if (batch_length == CRYPTO_BATCH_SIZE || num_sent + batch_length >= max_num) {
+                num_sent += send_data_packet_batch(c, crypt_connection_id, batch_nums, batch, batch_length, temp_time);
+                batch_length = 0;
+            }
 
-        if (dt->sent_time) {
-            continue;
+            if (num_sent >= max_num) {
+                return num_sent;
+            }
         }
 
-        if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
-                                    dt->length) == 0) {
-            dt->sent_time = temp_time;
-            ++num_sent;
-        }
+        priority = next_priority;
+    }
 
-        if (num_sent >= max_num) {
-            break;
-        }
+    if (batch_length > 0) {
+        num_sent += send_data_packet_batch(c, crypt_connection_id, batch_nums, batch, batch_length, temp_time);
     }
 
     return num_sent;
@@ -1334,7 +2638,7 @@ static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32
  * return -1 on failure.
  * return 0 on success.
  */
-static int new_temp_packet(const Net_Crypto *c, int crypt_connection_id, const uint8_t *packet, uint16_t length)
+static int new_temp_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *packet, uint16_t length)
 {
     if (length == 0 || length > MAX_CRYPTO_PACKET_SIZE) {
         return -1;
@@ -1361,6 +2665,7 @@ static int new_temp_packet(const Net_Crypto *c, int crypt_connection_id, const u
     conn->temp_packet_length = length;
     conn->temp_packet_sent_time = 0;
     conn->temp_packet_num_sent = 0;
+    wake_crypto_connection(c, crypt_connection_id);
     return 0;
 }
 
@@ -1479,76 +2784,118 @@ static void connection_kill(Net_Crypto *c, int crypt_connection_id, void *userda
     crypto_kill(c, crypt_connection_id);
 }
 
-/* Handle a received data packet.
+/* Pass a received lossless packet to the layer above.
  *
- * return -1 on failure.
+ * return -1 if the connection was killed in the callback.
  * return 0 on success.
  */
-static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const uint8_t *packet, uint16_t length,
-                                   bool udp, void *userdata)
+static int deliver_lossless_packet(Net_Crypto *c, int crypt_connection_id, const Packet_Data *dt, void *userdata)
 {
-    if (length > MAX_CRYPTO_PACKET_SIZE || length <= CRYPTO_DATA_PACKET_MIN_SIZE) {
-        return -1;
-    }
-
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
     if (conn == nullptr) {
         return -1;
     }
 
-    uint8_t data[MAX_DATA_DATA_PACKET_SIZE];
-    int len = handle_data_packet(c, crypt_connection_id, data, packet, length);
+    stream_packet_received(conn, dt);
 
-    if (len <= (int)(sizeof(uint32_t) * 2)) {
+    uint16_t header_length = 0;
+
+    if (dt->data[0] == PACKET_ID_STREAM) {
+        header_length = CRYPTO_STREAM_HEADER_SIZE;
+    } else if (dt->data[0] == PACKET_ID_UNORDERED) {
+        header_length = CRYPTO_UNORDERED_HEADER_SIZE;
+    }
+
+    if (conn->connection_data_callback) {
+        conn->connection_data_callback(conn->connection_data_callback_object, conn->connection_data_callback_id,
+                                       dt->data + header_length, dt->length - header_length, userdata);
+    }
+
+    /* conn might get killed in callback. */
+    if (get_crypto_connection(c, crypt_connection_id) == nullptr) {
         return -1;
     }
 
-    uint32_t buffer_start, num;
-    memcpy(&buffer_start, data, sizeof(uint32_t));
-    memcpy(&num, data + sizeof(uint32_t), sizeof(uint32_t));
-    buffer_start = net_ntohl(buffer_start);
-    num = net_ntohl(num);
+    return 0;
+}
 
-    uint64_t rtt_calc_time = 0;
+/* Pass on packets of streams that are next in their stream, while packets
+ * before them in other streams are still missing.
+ *
+ * return -1 if the connection was killed in a callback.
+ * return 0 on success.
+ */
+static int deliver_stream_packets(Net_Crypto *c, int crypt_connection_id, void *userdata)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
-    if (buffer_start != conn->send_array.buffer_start) {
-        Packet_Data *packet_time;
+    if (conn == nullptr) {
+        return -1;
+    }
 
-        if (get_data_pointer(c->log, &conn->send_array, &packet_time, conn->send_array.buffer_start) == 1) {
-            rtt_calc_time = packet_time->sent_time;
-        }
+    if (!conn->streams_receiving) {
+        return 0;
+    }
 
-        if (clear_buffer_until(c->log, &conn->send_array, buffer_start) != 0) {
-            return -1;
+    for (uint32_t stream = 0; stream < CRYPTO_NUM_STREAMS; ++stream) {
+        if (!conn->stream_check[stream]) {
+            continue;
         }
-    }
 
-    uint8_t *real_data = data + (sizeof(uint32_t) * 2);
-    uint16_t real_length = len - (sizeof(uint32_t) * 2);
+        conn->stream_check[stream] = false;
 
-    while (real_data[0] == PACKET_ID_PADDING) { /* Remove Padding */
-        ++real_data;
-        --real_length;
+        for (uint32_t num = conn->recv_array.buffer_start;
+                num != conn->recv_array.buffer_end && conn->stream_waiting[stream] != 0; ++num) {
+            Packet_Data *dt;
 
-        if (real_length == 0) {
-            return -1;
+            if (get_data_pointer(c->log, &conn->recv_array, &dt, num) != 1) {
+                continue;
+            }
+
+            if (dt->delivered || dt->data[0] != PACKET_ID_STREAM || stored_packet_stream(dt) != stream) {
+                continue;
+            }
+
+            /* Packets of a stream are in order, so if this one isn't next,
+             * the next one is missing. */
+            if (stored_packet_seq(dt) != conn->stream_recv_seq[stream]) {
+                break;
+            }
+
+            dt->delivered = true;
+            Packet_Data packet;
+            memcpy(&packet, dt, sizeof(Packet_Data));
+
+            if (deliver_lossless_packet(c, crypt_connection_id, &packet, userdata) == -1) {
+                return -1;
+            }
+
+            conn = get_crypto_connection(c, crypt_connection_id);
         }
     }
 
-    if (real_data[0] == PACKET_ID_KILL) {
-        connection_kill(c, crypt_connection_id, userdata);
-        return 0;
-    }
+    return 0;
+}
 
-    if (conn->status == CRYPTO_CONN_NOT_CONFIRMED) {
-        clear_temp_packet(c, crypt_connection_id);
-        conn->status = CRYPTO_CONN_ESTABLISHED;
+/* Handle the contents of a data packet, or of one of the packets in a
+ * PACKET_ID_BATCH packet, with packet number num.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int handle_data_payload(Net_Crypto *c, int crypt_connection_id, uint32_t num, const uint8_t *real_data,
+                               uint16_t real_length, bool udp, uint64_t *rtt_calc_time, void *userdata)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
-        if (conn->connection_status_callback) {
-            conn->connection_status_callback(conn->connection_status_callback_object, conn->connection_status_callback_id, 1,
-                                             userdata);
-        }
+    if (conn == nullptr) {
+        return -1;
+    }
+
+    /* Only batches are bigger, and they are unpacked before. */
+    if (real_length > MAX_CRYPTO_DATA_SIZE) {
+        return -1;
     }
 
     if (real_data[0] == PACKET_ID_REQUEST) {
@@ -1560,70 +2907,343 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
             rtt_time = DEFAULT_TCP_PING_CONNECTION;
         }
 
-        int requested = handle_request_packet(c->mono_time, c->log, &conn->send_array, real_data, real_length, &rtt_calc_time,
-                                              rtt_time);
+        uint32_t packets_acked = 0;
+        int requested = handle_request_packet(c->mono_time, c->log, &c->packet_pool, &conn->send_array, real_data,
+                                              real_length, rtt_calc_time, rtt_time, &packets_acked);
 
         if (requested == -1) {
             return -1;
         }
 
+        congestion_control_on_ack(&conn->congestion, current_time_monotonic(c->mono_time), packets_acked);
+
         set_buffer_end(c->log, &conn->recv_array, num);
-    } else if (real_data[0] >= PACKET_ID_RANGE_LOSSLESS_START && real_data[0] <= PACKET_ID_RANGE_LOSSLESS_END) {
+    } else if ((real_data[0] >= PACKET_ID_RANGE_LOSSLESS_START && real_data[0] <= PACKET_ID_RANGE_LOSSLESS_END)
+               || real_data[0] == PACKET_ID_STREAM || real_data[0] == PACKET_ID_UNORDERED) {
+        uint16_t stream_seq;
+
+        if (real_data[0] == PACKET_ID_STREAM && !crypto_unpack_stream_header(real_data, real_length, &stream_seq)) {
+            return -1;
+        }
+
+        if (real_data[0] == PACKET_ID_UNORDERED && !valid_unordered_packet(real_data, real_length)) {
+            return -1;
+        }
+
         Packet_Data dt = {0};
         dt.length = real_length;
         memcpy(dt.data, real_data, real_length);
 
-        if (add_data_to_buffer(c->log, &conn->recv_array, num, &dt) != 0) {
+        if (add_data_to_buffer(c->log, &c->packet_pool, &conn->recv_array, num, &dt) != 0) {
             return -1;
         }
 
+        if (real_data[0] == PACKET_ID_STREAM) {
+            const Crypto_Stream stream = stored_packet_stream(&dt);
+            ++conn->stream_waiting[stream];
+            conn->stream_check[stream] = true;
+        }
+
+        /* Otherwise it waits for its turn like any other packet. */
+        if (real_data[0] == PACKET_ID_UNORDERED && stored_packet_seq(&dt) == conn->barriers_received) {
+            Packet_Data *stored;
+
+            if (get_data_pointer(c->log, &conn->recv_array, &stored, num) == 1) {
+                stored->delivered = true;
+            }
+
+            if (deliver_lossless_packet(c, crypt_connection_id, &dt, userdata) == -1) {
+                return -1;
+            }
+
+            conn = get_crypto_connection(c, crypt_connection_id);
+        }
+
         while (1) {
             pthread_mutex_lock(&conn->mutex);
-            int ret = read_data_beg_buffer(c->log, &conn->recv_array, &dt);
+            int ret = read_data_beg_buffer(c->log, &c->packet_pool, &conn->recv_array, &dt);
             pthread_mutex_unlock(&conn->mutex);
 
-            if (ret == -1) {
-                break;
-            }
+            if (ret == -1) {
+                break;
+            }
+
+            if (dt.delivered) {
+                continue;
+            }
+
+            if (deliver_lossless_packet(c, crypt_connection_id, &dt, userdata) == -1) {
+                return -1;
+            }
+
+            conn = get_crypto_connection(c, crypt_connection_id);
+        }
+
+        if (deliver_stream_packets(c, crypt_connection_id, userdata) == -1) {
+            return -1;
+        }
+
+        conn = get_crypto_connection(c, crypt_connection_id);
+
+        /* Packet counter. */
+        ++conn->packet_counter;
+    } else if (real_data[0] >= PACKET_ID_RANGE_LOSSY_START && real_data[0] <= PACKET_ID_RANGE_LOSSY_END) {
+
+        set_buffer_end(c->log, &conn->recv_array, num);
+
+        if (conn->connection_lossy_data_callback) {
+            conn->connection_lossy_data_callback(conn->connection_lossy_data_callback_object,
+                                                 conn->connection_lossy_data_callback_id, real_data, real_length, userdata);
+        }
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Handle the packets in a PACKET_ID_BATCH packet. A packet that can't be
+ * handled, e.g. because it was received before, doesn't affect the others.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int handle_batch_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
+                               bool udp, uint64_t *rtt_calc_time, void *userdata)
+{
+    size_t pos = 1;
+
+    while (pos < length) {
+        if (length <= pos + CRYPTO_BATCH_ENTRY_HEADER_SIZE) {
+            return -1;
+        }
+
+        uint32_t num;
+        uint16_t entry_length;
+        net_unpack_u32(data + pos, &num);
+        net_unpack_u16(data + pos + sizeof(uint32_t), &entry_length);
+        pos += CRYPTO_BATCH_ENTRY_HEADER_SIZE;
+
+        if (entry_length == 0 || entry_length > length - pos) {
+            return -1;
+        }
+
+        const uint8_t packet_id = data[pos];
+
+        if (packet_id == PACKET_ID_REQUEST || packet_id == PACKET_ID_KILL || packet_id == PACKET_ID_BATCH) {
+            return -1;
+        }
+
+        handle_data_payload(c, crypt_connection_id, num, data + pos, entry_length, udp, rtt_calc_time, userdata);
+
+        /* The connection might get killed in a callback. */
+        if (get_crypto_connection(c, crypt_connection_id) == nullptr) {
+            return -1;
+        }
+
+        pos += entry_length;
+    }
+
+    return 0;
+}
+
+/* Handle a path MTU probe or an ack for one with packet number num. A probe
+ * is acked if it arrived over UDP with the size it was sent with,
+ * packet_length.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int handle_pmtu_packet(Net_Crypto *c, int crypt_connection_id, uint32_t num, const uint8_t *data,
+                              uint16_t length, uint16_t packet_length, bool udp)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr || length != CRYPTO_PMTU_PACKET_SIZE) {
+        return -1;
+    }
+
+    uint16_t size;
+    net_unpack_u16(data + 1, &size);
+
+    set_buffer_end(c->log, &conn->recv_array, num);
+
+    if (data[0] == PACKET_ID_PMTU_PROBE) {
+        if (!udp || size != packet_length) {
+            return -1;
+        }
+
+        uint8_t ack[CRYPTO_PMTU_PACKET_SIZE];
+        ack[0] = PACKET_ID_PMTU_ACK;
+        net_pack_u16(ack + 1, size);
+        return send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end,
+                                       ack, sizeof(ack));
+    }
+
+    if (conn->pmtu_probe_size == 0 || size != conn->pmtu_probe_size) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&conn->mutex);
+    conn->pmtu = size;
+    conn->pmtu_ip_port = conn->pmtu_probe_ip_port;
+    pthread_mutex_unlock(&conn->mutex);
+
+    conn->pmtu_probe_size = 0;
+    conn->pmtu_confirm_time = current_time_monotonic(c->mono_time) + PMTU_CONFIRM_INTERVAL;
+    return 0;
+}
+
+/* Handle a resumption cookie with packet number num. It replaces the one we
+ * had from the peer.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int handle_resume_cookie_packet(Net_Crypto *c, int crypt_connection_id, uint32_t num, const uint8_t *data,
+                                       uint16_t length)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr || length != RESUME_COOKIE_PACKET_SIZE) {
+        return -1;
+    }
+
+    set_buffer_end(c->log, &conn->recv_array, num);
+
+    Resume_Entry *entry = get_resume_entry(c, conn->public_key, true);
+    memcpy(entry->cookie, data + 1, COOKIE_LENGTH);
+    memcpy(entry->dht_public_key, conn->dht_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    entry->cookie_time = current_time_monotonic(c->mono_time);
+    entry->last_used = entry->cookie_time;
+    return 0;
+}
+
+/* Handle the decrypted part of length len of a received data packet, which
+ * was length bytes long.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int handle_decrypted_data_packet(Net_Crypto *c, int crypt_connection_id, uint8_t *data, int len,
+                                        uint16_t length, bool udp, void *userdata)
+{
+    if (len <= (int)(sizeof(uint32_t) * 2)) {
+        return -1;
+    }
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return -1;
+    }
+
+    conn->bytes_received += length;
+
+    uint32_t buffer_start, num;
+    memcpy(&buffer_start, data, sizeof(uint32_t));
+    memcpy(&num, data + sizeof(uint32_t), sizeof(uint32_t));
+    buffer_start = net_ntohl(buffer_start);
+    num = net_ntohl(num);
+
+    uint64_t rtt_calc_time = 0;
+
+    if (buffer_start != conn->send_array.buffer_start) {
+        Packet_Data *packet_time;
+
+        if (get_data_pointer(c->log, &conn->send_array, &packet_time, conn->send_array.buffer_start) == 1) {
+            rtt_calc_time = packet_time->sent_time;
+        }
+
+        const int packets_acked = clear_buffer_until(c->log, &c->packet_pool, &conn->send_array, buffer_start);
+
+        if (packets_acked == -1) {
+            return -1;
+        }
+
+        congestion_control_on_ack(&conn->congestion, current_time_monotonic(c->mono_time), packets_acked);
+    }
 
-            if (conn->connection_data_callback) {
-                conn->connection_data_callback(conn->connection_data_callback_object, conn->connection_data_callback_id, dt.data,
-                                               dt.length, userdata);
-            }
+    uint8_t *real_data = data + (sizeof(uint32_t) * 2);
+    uint16_t real_length = len - (sizeof(uint32_t) * 2);
 
-            /* conn might get killed in callback. */
-            conn = get_crypto_connection(c, crypt_connection_id);
+    while (real_data[0] == PACKET_ID_PADDING) { /* Remove Padding */
+        ++real_data;
+        --real_length;
 
-            if (conn == nullptr) {
-                return -1;
-            }
+        if (real_length == 0) {
+            return -1;
         }
+    }
 
-        /* Packet counter. */
-        ++conn->packet_counter;
-    } else if (real_data[0] >= PACKET_ID_RANGE_LOSSY_START && real_data[0] <= PACKET_ID_RANGE_LOSSY_END) {
+    if (real_data[0] == PACKET_ID_KILL) {
+        connection_kill(c, crypt_connection_id, userdata);
+        return 0;
+    }
 
-        set_buffer_end(c->log, &conn->recv_array, num);
+    if (conn->status == CRYPTO_CONN_NOT_CONFIRMED) {
+        clear_temp_packet(c, crypt_connection_id);
+        conn->status = CRYPTO_CONN_ESTABLISHED;
 
-        if (conn->connection_lossy_data_callback) {
-            conn->connection_lossy_data_callback(conn->connection_lossy_data_callback_object,
-                                                 conn->connection_lossy_data_callback_id, real_data, real_length, userdata);
+        if (conn->connection_status_callback) {
+            conn->connection_status_callback(conn->connection_status_callback_object, conn->connection_status_callback_id, 1,
+                                             userdata);
         }
+    }
+
+    int ret;
+
+    if (real_data[0] == PACKET_ID_BATCH) {
+        ret = handle_batch_packet(c, crypt_connection_id, real_data, real_length, udp, &rtt_calc_time, userdata);
+    } else if (real_data[0] == PACKET_ID_PMTU_PROBE || real_data[0] == PACKET_ID_PMTU_ACK) {
+        ret = handle_pmtu_packet(c, crypt_connection_id, num, real_data, real_length, length, udp);
+    } else if (real_data[0] == PACKET_ID_RESUME_COOKIE) {
+        ret = handle_resume_cookie_packet(c, crypt_connection_id, num, real_data, real_length);
     } else {
+        ret = handle_data_payload(c, crypt_connection_id, num, real_data, real_length, udp, &rtt_calc_time, userdata);
+    }
+
+    conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (ret == -1 || conn == nullptr) {
         return -1;
     }
 
     if (rtt_calc_time != 0) {
-        uint64_t rtt_time = current_time_monotonic(c->mono_time) - rtt_calc_time;
+        const uint64_t temp_time = current_time_monotonic(c->mono_time);
+        uint64_t rtt_time = temp_time - rtt_calc_time;
 
         if (rtt_time < conn->rtt_time) {
             conn->rtt_time = rtt_time;
         }
+
+        /* handle_request_packet() sets rtt_calc_time past the current time
+         * when packets were requested, which is not a sample. */
+        if (rtt_calc_time <= temp_time) {
+            congestion_control_on_rtt(&conn->congestion, rtt_time);
+        }
     }
 
     return 0;
 }
 
+/* Handle a received data packet.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const uint8_t *packet, uint16_t length,
+                                   bool udp, void *userdata)
+{
+    if (length > MAX_CRYPTO_PMTU_PACKET_SIZE || length <= CRYPTO_DATA_PACKET_MIN_SIZE) {
+        return -1;
+    }
+
+    uint8_t data[MAX_DATA_DATA_PACKET_SIZE];
+    const int len = handle_data_packet(c, crypt_connection_id, data, packet, length);
+    return handle_decrypted_data_packet(c, crypt_connection_id, data, len, length, udp, userdata);
+}
+
 /* Handle a packet that was received for the connection.
  *
  * return -1 on failure.
@@ -1632,7 +3252,8 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
 static int handle_packet_connection(Net_Crypto *c, int crypt_connection_id, const uint8_t *packet, uint16_t length,
                                     bool udp, void *userdata)
 {
-    if (length == 0 || length > MAX_CRYPTO_PACKET_SIZE) {
+    /* Only direct UDP packets may exceed MAX_CRYPTO_PACKET_SIZE. */
+    if (length == 0 || length > (udp ? MAX_CRYPTO_PMTU_PACKET_SIZE : MAX_CRYPTO_PACKET_SIZE)) {
         return -1;
     }
 
@@ -1642,6 +3263,8 @@ static int handle_packet_connection(Net_Crypto *c, int crypt_connection_id, cons
         return -1;
     }
 
+    wake_crypto_connection(c, crypt_connection_id);
+
     switch (packet[0]) {
         case NET_PACKET_COOKIE_RESPONSE: {
             if (conn->status != CRYPTO_CONN_COOKIE_REQUESTING) {
@@ -1679,17 +3302,22 @@ static int handle_packet_connection(Net_Crypto *c, int crypt_connection_id, cons
             uint8_t cookie[COOKIE_LENGTH];
 
             if (handle_crypto_handshake(c, conn->recv_nonce, conn->peersessionpublic_key, peer_real_pk, dht_public_key, cookie,
-                                        packet, length, conn->public_key) != 0) {
+                                        packet, length, conn->public_key, nullptr) != 0) {
                 return -1;
             }
 
             if (public_key_cmp(dht_public_key, conn->dht_public_key) == 0) {
-                encrypt_precompute(conn->peersessionpublic_key, conn->sessionsecret_key, conn->shared_key);
+                precompute_session_keys(conn);
 
-                if (conn->status == CRYPTO_CONN_COOKIE_REQUESTING) {
+                /* The peer might not have taken our resumption cookie, so answer
+                 * with the cookie it sent instead. */
+                if (conn->status == CRYPTO_CONN_COOKIE_REQUESTING
+                        || (conn->status == CRYPTO_CONN_HANDSHAKE_SENT && conn->resuming)) {
                     if (create_send_handshake(c, crypt_connection_id, cookie, dht_public_key) != 0) {
                         return -1;
                     }
+
+                    conn->resuming = false;
                 }
 
                 conn->status = CRYPTO_CONN_NOT_CONFIRMED;
@@ -1702,7 +3330,8 @@ static int handle_packet_connection(Net_Crypto *c, int crypt_connection_id, cons
             return 0;
         }
 
-        case NET_PACKET_CRYPTO_DATA: {
+        case NET_PACKET_CRYPTO_DATA:
+        case NET_PACKET_CRYPTO_DATA_AESGCM: {
             if (conn->status != CRYPTO_CONN_NOT_CONFIRMED && conn->status != CRYPTO_CONN_ESTABLISHED) {
                 return -1;
             }
@@ -1766,7 +3395,8 @@ static int create_crypto_connection(Net_Crypto *c)
 
     int id = -1;
 
-    if (realloc_cryptoconnection(c, c->crypto_connections_length + 1) == 0) {
+    if (schedule_reserve(c, c->crypto_connections_length + 1) == 0
+            && realloc_cryptoconnection(c, c->crypto_connections_length + 1) == 0) {
         id = c->crypto_connections_length;
         ++c->crypto_connections_length;
         memset(&c->crypto_connections[id], 0, sizeof(Crypto_Connection));
@@ -1787,6 +3417,20 @@ static int create_crypto_connection(Net_Crypto *c)
     return id;
 }
 
+
+/* Remove the connection from real_pk_map, unless the key maps to another
+ * connection.
+ */
+static void remove_real_pk(Net_Crypto *c, int crypt_connection_id)
+{
+    const uint8_t *public_key = c->crypto_connections[crypt_connection_id].public_key;
+    uint32_t id;
+
+    if (pk_map_find(c->real_pk_map, public_key, &id) && id == (uint32_t)crypt_connection_id) {
+        pk_map_remove(c->real_pk_map, public_key);
+    }
+}
+
 /* Wipe a crypto connection.
  *
  * return -1 on failure.
@@ -1800,6 +3444,9 @@ static int wipe_crypto_connection(Net_Crypto *c, int crypt_connection_id)
 
     uint32_t i;
 
+    unschedule_connection(c, crypt_connection_id);
+    remove_real_pk(c, crypt_connection_id);
+
     /* Keep mutex, only destroy it when connection is realloced out. */
     pthread_mutex_t mutex = c->crypto_connections[crypt_connection_id].mutex;
     crypto_memzero(&c->crypto_connections[crypt_connection_id], sizeof(Crypto_Connection));
@@ -1828,15 +3475,31 @@ static int wipe_crypto_connection(Net_Crypto *c, int crypt_connection_id)
  */
 static int getcryptconnection_id(const Net_Crypto *c, const uint8_t *public_key)
 {
-    for (uint32_t i = 0; i < c->crypto_connections_length; ++i) {
-        if (c->crypto_connections[i].status != CRYPTO_CONN_NO_CONNECTION) {
-            if (public_key_cmp(public_key, c->crypto_connections[i].public_key) == 0) {
-                return i;
-            }
-        }
+    uint32_t crypt_connection_id;
+
+    if (!pk_map_find(c->real_pk_map, public_key, &crypt_connection_id)
+            || crypt_connection_id_not_valid(c, crypt_connection_id)) {
+        return -1;
     }
 
-    return -1;
+    return crypt_connection_id;
+}
+
+/* Give up on a connection that failed before it was fully set up, keeping the
+ * slot for reuse by create_crypto_connection().
+ */
+static void abort_crypto_connection(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = &c->crypto_connections[crypt_connection_id];
+
+    pthread_mutex_lock(&c->tcp_mutex);
+    kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
+    pthread_mutex_unlock(&c->tcp_mutex);
+    unschedule_connection(c, crypt_connection_id);
+    remove_real_pk(c, crypt_connection_id);
+    clear_buffer(&c->packet_pool, &conn->send_array);
+    clear_buffer(&c->packet_pool, &conn->recv_array);
+    conn->status = CRYPTO_CONN_NO_CONNECTION;
 }
 
 /* Add a source to the crypto connection.
@@ -1908,9 +3571,10 @@ static int handle_new_connection_handshake(Net_Crypto *c, IP_Port source, const
 
     n_c.source = source;
     n_c.cookie_length = COOKIE_LENGTH;
+    bool resumed;
 
     if (handle_crypto_handshake(c, n_c.recv_nonce, n_c.peersessionpublic_key, n_c.public_key, n_c.dht_public_key,
-                                n_c.cookie, data, length, nullptr) != 0) {
+                                n_c.cookie, data, length, nullptr, &resumed) != 0) {
         free(n_c.cookie);
         return -1;
     }
@@ -1926,6 +3590,11 @@ static int handle_new_connection_handshake(Net_Crypto *c, IP_Port source, const
 
         if (public_key_cmp(n_c.dht_public_key, conn->dht_public_key) != 0) {
             connection_kill(c, crypt_connection_id, userdata);
+        } else if (resumed && (conn->status == CRYPTO_CONN_NOT_CONFIRMED || conn->status == CRYPTO_CONN_ESTABLISHED)
+                   && public_key_cmp(n_c.peersessionpublic_key, conn->peersessionpublic_key) != 0) {
+            /* The peer lost the session and is resuming it, so this one is
+             * dead even though it hasn't timed out yet. */
+            connection_kill(c, crypt_connection_id, userdata);
         } else {
             if (conn->status != CRYPTO_CONN_COOKIE_REQUESTING && conn->status != CRYPTO_CONN_HANDSHAKE_SENT) {
                 free(n_c.cookie);
@@ -1934,7 +3603,7 @@ static int handle_new_connection_handshake(Net_Crypto *c, IP_Port source, const
 
             memcpy(conn->recv_nonce, n_c.recv_nonce, CRYPTO_NONCE_SIZE);
             memcpy(conn->peersessionpublic_key, n_c.peersessionpublic_key, CRYPTO_PUBLIC_KEY_SIZE);
-            encrypt_precompute(conn->peersessionpublic_key, conn->sessionsecret_key, conn->shared_key);
+            precompute_session_keys(conn);
 
             crypto_connection_add_source(c, crypt_connection_id, source);
 
@@ -1988,18 +3657,23 @@ int accept_crypto_connection(Net_Crypto *c, New_Connection *n_c)
 
     conn->connection_number_tcp = connection_number_tcp;
     memcpy(conn->public_key, n_c->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+
+    if (!pk_map_add(c->real_pk_map, conn->public_key, crypt_connection_id)) {
+        pthread_mutex_lock(&c->tcp_mutex);
+        kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
+        pthread_mutex_unlock(&c->tcp_mutex);
+        return -1;
+    }
+
     memcpy(conn->recv_nonce, n_c->recv_nonce, CRYPTO_NONCE_SIZE);
     memcpy(conn->peersessionpublic_key, n_c->peersessionpublic_key, CRYPTO_PUBLIC_KEY_SIZE);
     random_nonce(conn->sent_nonce);
     crypto_new_keypair(conn->sessionpublic_key, conn->sessionsecret_key);
-    encrypt_precompute(conn->peersessionpublic_key, conn->sessionsecret_key, conn->shared_key);
+    precompute_session_keys(conn);
     conn->status = CRYPTO_CONN_NOT_CONFIRMED;
 
     if (create_send_handshake(c, crypt_connection_id, n_c->cookie, n_c->dht_public_key) != 0) {
-        pthread_mutex_lock(&c->tcp_mutex);
-        kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
-        pthread_mutex_unlock(&c->tcp_mutex);
-        conn->status = CRYPTO_CONN_NO_CONNECTION;
+        abort_crypto_connection(c, crypt_connection_id);
         return -1;
     }
 
@@ -2008,10 +3682,77 @@ int accept_crypto_connection(Net_Crypto *c, New_Connection *n_c)
     conn->packet_send_rate_requested = CRYPTO_PACKET_MIN_RATE;
     conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
     conn->rtt_time = DEFAULT_PING_CONNECTION;
+    congestion_control_init(&conn->congestion, c->congestion_algorithm);
     crypto_connection_add_source(c, crypt_connection_id, n_c->source);
     return crypt_connection_id;
 }
 
+/* Set a new cookie request as the temp packet of the connection.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int new_cookie_request(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return -1;
+    }
+
+    conn->cookie_request_number = random_u64();
+    uint8_t cookie_request[COOKIE_REQUEST_LENGTH];
+
+    if (create_cookie_request(c, cookie_request, conn->dht_public_key, conn->cookie_request_number,
+                              conn->shared_key) != sizeof(cookie_request)) {
+        return -1;
+    }
+
+    conn->status = CRYPTO_CONN_COOKIE_REQUESTING;
+    return new_temp_packet(c, crypt_connection_id, cookie_request, sizeof(cookie_request));
+}
+
+/* Set a handshake as the temp packet of the connection that uses the
+ * resumption cookie the peer gave us, if we have one that is recent enough.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int resume_crypto_connection(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return -1;
+    }
+
+    Resume_Entry *entry = get_resume_entry(c, conn->public_key, false);
+
+    if (entry == nullptr || entry->cookie_time == 0
+            || entry->cookie_time + RESUME_COOKIE_USE_TIMEOUT < current_time_monotonic(c->mono_time)
+            || public_key_cmp(entry->dht_public_key, conn->dht_public_key) != 0) {
+        return -1;
+    }
+
+    uint8_t handshake_packet[HANDSHAKE_PACKET_LENGTH];
+
+    if (create_crypto_handshake(c, handshake_packet, entry->cookie, conn->sent_nonce, conn->sessionpublic_key,
+                                conn->public_key, conn->dht_public_key) != sizeof(handshake_packet)) {
+        return -1;
+    }
+
+    /* The peer only takes it once. */
+    entry->cookie_time = 0;
+
+    if (new_temp_packet(c, crypt_connection_id, handshake_packet, sizeof(handshake_packet)) != 0) {
+        return -1;
+    }
+
+    conn->status = CRYPTO_CONN_HANDSHAKE_SENT;
+    conn->resuming = true;
+    return 0;
+}
+
 /* Create a crypto connection.
  * If one to that real public key already exists, return it.
  *
@@ -2044,6 +3785,14 @@ int new_crypto_connection(Net_Crypto *c, const uint8_t *real_public_key, const u
 
     conn->connection_number_tcp = connection_number_tcp;
     memcpy(conn->public_key, real_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+
+    if (!pk_map_add(c->real_pk_map, conn->public_key, crypt_connection_id)) {
+        pthread_mutex_lock(&c->tcp_mutex);
+        kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
+        pthread_mutex_unlock(&c->tcp_mutex);
+        return -1;
+    }
+
     random_nonce(conn->sent_nonce);
     crypto_new_keypair(conn->sessionpublic_key, conn->sessionsecret_key);
     conn->status = CRYPTO_CONN_COOKIE_REQUESTING;
@@ -2051,18 +3800,12 @@ int new_crypto_connection(Net_Crypto *c, const uint8_t *real_public_key, const u
     conn->packet_send_rate_requested = CRYPTO_PACKET_MIN_RATE;
     conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
     conn->rtt_time = DEFAULT_PING_CONNECTION;
+    congestion_control_init(&conn->congestion, c->congestion_algorithm);
     memcpy(conn->dht_public_key, dht_public_key, CRYPTO_PUBLIC_KEY_SIZE);
 
-    conn->cookie_request_number = random_u64();
-    uint8_t cookie_request[COOKIE_REQUEST_LENGTH];
-
-    if (create_cookie_request(c, cookie_request, conn->dht_public_key, conn->cookie_request_number,
-                              conn->shared_key) != sizeof(cookie_request)
-            || new_temp_packet(c, crypt_connection_id, cookie_request, sizeof(cookie_request)) != 0) {
-        pthread_mutex_lock(&c->tcp_mutex);
-        kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
-        pthread_mutex_unlock(&c->tcp_mutex);
-        conn->status = CRYPTO_CONN_NO_CONNECTION;
+    if (resume_crypto_connection(c, crypt_connection_id) != 0
+            && new_cookie_request(c, crypt_connection_id) != 0) {
+        abort_crypto_connection(c, crypt_connection_id);
         return -1;
     }
 
@@ -2385,6 +4128,134 @@ static int crypto_id_ip_port(const Net_Crypto *c, IP_Port ip_port)
 
 #define CRYPTO_MIN_PACKET_SIZE (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE)
 
+/* Remember when the last packet from the peer arrived over the direct UDP
+ * path at source.
+ */
+static void direct_packet_received(Net_Crypto *c, int crypt_connection_id, IP_Port source)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return;
+    }
+
+    pthread_mutex_lock(&conn->mutex);
+
+    if (net_family_is_ipv4(source.ip.family)) {
+        conn->direct_lastrecv_timev4 = mono_time_get(c->mono_time);
+    } else {
+        conn->direct_lastrecv_timev6 = mono_time_get(c->mono_time);
+    }
+
+    pthread_mutex_unlock(&conn->mutex);
+}
+
+/* Decrypt count received data packets for the same connection, which have
+ * the same packet type, together and handle them.
+ */
+static void handle_received_packet_batch(Net_Crypto *c, Received_Packet *received, uint32_t count, void *userdata)
+{
+    const uint16_t crypto_packet_overhead = 1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE;
+    const int crypt_connection_id = received[0].crypt_connection_id;
+    const Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return;
+    }
+
+    uint8_t nonces[CRYPTO_BATCH_SIZE][CRYPTO_NONCE_SIZE];
+    Crypto_Batch_Entry entries[CRYPTO_BATCH_SIZE];
+
+    for (uint32_t i = 0; i < count; ++i) {
+        data_packet_nonce(conn, received[i].packet, nonces[i]);
+        entries[i].nonce = nonces[i];
+        entries[i].input = received[i].packet + 1 + sizeof(uint16_t);
+        entries[i].length = received[i].length - (1 + sizeof(uint16_t));
+        entries[i].output = received[i].plain;
+    }
+
+    decrypt_data_packets(c, conn, received[0].packet[0], entries, count);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        Received_Packet *const packet = &received[i];
+        Crypto_Connection *const current_conn = get_crypto_connection(c, crypt_connection_id);
+
+        if (current_conn == nullptr
+                || (current_conn->status != CRYPTO_CONN_NOT_CONFIRMED && current_conn->status != CRYPTO_CONN_ESTABLISHED)) {
+            return;
+        }
+
+        uint8_t nonce[CRYPTO_NONCE_SIZE];
+        const uint16_t diff = data_packet_nonce(current_conn, packet->packet, nonce);
+        int len = entries[i].result;
+
+        if (memcmp(nonce, nonces[i], CRYPTO_NONCE_SIZE) != 0) {
+            /* An earlier packet of the batch moved the expected nonce on. */
+            len = handle_data_packet(c, crypt_connection_id, packet->plain, packet->packet, packet->length);
+        } else if (len == packet->length - crypto_packet_overhead) {
+            update_recv_nonce(current_conn, diff);
+        } else {
+            len = -1;
+        }
+
+        if (handle_decrypted_data_packet(c, crypt_connection_id, packet->plain, len, packet->length, 1, userdata) == 0) {
+            direct_packet_received(c, crypt_connection_id, packet->source);
+        }
+    }
+}
+
+/* Decrypt and handle the data packets received over UDP since the last call.
+ */
+static void handle_received_packets(Net_Crypto *c, void *userdata)
+{
+    const uint32_t count = c->received_packets_length;
+    uint32_t i = 0;
+
+    while (i < count) {
+        const Received_Packet *const first = &c->received_packets[i];
+        uint32_t end = i + 1;
+
+        while (end < count && c->received_packets[end].crypt_connection_id == first->crypt_connection_id
+                && c->received_packets[end].packet[0] == first->packet[0]) {
+            ++end;
+        }
+
+        handle_received_packet_batch(c, &c->received_packets[i], end - i, userdata);
+        i = end;
+    }
+
+    c->received_packets_length = 0;
+}
+
+/* Queue a data packet received over UDP to be decrypted together with the
+ * ones received after it. The queue is handled when it is full and in
+ * do_net_crypto().
+ *
+ * return false if the packet can't be a data packet for the connection.
+ */
+static bool queue_received_packet(Net_Crypto *c, int crypt_connection_id, IP_Port source, const uint8_t *packet,
+                                  uint16_t length, void *userdata)
+{
+    const Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr || length <= CRYPTO_DATA_PACKET_MIN_SIZE || length > MAX_CRYPTO_PMTU_PACKET_SIZE
+            || (conn->status != CRYPTO_CONN_NOT_CONFIRMED && conn->status != CRYPTO_CONN_ESTABLISHED)) {
+        return false;
+    }
+
+    if (c->received_packets_length == CRYPTO_BATCH_SIZE) {
+        handle_received_packets(c, userdata);
+    }
+
+    Received_Packet *const received = &c->received_packets[c->received_packets_length];
+    received->crypt_connection_id = crypt_connection_id;
+    received->source = source;
+    received->length = length;
+    memcpy(received->packet, packet, length);
+    ++c->received_packets_length;
+    return true;
+}
+
 /* Handle raw UDP packets coming directly from the socket.
  *
  * Handles:
@@ -2397,296 +4268,444 @@ static int udp_handle_packet(void *object, IP_Port source, const uint8_t *packet
 {
     Net_Crypto *c = (Net_Crypto *)object;
 
-    if (length <= CRYPTO_MIN_PACKET_SIZE || length > MAX_CRYPTO_PACKET_SIZE) {
+    if (length <= CRYPTO_MIN_PACKET_SIZE || length > MAX_CRYPTO_PMTU_PACKET_SIZE) {
         return 1;
     }
 
     const int crypt_connection_id = crypto_id_ip_port(c, source);
 
-    if (crypt_connection_id == -1) {
-        if (packet[0] != NET_PACKET_CRYPTO_HS) {
-            return 1;
-        }
+    /* A handshake for an established connection can only start a new one,
+     * e.g. because the peer is resuming the session. */
+    if (crypt_connection_id == -1
+            || (packet[0] == NET_PACKET_CRYPTO_HS
+                && crypto_connection_status(c, crypt_connection_id, nullptr, nullptr) == CRYPTO_CONN_ESTABLISHED)) {
+        if (packet[0] != NET_PACKET_CRYPTO_HS) {
+            return 1;
+        }
+
+        if (handle_new_connection_handshake(c, source, packet, length, userdata) != 0) {
+            return 1;
+        }
+
+        return 0;
+    }
+
+    if (packet[0] == NET_PACKET_CRYPTO_DATA || packet[0] == NET_PACKET_CRYPTO_DATA_AESGCM) {
+        return queue_received_packet(c, crypt_connection_id, source, packet, length, userdata) ? 0 : 1;
+    }
+
+    if (handle_packet_connection(c, crypt_connection_id, packet, length, 1, userdata) != 0) {
+        return 1;
+    }
+
+    direct_packet_received(c, crypt_connection_id, source);
+    return 0;
+}
+
+/* The dT for the average packet receiving rate calculations.
+   Also used as the interval at which congestion control runs. */
+#define PACKET_COUNTER_AVERAGE_INTERVAL CONGESTION_INTERVAL
+
+/* Ratio of recv queue size / recv packet rate (in seconds) times
+ * the number of ms between request packets to send at that ratio
+ */
+#define REQUEST_PACKETS_COMPARE_CONSTANT (0.125 * 100.0)
+
+/* A connection that had no traffic for this many packet counter intervals in
+ * a row has settled: its congestion control has nothing left to measure and
+ * more intervals would not change its rates. It is then only looked at for its
+ * request packets and when traffic resumes.
+ */
+#define CRYPTO_IDLE_TICKS_DORMANT CONGESTION_LAST_SENT_ARRAY_SIZE
+
+/* Return true if the connection had no traffic since the last packet counter interval. */
+static bool crypto_connection_idle(const Crypto_Connection *conn, uint64_t temp_time)
+{
+    return conn->packet_counter == 0 && conn->packets_sent == 0 && conn->packets_resent == 0
+           && num_packets_array(&conn->send_array) == 0 && num_packets_array(&conn->recv_array) == 0
+           && conn->last_congestion_event + CONGESTION_EVENT_TIMEOUT < temp_time;
+}
+
+/* Refill the send budget of a dormant connection once, which is where the
+ * refills skipped while it was dormant would have kept it, instead of giving
+ * it a budget for the whole time it slept.
+ */
+static void catch_up_dormant_connection(Crypto_Connection *conn, uint64_t temp_time)
+{
+    const uint64_t refill_time = (uint64_t)((1000.0 / conn->packet_send_rate) + 0.5);
+    const uint64_t refill_time_requested = (uint64_t)((1000.0 / conn->packet_send_rate_requested) + 0.5);
+
+    if (conn->last_packets_left_set + refill_time < temp_time) {
+        conn->last_packets_left_set = temp_time - refill_time;
+    }
+
+    if (conn->last_packets_left_requested_set + refill_time_requested < temp_time) {
+        conn->last_packets_left_requested_set = temp_time - refill_time_requested;
+    }
+}
+
+/* Return true if the connection gave up on its handshake. */
+static bool crypto_connection_timed_out(const Crypto_Connection *conn)
+{
+    return (conn->status == CRYPTO_CONN_COOKIE_REQUESTING || conn->status == CRYPTO_CONN_HANDSHAKE_SENT
+            || conn->status == CRYPTO_CONN_NOT_CONFIRMED)
+           && conn->temp_packet_num_sent >= MAX_NUM_SENDPACKET_TRIES;
+}
 
-        if (handle_new_connection_handshake(c, source, packet, length, userdata) != 0) {
-            return 1;
-        }
+/* Send the peer a fresh resumption cookie if one is due.
+ *
+ * return the time at which the next one is due, 0 if the peer doesn't take
+ * them.
+ */
+static uint64_t send_resume_cookie(Net_Crypto *c, int crypt_connection_id, uint64_t temp_time)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
+    if (conn == nullptr || !(conn->peer_capabilities & CRYPTO_CAPABILITY_RESUME)) {
         return 0;
     }
 
-    if (handle_packet_connection(c, crypt_connection_id, packet, length, 1, userdata) != 0) {
-        return 1;
+    if (conn->resume_cookie_sent_time != 0 && conn->resume_cookie_sent_time + RESUME_COOKIE_INTERVAL > temp_time) {
+        return conn->resume_cookie_sent_time + RESUME_COOKIE_INTERVAL;
     }
 
-    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+    uint8_t packet[RESUME_COOKIE_PACKET_SIZE];
+    packet[0] = PACKET_ID_RESUME_COOKIE;
 
-    if (conn == nullptr) {
-        return -1;
+    if (create_resume_cookie(c, packet + 1, conn->public_key, conn->dht_public_key) != 0
+            || send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end,
+                                       packet, sizeof(packet)) != 0) {
+        return temp_time + CRYPTO_SEND_PACKET_INTERVAL;
     }
 
-    pthread_mutex_lock(&conn->mutex);
+    conn->resume_cookie_sent_time = temp_time;
+    return temp_time + RESUME_COOKIE_INTERVAL;
+}
 
-    if (net_family_is_ipv4(source.ip.family)) {
-        conn->direct_lastrecv_timev4 = mono_time_get(c->mono_time);
-    } else {
-        conn->direct_lastrecv_timev6 = mono_time_get(c->mono_time);
+/* Return the size path MTU discovery tries after pmtu, 0 if there is none. */
+static uint16_t next_pmtu_probe_size(uint16_t pmtu)
+{
+    for (uint32_t i = 0; i < sizeof(pmtu_probe_sizes) / sizeof(pmtu_probe_sizes[0]); ++i) {
+        if (pmtu_probe_sizes[i] > pmtu) {
+            return pmtu_probe_sizes[i];
+        }
     }
 
-    pthread_mutex_unlock(&conn->mutex);
     return 0;
 }
 
-/* The dT for the average packet receiving rate calculations.
-   Also used as the */
-#define PACKET_COUNTER_AVERAGE_INTERVAL 50
+static void set_pmtu(Crypto_Connection *conn, uint16_t pmtu)
+{
+    pthread_mutex_lock(&conn->mutex);
+    conn->pmtu = pmtu;
+    pthread_mutex_unlock(&conn->mutex);
+}
 
-/* Ratio of recv queue size / recv packet rate (in seconds) times
- * the number of ms between request packets to send at that ratio
+/* Probe the direct UDP path of the connection for a bigger path MTU, and
+ * probe the one in use again from time to time so packets of its size are no
+ * longer sent once the path stops carrying them.
+ *
+ * return the time at which path MTU discovery next has something to do, 0 if
+ * nothing.
  */
-#define REQUEST_PACKETS_COMPARE_CONSTANT (0.125 * 100.0)
+static uint64_t do_pmtu_discovery(Net_Crypto *c, int crypt_connection_id, uint64_t temp_time)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
-/* Timeout for increasing speed after congestion event (in ms). */
-#define CONGESTION_EVENT_TIMEOUT 1000
+    if (conn == nullptr) {
+        return 0;
+    }
 
-/* If the send queue is SEND_QUEUE_RATIO times larger than the
- * calculated link speed the packet send speed will be reduced
- * by a value depending on this number.
- */
-#define SEND_QUEUE_RATIO 2.0
+    bool direct_connected = 0;
+    crypto_connection_status(c, crypt_connection_id, &direct_connected, nullptr);
 
-static void send_crypto_packets(Net_Crypto *c)
-{
-    const uint64_t temp_time = current_time_monotonic(c->mono_time);
-    double total_send_rate = 0;
-    uint32_t peak_request_packet_interval = ~0;
+    pthread_mutex_lock(&conn->mutex);
+    const IP_Port ip_port = return_ip_port_connection(c, crypt_connection_id);
+    pthread_mutex_unlock(&conn->mutex);
 
-    for (uint32_t i = 0; i < c->crypto_connections_length; ++i) {
-        Crypto_Connection *conn = get_crypto_connection(c, i);
+    const uint32_t capabilities = CRYPTO_CAPABILITY_BATCH | CRYPTO_CAPABILITY_PMTU;
 
-        if (conn == nullptr) {
-            continue;
-        }
+    if ((conn->peer_capabilities & capabilities) != capabilities || !direct_connected
+            || (conn->pmtu != 0 && !ipport_equal(&ip_port, &conn->pmtu_ip_port))) {
+        set_pmtu(conn, 0);
+        conn->pmtu_probe_size = 0;
+        return 0;
+    }
 
-        if ((CRYPTO_SEND_PACKET_INTERVAL + conn->temp_packet_sent_time) < temp_time) {
-            send_temp_packet(c, i);
+    if (conn->pmtu_probe_size != 0) {
+        if (conn->pmtu_probe_time + PMTU_PROBE_TIMEOUT > temp_time) {
+            return conn->pmtu_probe_time + PMTU_PROBE_TIMEOUT;
         }
 
-        if ((conn->status == CRYPTO_CONN_NOT_CONFIRMED || conn->status == CRYPTO_CONN_ESTABLISHED)
-                && (CRYPTO_SEND_PACKET_INTERVAL + conn->last_request_packet_sent) < temp_time) {
-            if (send_request_packet(c, i) == 0) {
-                conn->last_request_packet_sent = temp_time;
+        if (conn->pmtu_probes_sent >= PMTU_MAX_PROBES) {
+            if (conn->pmtu_probe_size == conn->pmtu) {
+                /* The path changed, start over from MAX_CRYPTO_PACKET_SIZE. */
+                set_pmtu(conn, 0);
+                conn->pmtu_search_time = temp_time;
+            } else {
+                conn->pmtu_search_time = temp_time + PMTU_SEARCH_INTERVAL;
             }
+
+            conn->pmtu_probe_size = 0;
         }
+    }
 
-        if (conn->status == CRYPTO_CONN_ESTABLISHED) {
-            if (conn->packet_recv_rate > CRYPTO_PACKET_MIN_RATE) {
-                double request_packet_interval = (REQUEST_PACKETS_COMPARE_CONSTANT / ((num_packets_array(
-                                                      &conn->recv_array) + 1.0) / (conn->packet_recv_rate + 1.0)));
+    if (conn->pmtu_probe_size == 0) {
+        const uint16_t next_size = next_pmtu_probe_size(max_u16(conn->pmtu, MAX_CRYPTO_PACKET_SIZE));
 
-                double request_packet_interval2 = ((CRYPTO_PACKET_MIN_RATE / conn->packet_recv_rate) *
-                                                   (double)CRYPTO_SEND_PACKET_INTERVAL) + (double)PACKET_COUNTER_AVERAGE_INTERVAL;
+        if (next_size != 0 && conn->pmtu_search_time <= temp_time) {
+            conn->pmtu_probe_size = next_size;
+        } else if (conn->pmtu != 0 && conn->pmtu_confirm_time <= temp_time) {
+            conn->pmtu_probe_size = conn->pmtu;
+        } else if (next_size != 0 && conn->pmtu != 0) {
+            return min_u64(conn->pmtu_search_time, conn->pmtu_confirm_time);
+        } else if (next_size != 0) {
+            return conn->pmtu_search_time;
+        } else {
+            return conn->pmtu_confirm_time;
+        }
 
-                if (request_packet_interval2 < request_packet_interval) {
-                    request_packet_interval = request_packet_interval2;
-                }
+        conn->pmtu_probes_sent = 0;
+    }
 
-                if (request_packet_interval < PACKET_COUNTER_AVERAGE_INTERVAL) {
-                    request_packet_interval = PACKET_COUNTER_AVERAGE_INTERVAL;
-                }
+    ++conn->pmtu_probes_sent;
+    conn->pmtu_probe_time = temp_time;
+    send_pmtu_probe(c, crypt_connection_id, conn->pmtu_probe_size);
+    return temp_time + PMTU_PROBE_TIMEOUT;
+}
 
-                if (request_packet_interval > CRYPTO_SEND_PACKET_INTERVAL) {
-                    request_packet_interval = CRYPTO_SEND_PACKET_INTERVAL;
-                }
+/* Send what is due on the connection: its temp packet, request packets and
+ * requested packets, and update its congestion control.
+ *
+ * return the time at which the connection next has something to do.
+ */
+static uint64_t send_crypto_packets_connection(Net_Crypto *c, int i, uint64_t temp_time)
+{
+    Crypto_Connection *conn = &c->crypto_connections[i];
+    uint64_t next_run_time = temp_time + CRYPTO_SEND_PACKET_INTERVAL;
+
+    if ((CRYPTO_SEND_PACKET_INTERVAL + conn->temp_packet_sent_time) < temp_time) {
+        /* The peer didn't take our resumption cookie, ask it for a cookie. */
+        if (conn->resuming && conn->status == CRYPTO_CONN_HANDSHAKE_SENT && conn->temp_packet_num_sent > 0) {
+            conn->resuming = false;
+            new_cookie_request(c, i);
+        }
 
-                if (temp_time - conn->last_request_packet_sent > (uint64_t)request_packet_interval) {
-                    if (send_request_packet(c, i) == 0) {
-                        conn->last_request_packet_sent = temp_time;
-                    }
-                }
+        send_temp_packet(c, i);
+    }
 
-                if (request_packet_interval < peak_request_packet_interval) {
-                    peak_request_packet_interval = request_packet_interval;
-                }
-            }
+    if ((conn->status == CRYPTO_CONN_NOT_CONFIRMED || conn->status == CRYPTO_CONN_ESTABLISHED)
+            && (CRYPTO_SEND_PACKET_INTERVAL + conn->last_request_packet_sent) < temp_time) {
+        if (send_request_packet(c, i) == 0) {
+            conn->last_request_packet_sent = temp_time;
+        }
+    }
 
-            if ((PACKET_COUNTER_AVERAGE_INTERVAL + conn->packet_counter_set) < temp_time) {
-                const double dt = temp_time - conn->packet_counter_set;
+    if (conn->status == CRYPTO_CONN_ESTABLISHED) {
+        if (conn->idle_ticks >= CRYPTO_IDLE_TICKS_DORMANT) {
+            catch_up_dormant_connection(conn, temp_time);
+        }
 
-                conn->packet_recv_rate = (double)conn->packet_counter / (dt / 1000.0);
-                conn->packet_counter = 0;
-                conn->packet_counter_set = temp_time;
+        if (conn->packet_recv_rate > CRYPTO_PACKET_MIN_RATE) {
+            double request_packet_interval = (REQUEST_PACKETS_COMPARE_CONSTANT / ((num_packets_array(
+                                                  &conn->recv_array) + 1.0) / (conn->packet_recv_rate + 1.0)));
 
-                uint32_t packets_sent = conn->packets_sent;
-                conn->packets_sent = 0;
+            double request_packet_interval2 = ((CRYPTO_PACKET_MIN_RATE / conn->packet_recv_rate) *
+                                               (double)CRYPTO_SEND_PACKET_INTERVAL) + (double)PACKET_COUNTER_AVERAGE_INTERVAL;
 
-                uint32_t packets_resent = conn->packets_resent;
-                conn->packets_resent = 0;
+            if (request_packet_interval2 < request_packet_interval) {
+                request_packet_interval = request_packet_interval2;
+            }
 
-                /* conjestion control
-                    calculate a new value of conn->packet_send_rate based on some data
-                 */
+            if (request_packet_interval < PACKET_COUNTER_AVERAGE_INTERVAL) {
+                request_packet_interval = PACKET_COUNTER_AVERAGE_INTERVAL;
+            }
 
-                unsigned int pos = conn->last_sendqueue_counter % CONGESTION_QUEUE_ARRAY_SIZE;
-                conn->last_sendqueue_size[pos] = num_packets_array(&conn->send_array);
+            if (request_packet_interval > CRYPTO_SEND_PACKET_INTERVAL) {
+                request_packet_interval = CRYPTO_SEND_PACKET_INTERVAL;
+            }
 
-                long signed int sum = 0;
-                sum = (long signed int)conn->last_sendqueue_size[pos] -
-                      (long signed int)conn->last_sendqueue_size[(pos + 1) % CONGESTION_QUEUE_ARRAY_SIZE];
+            if (temp_time - conn->last_request_packet_sent > (uint64_t)request_packet_interval) {
+                if (send_request_packet(c, i) == 0) {
+                    conn->last_request_packet_sent = temp_time;
+                }
+            }
 
-                unsigned int n_p_pos = conn->last_sendqueue_counter % CONGESTION_LAST_SENT_ARRAY_SIZE;
-                conn->last_num_packets_sent[n_p_pos] = packets_sent;
-                conn->last_num_packets_resent[n_p_pos] = packets_resent;
+            next_run_time = min_u64(next_run_time, conn->last_request_packet_sent + (uint64_t)request_packet_interval + 1);
+        }
 
-                conn->last_sendqueue_counter = (conn->last_sendqueue_counter + 1) %
-                                               (CONGESTION_QUEUE_ARRAY_SIZE * CONGESTION_LAST_SENT_ARRAY_SIZE);
+        if ((PACKET_COUNTER_AVERAGE_INTERVAL + conn->packet_counter_set) < temp_time) {
+            if (crypto_connection_idle(conn, temp_time)) {
+                conn->idle_ticks = min_u32(conn->idle_ticks + 1, CRYPTO_IDLE_TICKS_DORMANT);
+            } else {
+                conn->idle_ticks = 0;
+            }
 
-                bool direct_connected = 0;
-                crypto_connection_status(c, i, &direct_connected, nullptr);
+            const double dt = temp_time - conn->packet_counter_set;
 
-                /* When switching from TCP to UDP, don't change the packet send rate for CONGESTION_EVENT_TIMEOUT ms. */
-                if (!(direct_connected && conn->last_tcp_sent + CONGESTION_EVENT_TIMEOUT > temp_time)) {
-                    long signed int total_sent = 0, total_resent = 0;
+            conn->packet_recv_rate = (double)conn->packet_counter / (dt / 1000.0);
+            conn->packet_counter = 0;
+            conn->packet_counter_set = temp_time;
 
-                    // TODO(irungentoo): use real delay
-                    unsigned int delay = (unsigned int)((conn->rtt_time / PACKET_COUNTER_AVERAGE_INTERVAL) + 0.5);
-                    unsigned int packets_set_rem_array = (CONGESTION_LAST_SENT_ARRAY_SIZE - CONGESTION_QUEUE_ARRAY_SIZE);
+            uint32_t packets_sent = conn->packets_sent;
+            conn->packets_sent = 0;
 
-                    if (delay > packets_set_rem_array) {
-                        delay = packets_set_rem_array;
-                    }
+            uint32_t packets_resent = conn->packets_resent;
+            conn->packets_resent = 0;
 
-                    for (unsigned j = 0; j < CONGESTION_QUEUE_ARRAY_SIZE; ++j) {
-                        unsigned int ind = (j + (packets_set_rem_array  - delay) + n_p_pos) % CONGESTION_LAST_SENT_ARRAY_SIZE;
-                        total_sent += conn->last_num_packets_sent[ind];
-                        total_resent += conn->last_num_packets_resent[ind];
-                    }
+            bool direct_connected = 0;
+            crypto_connection_status(c, i, &direct_connected, nullptr);
 
-                    if (sum > 0) {
-                        total_sent -= sum;
-                    } else {
-                        if (total_resent > -sum) {
-                            total_resent = -sum;
-                        }
-                    }
+            Congestion_Interval interval;
+            interval.time = temp_time;
+            interval.packets_sent = packets_sent;
+            interval.packets_resent = packets_resent;
+            interval.send_queue_size = num_packets_array(&conn->send_array);
+            interval.rtt = conn->rtt_time;
+            interval.last_congestion_event = conn->last_congestion_event;
+            /* When switching from TCP to UDP, don't change the packet send rate for CONGESTION_EVENT_TIMEOUT ms. */
+            interval.hold_rate = direct_connected && conn->last_tcp_sent + CONGESTION_EVENT_TIMEOUT > temp_time;
+
+            congestion_control_update(&conn->congestion, &interval, &conn->packet_send_rate,
+                                      &conn->packet_send_rate_requested);
+        }
 
-                    /* if queue is too big only allow resending packets. */
-                    uint32_t npackets = num_packets_array(&conn->send_array);
-                    double min_speed = 1000.0 * (((double)(total_sent)) / ((double)(CONGESTION_QUEUE_ARRAY_SIZE) *
-                                                 PACKET_COUNTER_AVERAGE_INTERVAL));
+        if (conn->last_packets_left_set == 0 || conn->last_packets_left_requested_set == 0) {
+            conn->last_packets_left_requested_set = temp_time;
+            conn->last_packets_left_set = temp_time;
+            conn->packets_left_requested = CRYPTO_MIN_QUEUE_LENGTH;
+            conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
+        } else {
+            if (((uint64_t)((1000.0 / conn->packet_send_rate) + 0.5) + conn->last_packets_left_set) <= temp_time) {
+                double n_packets = conn->packet_send_rate * (((double)(temp_time - conn->last_packets_left_set)) / 1000.0);
+                n_packets += conn->last_packets_left_rem;
 
-                    double min_speed_request = 1000.0 * (((double)(total_sent + total_resent)) / ((double)(
-                            CONGESTION_QUEUE_ARRAY_SIZE) * PACKET_COUNTER_AVERAGE_INTERVAL));
+                uint32_t num_packets = n_packets;
+                double rem = n_packets - (double)num_packets;
 
-                    if (min_speed < CRYPTO_PACKET_MIN_RATE) {
-                        min_speed = CRYPTO_PACKET_MIN_RATE;
-                    }
+                if (conn->packets_left > num_packets * 4 + CRYPTO_MIN_QUEUE_LENGTH) {
+                    conn->packets_left = num_packets * 4 + CRYPTO_MIN_QUEUE_LENGTH;
+                } else {
+                    conn->packets_left += num_packets;
+                }
 
-                    double send_array_ratio = (((double)npackets) / min_speed);
+                conn->last_packets_left_set = temp_time;
+                conn->last_packets_left_rem = rem;
+            }
 
-                    // TODO(irungentoo): Improve formula?
-                    if (send_array_ratio > SEND_QUEUE_RATIO && CRYPTO_MIN_QUEUE_LENGTH < npackets) {
-                        conn->packet_send_rate = min_speed * (1.0 / (send_array_ratio / SEND_QUEUE_RATIO));
-                    } else if (conn->last_congestion_event + CONGESTION_EVENT_TIMEOUT < temp_time) {
-                        conn->packet_send_rate = min_speed * 1.2;
-                    } else {
-                        conn->packet_send_rate = min_speed * 0.9;
-                    }
+            if (((uint64_t)((1000.0 / conn->packet_send_rate_requested) + 0.5) + conn->last_packets_left_requested_set) <=
+                    temp_time) {
+                double n_packets = conn->packet_send_rate_requested * (((double)(temp_time - conn->last_packets_left_requested_set)) /
+                                   1000.0);
+                n_packets += conn->last_packets_left_requested_rem;
 
-                    conn->packet_send_rate_requested = min_speed_request * 1.2;
+                uint32_t num_packets = n_packets;
+                double rem = n_packets - (double)num_packets;
+                conn->packets_left_requested = num_packets;
 
-                    if (conn->packet_send_rate < CRYPTO_PACKET_MIN_RATE) {
-                        conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
-                    }
+                conn->last_packets_left_requested_set = temp_time;
+                conn->last_packets_left_requested_rem = rem;
+            }
 
-                    if (conn->packet_send_rate_requested < conn->packet_send_rate) {
-                        conn->packet_send_rate_requested = conn->packet_send_rate;
-                    }
-                }
+            if (conn->packets_left > conn->packets_left_requested) {
+                conn->packets_left_requested = conn->packets_left;
             }
+        }
 
-            if (conn->last_packets_left_set == 0 || conn->last_packets_left_requested_set == 0) {
-                conn->last_packets_left_requested_set = temp_time;
-                conn->last_packets_left_set = temp_time;
-                conn->packets_left_requested = CRYPTO_MIN_QUEUE_LENGTH;
-                conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
-            } else {
-                if (((uint64_t)((1000.0 / conn->packet_send_rate) + 0.5) + conn->last_packets_left_set) <= temp_time) {
-                    double n_packets = conn->packet_send_rate * (((double)(temp_time - conn->last_packets_left_set)) / 1000.0);
-                    n_packets += conn->last_packets_left_rem;
+        if (conn->packets_left > 0) {
+            conn->sendqueue_rate_limited = false;
+        }
 
-                    uint32_t num_packets = n_packets;
-                    double rem = n_packets - (double)num_packets;
+        const uint64_t pmtu_time = do_pmtu_discovery(c, i, temp_time);
 
-                    if (conn->packets_left > num_packets * 4 + CRYPTO_MIN_QUEUE_LENGTH) {
-                        conn->packets_left = num_packets * 4 + CRYPTO_MIN_QUEUE_LENGTH;
-                    } else {
-                        conn->packets_left += num_packets;
-                    }
+        if (pmtu_time != 0) {
+            next_run_time = min_u64(next_run_time, pmtu_time);
+        }
 
-                    conn->last_packets_left_set = temp_time;
-                    conn->last_packets_left_rem = rem;
-                }
+        const uint64_t resume_time = send_resume_cookie(c, i, temp_time);
 
-                if (((uint64_t)((1000.0 / conn->packet_send_rate_requested) + 0.5) + conn->last_packets_left_requested_set) <=
-                        temp_time) {
-                    double n_packets = conn->packet_send_rate_requested * (((double)(temp_time - conn->last_packets_left_requested_set)) /
-                                       1000.0);
-                    n_packets += conn->last_packets_left_requested_rem;
+        if (resume_time != 0) {
+            next_run_time = min_u64(next_run_time, resume_time);
+        }
 
-                    uint32_t num_packets = n_packets;
-                    double rem = n_packets - (double)num_packets;
-                    conn->packets_left_requested = num_packets;
+        if (conn->coalesce_deadline != 0 && conn->coalesce_deadline <= temp_time) {
+            send_coalesced_packets(c, i);
+        }
 
-                    conn->last_packets_left_requested_set = temp_time;
-                    conn->last_packets_left_requested_rem = rem;
-                }
+        int ret = send_requested_packets(c, i, conn->packets_left_requested);
 
-                if (conn->packets_left > conn->packets_left_requested) {
-                    conn->packets_left_requested = conn->packets_left;
-                }
-            }
+        if (ret != -1) {
+            conn->packets_left_requested -= ret;
+            conn->packets_resent += ret;
+            conn->total_packets_resent += ret;
 
-            int ret = send_requested_packets(c, i, conn->packets_left_requested);
+            if ((unsigned int)ret < conn->packets_left) {
+                conn->packets_left -= ret;
+            } else {
+                conn->last_congestion_event = temp_time;
+                conn->packets_left = 0;
+            }
+        }
+    }
 
-            if (ret != -1) {
-                conn->packets_left_requested -= ret;
-                conn->packets_resent += ret;
+    if (crypto_connection_timed_out(conn)) {
+        return temp_time + 1;
+    }
 
-                if ((unsigned int)ret < conn->packets_left) {
-                    conn->packets_left -= ret;
-                } else {
-                    conn->last_congestion_event = temp_time;
-                    conn->packets_left = 0;
-                }
-            }
+    if (conn->temp_packet != nullptr) {
+        next_run_time = min_u64(next_run_time, conn->temp_packet_sent_time + CRYPTO_SEND_PACKET_INTERVAL + 1);
+    }
 
-            if (conn->packet_send_rate > CRYPTO_PACKET_MIN_RATE * 1.5) {
-                total_send_rate += conn->packet_send_rate;
-            }
-        }
+    if (conn->status == CRYPTO_CONN_NOT_CONFIRMED || conn->status == CRYPTO_CONN_ESTABLISHED) {
+        next_run_time = min_u64(next_run_time, conn->last_request_packet_sent + CRYPTO_SEND_PACKET_INTERVAL + 1);
     }
 
-    c->current_sleep_time = ~0;
-    uint32_t sleep_time = peak_request_packet_interval;
+    if (conn->coalesce_deadline != 0) {
+        next_run_time = min_u64(next_run_time, conn->coalesce_deadline);
+    }
 
-    if (c->current_sleep_time > sleep_time) {
-        c->current_sleep_time = sleep_time;
+    if (conn->status == CRYPTO_CONN_ESTABLISHED && conn->idle_ticks < CRYPTO_IDLE_TICKS_DORMANT) {
+        next_run_time = min_u64(next_run_time, conn->packet_counter_set + PACKET_COUNTER_AVERAGE_INTERVAL + 1);
+        next_run_time = min_u64(next_run_time, conn->last_packets_left_set
+                                + (uint64_t)((1000.0 / conn->packet_send_rate) + 0.5));
+        next_run_time = min_u64(next_run_time, conn->last_packets_left_requested_set
+                                + (uint64_t)((1000.0 / conn->packet_send_rate_requested) + 0.5));
     }
 
-    if (total_send_rate > CRYPTO_PACKET_MIN_RATE) {
-        sleep_time = (1000.0 / total_send_rate);
+    return max_u64(next_run_time, temp_time + 1);
+}
+
+/* Visit the connections that have something to do, in the order it is due,
+ * and kill the ones whose handshake timed out.
+ */
+static void send_crypto_packets(Net_Crypto *c, void *userdata)
+{
+    const uint64_t temp_time = current_time_monotonic(c->mono_time);
+    int crypt_connection_id;
+
+    while ((crypt_connection_id = schedule_pop_due(c, temp_time)) != -1) {
+        const Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+        if (conn == nullptr) {
+            continue;
+        }
 
-        if (c->current_sleep_time > sleep_time) {
-            c->current_sleep_time = sleep_time + 1;
+        if (crypto_connection_timed_out(conn)) {
+            connection_kill(c, crypt_connection_id, userdata);
+            continue;
         }
+
+        schedule_connection(c, crypt_connection_id, send_crypto_packets_connection(c, crypt_connection_id, temp_time));
     }
 
-    sleep_time = CRYPTO_SEND_PACKET_INTERVAL;
+    pthread_mutex_lock(&c->schedule.mutex);
+    c->current_sleep_time = CRYPTO_SEND_PACKET_INTERVAL;
 
-    if (c->current_sleep_time > sleep_time) {
-        c->current_sleep_time = sleep_time;
+    if (c->schedule.size > 0 && c->schedule.heap[0].run_time < temp_time + CRYPTO_SEND_PACKET_INTERVAL) {
+        c->current_sleep_time = c->schedule.heap[0].run_time > temp_time ? c->schedule.heap[0].run_time - temp_time : 0;
     }
+
+    pthread_mutex_unlock(&c->schedule.mutex);
 }
 
 /* Return 1 if max speed was reached for this connection (no more data can be physically through the pipe).
@@ -2697,6 +4716,28 @@ bool max_speed_reached(Net_Crypto *c, int crypt_connection_id)
     return reset_max_speed_reached(c, crypt_connection_id) != 0;
 }
 
+bool crypto_sendqueue_unblocked(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr || !conn->sendqueue_blocked) {
+        return false;
+    }
+
+    if (conn->sendqueue_rate_limited || conn->packets_left == 0) {
+        return false;
+    }
+
+    /* Only looks at the queue: max_speed_reached() would resend the last
+     * packet as a side effect. A write retries that packet anyway. */
+    if (crypto_num_free_sendqueue_slots(c, crypt_connection_id) == 0) {
+        return false;
+    }
+
+    conn->sendqueue_blocked = false;
+    return true;
+}
+
 /* returns the number of packet slots left in the sendbuffer.
  * return 0 if failure.
  */
@@ -2717,19 +4758,13 @@ uint32_t crypto_num_free_sendqueue_slots(const Net_Crypto *c, int crypt_connecti
     return max_packets;
 }
 
-/* Sends a lossless cryptopacket.
- *
- * return -1 if data could not be put in packet queue.
- * return positive packet number if data was put into the queue.
- *
- * The first byte of data must in the PACKET_ID_RANGE_LOSSLESS.
- *
- * congestion_control: should congestion control apply to this packet?
+/* Put a lossless packet in the send queue, with an unordered header if
+ * unordered is true and a stream header if the packet belongs to a stream.
  */
-int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
-                          uint8_t congestion_control)
+static int64_t write_lossless_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
+                                     uint8_t congestion_control, bool unordered)
 {
-    if (length == 0) {
+    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
         return -1;
     }
 
@@ -2748,24 +4783,66 @@ int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
     }
 
     if (congestion_control && conn->packets_left == 0) {
+        conn->sendqueue_blocked = true;
+        conn->sendqueue_rate_limited = true;
         return -1;
     }
 
-    int64_t ret = send_lossless_packet(c, crypt_connection_id, data, length, congestion_control);
+    uint8_t packet[MAX_CRYPTO_DATA_SIZE];
+    const uint16_t packet_length = unordered
+                                   ? add_unordered_header(conn, data, length, packet)
+                                   : add_stream_header(conn, data, length, packet);
+    int64_t ret;
+
+    if (packet_length != 0) {
+        ret = send_lossless_packet(c, crypt_connection_id, packet, packet_length, congestion_control);
+    } else {
+        ret = send_lossless_packet(c, crypt_connection_id, data, length, congestion_control);
+    }
 
     if (ret == -1) {
+        conn->sendqueue_blocked = true;
         return -1;
     }
 
+    stream_packet_sent(conn, data, packet_length != 0 && packet[0] == PACKET_ID_STREAM);
+
     if (congestion_control) {
         --conn->packets_left;
         --conn->packets_left_requested;
         ++conn->packets_sent;
     }
 
+    ++conn->total_packets_sent;
+
     return ret;
 }
 
+/* Sends a lossless cryptopacket.
+ *
+ * return -1 if data could not be put in packet queue.
+ * return positive packet number if data was put into the queue.
+ *
+ * The first byte of data must in the PACKET_ID_RANGE_LOSSLESS.
+ *
+ * congestion_control: should congestion control apply to this packet?
+ */
+int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
+                          uint8_t congestion_control)
+{
+    return write_lossless_packet(c, crypt_connection_id, data, length, congestion_control, false);
+}
+
+int64_t write_cryptpacket_unordered(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
+                                    uint8_t congestion_control)
+{
+    if (length == 0 || data[0] < PACKET_ID_RANGE_LOSSLESS_CUSTOM_START || data[0] > PACKET_ID_RANGE_LOSSLESS_CUSTOM_END) {
+        return -1;
+    }
+
+    return write_lossless_packet(c, crypt_connection_id, data, length, congestion_control, true);
+}
+
 /* Check if packet_number was received by the other side.
  *
  * packet_number must be a valid packet number of a packet sent on this connection.
@@ -2828,7 +4905,12 @@ int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
         uint32_t buffer_start = conn->recv_array.buffer_start;
         uint32_t buffer_end = conn->send_array.buffer_end;
         pthread_mutex_unlock(&conn->mutex);
-        ret = send_data_packet_helper(c, crypt_connection_id, buffer_start, buffer_end, data, length);
+
+        if (coalesce_data_packet(c, crypt_connection_id, buffer_end, data, length) == 0) {
+            ret = 0;
+        } else {
+            ret = send_data_packet_helper(c, crypt_connection_id, buffer_start, buffer_end, data, length);
+        }
     }
 
     pthread_mutex_lock(&c->connections_mutex);
@@ -2871,8 +4953,8 @@ int crypto_kill(Net_Crypto *c, int crypt_connection_id)
         bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv4, crypt_connection_id);
         bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv6, crypt_connection_id);
         clear_temp_packet(c, crypt_connection_id);
-        clear_buffer(&conn->send_array);
-        clear_buffer(&conn->recv_array);
+        clear_buffer(&c->packet_pool, &conn->send_array);
+        clear_buffer(&c->packet_pool, &conn->recv_array);
         ret = wipe_crypto_connection(c, crypt_connection_id);
     }
 
@@ -2916,6 +4998,45 @@ Crypto_Conn_State crypto_connection_status(const Net_Crypto *c, int crypt_connec
     return conn->status;
 }
 
+uint32_t crypto_capabilities(const Net_Crypto *c)
+{
+    return c->capabilities;
+}
+
+int crypto_set_peer_capabilities(Net_Crypto *c, int crypt_connection_id, uint32_t capabilities)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return -1;
+    }
+
+    conn->peer_capabilities = capabilities & c->capabilities;
+    return 0;
+}
+
+int crypto_connection_stats(const Net_Crypto *c, int crypt_connection_id, Crypto_Connection_Stats *stats)
+{
+    const Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return -1;
+    }
+
+    stats->status = crypto_connection_status(c, crypt_connection_id, &stats->direct_connected, &stats->online_tcp_relays);
+    stats->rtt = conn->rtt_time;
+    stats->send_rate = conn->packet_send_rate;
+    stats->recv_rate = conn->packet_recv_rate;
+    stats->send_queue_size = num_packets_array(&conn->send_array);
+    stats->recv_queue_size = num_packets_array(&conn->recv_array);
+    stats->packets_sent = conn->total_packets_sent;
+    stats->packets_resent = conn->total_packets_resent;
+    stats->bytes_sent = conn->bytes_sent;
+    stats->bytes_received = conn->bytes_received;
+    stats->path_mtu = conn->pmtu != 0 ? conn->pmtu : MAX_CRYPTO_PACKET_SIZE;
+    return 0;
+}
+
 void new_keys(Net_Crypto *c)
 {
     crypto_new_keypair(c->self_public_key, c->self_secret_key);
@@ -2976,10 +5097,41 @@ Net_Crypto *new_net_crypto(const Logger *log, Mono_Time *mono_time, DHT *dht, TC
         return nullptr;
     }
 
+    temp->packet_pool.slab = slab_new(sizeof(Packet_Data), CRYPTO_PACKET_SLAB_SIZE);
+
+    if (temp->packet_pool.slab == nullptr || pthread_mutex_init(&temp->packet_pool.mutex, nullptr) != 0) {
+        slab_kill(temp->packet_pool.slab);
+        pthread_mutex_destroy(&temp->tcp_mutex);
+        pthread_mutex_destroy(&temp->connections_mutex);
+        kill_tcp_connections(temp->tcp_c);
+        free(temp);
+        return nullptr;
+    }
+
+    temp->real_pk_map = pk_map_new();
+
+    if (temp->real_pk_map == nullptr || pthread_mutex_init(&temp->schedule.mutex, nullptr) != 0) {
+        pk_map_kill(temp->real_pk_map);
+        pthread_mutex_destroy(&temp->packet_pool.mutex);
+        slab_kill(temp->packet_pool.slab);
+        pthread_mutex_destroy(&temp->tcp_mutex);
+        pthread_mutex_destroy(&temp->connections_mutex);
+        kill_tcp_connections(temp->tcp_c);
+        free(temp);
+        return nullptr;
+    }
+
     temp->dht = dht;
 
     new_keys(temp);
     new_symmetric_key(temp->secret_symmetric_key);
+    new_symmetric_key(temp->resume_symmetric_key);
+
+    temp->capabilities = CRYPTO_CAPABILITIES;
+
+    if (crypto_aesgcm_available()) {
+        temp->capabilities |= CRYPTO_CAPABILITY_AESGCM;
+    }
 
     temp->current_sleep_time = CRYPTO_SEND_PACKET_INTERVAL;
 
@@ -2987,45 +5139,13 @@ Net_Crypto *new_net_crypto(const Logger *log, Mono_Time *mono_time, DHT *dht, TC
     networking_registerhandler(dht_get_net(dht), NET_PACKET_COOKIE_RESPONSE, &udp_handle_packet, temp);
     networking_registerhandler(dht_get_net(dht), NET_PACKET_CRYPTO_HS, &udp_handle_packet, temp);
     networking_registerhandler(dht_get_net(dht), NET_PACKET_CRYPTO_DATA, &udp_handle_packet, temp);
+    networking_registerhandler(dht_get_net(dht), NET_PACKET_CRYPTO_DATA_AESGCM, &udp_handle_packet, temp);
 
     bs_list_init(&temp->ip_port_list, sizeof(IP_Port), 8);
 
     return temp;
 }
 
-static void kill_timedout(Net_Crypto *c, void *userdata)
-{
-    for (uint32_t i = 0; i < c->crypto_connections_length; ++i) {
-        Crypto_Connection *conn = get_crypto_connection(c, i);
-
-        if (conn == nullptr) {
-            continue;
-        }
-
-        if (conn->status == CRYPTO_CONN_NO_CONNECTION) {
-            continue;
-        }
-
-        if (conn->status == CRYPTO_CONN_COOKIE_REQUESTING || conn->status == CRYPTO_CONN_HANDSHAKE_SENT
-                || conn->status == CRYPTO_CONN_NOT_CONFIRMED) {
-            if (conn->temp_packet_num_sent < MAX_NUM_SENDPACKET_TRIES) {
-                continue;
-            }
-
-            connection_kill(c, i, userdata);
-        }
-
-#if 0
-
-        if (conn->status == CRYPTO_CONN_ESTABLISHED) {
-            // TODO(irungentoo): add a timeout here?
-            do_timeout_here();
-        }
-
-#endif
-    }
-}
-
 /* return the optimal interval in ms for running do_net_crypto.
  */
 uint32_t crypto_run_interval(const Net_Crypto *c)
@@ -3036,9 +5156,9 @@ uint32_t crypto_run_interval(const Net_Crypto *c)
 /* Main loop. */
 void do_net_crypto(Net_Crypto *c, void *userdata)
 {
-    kill_timedout(c, userdata);
+    handle_received_packets(c, userdata);
     do_tcp(c, userdata);
-    send_crypto_packets(c);
+    send_crypto_packets(c, userdata);
 }
 
 void kill_net_crypto(Net_Crypto *c)
@@ -3051,13 +5171,19 @@ void kill_net_crypto(Net_Crypto *c)
 
     pthread_mutex_destroy(&c->tcp_mutex);
     pthread_mutex_destroy(&c->connections_mutex);
+    pthread_mutex_destroy(&c->packet_pool.mutex);
+    slab_kill(c->packet_pool.slab);
+    pthread_mutex_destroy(&c->schedule.mutex);
+    free(c->schedule.heap);
 
     kill_tcp_connections(c->tcp_c);
     bs_list_free(&c->ip_port_list);
+    pk_map_kill(c->real_pk_map);
     networking_registerhandler(dht_get_net(c->dht), NET_PACKET_COOKIE_REQUEST, nullptr, nullptr);
     networking_registerhandler(dht_get_net(c->dht), NET_PACKET_COOKIE_RESPONSE, nullptr, nullptr);
     networking_registerhandler(dht_get_net(c->dht), NET_PACKET_CRYPTO_HS, nullptr, nullptr);
     networking_registerhandler(dht_get_net(c->dht), NET_PACKET_CRYPTO_DATA, nullptr, nullptr);
+    networking_registerhandler(dht_get_net(c->dht), NET_PACKET_CRYPTO_DATA_AESGCM, nullptr, nullptr);
     crypto_memzero(c, sizeof(Net_Crypto));
     free(c);
 }
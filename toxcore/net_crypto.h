@@ -27,10 +27,16 @@
 #include "DHT.h"
 #include "LAN_discovery.h"
 #include "TCP_connection.h"
+#include "congestion_control.h"
 #include "logger.h"
+#include "slab.h"
 
 #include <pthread.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*** Crypto payloads. ***/
 
 /** Ranges. **/
@@ -61,6 +67,12 @@
 #define PACKET_ID_PADDING 0 // Denotes padding
 #define PACKET_ID_REQUEST 1 // Used to request unreceived packets
 #define PACKET_ID_KILL    2 // Used to kill connection
+#define PACKET_ID_STREAM  3 // Lossless packet with a stream sequence number
+#define PACKET_ID_UNORDERED 4 // Lossless packet that may be passed on out of order
+#define PACKET_ID_BATCH   5 // Several small packets sent together
+#define PACKET_ID_PMTU_PROBE 6 // Padded to the size of the path MTU probe
+#define PACKET_ID_PMTU_ACK 7 // Confirms a path MTU probe arrived
+#define PACKET_ID_RESUME_COOKIE 8 // Cookie for resuming the session later
 
 #define PACKET_ID_ONLINE 24
 #define PACKET_ID_OFFLINE 25
@@ -95,10 +107,10 @@ typedef enum Crypto_Conn_State {
 #define CRYPTO_PACKET_BUFFER_SIZE 32768 // Must be a power of 2
 
 /* Minimum packet rate per second. */
-#define CRYPTO_PACKET_MIN_RATE 4.0
+#define CRYPTO_PACKET_MIN_RATE CONGESTION_MIN_RATE
 
 /* Minimum packet queue max length. */
-#define CRYPTO_MIN_QUEUE_LENGTH 64
+#define CRYPTO_MIN_QUEUE_LENGTH CONGESTION_MIN_QUEUE_LENGTH
 
 /* Maximum total size of packets that net_crypto sends. */
 #define MAX_CRYPTO_PACKET_SIZE (uint16_t)1400
@@ -108,6 +120,15 @@ typedef enum Crypto_Conn_State {
 /* Max size of data in packets */
 #define MAX_CRYPTO_DATA_SIZE (uint16_t)(MAX_CRYPTO_PACKET_SIZE - CRYPTO_DATA_PACKET_MIN_SIZE)
 
+/* Maximum total size of packets sent over a direct UDP path once path MTU
+ * discovery has found that the path carries them. Fits a 9000 byte frame
+ * with IPv6 and UDP headers. */
+#define MAX_CRYPTO_PMTU_PACKET_SIZE (uint16_t)8952
+
+/* Max size of data in those packets. They only ever carry PACKET_ID_BATCH
+ * packets, each packet in the batch is at most MAX_CRYPTO_DATA_SIZE. */
+#define MAX_CRYPTO_PMTU_DATA_SIZE (uint16_t)(MAX_CRYPTO_PMTU_PACKET_SIZE - CRYPTO_DATA_PACKET_MIN_SIZE)
+
 /* Interval in ms between sending cookie request/handshake packets. */
 #define CRYPTO_SEND_PACKET_INTERVAL 1000
 
@@ -124,11 +145,6 @@ typedef enum Crypto_Conn_State {
 /* All packets will be padded a number of bytes based on this number. */
 #define CRYPTO_MAX_PADDING 8
 
-/* Base current transfer speed on last CONGESTION_QUEUE_ARRAY_SIZE number of points taken
-   at the dT defined in net_crypto.c */
-#define CONGESTION_QUEUE_ARRAY_SIZE 12
-#define CONGESTION_LAST_SENT_ARRAY_SIZE (CONGESTION_QUEUE_ARRAY_SIZE * 2)
-
 /* Default connection ping in ms. */
 #define DEFAULT_PING_CONNECTION 1000
 #define DEFAULT_TCP_PING_CONNECTION 500
@@ -140,6 +156,26 @@ const uint8_t *nc_get_self_secret_key(const Net_Crypto *c);
 TCP_Connections *nc_get_tcp_c(const Net_Crypto *c);
 DHT *nc_get_dht(const Net_Crypto *c);
 
+/* Copy the statistics of the allocator used for packets in the send and
+ * receive buffers of all connections into stats.
+ */
+void nc_get_packet_pool_stats(Net_Crypto *c, Slab_Stats *stats);
+
+/* Set the congestion control algorithm used by connections created from now
+ * on. The default is CONGESTION_ALGORITHM_QUEUE.
+ */
+void nc_set_congestion_algorithm(Net_Crypto *c, Congestion_Algorithm algorithm);
+
+/* Maximum time in ms small packets wait to be sent together. */
+#define CRYPTO_MAX_COALESCING_DELAY 100
+
+/* Let small lossless and lossy packets wait up to delay ms, so that several of
+ * them are sent in one data packet to peers that support it. Larger values
+ * are capped to CRYPTO_MAX_COALESCING_DELAY. The default is 0, which sends
+ * every packet right away.
+ */
+void nc_set_coalescing_delay(Net_Crypto *c, uint16_t delay);
+
 typedef struct New_Connection {
     IP_Port source;
     uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE]; /* The real public key of the peer. */
@@ -246,18 +282,41 @@ uint32_t crypto_num_free_sendqueue_slots(const Net_Crypto *c, int crypt_connecti
  */
 bool max_speed_reached(Net_Crypto *c, int crypt_connection_id);
 
+/* Return true once after write_cryptpacket() failed because the send queue
+ * was full, as soon as the queue has free slots again. If the write failed
+ * because the send rate budget ran out, also waits for the budget to refill.
+ * Return false otherwise. Sends nothing.
+ */
+bool crypto_sendqueue_unblocked(Net_Crypto *c, int crypt_connection_id);
+
 /* Sends a lossless cryptopacket.
  *
  * return -1 if data could not be put in packet queue.
  * return positive packet number if data was put into the queue.
  *
- * The first byte of data must be in the PACKET_ID_RANGE_LOSSLESS.
+ * The first byte of data must be in the PACKET_ID_RANGE_LOSSLESS, and length
+ * at most MAX_CRYPTO_DATA_SIZE. Packets that are too long fail without
+ * marking the send queue as blocked.
  *
  * congestion_control: should congestion control apply to this packet?
  */
 int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
                           uint8_t congestion_control);
 
+/* Sends a lossless cryptopacket that the other side passes on as soon as it
+ * arrives, without waiting for the packets sent before it. It is still resent
+ * until it is received.
+ *
+ * Only packets in PACKET_ID_RANGE_LOSSLESS_CUSTOM can be sent this way. If the
+ * peer doesn't support CRYPTO_CAPABILITY_UNORDERED or the packet is too big
+ * for the extra header, it is sent like with write_cryptpacket().
+ *
+ * return -1 if data could not be put in packet queue.
+ * return positive packet number if data was put into the queue.
+ */
+int64_t write_cryptpacket_unordered(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
+                                    uint8_t congestion_control);
+
 /* Check if packet_number was received by the other side.
  *
  * packet_number must be a valid packet number of a packet sent on this connection.
@@ -327,6 +386,127 @@ int crypto_kill(Net_Crypto *c, int crypt_connection_id);
 Crypto_Conn_State crypto_connection_status(const Net_Crypto *c, int crypt_connection_id, bool *direct_connected,
         unsigned int *online_tcp_relays);
 
+typedef struct Crypto_Connection_Stats {
+    Crypto_Conn_State status;
+    bool direct_connected;
+    unsigned int online_tcp_relays;
+
+    /* Lowest round trip time seen in ms, DEFAULT_PING_CONNECTION until
+     * measured. */
+    uint64_t rtt;
+    /* Rate in packets per second at which new lossless packets may be sent. */
+    double send_rate;
+    /* Rate in packets per second at which packets were received recently. */
+    double recv_rate;
+    /* Lossless packets sent but not acknowledged yet. */
+    uint32_t send_queue_size;
+    /* Lossless packets received out of order, waiting for missing ones. */
+    uint32_t recv_queue_size;
+
+    /* Totals since the connection was created. */
+    uint64_t packets_sent;
+    uint64_t packets_resent;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+
+    /* Largest packet size in bytes the connection currently sends,
+     * MAX_CRYPTO_PACKET_SIZE unless path MTU discovery found a larger one. */
+    uint16_t path_mtu;
+} Crypto_Connection_Stats;
+
+/* Extensions of the protocol a peer may support. They are exchanged by the
+ * layer above once the connection is established, see
+ * crypto_set_peer_capabilities().
+ */
+/* Lossless packets are split into streams that are ordered independently, so
+ * a lost file chunk doesn't hold back messages sent after it. */
+#define CRYPTO_CAPABILITY_STREAMS (1 << 0)
+/* Packets sent with write_cryptpacket_unordered() are passed on as soon as
+ * they arrive. */
+#define CRYPTO_CAPABILITY_UNORDERED (1 << 1)
+/* Several small packets may be sent in one data packet, see
+ * nc_set_coalescing_delay(). */
+#define CRYPTO_CAPABILITY_BATCH (1 << 2)
+/* Direct UDP paths are probed for a path MTU above MAX_CRYPTO_PACKET_SIZE,
+ * and PACKET_ID_BATCH packets up to that size are sent over them. Requires
+ * CRYPTO_CAPABILITY_BATCH. */
+#define CRYPTO_CAPABILITY_PMTU (1 << 3)
+/* The peer is sent resumption cookies, which let it send a handshake right
+ * away when it reconnects instead of asking for a cookie first. */
+#define CRYPTO_CAPABILITY_RESUME (1 << 4)
+
+/* The extensions we support. */
+#define CRYPTO_CAPABILITIES (CRYPTO_CAPABILITY_STREAMS | CRYPTO_CAPABILITY_UNORDERED | CRYPTO_CAPABILITY_BATCH \
+                             | CRYPTO_CAPABILITY_PMTU | CRYPTO_CAPABILITY_RESUME)
+
+/* Lossless packets are ordered per stream once both sides support
+ * CRYPTO_CAPABILITY_STREAMS. Packets of a stream carry a header with the
+ * stream's sequence number and are passed on as soon as the ones before them
+ * in the same stream were, even if packets of other streams are still missing.
+ */
+typedef enum Crypto_Stream {
+    /* Status, typing, keepalives and call signalling. */
+    CRYPTO_STREAM_CONTROL,
+    /* Messages and conferences. */
+    CRYPTO_STREAM_MESSAGES,
+
+    /* Not streams of their own: file transfers and custom packets are sent
+     * without a header and passed on in order with everything sent before
+     * them. Packets of the streams may overtake them. */
+    CRYPTO_STREAM_BULK,
+    /* Like bulk packets, but nothing sent after them overtakes them. */
+    CRYPTO_STREAM_BARRIER,
+} Crypto_Stream;
+
+#define CRYPTO_NUM_STREAMS 2
+
+/* PACKET_ID_STREAM, then the sequence number of the packet in its stream. */
+#define CRYPTO_STREAM_HEADER_SIZE (1 + sizeof(uint16_t))
+
+/* Return the stream a lossless packet with the given id belongs to. Streams
+ * are resent in this order, so CRYPTO_STREAM_CONTROL packets go out first.
+ */
+Crypto_Stream crypto_packet_stream(uint8_t packet_id);
+
+/* Write data into packet behind a stream header with sequence number seq.
+ * packet must have room for length + CRYPTO_STREAM_HEADER_SIZE bytes.
+ *
+ * return length of the packet with the header.
+ * return 0 if data doesn't belong to a stream or is too long for a header.
+ */
+uint16_t crypto_pack_stream_header(uint8_t *packet, uint16_t seq, const uint8_t *data, uint16_t length);
+
+/* Read the sequence number from a received packet with a stream header. The
+ * packet it carries starts at packet + CRYPTO_STREAM_HEADER_SIZE.
+ *
+ * return true if the header is valid and belongs to a stream.
+ */
+bool crypto_unpack_stream_header(const uint8_t *packet, uint16_t length, uint16_t *seq);
+
+/* Data packets are encrypted with AES-256-GCM instead of XSalsa20-Poly1305.
+ * Only supported when crypto_aesgcm_available(), so it is not part of
+ * CRYPTO_CAPABILITIES, see crypto_capabilities(). */
+#define CRYPTO_CAPABILITY_AESGCM (1 << 5)
+
+/* return the CRYPTO_CAPABILITY_* extensions we support.
+ */
+uint32_t crypto_capabilities(const Net_Crypto *c);
+
+/* Tell the connection which of the CRYPTO_CAPABILITY_* extensions the peer
+ * supports. Packets are only sent using the ones both sides support.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int crypto_set_peer_capabilities(Net_Crypto *c, int crypt_connection_id, uint32_t capabilities);
+
+/* Fill stats with the transport statistics of the connection.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int crypto_connection_stats(const Net_Crypto *c, int crypt_connection_id, Crypto_Connection_Stats *stats);
+
 /* Generate our public and private keys.
  *  Only call this function the first time the program starts.
  */
@@ -356,6 +536,8 @@ void do_net_crypto(Net_Crypto *c, void *userdata);
 
 void kill_net_crypto(Net_Crypto *c);
 
-
+#ifdef __cplusplus
+}  // extern "C"
+#endif
 
 #endif
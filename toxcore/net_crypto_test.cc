@@ -0,0 +1,77 @@
+#include "net_crypto.h"
+
+#include <cstring>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+TEST(NetCrypto, PacketIdsMapToStreams) {
+  EXPECT_EQ(crypto_packet_stream(PACKET_ID_RANGE_LOSSLESS_START), CRYPTO_STREAM_CONTROL);
+  EXPECT_EQ(crypto_packet_stream(PACKET_ID_TYPING), CRYPTO_STREAM_CONTROL);
+  EXPECT_EQ(crypto_packet_stream(PACKET_ID_MSI), CRYPTO_STREAM_CONTROL);
+  EXPECT_EQ(crypto_packet_stream(PACKET_ID_MESSAGE), CRYPTO_STREAM_MESSAGES);
+  EXPECT_EQ(crypto_packet_stream(PACKET_ID_MESSAGE_CONFERENCE), CRYPTO_STREAM_MESSAGES);
+  EXPECT_EQ(crypto_packet_stream(PACKET_ID_FILE_DATA), CRYPTO_STREAM_BULK);
+  EXPECT_EQ(crypto_packet_stream(PACKET_ID_RANGE_LOSSLESS_CUSTOM_START), CRYPTO_STREAM_BULK);
+  EXPECT_EQ(crypto_packet_stream(PACKET_ID_ONLINE), CRYPTO_STREAM_BARRIER);
+  EXPECT_EQ(crypto_packet_stream(PACKET_ID_OFFLINE), CRYPTO_STREAM_BARRIER);
+}
+
+TEST(NetCrypto, StreamsAreResentBeforeBulkData) {
+  EXPECT_LT(crypto_packet_stream(PACKET_ID_TYPING), crypto_packet_stream(PACKET_ID_MESSAGE));
+  EXPECT_LT(crypto_packet_stream(PACKET_ID_MESSAGE), crypto_packet_stream(PACKET_ID_FILE_DATA));
+}
+
+TEST(NetCrypto, StreamHeaderRoundTrips) {
+  const uint8_t data[] = {PACKET_ID_MESSAGE, 0, 'h', 'i'};
+  uint8_t packet[sizeof(data) + CRYPTO_STREAM_HEADER_SIZE];
+
+  for (uint32_t seq : {0u, 1u, 0x1234u, 0xffffu}) {
+    ASSERT_EQ(crypto_pack_stream_header(packet, seq, data, sizeof(data)), sizeof(packet));
+    EXPECT_EQ(packet[0], PACKET_ID_STREAM);
+
+    uint16_t unpacked_seq = 0;
+    ASSERT_TRUE(crypto_unpack_stream_header(packet, sizeof(packet), &unpacked_seq));
+    EXPECT_EQ(unpacked_seq, seq);
+    EXPECT_EQ(memcmp(packet + CRYPTO_STREAM_HEADER_SIZE, data, sizeof(data)), 0);
+    EXPECT_EQ(crypto_packet_stream(packet[CRYPTO_STREAM_HEADER_SIZE]), CRYPTO_STREAM_MESSAGES);
+  }
+}
+
+TEST(NetCrypto, PacketsOutsideStreamsGetNoHeader) {
+  uint8_t packet[MAX_CRYPTO_DATA_SIZE];
+
+  const uint8_t file_data[] = {PACKET_ID_FILE_DATA, 0, 1, 2};
+  EXPECT_EQ(crypto_pack_stream_header(packet, 0, file_data, sizeof(file_data)), 0);
+
+  const uint8_t online[] = {PACKET_ID_ONLINE};
+  EXPECT_EQ(crypto_pack_stream_header(packet, 0, online, sizeof(online)), 0);
+
+  uint8_t too_long[MAX_CRYPTO_DATA_SIZE] = {PACKET_ID_MESSAGE};
+  EXPECT_EQ(crypto_pack_stream_header(packet, 0, too_long, MAX_CRYPTO_DATA_SIZE - CRYPTO_STREAM_HEADER_SIZE + 1),
+            0);
+  EXPECT_EQ(crypto_pack_stream_header(packet, 0, too_long, MAX_CRYPTO_DATA_SIZE - CRYPTO_STREAM_HEADER_SIZE),
+            MAX_CRYPTO_DATA_SIZE);
+}
+
+TEST(NetCrypto, InvalidStreamHeadersAreRejected) {
+  uint16_t seq;
+
+  const uint8_t empty[] = {PACKET_ID_STREAM, 0, 1};
+  EXPECT_FALSE(crypto_unpack_stream_header(empty, sizeof(empty), &seq));
+
+  const uint8_t not_a_stream_packet[] = {PACKET_ID_MESSAGE, 0, 1, 'x'};
+  EXPECT_FALSE(crypto_unpack_stream_header(not_a_stream_packet, sizeof(not_a_stream_packet), &seq));
+
+  const uint8_t bulk[] = {PACKET_ID_STREAM, 0, 1, PACKET_ID_FILE_DATA, 0};
+  EXPECT_FALSE(crypto_unpack_stream_header(bulk, sizeof(bulk), &seq));
+
+  const uint8_t lossy[] = {PACKET_ID_STREAM, 0, 1, PACKET_ID_RANGE_LOSSY_START};
+  EXPECT_FALSE(crypto_unpack_stream_header(lossy, sizeof(lossy), &seq));
+
+  const uint8_t internal[] = {PACKET_ID_STREAM, 0, 1, PACKET_ID_KILL};
+  EXPECT_FALSE(crypto_unpack_stream_header(internal, sizeof(internal), &seq));
+}
+
+}  // namespace
@@ -39,6 +39,11 @@
 #define _XOPEN_SOURCE 700
 #endif
 
+// For recvmmsg/sendmmsg on Linux.
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #if defined(_WIN32) && _WIN32_WINNT >= _WIN32_WINNT_WINXP
 #undef _WIN32_WINNT
 #define _WIN32_WINNT  0x501
@@ -98,6 +103,10 @@
 
 #define TOX_EWOULDBLOCK EWOULDBLOCK
 
+#if defined(__linux__)
+#define NET_USE_MMSG
+#endif
+
 #else
 #ifndef IPV6_V6ONLY
 #define IPV6_V6ONLY 27
@@ -362,6 +371,16 @@ void kill_sock(Socket sock)
 #endif
 }
 
+uint32_t net_poll_fds_add(Net_Poll_Fd *fds, uint32_t max_fds, uint32_t count, Socket sock, bool want_write)
+{
+    if (count < max_fds) {
+        fds[count].sock = sock;
+        fds[count].want_write = want_write;
+    }
+
+    return count + 1;
+}
+
 bool set_socket_nonblock(Socket sock)
 {
 #ifdef OS_WIN32
@@ -455,6 +474,17 @@ typedef struct Packet_Handler {
     void *object;
 } Packet_Handler;
 
+/* A datagram in one of the batched I/O buffers, together with its peer address
+ * in both the native and the Tox representation.
+ */
+typedef struct Net_Batch_Packet {
+    IP_Port ip_port;
+    struct sockaddr_storage addr;
+    size_t addrsize;
+    uint16_t length;
+    uint8_t data[NET_BATCH_PACKET_SIZE];
+} Net_Batch_Packet;
+
 struct Networking_Core {
     const Logger *log;
     Packet_Handler packethandlers[256];
@@ -463,6 +493,15 @@ struct Networking_Core {
     uint16_t port;
     /* Our UDP socket. */
     Socket sock;
+
+    /* Batched I/O, only allocated when batch_size > 1. See networking_set_batch_size(). */
+    uint16_t batch_size;
+    Net_Batch_Packet *recv_batch;
+    Net_Batch_Packet *send_queue;
+    uint16_t send_queue_length;
+
+    /* Not owned, see networking_set_precompute_pool(). */
+    Precompute_Pool *precompute_pool;
 };
 
 Family net_family(const Networking_Core *net)
@@ -475,10 +514,162 @@ uint16_t net_port(const Networking_Core *net)
     return net->port;
 }
 
-/* Basic network functions:
- * Function to send packet(data) of length length to ip_port.
+/* Send a single packet from the send queue with sendto.
+ *
+ * return the sendto result.
  */
-int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+static int send_queued_packet(const Networking_Core *net, const Net_Batch_Packet *packet)
+{
+    const int res = sendto(net->sock.socket, (const char *)packet->data, packet->length, 0,
+                           (const struct sockaddr *)&packet->addr, packet->addrsize);
+
+    loglogdata(net->log, "O=>", packet->data, packet->length, packet->ip_port, res);
+
+    return res;
+}
+
+void networking_flush(Networking_Core *net)
+{
+    if (net->send_queue_length == 0) {
+        return;
+    }
+
+    uint16_t sent = 0;
+
+#ifdef NET_USE_MMSG
+    struct mmsghdr msgs[NET_MAX_BATCH_SIZE];
+    struct iovec iovecs[NET_MAX_BATCH_SIZE];
+    memset(msgs, 0, net->send_queue_length * sizeof(struct mmsghdr));
+
+    for (uint16_t i = 0; i < net->send_queue_length; ++i) {
+        Net_Batch_Packet *const packet = &net->send_queue[i];
+        iovecs[i].iov_base = packet->data;
+        iovecs[i].iov_len = packet->length;
+        msgs[i].msg_hdr.msg_name = &packet->addr;
+        msgs[i].msg_hdr.msg_namelen = packet->addrsize;
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (sent < net->send_queue_length) {
+        const int res = sendmmsg(net->sock.socket, &msgs[sent], net->send_queue_length - sent, 0);
+
+        if (res <= 0) {
+            /* sendmmsg only fails if the first packet could not be sent. Retry
+             * that one on its own so the error is logged, then carry on with
+             * the rest of the queue. */
+            send_queued_packet(net, &net->send_queue[sent]);
+            ++sent;
+            continue;
+        }
+
+        for (int i = 0; i < res; ++i) {
+            const Net_Batch_Packet *const packet = &net->send_queue[sent + i];
+            loglogdata(net->log, "O=>", packet->data, packet->length, packet->ip_port, msgs[sent + i].msg_len);
+        }
+
+        sent += res;
+    }
+
+#endif
+
+    for (; sent < net->send_queue_length; ++sent) {
+        send_queued_packet(net, &net->send_queue[sent]);
+    }
+
+    net->send_queue_length = 0;
+}
+
+/* Add a packet to the send queue, flushing it first if it is full.
+ *
+ * return length.
+ */
+static int queue_packet(Networking_Core *net, IP_Port ip_port, const struct sockaddr_storage *addr, size_t addrsize,
+                        const uint8_t *data, uint16_t length)
+{
+    if (net->send_queue_length == net->batch_size) {
+        networking_flush(net);
+    }
+
+    Net_Batch_Packet *const packet = &net->send_queue[net->send_queue_length];
+    packet->ip_port = ip_port;
+    memcpy(&packet->addr, addr, addrsize);
+    packet->addrsize = addrsize;
+    packet->length = length;
+    memcpy(packet->data, data, length);
+    ++net->send_queue_length;
+
+    return length;
+}
+
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+/* Set an IP_MTU_DISCOVER style option and return its previous value, or -1
+ * if it can't be set on the socket.
+ */
+static int swap_mtu_discover(Socket sock, int level, int option, int value)
+{
+    int old_value;
+    socklen_t length = sizeof(old_value);
+
+    if (getsockopt(sock.socket, level, option, (char *)&old_value, &length) != 0) {
+        return -1;
+    }
+
+    if (setsockopt(sock.socket, level, option, (const char *)&value, sizeof(value)) != 0) {
+        return -1;
+    }
+
+    return old_value;
+}
+#endif
+
+/* Send a packet with the don't fragment bit set.
+ *
+ * return length on success.
+ * return -1 on failure.
+ */
+static int send_unfragmented(Networking_Core *net, IP_Port ip_port, const struct sockaddr_storage *addr,
+                             size_t addrsize, const uint8_t *data, uint16_t length)
+{
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+    /* IPv4 packets sent on an IPv6 socket use the IPv4 option. */
+    const bool ipv6 = net_family_is_ipv6(ip_port.ip.family) && !ipv6_ipv4_in_v6(ip_port.ip.ip.v6);
+#if defined(IPV6_MTU_DISCOVER) && defined(IPV6_PMTUDISC_PROBE)
+    const int level = ipv6 ? IPPROTO_IPV6 : IPPROTO_IP;
+    const int option = ipv6 ? IPV6_MTU_DISCOVER : IP_MTU_DISCOVER;
+    const int probe = ipv6 ? IPV6_PMTUDISC_PROBE : IP_PMTUDISC_PROBE;
+#else
+
+    if (ipv6) {
+        return -1;
+    }
+
+    const int level = IPPROTO_IP;
+    const int option = IP_MTU_DISCOVER;
+    const int probe = IP_PMTUDISC_PROBE;
+#endif
+    const int old_value = swap_mtu_discover(net->sock, level, option, probe);
+
+    if (old_value == -1) {
+        return -1;
+    }
+
+    const int res = sendto(net->sock.socket, (const char *)data, length, 0, (const struct sockaddr *)addr, addrsize);
+    swap_mtu_discover(net->sock, level, option, old_value);
+
+    loglogdata(net->log, "O=>", data, length, ip_port, res);
+
+    return res;
+#else
+    return -1;
+#endif
+}
+
+/* Send a packet, queueing it if batching is enabled unless unfragmented is
+ * true.
+ */
+static int send_packet(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length,
+                       bool unfragmented)
 {
     if (net_family_is_unspec(net->family)) { /* Socket not initialized */
         LOGGER_ERROR(net->log, "attempted to send message of length %u on uninitialised socket", (unsigned)length);
@@ -533,6 +724,19 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
         return -1;
     }
 
+    if (unfragmented) {
+        return send_unfragmented(net, ip_port, &addr, addrsize, data, length);
+    }
+
+    if (net->batch_size > 1) {
+        if (length <= NET_BATCH_PACKET_SIZE) {
+            return queue_packet(net, ip_port, &addr, addrsize, data, length);
+        }
+
+        /* Too large for the queue: keep it behind the packets queued before it. */
+        networking_flush(net);
+    }
+
     const int res = sendto(net->sock.socket, (const char *)data, length, 0, (struct sockaddr *)&addr, addrsize);
 
     loglogdata(net->log, "O=>", data, length, ip_port, res);
@@ -540,39 +744,28 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
     return res;
 }
 
-/* Function to receive data
- *  ip and port of sender is put into ip_port.
- *  Packet data is put into data.
- *  Packet length is put into length.
+/* Basic network functions:
+ * Function to send packet(data) of length length to ip_port.
  */
-static int receivepacket(const Logger *log, Socket sock, IP_Port *ip_port, uint8_t *data, uint32_t *length)
+int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
 {
-    memset(ip_port, 0, sizeof(IP_Port));
-    struct sockaddr_storage addr;
-#ifdef OS_WIN32
-    int addrlen = sizeof(addr);
-#else
-    socklen_t addrlen = sizeof(addr);
-#endif
-    *length = 0;
-    int fail_or_len = recvfrom(sock.socket, (char *) data, MAX_UDP_PACKET_SIZE, 0, (struct sockaddr *)&addr, &addrlen);
-
-    if (fail_or_len < 0) {
-        int error = net_error();
-
-        if (fail_or_len < 0 && error != TOX_EWOULDBLOCK) {
-            const char *strerror = net_new_strerror(error);
-            LOGGER_ERROR(log, "Unexpected error reading from socket: %u, %s", error, strerror);
-            net_kill_strerror(strerror);
-        }
-
-        return -1; /* Nothing received. */
-    }
+    return send_packet(net, ip_port, data, length, false);
+}
 
-    *length = (uint32_t)fail_or_len;
+int sendpacket_probe(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    return send_packet(net, ip_port, data, length, true);
+}
 
-    if (addr.ss_family == AF_INET) {
-        struct sockaddr_in *addr_in = (struct sockaddr_in *)&addr;
+/* Convert the source address of a received packet into an IP_Port.
+ *
+ * return 0 on success.
+ * return -1 if the address family is not supported.
+ */
+static int sockaddr_to_ip_port(const struct sockaddr_storage *addr, IP_Port *ip_port)
+{
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *addr_in = (const struct sockaddr_in *)addr;
 
         const Family *const family = make_tox_family(addr_in->sin_family);
         assert(family != nullptr);
@@ -584,8 +777,8 @@ static int receivepacket(const Logger *log, Socket sock, IP_Port *ip_port, uint8
         ip_port->ip.family = *family;
         get_ip4(&ip_port->ip.ip.v4, &addr_in->sin_addr);
         ip_port->port = addr_in->sin_port;
-    } else if (addr.ss_family == AF_INET6) {
-        struct sockaddr_in6 *addr_in6 = (struct sockaddr_in6 *)&addr;
+    } else if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *addr_in6 = (const struct sockaddr_in6 *)addr;
         const Family *const family = make_tox_family(addr_in6->sin6_family);
         assert(family != nullptr);
 
@@ -605,17 +798,126 @@ static int receivepacket(const Logger *log, Socket sock, IP_Port *ip_port, uint8
         return -1;
     }
 
+    return 0;
+}
+
+static void log_receive_error(const Logger *log)
+{
+    const int error = net_error();
+
+    if (error != TOX_EWOULDBLOCK) {
+        const char *strerror = net_new_strerror(error);
+        LOGGER_ERROR(log, "Unexpected error reading from socket: %u, %s", error, strerror);
+        net_kill_strerror(strerror);
+    }
+}
+
+/* Function to receive data
+ *  ip and port of sender is put into ip_port.
+ *  Packet data is put into data.
+ *  Packet length is put into length.
+ */
+static int receivepacket(const Logger *log, Socket sock, IP_Port *ip_port, uint8_t *data, uint32_t *length)
+{
+    memset(ip_port, 0, sizeof(IP_Port));
+    struct sockaddr_storage addr;
+#ifdef OS_WIN32
+    int addrlen = sizeof(addr);
+#else
+    socklen_t addrlen = sizeof(addr);
+#endif
+    *length = 0;
+    int fail_or_len = recvfrom(sock.socket, (char *) data, MAX_UDP_PACKET_SIZE, 0, (struct sockaddr *)&addr, &addrlen);
+
+    if (fail_or_len < 0) {
+        log_receive_error(log);
+        return -1; /* Nothing received. */
+    }
+
+    *length = (uint32_t)fail_or_len;
+
+    if (sockaddr_to_ip_port(&addr, ip_port) == -1) {
+        return -1;
+    }
+
     loglogdata(log, "=>O", data, MAX_UDP_PACKET_SIZE, *ip_port, *length);
 
     return 0;
 }
 
+#ifdef NET_USE_MMSG
+/* Receive up to batch_size packets into the receive batch with one recvmmsg call.
+ *
+ * return number of packets received.
+ * return -1 if nothing was received.
+ */
+static int receive_batch(Networking_Core *net)
+{
+    struct mmsghdr msgs[NET_MAX_BATCH_SIZE];
+    struct iovec iovecs[NET_MAX_BATCH_SIZE];
+    memset(msgs, 0, net->batch_size * sizeof(struct mmsghdr));
+
+    for (uint16_t i = 0; i < net->batch_size; ++i) {
+        Net_Batch_Packet *const packet = &net->recv_batch[i];
+        iovecs[i].iov_base = packet->data;
+        iovecs[i].iov_len = NET_BATCH_PACKET_SIZE;
+        msgs[i].msg_hdr.msg_name = &packet->addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(packet->addr);
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    const int count = recvmmsg(net->sock.socket, msgs, net->batch_size, MSG_DONTWAIT, nullptr);
+
+    if (count < 0) {
+        if (net_error() == ENOSYS) {
+            LOGGER_WARNING(net->log, "recvmmsg is not supported by this kernel, disabling batched UDP I/O");
+            networking_set_batch_size(net, 0);
+            return -1;
+        }
+
+        log_receive_error(net->log);
+        return -1;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        Net_Batch_Packet *const packet = &net->recv_batch[i];
+        /* A truncated datagram is useless, handle_packet() ignores length 0. */
+        packet->length = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0 ? 0 : msgs[i].msg_len;
+        packet->addrsize = msgs[i].msg_hdr.msg_namelen;
+    }
+
+    return count;
+}
+#endif
+
 void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handler_cb *cb, void *object)
 {
     net->packethandlers[byte].function = cb;
     net->packethandlers[byte].object = object;
 }
 
+packet_handler_cb *networking_gethandler(const Networking_Core *net, uint8_t byte, void **object)
+{
+    *object = net->packethandlers[byte].object;
+    return net->packethandlers[byte].function;
+}
+
+static void handle_packet(const Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint32_t length,
+                          void *userdata)
+{
+    if (length < 1) {
+        return;
+    }
+
+    if (!(net->packethandlers[data[0]].function)) {
+        LOGGER_WARNING(net->log, "[%02u] -- Packet has no handler", data[0]);
+        return;
+    }
+
+    net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length, userdata);
+}
+
 void networking_poll(Networking_Core *net, void *userdata)
 {
     if (net_family_is_unspec(net->family)) {
@@ -623,22 +925,170 @@ void networking_poll(Networking_Core *net, void *userdata)
         return;
     }
 
+    /* Get anything queued since the last iteration on the wire before we
+     * handle the replies. */
+    networking_flush(net);
+
+    if (net->precompute_pool != nullptr) {
+        precompute_pool_run(net->precompute_pool, userdata);
+    }
+
+#ifdef NET_USE_MMSG
+
+    if (net->batch_size > 1) {
+        int count;
+
+        do {
+            count = receive_batch(net);
+
+            for (int i = 0; i < count; ++i) {
+                Net_Batch_Packet *const packet = &net->recv_batch[i];
+                memset(&packet->ip_port, 0, sizeof(IP_Port));
+
+                if (sockaddr_to_ip_port(&packet->addr, &packet->ip_port) == -1) {
+                    continue;
+                }
+
+                loglogdata(net->log, "=>O", packet->data, NET_BATCH_PACKET_SIZE, packet->ip_port, packet->length);
+                handle_packet(net, packet->ip_port, packet->data, packet->length, userdata);
+            }
+        } while (count == net->batch_size);
+
+        return;
+    }
+
+#endif
+
     IP_Port ip_port;
     uint8_t data[MAX_UDP_PACKET_SIZE];
     uint32_t length;
 
     while (receivepacket(net->log, net->sock, &ip_port, data, &length) != -1) {
-        if (length < 1) {
-            continue;
-        }
+        handle_packet(net, ip_port, data, length, userdata);
+    }
+}
 
-        if (!(net->packethandlers[data[0]].function)) {
-            LOGGER_WARNING(net->log, "[%02u] -- Packet has no handler", data[0]);
-            continue;
-        }
+uint32_t networking_get_fds(const Networking_Core *net, Net_Poll_Fd *fds, uint32_t max_fds)
+{
+    if (net_family_is_unspec(net->family)) {
+        return 0;
+    }
+
+    /* Packets queued in batched mode go out on the next networking_poll(). */
+    uint32_t count = net_poll_fds_add(fds, max_fds, 0, net->sock, net->send_queue_length > 0);
+
+    if (net->precompute_pool != nullptr && precompute_pool_fd(net->precompute_pool) != -1) {
+        const Socket wake_sock = {precompute_pool_fd(net->precompute_pool)};
+        count = net_poll_fds_add(fds, max_fds, count, wake_sock, false);
+    }
+
+    return count;
+}
+
+void networking_set_precompute_pool(Networking_Core *net, Precompute_Pool *pool)
+{
+    net->precompute_pool = pool;
+}
+
+/* What a parked packet needs to be handled again: the cache to put the key in
+ * and where the packet came from. The packet itself follows it. */
+typedef struct Parked_Packet {
+    Shared_Key_Cache *cache;
+    IP_Port source;
+    uint16_t length;
+} Parked_Packet;
+
+static void resume_parked_packet(void *object, const uint8_t *public_key, const uint8_t *shared_key,
+                                 const uint8_t *context, uint16_t context_size, void *userdata)
+{
+    const Networking_Core *net = (const Networking_Core *)object;
+    Parked_Packet parked;
+
+    if (context_size < sizeof(parked)) {
+        return;
+    }
+
+    memcpy(&parked, context, sizeof(parked));
+
+    if (context_size != sizeof(parked) + parked.length) {
+        return;
+    }
+
+    shared_key_cache_add(parked.cache, public_key, shared_key);
+    handle_packet(net, parked.source, context + sizeof(parked), parked.length, userdata);
+}
+
+bool networking_get_shared_key(Networking_Core *net, Shared_Key_Cache *cache, uint8_t *shared_key,
+                               const uint8_t *secret_key, const uint8_t *public_key, IP_Port source,
+                               const uint8_t *packet, uint16_t length)
+{
+    if (net->precompute_pool == nullptr) {
+        shared_key_cache_lookup(cache, shared_key, secret_key, public_key);
+        return true;
+    }
+
+    if (shared_key_cache_get(cache, shared_key, public_key)) {
+        return true;
+    }
+
+    if (sizeof(Parked_Packet) + length > PRECOMPUTE_POOL_MAX_CONTEXT_SIZE) {
+        /* Too large to park. Rare enough that computing it here is cheaper
+         * than making every parked packet as large as a jumbo frame. */
+        shared_key_cache_lookup(cache, shared_key, secret_key, public_key);
+        return true;
+    }
+
+    const Parked_Packet parked = {cache, source, length};
+    uint8_t context[PRECOMPUTE_POOL_MAX_CONTEXT_SIZE];
+    memcpy(context, &parked, sizeof(parked));
+    memcpy(context + sizeof(parked), packet, length);
+
+    if (!precompute_pool_submit(net->precompute_pool, secret_key, public_key, &resume_parked_packet, net,
+                                context, sizeof(parked) + length)) {
+        LOGGER_DEBUG(net->log, "could not queue shared key precompute, dropping packet");
+    }
+
+    return false;
+}
+
+bool networking_set_batch_size(Networking_Core *net, uint16_t batch_size)
+{
+    networking_flush(net);
+
+    free(net->recv_batch);
+    free(net->send_queue);
+    net->recv_batch = nullptr;
+    net->send_queue = nullptr;
+    net->batch_size = 0;
+
+    if (batch_size <= 1) {
+        return true;
+    }
+
+#ifdef NET_USE_MMSG
 
-        net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length, userdata);
+    if (net_family_is_unspec(net->family)) {
+        return false;
+    }
+
+    batch_size = min_u16(batch_size, NET_MAX_BATCH_SIZE);
+
+    net->recv_batch = (Net_Batch_Packet *)calloc(batch_size, sizeof(Net_Batch_Packet));
+    net->send_queue = (Net_Batch_Packet *)calloc(batch_size, sizeof(Net_Batch_Packet));
+
+    if (net->recv_batch == nullptr || net->send_queue == nullptr) {
+        free(net->recv_batch);
+        free(net->send_queue);
+        net->recv_batch = nullptr;
+        net->send_queue = nullptr;
+        return false;
     }
+
+    net->batch_size = batch_size;
+    return true;
+#else
+    return false;
+#endif
 }
 
 #ifndef VANILLA_NACL
@@ -948,9 +1398,12 @@ void kill_networking(Networking_Core *net)
 
     if (!net_family_is_unspec(net->family)) {
         /* Socket is initialized, so we close it. */
+        networking_flush(net);
         kill_sock(net->sock);
     }
 
+    free(net->recv_batch);
+    free(net->send_queue);
     free(net);
 }
 
@@ -1442,6 +1895,36 @@ int net_send(Socket sock, const void *buf, size_t len)
     return send(sock.socket, (const char *)buf, len, MSG_NOSIGNAL);
 }
 
+int net_send_iov(Socket sock, const void *buf1, size_t len1, const void *buf2, size_t len2)
+{
+    if (len2 == 0) {
+        return net_send(sock, buf1, len1);
+    }
+
+#ifdef OS_WIN32
+    const int len = net_send(sock, buf1, len1);
+
+    if (len != (int)len1) {
+        return len;
+    }
+
+    const int len_2 = net_send(sock, buf2, len2);
+    return len_2 > 0 ? len + len_2 : len;
+#else
+    struct iovec iov[2];
+    iov[0].iov_base = (void *)buf1;
+    iov[0].iov_len = len1;
+    iov[1].iov_base = (void *)buf2;
+    iov[1].iov_len = len2;
+
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    return sendmsg(sock.socket, &msg, MSG_NOSIGNAL);
+#endif
+}
+
 int net_recv(Socket sock, void *buf, size_t len)
 {
     return recv(sock.socket, (char *)buf, len, MSG_NOSIGNAL);
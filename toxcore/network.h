@@ -25,6 +25,8 @@
 #define C_TOXCORE_TOXCORE_NETWORK_H
 
 #include "logger.h"
+#include "precompute_pool.h"
+#include "shared_key_cache.h"
 
 #include <stdbool.h>    // bool
 #include <stddef.h>     // size_t
@@ -77,6 +79,13 @@ extern const Socket net_invalid_socket;
  * Calls send(sockfd, buf, len, MSG_NOSIGNAL).
  */
 int net_send(Socket sock, const void *buf, size_t len);
+/**
+ * Sends len1 bytes of buf1 followed by len2 bytes of buf2 with a single
+ * sendmsg(sockfd, msg, MSG_NOSIGNAL) where the platform has it.
+ *
+ * @return the number of bytes sent, or -1 on error.
+ */
+int net_send_iov(Socket sock, const void *buf1, size_t len1, const void *buf2, size_t len2);
 /**
  * Calls recv(sockfd, buf, len, MSG_NOSIGNAL).
  */
@@ -90,13 +99,31 @@ int net_listen(Socket sock, int backlog);
  */
 Socket net_accept(Socket sock);
 
+/**
+ * A socket that the main loop needs to be woken up for. Sockets are always
+ * watched for readability, and for writability if want_write is set.
+ */
+typedef struct Net_Poll_Fd {
+    Socket sock;
+    bool want_write;
+} Net_Poll_Fd;
+
+/**
+ * Add a socket to a list of at most max_fds sockets to watch, which currently
+ * holds count sockets. If the list is full, the socket is only counted.
+ *
+ * @return count + 1.
+ */
+uint32_t net_poll_fds_add(Net_Poll_Fd *fds, uint32_t max_fds, uint32_t count, Socket sock, bool want_write);
+
 /**
  * return the amount of data in the tcp recv buffer.
  * return 0 on failure.
  */
 size_t net_socket_data_recv_buffer(Socket sock);
 
-#define MAX_UDP_PACKET_SIZE 2048
+/* Large enough for the jumbo frames net_crypto probes direct paths for. */
+#define MAX_UDP_PACKET_SIZE 9000
 
 typedef enum Net_Packet_Type {
     NET_PACKET_PING_REQUEST         = 0x00, /* Ping request packet ID. */
@@ -107,6 +134,7 @@ typedef enum Net_Packet_Type {
     NET_PACKET_COOKIE_RESPONSE      = 0x19, /* Cookie response packet */
     NET_PACKET_CRYPTO_HS            = 0x1a, /* Crypto handshake packet */
     NET_PACKET_CRYPTO_DATA          = 0x1b, /* Crypto data packet */
+    NET_PACKET_CRYPTO_DATA_AESGCM   = 0x1c, /* Crypto data packet encrypted with AES-256-GCM */
     NET_PACKET_CRYPTO               = 0x20, /* Encrypted data packet ID. */
     NET_PACKET_LAN_DISCOVERY        = 0x21, /* LAN discovery packet ID. */
 
@@ -382,12 +410,93 @@ bool set_socket_dualstack(Socket sock);
 /* Function to send packet(data) of length length to ip_port. */
 int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length);
 
+/* Send a packet to find out if packets of its size reach ip_port. Unlike
+ * sendpacket(), the packet is sent right away and with the don't fragment
+ * bit set, so it is dropped instead of fragmented if it is too big for the
+ * path.
+ *
+ * return length on success.
+ * return -1 on failure, or if the platform can't send unfragmented packets.
+ */
+int sendpacket_probe(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length);
+
 /* Function to call when packet beginning with byte is received. */
 void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handler_cb *cb, void *object);
 
+/* Return the function called when packet beginning with byte is received, and
+ * put the object it is called with in object. Lets tests wrap a handler.
+ */
+packet_handler_cb *networking_gethandler(const Networking_Core *net, uint8_t byte, void **object);
+
 /* Call this several times a second. */
 void networking_poll(Networking_Core *net, void *userdata);
 
+/**
+ * Write the sockets networking_poll() reads from into fds, see net_poll_fds_add().
+ *
+ * @return the number of sockets, which may be larger than max_fds.
+ */
+uint32_t networking_get_fds(const Networking_Core *net, Net_Poll_Fd *fds, uint32_t max_fds);
+
+/**
+ * Compute the shared keys networking_get_shared_key() is asked for with the
+ * threads of pool, or synchronously if pool is nullptr. The pool is not owned
+ * by net: it must outlive net or be unset first.
+ *
+ * networking_poll() handles parked packets whose key is ready before reading
+ * new ones, and networking_get_fds() includes the pool's wakeup descriptor.
+ */
+void networking_set_precompute_pool(Networking_Core *net, Precompute_Pool *pool);
+
+/**
+ * Get the shared key between secret_key and public_key for a packet received
+ * from source, using cache.
+ *
+ * If the key is not in the cache and a precompute pool is set, the packet is
+ * parked instead: once the pool has computed the key, it is added to the cache
+ * and networking_poll() handles the packet again as if it was just received.
+ *
+ * @return true with the key in shared_key if it was cached or computed now.
+ * @return false if the packet was parked, or dropped because it could not be
+ *   queued in the pool.
+ */
+bool networking_get_shared_key(Networking_Core *net, Shared_Key_Cache *cache, uint8_t *shared_key,
+                               const uint8_t *secret_key, const uint8_t *public_key, IP_Port source,
+                               const uint8_t *packet, uint16_t length);
+
+/* Maximum number of datagrams moved by a single batched send or receive syscall. */
+#define NET_MAX_BATCH_SIZE 64
+
+/* Size of each datagram buffer used for batched I/O. Smaller than
+ * MAX_UDP_PACKET_SIZE, so the batch buffers don't grow with it: larger
+ * packets are sent on their own, and larger datagrams can't be received.
+ */
+#define NET_BATCH_PACKET_SIZE 2048
+
+/**
+ * Enable or disable batched UDP I/O.
+ *
+ * With a batch size greater than 1, networking_poll() reads up to batch_size
+ * datagrams per syscall (recvmmsg), and sendpacket() queues outgoing packets
+ * instead of sending them right away. Queued packets are sent with as few
+ * syscalls as possible (sendmmsg) by networking_flush(), at the start of
+ * networking_poll(), or when the queue is full. The batch size is capped at
+ * NET_MAX_BATCH_SIZE. A batch size of 0 or 1 restores one syscall per packet.
+ *
+ * Datagrams longer than NET_BATCH_PACKET_SIZE are dropped when received in
+ * batched mode, so the path MTU peers discover towards us stays below it.
+ *
+ * @return true on success, false if batched I/O is not supported on this
+ *   platform or socket, or memory allocation failed. Batching is disabled in
+ *   that case.
+ */
+bool networking_set_batch_size(Networking_Core *net, uint16_t batch_size);
+
+/* Send all packets queued by sendpacket() in batched mode. Call this at the
+ * end of each main loop iteration.
+ */
+void networking_flush(Networking_Core *net);
+
 /* Connect a socket to the address specified by the ip_port. */
 int net_connect(Socket sock, IP_Port ip_port);
 
@@ -52,6 +52,9 @@ typedef struct Onion_Announce Onion_Announce;
 uint8_t *onion_announce_entry_public_key(Onion_Announce *onion_a, uint32_t entry);
 void onion_announce_entry_set_time(Onion_Announce *onion_a, uint32_t entry, uint64_t time);
 
+/* The cache of shared keys for received announce and data requests. */
+Shared_Key_Cache *onion_announce_get_shared_keys(const Onion_Announce *onion_a);
+
 /* Create an onion announce request packet in packet of max_packet_length (recommended size ONION_ANNOUNCE_REQUEST_SIZE).
  *
  * dest_client_id is the public key of the node the packet will be sent to.
@@ -156,7 +156,10 @@ static int handle_ping_request(void *object, IP_Port source, const uint8_t *pack
 
     uint8_t ping_plain[PING_PLAIN_SIZE];
     // Decrypt ping_id
-    dht_get_shared_key_recv(dht, shared_key, packet + 1);
+    if (!dht_get_shared_key_recv_async(dht, shared_key, packet + 1, source, packet, length)) {
+        return 0;
+    }
+
     rc = decrypt_data_symmetric(shared_key,
                                 packet + 1 + CRYPTO_PUBLIC_KEY_SIZE,
                                 packet + 1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE,
@@ -288,7 +291,10 @@ int32_t ping_add(Ping *ping, const uint8_t *public_key, IP_Port ip_port)
         return -1;
     }
 
-    if (in_list(dht_get_close_clientlist(ping->dht), LCLIENT_LIST, ping->mono_time, public_key, ip_port)) {
+    uint16_t bucket_length;
+    const Client_data *const bucket = dht_get_close_bucket(ping->dht, public_key, &bucket_length);
+
+    if (in_list(bucket, bucket_length, ping->mono_time, public_key, ip_port)) {
         return -1;
     }
 
@@ -0,0 +1,349 @@
+/*
+ * XOR distance between public keys, as used by the DHT.
+ *
+ * Comparing two distances to the same key only requires finding the first byte
+ * in which the two other keys differ, which SIMD instructions can do for a
+ * whole key at once.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "pk_distance.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#include "ccompat.h"
+#include "crypto_core.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+#define PK_DISTANCE_HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+/* AVX2 code is compiled with a target attribute and only used if the CPU
+ * supports it, so only compilers supporting both can build it. */
+#if defined(PK_DISTANCE_HAVE_SSE2) && defined(__GNUC__) && !defined(__INTEL_COMPILER) \
+    && (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define PK_DISTANCE_HAVE_AVX2
+#include <immintrin.h>
+#define PK_DISTANCE_AVX2_FUNC __attribute__((__target__("avx2")))
+#endif
+
+typedef struct Pk_Distance_Funcs {
+    /* Return the index of the first byte in which pk1 and pk2 differ, or
+     * CRYPTO_PUBLIC_KEY_SIZE if they are equal. */
+    uint32_t (*first_difference)(const uint8_t *pk1, const uint8_t *pk2);
+    void (*prefixes)(const uint8_t *pk, const uint8_t *keys, size_t stride, uint32_t count, uint64_t *prefixes);
+} Pk_Distance_Funcs;
+
+#ifdef PK_DISTANCE_HAVE_SSE2
+/* Return the index of the first byte not set in a 32 bit byte equality mask. */
+static uint32_t first_unset_bit(uint32_t mask)
+{
+    if (mask == UINT32_C(0xffffffff)) {
+        return CRYPTO_PUBLIC_KEY_SIZE;
+    }
+
+#ifdef __GNUC__
+    return __builtin_ctz(~mask);
+#else
+    uint32_t i = 0;
+
+    while (mask & 1) {
+        mask >>= 1;
+        ++i;
+    }
+
+    return i;
+#endif
+}
+#endif
+
+/* x must not be 0. */
+static uint32_t count_leading_zeros64(uint64_t x)
+{
+#ifdef __GNUC__
+    return __builtin_clzll(x);
+#else
+    uint32_t i = 0;
+
+    while ((x & UINT64_C(0x8000000000000000)) == 0) {
+        x <<= 1;
+        ++i;
+    }
+
+    return i;
+#endif
+}
+
+static uint64_t load_be64(const uint8_t *bytes)
+{
+    return ((uint64_t)bytes[0] << 56) | ((uint64_t)bytes[1] << 48)
+           | ((uint64_t)bytes[2] << 40) | ((uint64_t)bytes[3] << 32)
+           | ((uint64_t)bytes[4] << 24) | ((uint64_t)bytes[5] << 16)
+           | ((uint64_t)bytes[6] << 8) | (uint64_t)bytes[7];
+}
+
+/*** Portable implementation */
+
+static uint32_t first_difference_scalar(const uint8_t *pk1, const uint8_t *pk2)
+{
+    for (uint32_t i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; i += 8) {
+        if (load_be64(pk1 + i) == load_be64(pk2 + i)) {
+            continue;
+        }
+
+        uint32_t j = i;
+
+        while (pk1[j] == pk2[j]) {
+            ++j;
+        }
+
+        return j;
+    }
+
+    return CRYPTO_PUBLIC_KEY_SIZE;
+}
+
+static void prefixes_scalar(const uint8_t *pk, const uint8_t *keys, size_t stride, uint32_t count, uint64_t *prefixes)
+{
+    const uint64_t pk_prefix = load_be64(pk);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        prefixes[i] = pk_prefix ^ load_be64(keys + i * stride);
+    }
+}
+
+static const Pk_Distance_Funcs pk_distance_scalar = {
+    first_difference_scalar,
+    prefixes_scalar,
+};
+
+/*** SSE2 implementation */
+
+#ifdef PK_DISTANCE_HAVE_SSE2
+static uint32_t first_difference_sse2(const uint8_t *pk1, const uint8_t *pk2)
+{
+    const __m128i lo = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)pk1),
+                                      _mm_loadu_si128((const __m128i *)pk2));
+    const __m128i hi = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(pk1 + 16)),
+                                      _mm_loadu_si128((const __m128i *)(pk2 + 16)));
+    return first_unset_bit((uint32_t)_mm_movemask_epi8(lo) | ((uint32_t)_mm_movemask_epi8(hi) << 16));
+}
+
+/* SSE2 has no byte shuffle to do the endianness conversion with, and the
+ * compiler turns load_be64() into a single load and byte swap anyway. */
+static const Pk_Distance_Funcs pk_distance_sse2 = {
+    first_difference_sse2,
+    prefixes_scalar,
+};
+#endif
+
+/*** AVX2 implementation */
+
+#ifdef PK_DISTANCE_HAVE_AVX2
+PK_DISTANCE_AVX2_FUNC
+static uint32_t first_difference_avx2(const uint8_t *pk1, const uint8_t *pk2)
+{
+    const __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)pk1),
+                                         _mm256_loadu_si256((const __m256i *)pk2));
+    return first_unset_bit((uint32_t)_mm256_movemask_epi8(eq));
+}
+
+PK_DISTANCE_AVX2_FUNC
+static void prefixes_avx2(const uint8_t *pk, const uint8_t *keys, size_t stride, uint32_t count, uint64_t *prefixes)
+{
+    const __m256i bswap64 = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                             7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    const __m256i offsets = _mm256_setr_epi64x(0, (long long)stride, 2 * (long long)stride, 3 * (long long)stride);
+    long long pk_word;
+    memcpy(&pk_word, pk, sizeof(pk_word));
+    const __m256i pk_words = _mm256_set1_epi64x(pk_word);
+
+    uint32_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        /* gather the first 8 bytes of 4 keys and xor them with ours, then make
+         * them big endian so they compare like the distance */
+        const __m256i words = _mm256_i64gather_epi64((const long long *)(const void *)(keys + i * stride), offsets, 1);
+        const __m256i distances = _mm256_shuffle_epi8(_mm256_xor_si256(words, pk_words), bswap64);
+        _mm256_storeu_si256((__m256i *)(prefixes + i), distances);
+    }
+
+    prefixes_scalar(pk, keys + i * stride, stride, count - i, prefixes + i);
+}
+
+static const Pk_Distance_Funcs pk_distance_avx2 = {
+    first_difference_avx2,
+    prefixes_avx2,
+};
+#endif
+
+/*** Dispatch */
+
+static bool pk_distance_impl_supported(Pk_Distance_Impl impl)
+{
+    switch (impl) {
+        case PK_DISTANCE_IMPL_SCALAR:
+            return true;
+
+        case PK_DISTANCE_IMPL_SSE2:
+#ifdef PK_DISTANCE_HAVE_SSE2
+            return true;
+#else
+            return false;
+#endif
+
+        case PK_DISTANCE_IMPL_AVX2:
+#ifdef PK_DISTANCE_HAVE_AVX2
+            return __builtin_cpu_supports("avx2");
+#else
+            return false;
+#endif
+    }
+
+    return false;
+}
+
+static const Pk_Distance_Funcs *pk_distance_funcs_for(Pk_Distance_Impl impl)
+{
+    switch (impl) {
+        case PK_DISTANCE_IMPL_SCALAR:
+            break;
+
+        case PK_DISTANCE_IMPL_SSE2:
+#ifdef PK_DISTANCE_HAVE_SSE2
+            return &pk_distance_sse2;
+#else
+            break;
+#endif
+
+        case PK_DISTANCE_IMPL_AVX2:
+#ifdef PK_DISTANCE_HAVE_AVX2
+            return &pk_distance_avx2;
+#else
+            break;
+#endif
+    }
+
+    return &pk_distance_scalar;
+}
+
+/* Chosen once, on first use, by pk_distance_init. Several Tox instances may
+ * start on different threads, so this goes through pthread_once. */
+static pthread_once_t pk_distance_once = PTHREAD_ONCE_INIT;
+static const Pk_Distance_Funcs *pk_distance_funcs = nullptr;
+static Pk_Distance_Impl pk_distance_impl = PK_DISTANCE_IMPL_SCALAR;
+
+static void use_impl(Pk_Distance_Impl impl)
+{
+    pk_distance_impl = impl;
+    pk_distance_funcs = pk_distance_funcs_for(impl);
+}
+
+static void pk_distance_init(void)
+{
+    if (pk_distance_impl_supported(PK_DISTANCE_IMPL_AVX2)) {
+        use_impl(PK_DISTANCE_IMPL_AVX2);
+    } else if (pk_distance_impl_supported(PK_DISTANCE_IMPL_SSE2)) {
+        use_impl(PK_DISTANCE_IMPL_SSE2);
+    } else {
+        use_impl(PK_DISTANCE_IMPL_SCALAR);
+    }
+}
+
+static const Pk_Distance_Funcs *get_funcs(void)
+{
+    pthread_once(&pk_distance_once, pk_distance_init);
+    return pk_distance_funcs;
+}
+
+Pk_Distance_Impl pk_distance_get_impl(void)
+{
+    pthread_once(&pk_distance_once, pk_distance_init);
+    return pk_distance_impl;
+}
+
+bool pk_distance_set_impl(Pk_Distance_Impl impl)
+{
+    if (!pk_distance_impl_supported(impl)) {
+        return false;
+    }
+
+    /* Run the default choice first so it can't later overwrite this one. */
+    pthread_once(&pk_distance_once, pk_distance_init);
+    use_impl(impl);
+    return true;
+}
+
+int pk_distance_cmp(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2)
+{
+    /* Most keys already differ in their first 64 bits, which are cheaper to
+     * compare directly than through the dispatch. */
+    const uint64_t prefix1 = pk_distance_prefix(pk, pk1);
+    const uint64_t prefix2 = pk_distance_prefix(pk, pk2);
+
+    if (prefix1 != prefix2) {
+        return prefix1 < prefix2 ? 1 : 2;
+    }
+
+    /* the distances are equal up to the first byte where pk1 and pk2 differ */
+    const uint32_t i = get_funcs()->first_difference(pk1, pk2);
+
+    if (i == CRYPTO_PUBLIC_KEY_SIZE) {
+        return 0;
+    }
+
+    const uint8_t distance1 = pk[i] ^ pk1[i];
+    const uint8_t distance2 = pk[i] ^ pk2[i];
+
+    return distance1 < distance2 ? 1 : 2;
+}
+
+uint32_t pk_common_prefix(const uint8_t *pk1, const uint8_t *pk2)
+{
+    const uint64_t prefix = pk_distance_prefix(pk1, pk2);
+
+    if (prefix != 0) {
+        return count_leading_zeros64(prefix);
+    }
+
+    const uint32_t i = get_funcs()->first_difference(pk1, pk2);
+
+    if (i == CRYPTO_PUBLIC_KEY_SIZE) {
+        return CRYPTO_PUBLIC_KEY_SIZE * 8;
+    }
+
+    return i * 8 + count_leading_zeros64((uint64_t)(pk1[i] ^ pk2[i]) << 56);
+}
+
+uint64_t pk_distance_prefix(const uint8_t *pk1, const uint8_t *pk2)
+{
+    return load_be64(pk1) ^ load_be64(pk2);
+}
+
+void pk_distance_prefixes(const uint8_t *pk, const uint8_t *keys, size_t stride, uint32_t count, uint64_t *prefixes)
+{
+    get_funcs()->prefixes(pk, keys, stride, count, prefixes);
+}
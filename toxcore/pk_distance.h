@@ -0,0 +1,86 @@
+/*
+ * XOR distance between public keys, as used by the DHT.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef C_TOXCORE_TOXCORE_PK_DISTANCE_H
+#define C_TOXCORE_TOXCORE_PK_DISTANCE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The implementations of the distance functions. The fastest one supported by
+ * the CPU is picked on first use.
+ */
+typedef enum Pk_Distance_Impl {
+    /* Portable C, comparing 64 bits at a time. */
+    PK_DISTANCE_IMPL_SCALAR,
+    /* SSE2, comparing 128 bits at a time. */
+    PK_DISTANCE_IMPL_SSE2,
+    /* AVX2, comparing whole keys at once and computing 4 distances per batch step. */
+    PK_DISTANCE_IMPL_AVX2,
+} Pk_Distance_Impl;
+
+/* Return the implementation currently in use. */
+Pk_Distance_Impl pk_distance_get_impl(void);
+
+/* Force the use of a specific implementation, for testing and benchmarking.
+ * Must not be called while other threads are using these functions.
+ *
+ * return true on success.
+ * return false if the implementation is not supported on this CPU or build.
+ */
+bool pk_distance_set_impl(Pk_Distance_Impl impl);
+
+/* Compares pk1 and pk2 with pk.
+ *
+ *  return 0 if both are same distance.
+ *  return 1 if pk1 is closer.
+ *  return 2 if pk2 is closer.
+ */
+int pk_distance_cmp(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2);
+
+/* Return the number of leading bits pk1 and pk2 have in common, which is the
+ * length of the key in bits if they are equal.
+ */
+uint32_t pk_common_prefix(const uint8_t *pk1, const uint8_t *pk2);
+
+/* Return the first 64 bits of the distance between pk1 and pk2 as a number:
+ * a smaller prefix means a smaller distance, an equal prefix needs
+ * pk_distance_cmp() to break the tie.
+ */
+uint64_t pk_distance_prefix(const uint8_t *pk1, const uint8_t *pk2);
+
+/* Compute pk_distance_prefix(pk, key) for count keys, the first one at keys and
+ * each following one stride bytes after the previous one. This allows passing
+ * the public_key member of an array of structs directly.
+ */
+void pk_distance_prefixes(const uint8_t *pk, const uint8_t *keys, size_t stride, uint32_t count, uint64_t *prefixes);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif // C_TOXCORE_TOXCORE_PK_DISTANCE_H
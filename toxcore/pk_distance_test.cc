@@ -0,0 +1,163 @@
+#include "pk_distance.h"
+
+#include <array>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "crypto_core.h"
+
+namespace {
+
+using Public_Key = std::array<uint8_t, CRYPTO_PUBLIC_KEY_SIZE>;
+
+constexpr Pk_Distance_Impl all_impls[] = {
+    PK_DISTANCE_IMPL_SCALAR,
+    PK_DISTANCE_IMPL_SSE2,
+    PK_DISTANCE_IMPL_AVX2,
+};
+
+// The byte at a time comparison pk_distance_cmp replaces.
+int reference_cmp(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2) {
+  for (size_t i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; ++i) {
+    const uint8_t distance1 = pk[i] ^ pk1[i];
+    const uint8_t distance2 = pk[i] ^ pk2[i];
+
+    if (distance1 < distance2) {
+      return 1;
+    }
+
+    if (distance1 > distance2) {
+      return 2;
+    }
+  }
+
+  return 0;
+}
+
+uint32_t reference_common_prefix(const uint8_t *pk1, const uint8_t *pk2) {
+  for (uint32_t i = 0; i < CRYPTO_PUBLIC_KEY_SIZE * 8; ++i) {
+    const uint8_t mask = 0x80 >> (i % 8);
+
+    if ((pk1[i / 8] & mask) != (pk2[i / 8] & mask)) {
+      return i;
+    }
+  }
+
+  return CRYPTO_PUBLIC_KEY_SIZE * 8;
+}
+
+Public_Key random_pk() {
+  Public_Key pk;
+  random_bytes(pk.data(), pk.size());
+  return pk;
+}
+
+// Copy the first prefix bits of base into a random key, so keys differ deep
+// into the key and not just in the first byte.
+Public_Key random_pk_near(const Public_Key &base, uint32_t prefix) {
+  Public_Key pk = random_pk();
+
+  for (uint32_t i = 0; i < prefix; ++i) {
+    const uint8_t mask = 0x80 >> (i % 8);
+    pk[i / 8] = (pk[i / 8] & ~mask) | (base[i / 8] & mask);
+  }
+
+  return pk;
+}
+
+class PkDistance : public ::testing::TestWithParam<Pk_Distance_Impl> {
+ protected:
+  void SetUp() override {
+    saved_impl_ = pk_distance_get_impl();
+
+    if (!pk_distance_set_impl(GetParam())) {
+      GTEST_SKIP() << "implementation not supported on this CPU";
+    }
+  }
+
+  void TearDown() override { pk_distance_set_impl(saved_impl_); }
+
+ private:
+  Pk_Distance_Impl saved_impl_;
+};
+
+TEST_P(PkDistance, ComparesLikeBytewiseComparison) {
+  for (uint32_t i = 0; i < 10000; ++i) {
+    const Public_Key pk = random_pk();
+    const Public_Key pk1 = random_pk_near(pk, i % 256);
+    const Public_Key pk2 = random_pk_near(pk1, (i * 7) % 257);
+
+    EXPECT_EQ(pk_distance_cmp(pk.data(), pk1.data(), pk2.data()),
+              reference_cmp(pk.data(), pk1.data(), pk2.data()));
+  }
+}
+
+TEST_P(PkDistance, EqualKeysAreTheSameDistance) {
+  const Public_Key pk = random_pk();
+  const Public_Key pk1 = random_pk();
+  EXPECT_EQ(pk_distance_cmp(pk.data(), pk1.data(), pk1.data()), 0);
+  EXPECT_EQ(pk_common_prefix(pk1.data(), pk1.data()), CRYPTO_PUBLIC_KEY_SIZE * 8);
+}
+
+TEST_P(PkDistance, CommonPrefixLikeBitwiseComparison) {
+  for (uint32_t i = 0; i < 10000; ++i) {
+    const Public_Key pk1 = random_pk();
+    const Public_Key pk2 = random_pk_near(pk1, i % 257);
+
+    EXPECT_EQ(pk_common_prefix(pk1.data(), pk2.data()),
+              reference_common_prefix(pk1.data(), pk2.data()));
+  }
+}
+
+struct Keyed_Entry {
+  uint8_t padding[3];
+  Public_Key public_key;
+};
+
+TEST_P(PkDistance, BatchPrefixesMatchSinglePrefix) {
+  const Public_Key pk = random_pk();
+
+  for (uint32_t count = 0; count < 19; ++count) {
+    std::vector<Keyed_Entry> entries(count);
+
+    for (Keyed_Entry &entry : entries) {
+      entry.public_key = random_pk_near(pk, count * 3);
+    }
+
+    std::vector<uint64_t> prefixes(count);
+    pk_distance_prefixes(pk.data(), count ? entries[0].public_key.data() : nullptr, sizeof(Keyed_Entry), count,
+                         prefixes.data());
+
+    for (uint32_t i = 0; i < count; ++i) {
+      EXPECT_EQ(prefixes[i], pk_distance_prefix(pk.data(), entries[i].public_key.data()));
+    }
+  }
+}
+
+TEST_P(PkDistance, SmallerPrefixMeansCloser) {
+  for (uint32_t i = 0; i < 10000; ++i) {
+    const Public_Key pk = random_pk();
+    const Public_Key pk1 = random_pk_near(pk, i % 64);
+    const Public_Key pk2 = random_pk_near(pk, (i * 3) % 64);
+    const uint64_t prefix1 = pk_distance_prefix(pk.data(), pk1.data());
+    const uint64_t prefix2 = pk_distance_prefix(pk.data(), pk2.data());
+
+    if (prefix1 < prefix2) {
+      EXPECT_EQ(reference_cmp(pk.data(), pk1.data(), pk2.data()), 1);
+    } else if (prefix1 > prefix2) {
+      EXPECT_EQ(reference_cmp(pk.data(), pk1.data(), pk2.data()), 2);
+    }
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(AllImpls, PkDistance, ::testing::ValuesIn(all_impls));
+
+TEST(PkDistance, ScalarIsAlwaysSupported) {
+  const Pk_Distance_Impl saved_impl = pk_distance_get_impl();
+  EXPECT_TRUE(pk_distance_set_impl(PK_DISTANCE_IMPL_SCALAR));
+  EXPECT_EQ(pk_distance_get_impl(), PK_DISTANCE_IMPL_SCALAR);
+  pk_distance_set_impl(saved_impl);
+}
+
+}  // namespace
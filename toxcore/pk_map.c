@@ -0,0 +1,188 @@
+/*
+ * Hash map from public keys to 32 bit values.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "pk_map.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ccompat.h"
+#include "crypto_core.h"
+
+/* The map never has fewer slots than this. */
+#define PK_MAP_MIN_SLOTS 16
+
+typedef struct PK_Map_Slot {
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint32_t value;
+    bool used;
+} PK_Map_Slot;
+
+/* Open addressing with linear probing. The map is kept at most half full, so
+ * probe sequences stay short. */
+struct PK_Map {
+    PK_Map_Slot *slots;
+    uint32_t num_slots;
+    uint32_t count;
+    /* Random per map, so peers can't pick keys that all land in one slot. */
+    uint64_t hash_seed[2];
+};
+
+static uint32_t home_slot(const PK_Map *map, const uint8_t *public_key)
+{
+    return (uint32_t)(pk_hash(map->hash_seed, public_key) >> 32) & (map->num_slots - 1);
+}
+
+/* return the slot holding public_key, or the empty slot where it would go. */
+static uint32_t find_slot(const PK_Map *map, const uint8_t *public_key)
+{
+    uint32_t i = home_slot(map, public_key);
+
+    while (map->slots[i].used && public_key_cmp(map->slots[i].public_key, public_key) != 0) {
+        i = (i + 1) & (map->num_slots - 1);
+    }
+
+    return i;
+}
+
+static bool resize(PK_Map *map, uint32_t num_slots)
+{
+    PK_Map_Slot *slots = (PK_Map_Slot *)calloc(num_slots, sizeof(PK_Map_Slot));
+
+    if (slots == nullptr) {
+        return false;
+    }
+
+    PK_Map_Slot *const old_slots = map->slots;
+    const uint32_t old_num_slots = map->num_slots;
+    map->slots = slots;
+    map->num_slots = num_slots;
+
+    for (uint32_t i = 0; i < old_num_slots; ++i) {
+        if (old_slots[i].used) {
+            map->slots[find_slot(map, old_slots[i].public_key)] = old_slots[i];
+        }
+    }
+
+    free(old_slots);
+    return true;
+}
+
+PK_Map *pk_map_new(void)
+{
+    PK_Map *map = (PK_Map *)calloc(1, sizeof(PK_Map));
+
+    if (map == nullptr) {
+        return nullptr;
+    }
+
+    map->hash_seed[0] = random_u64();
+    map->hash_seed[1] = random_u64();
+
+    if (!resize(map, PK_MAP_MIN_SLOTS)) {
+        free(map);
+        return nullptr;
+    }
+
+    return map;
+}
+
+void pk_map_kill(PK_Map *map)
+{
+    if (map == nullptr) {
+        return;
+    }
+
+    free(map->slots);
+    free(map);
+}
+
+bool pk_map_add(PK_Map *map, const uint8_t *public_key, uint32_t value)
+{
+    if ((map->count + 1) * 2 > map->num_slots && !resize(map, map->num_slots * 2)) {
+        return false;
+    }
+
+    const uint32_t i = find_slot(map, public_key);
+
+    if (map->slots[i].used) {
+        return false;
+    }
+
+    memcpy(map->slots[i].public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    map->slots[i].value = value;
+    map->slots[i].used = true;
+    ++map->count;
+    return true;
+}
+
+bool pk_map_find(const PK_Map *map, const uint8_t *public_key, uint32_t *value)
+{
+    const uint32_t i = find_slot(map, public_key);
+
+    if (!map->slots[i].used) {
+        return false;
+    }
+
+    *value = map->slots[i].value;
+    return true;
+}
+
+bool pk_map_remove(PK_Map *map, const uint8_t *public_key)
+{
+    const uint32_t mask = map->num_slots - 1;
+    uint32_t i = find_slot(map, public_key);
+
+    if (!map->slots[i].used) {
+        return false;
+    }
+
+    /* Move later keys of the same probe sequence back into the hole, so
+     * lookups never have to skip over removed keys. */
+    for (uint32_t j = (i + 1) & mask; map->slots[j].used; j = (j + 1) & mask) {
+        const uint32_t home = home_slot(map, map->slots[j].public_key);
+
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            map->slots[i] = map->slots[j];
+            i = j;
+        }
+    }
+
+    map->slots[i].used = false;
+    --map->count;
+
+    if (map->num_slots > PK_MAP_MIN_SLOTS && map->count * 8 < map->num_slots) {
+        /* Failing to shrink only wastes memory. */
+        resize(map, map->num_slots / 2);
+    }
+
+    return true;
+}
+
+uint32_t pk_map_count(const PK_Map *map)
+{
+    return map->count;
+}
@@ -0,0 +1,82 @@
+/*
+ * Hash map from public keys to 32 bit values.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef C_TOXCORE_TOXCORE_PK_MAP_H
+#define C_TOXCORE_TOXCORE_PK_MAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef PK_MAP_DEFINED
+#define PK_MAP_DEFINED
+typedef struct PK_Map PK_Map;
+#endif /* PK_MAP_DEFINED */
+
+/**
+ * Create an empty map. It grows as keys are added and shrinks as they are
+ * removed, so adding and removing a key takes constant time on average no
+ * matter how many keys there are.
+ *
+ * @return nullptr on allocation failure.
+ */
+PK_Map *pk_map_new(void);
+
+/**
+ * Free the map.
+ */
+void pk_map_kill(PK_Map *map);
+
+/**
+ * Map public_key to value.
+ *
+ * @return false if the key is already in the map or on allocation failure.
+ */
+bool pk_map_add(PK_Map *map, const uint8_t *public_key, uint32_t value);
+
+/**
+ * Copy the value public_key maps to into value.
+ *
+ * @return false if the key is not in the map.
+ */
+bool pk_map_find(const PK_Map *map, const uint8_t *public_key, uint32_t *value);
+
+/**
+ * Remove public_key from the map.
+ *
+ * @return false if the key is not in the map.
+ */
+bool pk_map_remove(PK_Map *map, const uint8_t *public_key);
+
+/**
+ * @return the number of keys in the map.
+ */
+uint32_t pk_map_count(const PK_Map *map);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif // C_TOXCORE_TOXCORE_PK_MAP_H
@@ -0,0 +1,116 @@
+#include "pk_map.h"
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "crypto_core.h"
+
+namespace {
+
+struct PK_Map_Deleter {
+  void operator()(PK_Map *map) { pk_map_kill(map); }
+};
+
+using PK_Map_Ptr = std::unique_ptr<PK_Map, PK_Map_Deleter>;
+using Public_Key = std::array<uint8_t, CRYPTO_PUBLIC_KEY_SIZE>;
+
+Public_Key random_pk() {
+  Public_Key pk;
+  random_bytes(pk.data(), pk.size());
+  return pk;
+}
+
+TEST(PK_Map, FindsWhatWasAdded) {
+  PK_Map_Ptr map(pk_map_new());
+  ASSERT_NE(map, nullptr);
+
+  const Public_Key pk1 = random_pk();
+  const Public_Key pk2 = random_pk();
+  uint32_t value;
+
+  EXPECT_FALSE(pk_map_find(map.get(), pk1.data(), &value));
+  ASSERT_TRUE(pk_map_add(map.get(), pk1.data(), 1));
+  ASSERT_TRUE(pk_map_add(map.get(), pk2.data(), 2));
+  EXPECT_EQ(pk_map_count(map.get()), 2u);
+
+  ASSERT_TRUE(pk_map_find(map.get(), pk1.data(), &value));
+  EXPECT_EQ(value, 1u);
+  ASSERT_TRUE(pk_map_find(map.get(), pk2.data(), &value));
+  EXPECT_EQ(value, 2u);
+}
+
+TEST(PK_Map, RejectsKeysThatAreAlreadyThere) {
+  PK_Map_Ptr map(pk_map_new());
+  const Public_Key pk = random_pk();
+  uint32_t value;
+
+  ASSERT_TRUE(pk_map_add(map.get(), pk.data(), 1));
+  EXPECT_FALSE(pk_map_add(map.get(), pk.data(), 2));
+  ASSERT_TRUE(pk_map_find(map.get(), pk.data(), &value));
+  EXPECT_EQ(value, 1u);
+  EXPECT_EQ(pk_map_count(map.get()), 1u);
+}
+
+TEST(PK_Map, RemovedKeysAreGone) {
+  PK_Map_Ptr map(pk_map_new());
+  const Public_Key pk = random_pk();
+  uint32_t value;
+
+  EXPECT_FALSE(pk_map_remove(map.get(), pk.data()));
+  ASSERT_TRUE(pk_map_add(map.get(), pk.data(), 1));
+  EXPECT_TRUE(pk_map_remove(map.get(), pk.data()));
+  EXPECT_FALSE(pk_map_find(map.get(), pk.data(), &value));
+  EXPECT_EQ(pk_map_count(map.get()), 0u);
+
+  // Can be added again.
+  EXPECT_TRUE(pk_map_add(map.get(), pk.data(), 2));
+}
+
+/**
+ * Add and remove many keys in random order, growing and shrinking the map,
+ * and check that it always agrees with std::map.
+ */
+TEST(PK_Map, MatchesStdMapUnderChurn) {
+  PK_Map_Ptr map(pk_map_new());
+  std::map<Public_Key, uint32_t> expected;
+  std::vector<Public_Key> keys;
+
+  for (uint32_t round = 0; round < 20000; ++round) {
+    if (keys.empty() || random_u32() % 3 != 0 || round < 5000) {
+      const Public_Key pk = random_pk();
+      ASSERT_TRUE(pk_map_add(map.get(), pk.data(), round));
+      expected[pk] = round;
+      keys.push_back(pk);
+    } else {
+      const uint32_t i = random_u32() % keys.size();
+      ASSERT_TRUE(pk_map_remove(map.get(), keys[i].data()));
+      expected.erase(keys[i]);
+      keys[i] = keys.back();
+      keys.pop_back();
+    }
+
+    if (round == 15000) {
+      // Remove almost everything to make the map shrink.
+      while (keys.size() > 10) {
+        ASSERT_TRUE(pk_map_remove(map.get(), keys.back().data()));
+        expected.erase(keys.back());
+        keys.pop_back();
+      }
+    }
+  }
+
+  ASSERT_EQ(pk_map_count(map.get()), expected.size());
+
+  for (const auto &entry : expected) {
+    uint32_t value;
+    ASSERT_TRUE(pk_map_find(map.get(), entry.first.data(), &value));
+    EXPECT_EQ(value, entry.second);
+  }
+}
+
+}  // namespace
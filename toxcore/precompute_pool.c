@@ -0,0 +1,379 @@
+/*
+ * Worker threads computing shared keys away from the main loop.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "precompute_pool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "ccompat.h"
+#include "crypto_core.h"
+
+typedef struct Precompute_Job {
+    struct Precompute_Job *next;
+
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+
+    precompute_done_cb *callback;
+    void *object;
+
+    /* Stored right after the job. */
+    uint8_t *context;
+    uint16_t context_size;
+} Precompute_Job;
+
+typedef struct Precompute_Queue {
+    Precompute_Job *head;
+    Precompute_Job *tail;
+} Precompute_Queue;
+
+struct Precompute_Pool {
+    pthread_t *threads;
+    uint32_t num_threads;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool stopping;
+
+    /* Protected by mutex. */
+    Precompute_Queue todo;
+    Precompute_Queue done;
+    uint32_t num_jobs;
+
+    /* Written to by the threads when a job is done, read end is returned by
+     * precompute_pool_fd(). */
+    int wake_fds[2];
+};
+
+static void queue_push(Precompute_Queue *queue, Precompute_Job *job)
+{
+    job->next = nullptr;
+
+    if (queue->tail != nullptr) {
+        queue->tail->next = job;
+    } else {
+        queue->head = job;
+    }
+
+    queue->tail = job;
+}
+
+static Precompute_Job *queue_pop(Precompute_Queue *queue)
+{
+    Precompute_Job *const job = queue->head;
+
+    if (job != nullptr) {
+        queue->head = job->next;
+
+        if (queue->head == nullptr) {
+            queue->tail = nullptr;
+        }
+    }
+
+    return job;
+}
+
+static void job_free(Precompute_Job *job)
+{
+    crypto_memzero(job->secret_key, sizeof(job->secret_key));
+    crypto_memzero(job->shared_key, sizeof(job->shared_key));
+    free(job);
+}
+
+static void queue_free(Precompute_Queue *queue)
+{
+    Precompute_Job *job;
+
+    while ((job = queue_pop(queue)) != nullptr) {
+        job_free(job);
+    }
+}
+
+static void wake_main_loop(const Precompute_Pool *pool)
+{
+#ifndef _WIN32
+
+    if (pool->wake_fds[1] != -1) {
+        const uint8_t byte = 0;
+        /* If the pipe is full the main loop has a wakeup pending anyway. */
+        const ssize_t ret = write(pool->wake_fds[1], &byte, 1);
+        (void)ret;
+    }
+
+#endif
+}
+
+static void drain_wakeups(const Precompute_Pool *pool)
+{
+#ifndef _WIN32
+
+    if (pool->wake_fds[0] != -1) {
+        uint8_t buf[64];
+
+        while (read(pool->wake_fds[0], buf, sizeof(buf)) > 0) {
+            continue;
+        }
+    }
+
+#endif
+}
+
+static void *precompute_thread(void *arg)
+{
+    Precompute_Pool *const pool = (Precompute_Pool *)arg;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    while (true) {
+        while (!pool->stopping && pool->todo.head == nullptr) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        }
+
+        if (pool->stopping) {
+            break;
+        }
+
+        Precompute_Job *const job = queue_pop(&pool->todo);
+        pthread_mutex_unlock(&pool->mutex);
+
+        encrypt_precompute(job->public_key, job->secret_key, job->shared_key);
+        crypto_memzero(job->secret_key, sizeof(job->secret_key));
+
+        pthread_mutex_lock(&pool->mutex);
+        queue_push(&pool->done, job);
+        wake_main_loop(pool);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+    return nullptr;
+}
+
+static bool open_wake_fds(Precompute_Pool *pool)
+{
+    pool->wake_fds[0] = -1;
+    pool->wake_fds[1] = -1;
+
+#ifndef _WIN32
+
+    if (pipe(pool->wake_fds) != 0) {
+        pool->wake_fds[0] = -1;
+        pool->wake_fds[1] = -1;
+        return false;
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        if (fcntl(pool->wake_fds[i], F_SETFL, O_NONBLOCK) != 0
+                || fcntl(pool->wake_fds[i], F_SETFD, FD_CLOEXEC) != 0) {
+            return false;
+        }
+    }
+
+#endif
+
+    return true;
+}
+
+static void close_wake_fds(const Precompute_Pool *pool)
+{
+#ifndef _WIN32
+
+    for (int i = 0; i < 2; ++i) {
+        if (pool->wake_fds[i] != -1) {
+            close(pool->wake_fds[i]);
+        }
+    }
+
+#endif
+}
+
+Precompute_Pool *precompute_pool_new(uint32_t num_threads)
+{
+    if (num_threads == 0 || num_threads > PRECOMPUTE_POOL_MAX_THREADS) {
+        return nullptr;
+    }
+
+    Precompute_Pool *const pool = (Precompute_Pool *)calloc(1, sizeof(Precompute_Pool));
+
+    if (pool == nullptr) {
+        return nullptr;
+    }
+
+    pool->threads = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
+
+    if (pool->threads == nullptr) {
+        free(pool);
+        return nullptr;
+    }
+
+    if (pthread_mutex_init(&pool->mutex, nullptr) != 0) {
+        free(pool->threads);
+        free(pool);
+        return nullptr;
+    }
+
+    if (pthread_cond_init(&pool->cond, nullptr) != 0) {
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool->threads);
+        free(pool);
+        return nullptr;
+    }
+
+    if (!open_wake_fds(pool)) {
+        precompute_pool_kill(pool);
+        return nullptr;
+    }
+
+    for (uint32_t i = 0; i < num_threads; ++i) {
+        if (pthread_create(&pool->threads[i], nullptr, &precompute_thread, pool) != 0) {
+            precompute_pool_kill(pool);
+            return nullptr;
+        }
+
+        ++pool->num_threads;
+    }
+
+    return pool;
+}
+
+void precompute_pool_kill(Precompute_Pool *pool)
+{
+    if (pool == nullptr) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (uint32_t i = 0; i < pool->num_threads; ++i) {
+        pthread_join(pool->threads[i], nullptr);
+    }
+
+    queue_free(&pool->todo);
+    queue_free(&pool->done);
+    close_wake_fds(pool);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->threads);
+    free(pool);
+}
+
+bool precompute_pool_submit(Precompute_Pool *pool, const uint8_t *secret_key, const uint8_t *public_key,
+                            precompute_done_cb *callback, void *object, const uint8_t *context, uint16_t context_size)
+{
+    if (context_size > PRECOMPUTE_POOL_MAX_CONTEXT_SIZE) {
+        return false;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    const bool full = pool->num_jobs >= PRECOMPUTE_POOL_MAX_JOBS;
+
+    if (!full) {
+        ++pool->num_jobs;
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (full) {
+        return false;
+    }
+
+    Precompute_Job *const job = (Precompute_Job *)malloc(sizeof(Precompute_Job) + context_size);
+
+    if (job == nullptr) {
+        pthread_mutex_lock(&pool->mutex);
+        --pool->num_jobs;
+        pthread_mutex_unlock(&pool->mutex);
+        return false;
+    }
+
+    memcpy(job->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(job->secret_key, secret_key, CRYPTO_SECRET_KEY_SIZE);
+    job->callback = callback;
+    job->object = object;
+    job->context = (uint8_t *)(job + 1);
+    job->context_size = context_size;
+
+    if (context_size > 0) {
+        memcpy(job->context, context, context_size);
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    queue_push(&pool->todo, job);
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    return true;
+}
+
+uint32_t precompute_pool_run(Precompute_Pool *pool, void *userdata)
+{
+    drain_wakeups(pool);
+
+    pthread_mutex_lock(&pool->mutex);
+    Precompute_Queue done = pool->done;
+    pool->done.head = nullptr;
+    pool->done.tail = nullptr;
+    pthread_mutex_unlock(&pool->mutex);
+
+    uint32_t count = 0;
+    Precompute_Job *job;
+
+    while ((job = queue_pop(&done)) != nullptr) {
+        job->callback(job->object, job->public_key, job->shared_key, job->context, job->context_size, userdata);
+        job_free(job);
+        ++count;
+    }
+
+    if (count > 0) {
+        pthread_mutex_lock(&pool->mutex);
+        pool->num_jobs -= count;
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    return count;
+}
+
+int precompute_pool_fd(const Precompute_Pool *pool)
+{
+    return pool->wake_fds[0];
+}
+
+uint32_t precompute_pool_pending(Precompute_Pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    const uint32_t num_jobs = pool->num_jobs;
+    pthread_mutex_unlock(&pool->mutex);
+    return num_jobs;
+}
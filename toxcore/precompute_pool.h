@@ -0,0 +1,103 @@
+/*
+ * Worker threads computing shared keys away from the main loop.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef C_TOXCORE_TOXCORE_PRECOMPUTE_POOL_H
+#define C_TOXCORE_TOXCORE_PRECOMPUTE_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Maximum number of threads in a pool. */
+#define PRECOMPUTE_POOL_MAX_THREADS 64
+
+/* Maximum number of jobs queued or waiting for precompute_pool_run() at once.
+ * Further jobs are refused, so a flood of new keys can't use unbounded memory.
+ */
+#define PRECOMPUTE_POOL_MAX_JOBS 4096
+
+/* Maximum size of the context passed along with a job. */
+#define PRECOMPUTE_POOL_MAX_CONTEXT_SIZE 4096
+
+#ifndef PRECOMPUTE_POOL_DEFINED
+#define PRECOMPUTE_POOL_DEFINED
+typedef struct Precompute_Pool Precompute_Pool;
+#endif /* PRECOMPUTE_POOL_DEFINED */
+
+/* Called from precompute_pool_run() once the shared key for public_key is
+ * computed. context is the copy of the context given to precompute_pool_submit().
+ */
+typedef void precompute_done_cb(void *object, const uint8_t *public_key, const uint8_t *shared_key,
+                                const uint8_t *context, uint16_t context_size, void *userdata);
+
+/**
+ * Start a pool of num_threads threads.
+ *
+ * @return nullptr on failure or if num_threads is 0 or larger than PRECOMPUTE_POOL_MAX_THREADS.
+ */
+Precompute_Pool *precompute_pool_new(uint32_t num_threads);
+
+/**
+ * Stop the threads and free the pool. Jobs not yet passed to their callback
+ * are dropped, so this must be called before the objects they were submitted
+ * for are freed.
+ */
+void precompute_pool_kill(Precompute_Pool *pool);
+
+/**
+ * Queue the computation of the shared key between secret_key and public_key.
+ * The keys and context_size bytes of context are copied.
+ *
+ * @return true on success, false if the queue is full or on allocation failure.
+ */
+bool precompute_pool_submit(Precompute_Pool *pool, const uint8_t *secret_key, const uint8_t *public_key,
+                            precompute_done_cb *callback, void *object, const uint8_t *context, uint16_t context_size);
+
+/**
+ * Call the callbacks of all finished jobs, in the calling thread, passing them
+ * userdata.
+ *
+ * @return the number of callbacks called.
+ */
+uint32_t precompute_pool_run(Precompute_Pool *pool, void *userdata);
+
+/**
+ * Return a file descriptor that becomes readable when a job finishes, so an
+ * event loop can wake up to call precompute_pool_run(), or -1 if this platform
+ * doesn't have one.
+ */
+int precompute_pool_fd(const Precompute_Pool *pool);
+
+/**
+ * Return the number of jobs submitted and not yet passed to their callback.
+ */
+uint32_t precompute_pool_pending(Precompute_Pool *pool);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif // C_TOXCORE_TOXCORE_PRECOMPUTE_POOL_H
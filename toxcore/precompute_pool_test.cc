@@ -0,0 +1,150 @@
+#include "precompute_pool.h"
+
+#include <poll.h>
+
+#include <array>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "crypto_core.h"
+
+namespace {
+
+using Public_Key = std::array<uint8_t, CRYPTO_PUBLIC_KEY_SIZE>;
+using Shared_Key = std::array<uint8_t, CRYPTO_SHARED_KEY_SIZE>;
+
+struct Result {
+  Public_Key public_key;
+  Shared_Key shared_key;
+  uint32_t context;
+  void *userdata;
+};
+
+void record_result(void *object, const uint8_t *public_key, const uint8_t *shared_key,
+                   const uint8_t *context, uint16_t context_size, void *userdata) {
+  auto *results = static_cast<std::vector<Result> *>(object);
+  Result result;
+  std::copy(public_key, public_key + CRYPTO_PUBLIC_KEY_SIZE, result.public_key.begin());
+  std::copy(shared_key, shared_key + CRYPTO_SHARED_KEY_SIZE, result.shared_key.begin());
+  ASSERT_EQ(context_size, sizeof(result.context));
+  memcpy(&result.context, context, sizeof(result.context));
+  result.userdata = userdata;
+  results->push_back(result);
+}
+
+// Run the pool until count callbacks were called or a few seconds passed.
+void run_until(Precompute_Pool *pool, std::vector<Result> *results, size_t count, void *userdata) {
+  for (int i = 0; i < 5000 && results->size() < count; ++i) {
+    precompute_pool_run(pool, userdata);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+TEST(PrecomputePool, RejectsInvalidThreadCounts) {
+  EXPECT_EQ(precompute_pool_new(0), nullptr);
+  EXPECT_EQ(precompute_pool_new(PRECOMPUTE_POOL_MAX_THREADS + 1), nullptr);
+}
+
+TEST(PrecomputePool, ComputesSameKeysAsEncryptPrecompute) {
+  Precompute_Pool *pool = precompute_pool_new(4);
+  ASSERT_NE(pool, nullptr);
+
+  uint8_t self_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+  uint8_t self_secret_key[CRYPTO_SECRET_KEY_SIZE];
+  crypto_new_keypair(self_public_key, self_secret_key);
+
+  std::vector<Public_Key> keys(100);
+  std::vector<Result> results;
+  int userdata;
+
+  for (uint32_t i = 0; i < keys.size(); ++i) {
+    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(keys[i].data(), secret_key);
+    ASSERT_TRUE(precompute_pool_submit(pool, self_secret_key, keys[i].data(), &record_result, &results,
+                                       reinterpret_cast<const uint8_t *>(&i), sizeof(i)));
+  }
+
+  run_until(pool, &results, keys.size(), &userdata);
+  ASSERT_EQ(results.size(), keys.size());
+  EXPECT_EQ(precompute_pool_pending(pool), 0);
+
+  std::vector<bool> seen(keys.size());
+
+  for (const Result &result : results) {
+    ASSERT_LT(result.context, keys.size());
+    EXPECT_FALSE(seen[result.context]);
+    seen[result.context] = true;
+
+    EXPECT_EQ(result.public_key, keys[result.context]);
+    EXPECT_EQ(result.userdata, &userdata);
+
+    Shared_Key expected;
+    encrypt_precompute(keys[result.context].data(), self_secret_key, expected.data());
+    EXPECT_EQ(result.shared_key, expected);
+  }
+
+  precompute_pool_kill(pool);
+}
+
+TEST(PrecomputePool, FdBecomesReadableWhenJobIsDone) {
+  Precompute_Pool *pool = precompute_pool_new(1);
+  ASSERT_NE(pool, nullptr);
+
+  const int fd = precompute_pool_fd(pool);
+
+  if (fd == -1) {
+    precompute_pool_kill(pool);
+    GTEST_SKIP() << "no wakeup descriptor on this platform";
+  }
+
+  uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+  uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+  crypto_new_keypair(public_key, secret_key);
+
+  std::vector<Result> results;
+  const uint32_t context = 0;
+  ASSERT_TRUE(precompute_pool_submit(pool, secret_key, public_key, &record_result, &results,
+                                     reinterpret_cast<const uint8_t *>(&context), sizeof(context)));
+
+  pollfd pfd = {fd, POLLIN, 0};
+  ASSERT_EQ(poll(&pfd, 1, 5000), 1);
+
+  EXPECT_EQ(precompute_pool_run(pool, nullptr), 1);
+  EXPECT_EQ(results.size(), 1);
+
+  // Running the pool consumes the wakeup.
+  EXPECT_EQ(poll(&pfd, 1, 0), 0);
+
+  precompute_pool_kill(pool);
+}
+
+TEST(PrecomputePool, RefusesJobsWhenFull) {
+  Precompute_Pool *pool = precompute_pool_new(2);
+  ASSERT_NE(pool, nullptr);
+
+  uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+  uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+  crypto_new_keypair(public_key, secret_key);
+
+  std::vector<Result> results;
+  const uint32_t context = 0;
+
+  // Jobs count until their callback is called, so without running the pool
+  // it fills up.
+  for (uint32_t i = 0; i < PRECOMPUTE_POOL_MAX_JOBS; ++i) {
+    ASSERT_TRUE(precompute_pool_submit(pool, secret_key, public_key, &record_result, &results,
+                                       reinterpret_cast<const uint8_t *>(&context), sizeof(context)));
+  }
+
+  EXPECT_FALSE(precompute_pool_submit(pool, secret_key, public_key, &record_result, &results,
+                                      reinterpret_cast<const uint8_t *>(&context), sizeof(context)));
+
+  // Killing the pool drops the remaining jobs without calling back.
+  precompute_pool_kill(pool);
+  EXPECT_TRUE(results.empty());
+}
+
+}  // namespace
@@ -0,0 +1,330 @@
+/*
+ * Cache of precomputed shared keys, so the expensive key exchange only has to
+ * be done once for each peer we talk to.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "shared_key_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ccompat.h"
+#include "crypto_core.h"
+
+#define NO_ENTRY UINT32_MAX
+
+typedef struct Shared_Key_Entry {
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    /* Next entry in the same hash bucket. */
+    uint32_t hash_next;
+    /* Neighbours in the list of entries ordered by last use. */
+    uint32_t lru_prev;
+    uint32_t lru_next;
+} Shared_Key_Entry;
+
+/* The entries and hash table, replaced as a whole when resizing. */
+typedef struct Shared_Key_Table {
+    Shared_Key_Entry *entries;
+    uint32_t capacity;
+    uint32_t count;
+
+    uint32_t *buckets;
+    uint32_t bucket_bits;
+
+    /* Most and least recently used entries. */
+    uint32_t lru_head;
+    uint32_t lru_tail;
+} Shared_Key_Table;
+
+struct Shared_Key_Cache {
+    Shared_Key_Table table;
+    /* Random per cache, so peers can't pick keys that all land in one bucket. */
+    uint64_t hash_seed[2];
+    Shared_Key_Cache_Stats stats;
+};
+
+static uint32_t bucket_of(const Shared_Key_Cache *cache, const Shared_Key_Table *table, const uint8_t *public_key)
+{
+    if (table->bucket_bits == 0) {
+        return 0;
+    }
+
+    return (uint32_t)(pk_hash(cache->hash_seed, public_key) >> (64 - table->bucket_bits));
+}
+
+static bool table_init(Shared_Key_Table *table, uint32_t capacity)
+{
+    uint32_t bucket_bits = 0;
+
+    while ((UINT32_C(1) << bucket_bits) < capacity) {
+        ++bucket_bits;
+    }
+
+    Shared_Key_Entry *entries = (Shared_Key_Entry *)calloc(capacity, sizeof(Shared_Key_Entry));
+    uint32_t *buckets = (uint32_t *)malloc((size_t)(UINT32_C(1) << bucket_bits) * sizeof(uint32_t));
+
+    if (entries == nullptr || buckets == nullptr) {
+        free(entries);
+        free(buckets);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < (UINT32_C(1) << bucket_bits); ++i) {
+        buckets[i] = NO_ENTRY;
+    }
+
+    table->entries = entries;
+    table->capacity = capacity;
+    table->count = 0;
+    table->buckets = buckets;
+    table->bucket_bits = bucket_bits;
+    table->lru_head = NO_ENTRY;
+    table->lru_tail = NO_ENTRY;
+    return true;
+}
+
+static void table_free(Shared_Key_Table *table)
+{
+    crypto_memzero(table->entries, (size_t)table->capacity * sizeof(Shared_Key_Entry));
+    free(table->entries);
+    free(table->buckets);
+}
+
+static void lru_unlink(Shared_Key_Table *table, uint32_t index)
+{
+    Shared_Key_Entry *const entry = &table->entries[index];
+
+    if (entry->lru_prev != NO_ENTRY) {
+        table->entries[entry->lru_prev].lru_next = entry->lru_next;
+    } else {
+        table->lru_head = entry->lru_next;
+    }
+
+    if (entry->lru_next != NO_ENTRY) {
+        table->entries[entry->lru_next].lru_prev = entry->lru_prev;
+    } else {
+        table->lru_tail = entry->lru_prev;
+    }
+}
+
+static void lru_push_front(Shared_Key_Table *table, uint32_t index)
+{
+    Shared_Key_Entry *const entry = &table->entries[index];
+    entry->lru_prev = NO_ENTRY;
+    entry->lru_next = table->lru_head;
+
+    if (table->lru_head != NO_ENTRY) {
+        table->entries[table->lru_head].lru_prev = index;
+    } else {
+        table->lru_tail = index;
+    }
+
+    table->lru_head = index;
+}
+
+static void hash_unlink(const Shared_Key_Cache *cache, Shared_Key_Table *table, uint32_t index)
+{
+    uint32_t *link = &table->buckets[bucket_of(cache, table, table->entries[index].public_key)];
+
+    while (*link != index) {
+        link = &table->entries[*link].hash_next;
+    }
+
+    *link = table->entries[index].hash_next;
+}
+
+static uint32_t table_find(const Shared_Key_Cache *cache, const Shared_Key_Table *table, const uint8_t *public_key)
+{
+    uint32_t index = table->buckets[bucket_of(cache, table, public_key)];
+
+    while (index != NO_ENTRY && public_key_cmp(table->entries[index].public_key, public_key) != 0) {
+        index = table->entries[index].hash_next;
+    }
+
+    return index;
+}
+
+/* Add a key that isn't in the table yet as the most recently used one.
+ *
+ * return true if the least recently used key was evicted to make room.
+ */
+static bool table_insert(const Shared_Key_Cache *cache, Shared_Key_Table *table, const uint8_t *public_key,
+                         const uint8_t *shared_key)
+{
+    uint32_t index;
+    bool evicted = false;
+
+    if (table->count < table->capacity) {
+        index = table->count;
+        ++table->count;
+    } else {
+        index = table->lru_tail;
+        hash_unlink(cache, table, index);
+        lru_unlink(table, index);
+        evicted = true;
+    }
+
+    Shared_Key_Entry *const entry = &table->entries[index];
+    memcpy(entry->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(entry->shared_key, shared_key, CRYPTO_SHARED_KEY_SIZE);
+
+    const uint32_t bucket = bucket_of(cache, table, public_key);
+    entry->hash_next = table->buckets[bucket];
+    table->buckets[bucket] = index;
+
+    lru_push_front(table, index);
+    return evicted;
+}
+
+Shared_Key_Cache *shared_key_cache_new(uint32_t size)
+{
+    if (size == 0 || size > SHARED_KEY_CACHE_MAX_SIZE) {
+        return nullptr;
+    }
+
+    Shared_Key_Cache *cache = (Shared_Key_Cache *)calloc(1, sizeof(Shared_Key_Cache));
+
+    if (cache == nullptr) {
+        return nullptr;
+    }
+
+    if (!table_init(&cache->table, size)) {
+        free(cache);
+        return nullptr;
+    }
+
+    cache->hash_seed[0] = random_u64();
+    cache->hash_seed[1] = random_u64();
+    return cache;
+}
+
+void shared_key_cache_kill(Shared_Key_Cache *cache)
+{
+    if (cache == nullptr) {
+        return;
+    }
+
+    table_free(&cache->table);
+    free(cache);
+}
+
+static void mark_used(Shared_Key_Table *table, uint32_t index)
+{
+    if (table->lru_head != index) {
+        lru_unlink(table, index);
+        lru_push_front(table, index);
+    }
+}
+
+bool shared_key_cache_get(Shared_Key_Cache *cache, uint8_t *shared_key, const uint8_t *public_key)
+{
+    Shared_Key_Table *const table = &cache->table;
+    const uint32_t index = table_find(cache, table, public_key);
+
+    if (index == NO_ENTRY) {
+        ++cache->stats.misses;
+        return false;
+    }
+
+    memcpy(shared_key, table->entries[index].shared_key, CRYPTO_SHARED_KEY_SIZE);
+    mark_used(table, index);
+    ++cache->stats.hits;
+    return true;
+}
+
+void shared_key_cache_add(Shared_Key_Cache *cache, const uint8_t *public_key, const uint8_t *shared_key)
+{
+    Shared_Key_Table *const table = &cache->table;
+    const uint32_t index = table_find(cache, table, public_key);
+
+    if (index != NO_ENTRY) {
+        mark_used(table, index);
+        return;
+    }
+
+    if (table_insert(cache, table, public_key, shared_key)) {
+        ++cache->stats.evictions;
+    }
+}
+
+void shared_key_cache_lookup(Shared_Key_Cache *cache, uint8_t *shared_key, const uint8_t *secret_key,
+                             const uint8_t *public_key)
+{
+    if (shared_key_cache_get(cache, shared_key, public_key)) {
+        return;
+    }
+
+    encrypt_precompute(public_key, secret_key, shared_key);
+    shared_key_cache_add(cache, public_key, shared_key);
+}
+
+bool shared_key_cache_resize(Shared_Key_Cache *cache, uint32_t size)
+{
+    if (size == 0 || size > SHARED_KEY_CACHE_MAX_SIZE) {
+        return false;
+    }
+
+    if (size == cache->table.capacity) {
+        return true;
+    }
+
+    Shared_Key_Table table;
+
+    if (!table_init(&table, size)) {
+        return false;
+    }
+
+    /* Insert from least to most recently used, so if the new table is smaller
+     * the oldest keys are the ones pushed out and the order is kept. */
+    for (uint32_t i = cache->table.lru_tail; i != NO_ENTRY; i = cache->table.entries[i].lru_prev) {
+        const Shared_Key_Entry *const entry = &cache->table.entries[i];
+        table_insert(cache, &table, entry->public_key, entry->shared_key);
+    }
+
+    table_free(&cache->table);
+    cache->table = table;
+    return true;
+}
+
+uint32_t shared_key_cache_capacity(const Shared_Key_Cache *cache)
+{
+    return cache->table.capacity;
+}
+
+uint32_t shared_key_cache_count(const Shared_Key_Cache *cache)
+{
+    return cache->table.count;
+}
+
+void shared_key_cache_get_stats(const Shared_Key_Cache *cache, Shared_Key_Cache_Stats *stats)
+{
+    *stats = cache->stats;
+}
+
+void shared_key_cache_reset_stats(Shared_Key_Cache *cache)
+{
+    memset(&cache->stats, 0, sizeof(cache->stats));
+}
@@ -0,0 +1,123 @@
+/*
+ * Cache of precomputed shared keys, so the expensive key exchange only has to
+ * be done once for each peer we talk to.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef C_TOXCORE_TOXCORE_SHARED_KEY_CACHE_H
+#define C_TOXCORE_TOXCORE_SHARED_KEY_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Number of keys a cache holds unless it is resized. */
+#define SHARED_KEY_CACHE_DEFAULT_SIZE 1024
+
+/* Caches can't be made larger than this. */
+#define SHARED_KEY_CACHE_MAX_SIZE (1 << 20)
+
+#ifndef SHARED_KEY_CACHE_DEFINED
+#define SHARED_KEY_CACHE_DEFINED
+typedef struct Shared_Key_Cache Shared_Key_Cache;
+#endif /* SHARED_KEY_CACHE_DEFINED */
+
+typedef struct Shared_Key_Cache_Stats {
+    /* Lookups answered from the cache. */
+    uint64_t hits;
+    /* Lookups that had to compute the shared key. */
+    uint64_t misses;
+    /* Keys dropped to make room for a new one. */
+    uint64_t evictions;
+} Shared_Key_Cache_Stats;
+
+/**
+ * Create a cache holding up to size keys. When it is full, the least recently
+ * used key is evicted.
+ *
+ * @return nullptr on failure or if size is 0 or larger than SHARED_KEY_CACHE_MAX_SIZE.
+ */
+Shared_Key_Cache *shared_key_cache_new(uint32_t size);
+
+/**
+ * Free the cache and wipe the keys in it.
+ */
+void shared_key_cache_kill(Shared_Key_Cache *cache);
+
+/**
+ * Copy the shared key between secret_key and public_key into shared_key,
+ * computing it and storing it in the cache if it isn't there yet.
+ *
+ * Every user of a cache must pass the same secret key.
+ */
+void shared_key_cache_lookup(Shared_Key_Cache *cache, uint8_t *shared_key, const uint8_t *secret_key,
+                             const uint8_t *public_key);
+
+/**
+ * Copy the shared key for public_key into shared_key if it is in the cache.
+ * This counts as a hit or a miss like shared_key_cache_lookup().
+ *
+ * @return true if the key was found.
+ */
+bool shared_key_cache_get(Shared_Key_Cache *cache, uint8_t *shared_key, const uint8_t *public_key);
+
+/**
+ * Store a shared key computed elsewhere, or mark it as most recently used if
+ * the cache already has it.
+ */
+void shared_key_cache_add(Shared_Key_Cache *cache, const uint8_t *public_key, const uint8_t *shared_key);
+
+/**
+ * Change the number of keys the cache can hold, keeping the most recently
+ * used ones.
+ *
+ * @return true on success, false on allocation failure or an invalid size, in
+ *   which case the cache is left unchanged.
+ */
+bool shared_key_cache_resize(Shared_Key_Cache *cache, uint32_t size);
+
+/**
+ * Return the number of keys the cache can hold.
+ */
+uint32_t shared_key_cache_capacity(const Shared_Key_Cache *cache);
+
+/**
+ * Return the number of keys currently in the cache.
+ */
+uint32_t shared_key_cache_count(const Shared_Key_Cache *cache);
+
+/**
+ * Copy the counters of the cache into stats.
+ */
+void shared_key_cache_get_stats(const Shared_Key_Cache *cache, Shared_Key_Cache_Stats *stats);
+
+/**
+ * Set all counters of the cache to 0.
+ */
+void shared_key_cache_reset_stats(Shared_Key_Cache *cache);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif // C_TOXCORE_TOXCORE_SHARED_KEY_CACHE_H
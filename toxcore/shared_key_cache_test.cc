@@ -0,0 +1,170 @@
+#include "shared_key_cache.h"
+
+#include <array>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "crypto_core.h"
+
+namespace {
+
+using Public_Key = std::array<uint8_t, CRYPTO_PUBLIC_KEY_SIZE>;
+using Shared_Key = std::array<uint8_t, CRYPTO_SHARED_KEY_SIZE>;
+
+class SharedKeyCache : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    uint8_t self_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    crypto_new_keypair(self_public_key, secret_key_);
+  }
+
+  Public_Key new_public_key() {
+    Public_Key public_key;
+    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+    crypto_new_keypair(public_key.data(), secret_key);
+    return public_key;
+  }
+
+  Shared_Key lookup(Shared_Key_Cache *cache, const Public_Key &public_key) {
+    Shared_Key shared_key;
+    shared_key_cache_lookup(cache, shared_key.data(), secret_key_, public_key.data());
+    return shared_key;
+  }
+
+  Shared_Key_Cache_Stats stats(const Shared_Key_Cache *cache) {
+    Shared_Key_Cache_Stats stats;
+    shared_key_cache_get_stats(cache, &stats);
+    return stats;
+  }
+
+  uint8_t secret_key_[CRYPTO_SECRET_KEY_SIZE];
+};
+
+TEST_F(SharedKeyCache, RejectsInvalidSizes) {
+  EXPECT_EQ(shared_key_cache_new(0), nullptr);
+  EXPECT_EQ(shared_key_cache_new(SHARED_KEY_CACHE_MAX_SIZE + 1), nullptr);
+
+  Shared_Key_Cache *cache = shared_key_cache_new(1);
+  ASSERT_NE(cache, nullptr);
+  EXPECT_FALSE(shared_key_cache_resize(cache, 0));
+  EXPECT_EQ(shared_key_cache_capacity(cache), 1);
+  shared_key_cache_kill(cache);
+}
+
+TEST_F(SharedKeyCache, ReturnsPrecomputedKey) {
+  Shared_Key_Cache *cache = shared_key_cache_new(16);
+  ASSERT_NE(cache, nullptr);
+
+  const Public_Key public_key = new_public_key();
+  Shared_Key expected;
+  encrypt_precompute(public_key.data(), secret_key_, expected.data());
+
+  EXPECT_EQ(lookup(cache, public_key), expected);
+  EXPECT_EQ(lookup(cache, public_key), expected);
+  EXPECT_EQ(stats(cache).misses, 1);
+  EXPECT_EQ(stats(cache).hits, 1);
+  EXPECT_EQ(shared_key_cache_count(cache), 1);
+
+  shared_key_cache_kill(cache);
+}
+
+TEST_F(SharedKeyCache, EvictsLeastRecentlyUsed) {
+  Shared_Key_Cache *cache = shared_key_cache_new(3);
+  ASSERT_NE(cache, nullptr);
+
+  const Public_Key a = new_public_key();
+  const Public_Key b = new_public_key();
+  const Public_Key c = new_public_key();
+  const Public_Key d = new_public_key();
+
+  lookup(cache, a);
+  lookup(cache, b);
+  lookup(cache, c);
+  // Use a again, so b is now the least recently used.
+  lookup(cache, a);
+  lookup(cache, d);
+
+  EXPECT_EQ(stats(cache).evictions, 1);
+  EXPECT_EQ(shared_key_cache_count(cache), 3);
+
+  shared_key_cache_reset_stats(cache);
+  lookup(cache, a);
+  lookup(cache, c);
+  lookup(cache, d);
+  EXPECT_EQ(stats(cache).hits, 3);
+  EXPECT_EQ(stats(cache).misses, 0);
+
+  lookup(cache, b);
+  EXPECT_EQ(stats(cache).misses, 1);
+  EXPECT_EQ(stats(cache).evictions, 1);
+
+  shared_key_cache_kill(cache);
+}
+
+TEST_F(SharedKeyCache, ResizeKeepsMostRecentlyUsed) {
+  Shared_Key_Cache *cache = shared_key_cache_new(64);
+  ASSERT_NE(cache, nullptr);
+
+  std::vector<Public_Key> keys;
+
+  for (uint32_t i = 0; i < 64; ++i) {
+    keys.push_back(new_public_key());
+    lookup(cache, keys.back());
+  }
+
+  ASSERT_TRUE(shared_key_cache_resize(cache, 8));
+  EXPECT_EQ(shared_key_cache_capacity(cache), 8);
+  EXPECT_EQ(shared_key_cache_count(cache), 8);
+
+  shared_key_cache_reset_stats(cache);
+
+  for (uint32_t i = 56; i < 64; ++i) {
+    Shared_Key expected;
+    encrypt_precompute(keys[i].data(), secret_key_, expected.data());
+    EXPECT_EQ(lookup(cache, keys[i]), expected);
+  }
+
+  EXPECT_EQ(stats(cache).hits, 8);
+  EXPECT_EQ(stats(cache).misses, 0);
+
+  ASSERT_TRUE(shared_key_cache_resize(cache, 128));
+  EXPECT_EQ(shared_key_cache_count(cache), 8);
+
+  for (uint32_t i = 0; i < 64; ++i) {
+    lookup(cache, keys[i]);
+  }
+
+  EXPECT_EQ(stats(cache).hits, 16);
+  EXPECT_EQ(stats(cache).misses, 56);
+  EXPECT_EQ(stats(cache).evictions, 0);
+
+  shared_key_cache_kill(cache);
+}
+
+TEST_F(SharedKeyCache, StaysConsistentUnderChurn) {
+  Shared_Key_Cache *cache = shared_key_cache_new(32);
+  ASSERT_NE(cache, nullptr);
+
+  std::vector<Public_Key> keys;
+
+  for (uint32_t i = 0; i < 100; ++i) {
+    keys.push_back(new_public_key());
+  }
+
+  for (uint32_t i = 0; i < 2000; ++i) {
+    const Public_Key &public_key = keys[random_u32() % keys.size()];
+    Shared_Key expected;
+    encrypt_precompute(public_key.data(), secret_key_, expected.data());
+    ASSERT_EQ(lookup(cache, public_key), expected);
+  }
+
+  const Shared_Key_Cache_Stats cache_stats = stats(cache);
+  EXPECT_EQ(cache_stats.hits + cache_stats.misses, 2000);
+  EXPECT_EQ(cache_stats.evictions, cache_stats.misses - 32);
+  EXPECT_EQ(shared_key_cache_count(cache), 32);
+
+  shared_key_cache_kill(cache);
+}
+
+}  // namespace
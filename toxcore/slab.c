@@ -0,0 +1,251 @@
+/*
+ * Slab allocator for many objects of the same size, such as packets waiting
+ * in a send or receive window.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "slab.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "ccompat.h"
+
+/* Objects are aligned to this many bytes, enough for any scalar type. */
+#define SLAB_ALIGNMENT 16
+
+typedef struct Slab_Chunk Slab_Chunk;
+
+/* Stored in front of every object. */
+typedef struct Slab_Object_Header {
+    Slab_Chunk *chunk;
+    /* Next free object of the chunk, only used while this one is free. */
+    struct Slab_Object_Header *next_free;
+} Slab_Object_Header;
+
+/* One slab. The objects follow the chunk header in the same allocation. */
+struct Slab_Chunk {
+    Slab_Chunk *prev;
+    Slab_Chunk *next;
+    Slab_Object_Header *free_list;
+    uint32_t num_used;
+};
+
+typedef struct Slab_Chunk_List {
+    Slab_Chunk *head;
+} Slab_Chunk_List;
+
+struct Slab {
+    uint32_t objects_per_slab;
+    size_t object_offset;
+    size_t slot_size;
+    size_t chunk_header_size;
+
+    /* Chunks with at least one free object, including the empty one if any. */
+    Slab_Chunk_List partial;
+    /* Chunks without free objects. */
+    Slab_Chunk_List full;
+    bool has_empty_chunk;
+
+    Slab_Stats stats;
+};
+
+static size_t align_up(size_t size)
+{
+    return (size + SLAB_ALIGNMENT - 1) / SLAB_ALIGNMENT * SLAB_ALIGNMENT;
+}
+
+static void chunk_list_push(Slab_Chunk_List *list, Slab_Chunk *chunk)
+{
+    chunk->prev = nullptr;
+    chunk->next = list->head;
+
+    if (list->head != nullptr) {
+        list->head->prev = chunk;
+    }
+
+    list->head = chunk;
+}
+
+static void chunk_list_remove(Slab_Chunk_List *list, Slab_Chunk *chunk)
+{
+    if (chunk->prev != nullptr) {
+        chunk->prev->next = chunk->next;
+    } else {
+        list->head = chunk->next;
+    }
+
+    if (chunk->next != nullptr) {
+        chunk->next->prev = chunk->prev;
+    }
+}
+
+static void chunk_list_free(Slab_Chunk_List *list)
+{
+    while (list->head != nullptr) {
+        Slab_Chunk *const next = list->head->next;
+        free(list->head);
+        list->head = next;
+    }
+}
+
+static Slab_Object_Header *chunk_slot(const Slab *slab, Slab_Chunk *chunk, uint32_t index)
+{
+    return (Slab_Object_Header *)((uint8_t *)chunk + slab->chunk_header_size + index * slab->slot_size);
+}
+
+static Slab_Chunk *chunk_new(Slab *slab)
+{
+    Slab_Chunk *const chunk = (Slab_Chunk *)malloc(slab->chunk_header_size
+                              + (size_t)slab->objects_per_slab * slab->slot_size);
+
+    if (chunk == nullptr) {
+        return nullptr;
+    }
+
+    chunk->num_used = 0;
+    chunk->free_list = nullptr;
+
+    for (uint32_t i = slab->objects_per_slab; i != 0; --i) {
+        Slab_Object_Header *const header = chunk_slot(slab, chunk, i - 1);
+        header->chunk = chunk;
+        header->next_free = chunk->free_list;
+        chunk->free_list = header;
+    }
+
+    ++slab->stats.slab_allocations;
+    ++slab->stats.slabs;
+    return chunk;
+}
+
+Slab *slab_new(uint32_t object_size, uint32_t objects_per_slab)
+{
+    if (object_size == 0 || objects_per_slab == 0) {
+        return nullptr;
+    }
+
+    Slab *const slab = (Slab *)calloc(1, sizeof(Slab));
+
+    if (slab == nullptr) {
+        return nullptr;
+    }
+
+    slab->objects_per_slab = objects_per_slab;
+    slab->object_offset = align_up(sizeof(Slab_Object_Header));
+    slab->slot_size = align_up(slab->object_offset + object_size);
+    slab->chunk_header_size = align_up(sizeof(Slab_Chunk));
+
+    if (objects_per_slab > (SIZE_MAX - slab->chunk_header_size) / slab->slot_size) {
+        free(slab);
+        return nullptr;
+    }
+
+    return slab;
+}
+
+void slab_kill(Slab *slab)
+{
+    if (slab == nullptr) {
+        return;
+    }
+
+    chunk_list_free(&slab->partial);
+    chunk_list_free(&slab->full);
+    free(slab);
+}
+
+void *slab_alloc(Slab *slab)
+{
+    Slab_Chunk *chunk = slab->partial.head;
+
+    if (chunk == nullptr) {
+        chunk = chunk_new(slab);
+
+        if (chunk == nullptr) {
+            return nullptr;
+        }
+
+        chunk_list_push(&slab->partial, chunk);
+    } else if (chunk->num_used == 0) {
+        slab->has_empty_chunk = false;
+    }
+
+    Slab_Object_Header *const header = chunk->free_list;
+    chunk->free_list = header->next_free;
+    ++chunk->num_used;
+
+    if (chunk->free_list == nullptr) {
+        chunk_list_remove(&slab->partial, chunk);
+        chunk_list_push(&slab->full, chunk);
+    }
+
+    ++slab->stats.allocations;
+    ++slab->stats.in_use;
+
+    if (slab->stats.in_use > slab->stats.peak_in_use) {
+        slab->stats.peak_in_use = slab->stats.in_use;
+    }
+
+    return (uint8_t *)header + slab->object_offset;
+}
+
+void slab_free(Slab *slab, void *object)
+{
+    if (object == nullptr) {
+        return;
+    }
+
+    Slab_Object_Header *const header = (Slab_Object_Header *)((uint8_t *)object - slab->object_offset);
+    Slab_Chunk *const chunk = header->chunk;
+
+    if (chunk->free_list == nullptr) {
+        chunk_list_remove(&slab->full, chunk);
+        chunk_list_push(&slab->partial, chunk);
+    }
+
+    header->next_free = chunk->free_list;
+    chunk->free_list = header;
+    --chunk->num_used;
+
+    ++slab->stats.frees;
+    --slab->stats.in_use;
+
+    if (chunk->num_used != 0) {
+        return;
+    }
+
+    if (!slab->has_empty_chunk) {
+        slab->has_empty_chunk = true;
+        return;
+    }
+
+    chunk_list_remove(&slab->partial, chunk);
+    free(chunk);
+    --slab->stats.slabs;
+}
+
+void slab_get_stats(const Slab *slab, Slab_Stats *stats)
+{
+    *stats = slab->stats;
+}
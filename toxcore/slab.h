@@ -0,0 +1,92 @@
+/*
+ * Slab allocator for many objects of the same size, such as packets waiting
+ * in a send or receive window.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef C_TOXCORE_TOXCORE_SLAB_H
+#define C_TOXCORE_TOXCORE_SLAB_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SLAB_DEFINED
+#define SLAB_DEFINED
+typedef struct Slab Slab;
+#endif /* SLAB_DEFINED */
+
+typedef struct Slab_Stats {
+    /* Objects handed out by slab_alloc(), ever. */
+    uint64_t allocations;
+    /* Objects given back with slab_free(), ever. */
+    uint64_t frees;
+    /* Slabs requested from the system allocator, ever. */
+    uint64_t slab_allocations;
+    /* Objects currently allocated. */
+    uint32_t in_use;
+    /* Highest value in_use has had. */
+    uint32_t peak_in_use;
+    /* Slabs currently held, including at most one empty slab kept for reuse. */
+    uint32_t slabs;
+} Slab_Stats;
+
+/**
+ * Create an allocator for objects of object_size bytes, getting memory from
+ * the system objects_per_slab objects at a time.
+ *
+ * A slab is returned to the system once all its objects are freed, except for
+ * one empty slab that is kept so alternating allocations and frees don't call
+ * the system allocator every time.
+ *
+ * @return nullptr on failure or if either size is 0.
+ */
+Slab *slab_new(uint32_t object_size, uint32_t objects_per_slab);
+
+/**
+ * Free the allocator and all slabs. Objects still allocated become invalid.
+ */
+void slab_kill(Slab *slab);
+
+/**
+ * Allocate an object. Its content is not initialised.
+ *
+ * @return nullptr on allocation failure.
+ */
+void *slab_alloc(Slab *slab);
+
+/**
+ * Give back an object returned by slab_alloc() on the same allocator.
+ * Passing nullptr does nothing.
+ */
+void slab_free(Slab *slab, void *object);
+
+/**
+ * Copy the counters of the allocator into stats.
+ */
+void slab_get_stats(const Slab *slab, Slab_Stats *stats);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif // C_TOXCORE_TOXCORE_SLAB_H
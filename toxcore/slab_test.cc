@@ -0,0 +1,153 @@
+#include "slab.h"
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <set>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+struct Slab_Deleter {
+  void operator()(Slab *slab) { slab_kill(slab); }
+};
+
+using Slab_Ptr = std::unique_ptr<Slab, Slab_Deleter>;
+
+Slab_Stats get_stats(const Slab *slab) {
+  Slab_Stats stats;
+  slab_get_stats(slab, &stats);
+  return stats;
+}
+
+TEST(Slab, RejectsZeroSizes) {
+  EXPECT_EQ(slab_new(0, 8), nullptr);
+  EXPECT_EQ(slab_new(8, 0), nullptr);
+}
+
+TEST(Slab, ObjectsAreDistinctAlignedAndWritable) {
+  Slab_Ptr slab(slab_new(1373, 4));
+  ASSERT_NE(slab, nullptr);
+
+  std::vector<uint8_t *> objects;
+
+  for (int i = 0; i < 10; ++i) {
+    auto *object = static_cast<uint8_t *>(slab_alloc(slab.get()));
+    ASSERT_NE(object, nullptr);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(object) % alignof(uint64_t), 0);
+    memset(object, i, 1373);
+    objects.push_back(object);
+  }
+
+  EXPECT_EQ(std::set<uint8_t *>(objects.begin(), objects.end()).size(), objects.size());
+
+  for (int i = 0; i < 10; ++i) {
+    for (int j = 0; j < 1373; ++j) {
+      ASSERT_EQ(objects[i][j], i);
+    }
+  }
+
+  for (uint8_t *object : objects) {
+    slab_free(slab.get(), object);
+  }
+}
+
+TEST(Slab, FreedObjectsAreReused) {
+  Slab_Ptr slab(slab_new(64, 8));
+  ASSERT_NE(slab, nullptr);
+
+  void *first = slab_alloc(slab.get());
+  slab_free(slab.get(), first);
+  EXPECT_EQ(slab_alloc(slab.get()), first);
+  slab_free(slab.get(), first);
+
+  // Alternating allocations and frees don't touch the system allocator again.
+  for (int i = 0; i < 1000; ++i) {
+    slab_free(slab.get(), slab_alloc(slab.get()));
+  }
+
+  const Slab_Stats stats = get_stats(slab.get());
+  EXPECT_EQ(stats.slab_allocations, 1);
+  EXPECT_EQ(stats.allocations, 1002);
+  EXPECT_EQ(stats.frees, 1002);
+  EXPECT_EQ(stats.in_use, 0);
+  EXPECT_EQ(stats.peak_in_use, 1);
+}
+
+TEST(Slab, CountsSlabsAndReturnsEmptyOnes) {
+  Slab_Ptr slab(slab_new(16, 4));
+  ASSERT_NE(slab, nullptr);
+
+  std::vector<void *> objects;
+
+  for (int i = 0; i < 16; ++i) {
+    objects.push_back(slab_alloc(slab.get()));
+  }
+
+  Slab_Stats stats = get_stats(slab.get());
+  EXPECT_EQ(stats.slabs, 4);
+  EXPECT_EQ(stats.in_use, 16);
+  EXPECT_EQ(stats.peak_in_use, 16);
+
+  for (void *object : objects) {
+    slab_free(slab.get(), object);
+  }
+
+  // One empty slab is kept around for the next allocation.
+  stats = get_stats(slab.get());
+  EXPECT_EQ(stats.slabs, 1);
+  EXPECT_EQ(stats.in_use, 0);
+  EXPECT_EQ(stats.peak_in_use, 16);
+  EXPECT_EQ(stats.slab_allocations, 4);
+
+  EXPECT_NE(slab_alloc(slab.get()), nullptr);
+  EXPECT_EQ(get_stats(slab.get()).slab_allocations, 4);
+}
+
+TEST(Slab, FreesInAnyOrder) {
+  Slab_Ptr slab(slab_new(8, 3));
+  ASSERT_NE(slab, nullptr);
+
+  std::vector<void *> objects;
+
+  for (int round = 0; round < 50; ++round) {
+    for (int i = 0; i < 7; ++i) {
+      objects.push_back(slab_alloc(slab.get()));
+    }
+
+    // Free every other object, oldest first.
+    for (size_t i = 0; i < objects.size(); i += 2) {
+      slab_free(slab.get(), objects[i]);
+      objects[i] = nullptr;
+    }
+
+    std::vector<void *> live;
+
+    for (void *object : objects) {
+      if (object != nullptr) {
+        live.push_back(object);
+      }
+    }
+
+    objects = live;
+    EXPECT_EQ(get_stats(slab.get()).in_use, objects.size());
+  }
+
+  for (void *object : objects) {
+    slab_free(slab.get(), object);
+  }
+
+  EXPECT_EQ(get_stats(slab.get()).in_use, 0);
+  EXPECT_EQ(get_stats(slab.get()).slabs, 1);
+}
+
+TEST(Slab, FreeingNullDoesNothing) {
+  Slab_Ptr slab(slab_new(8, 8));
+  ASSERT_NE(slab, nullptr);
+  slab_free(slab.get(), nullptr);
+  EXPECT_EQ(get_stats(slab.get()).frees, 0);
+}
+
+}  // namespace
@@ -412,6 +412,27 @@ enum class PROXY_TYPE {
   SOCKS5,
 }
 
+/**
+ * Algorithm deciding how fast data is sent to a friend.
+ *
+ * @deprecated All UPPER_CASE enum type names are deprecated. Use the
+ *   Camel_Snake_Case versions, instead.
+ */
+enum class CONGESTION_CONTROL {
+  /**
+   * Infer the link speed from how many packets are waiting to be sent and
+   * how many had to be resent.
+   */
+  QUEUE,
+  /**
+   * Estimate the bandwidth of the slowest link to the friend from the rate
+   * at which packets arrive, send at that rate and slow down as soon as the
+   * round trip time grows. Keeps queues on routers short, so it is faster
+   * on links with large buffers or a long round trip time.
+   */
+  DELAY,
+}
+
 /**
  * Type of savedata to create the Tox instance from.
  *
@@ -623,6 +644,56 @@ static class options {
        */
       any user_data;
     }
+
+    /**
+     * Maximum number of UDP packets to send or receive per system call.
+     *
+     * If this is greater than 1 and the platform supports it (currently
+     * Linux), Tox reads up to this many packets at once and queues outgoing
+     * UDP packets until the end of $iterate. This greatly reduces the number
+     * of system calls on busy nodes. Packets sent from other API functions are
+     * put on the wire at the next $iterate. Values above 64 are capped.
+     *
+     * If this is 0 or 1 (the default), every packet is sent and received with
+     * its own system call.
+     */
+    uint16_t udp_batch_size;
+
+    /**
+     * Number of threads computing shared keys for new peers.
+     *
+     * The first packet from a DHT node or onion path we haven't talked to
+     * recently needs an expensive key exchange. If this is greater than 0,
+     * that is done by this many background threads, and the packet is handled
+     * in a later $iterate once the key is ready, so a burst of new peers
+     * doesn't delay everything else $iterate does.
+     *
+     * If this is 0 (the default), or the threads can't be started (at most
+     * 64 are allowed), the keys are computed inside $iterate.
+     */
+    uint8_t precompute_threads;
+
+    /**
+     * Algorithm deciding how fast data is sent to friends.
+     *
+     * The default is ${CONGESTION_CONTROL.QUEUE}. Unknown values are treated
+     * as the default.
+     */
+    CONGESTION_CONTROL congestion_control;
+
+    /**
+     * Milliseconds small packets to a friend may wait to be sent together.
+     *
+     * If this is greater than 0, small packets such as typing notifications,
+     * read receipts and small custom packets are held back for up to this
+     * long and sent to the friend in a single encrypted packet, which reduces
+     * the number of packets sent and their processing cost for busy clients
+     * and bots. Only friends running a version of toxcore that supports this
+     * receive packets this way. Values above 100 are capped.
+     *
+     * If this is 0 (the default), every packet is sent right away.
+     */
+    uint16_t coalescing_delay;
   }
 
 
@@ -894,6 +965,19 @@ inline namespace self {
 const uint32_t iteration_interval();
 
 
+/**
+ * Return the time in milliseconds an event loop watching the descriptors from
+ * $get_fds and $get_write_fds may wait for them before calling
+ * $iterate again.
+ *
+ * Unlike $iteration_interval this is not capped at 50 milliseconds, so an
+ * idle instance may wait up to a second. A loop that doesn't watch the
+ * descriptors must use $iteration_interval instead, since packets arriving
+ * would otherwise wait that long.
+ */
+const uint32_t iteration_timeout();
+
+
 /**
  * The main loop that needs to be run in intervals of $iteration_interval()
  * milliseconds.
@@ -901,6 +985,53 @@ const uint32_t iteration_interval();
 void iterate(any user_data);
 
 
+int32_t[size] fds {
+  /**
+   * Return the number of file descriptors Tox currently reads from.
+   *
+   * The set of file descriptors changes as TCP connections come and go, so
+   * it should be fetched again after each call to $iterate.
+   */
+  size();
+
+  /**
+   * Copy the file descriptors Tox currently reads from into an array.
+   *
+   * Instead of calling $iterate on a fixed schedule, an event loop can wait
+   * until one of these file descriptors becomes readable, one of the
+   * descriptors returned by $get_write_fds becomes writable, or
+   * $iteration_timeout milliseconds have passed, whichever comes first,
+   * and then call $iterate. This allows many Tox instances to be driven by
+   * a single epoll or poll loop.
+   *
+   * POSIX only: a Windows SOCKET does not fit in int32_t. Windows clients
+   * should call $iterate every $iteration_interval milliseconds instead.
+   *
+   * @param fds A memory region large enough to store $size file
+   *   descriptors. If this parameter is NULL, this function has no effect.
+   */
+  get();
+}
+
+
+int32_t[size] write_fds {
+  /**
+   * Return the number of file descriptors Tox has pending outgoing data for.
+   */
+  size();
+
+  /**
+   * Copy the file descriptors Tox has pending outgoing data for into an
+   * array. These are a subset of the descriptors returned by $get_fds, and
+   * should additionally be watched for becoming writable.
+   *
+   * @param write_fds A memory region large enough to store $size file
+   *   descriptors. If this parameter is NULL, this function has no effect.
+   */
+  get();
+}
+
+
 /*******************************************************************************
  *
  * :: Internal client information (Tox address/id)
@@ -1507,6 +1638,91 @@ namespace friend {
 
 }
 
+%{
+/**
+ * Statistics about the connection to a friend, see tox_friend_get_transport_stats.
+ */
+struct Tox_Transport_Stats {
+
+    /**
+     * How the friend is connected: TOX_CONNECTION_UDP for a direct connection,
+     * TOX_CONNECTION_TCP through a TCP relay, TOX_CONNECTION_NONE if offline.
+     * If offline, all other fields are 0.
+     */
+    TOX_CONNECTION connection;
+
+    /**
+     * Round trip time in milliseconds: the lowest seen on the connection.
+     */
+    uint32_t rtt;
+
+    /**
+     * Number of data packets per second that may currently be sent to the
+     * friend. This is how much bandwidth congestion control thinks is
+     * available; each packet carries at most TOX_MAX_CUSTOM_PACKET_SIZE bytes.
+     */
+    uint32_t send_rate;
+
+    /**
+     * Number of data packets per second recently received from the friend.
+     */
+    uint32_t recv_rate;
+
+    /**
+     * Number of packets sent but not acknowledged by the friend yet. A queue
+     * that keeps growing means we are sending faster than the path allows.
+     */
+    uint32_t send_queue_size;
+
+    /**
+     * Number of packets received out of order, waiting for earlier packets
+     * that were lost.
+     */
+    uint32_t recv_queue_size;
+
+    /**
+     * Number of reliable packets sent since the connection was established,
+     * not counting resent ones.
+     */
+    uint64_t packets_sent;
+
+    /**
+     * Number of reliable packets that had to be resent because they were lost.
+     * packets_resent / packets_sent estimates the loss rate of the path.
+     */
+    uint64_t packets_resent;
+
+    /**
+     * Number of bytes sent to and received from the friend on the wire,
+     * including encryption overhead and handshake packets sent.
+     */
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+
+    /**
+     * Largest packet in bytes sent to the friend. Above 1400 once the direct
+     * UDP path was found to carry larger packets.
+     */
+    uint32_t path_mtu;
+
+};
+
+/**
+ * Get statistics about the connection to a friend, to find out why transfers
+ * are slow.
+ *
+ * The values are a snapshot; call this periodically, e.g. once a second, to
+ * see how they change.
+ *
+ * @param friend_number The friend number for which to query the statistics.
+ * @param stats A struct to fill with the statistics. Must not be NULL.
+ *
+ * @return true on success.
+ */
+bool tox_friend_get_transport_stats(const Tox *tox, uint32_t friend_number, struct Tox_Transport_Stats *stats,
+                                    TOX_ERR_FRIEND_QUERY *error);
+%}
+
 
 /*******************************************************************************
  *
@@ -1607,6 +1823,22 @@ namespace friend {
     typedef void(uint32_t friend_number, uint32_t message_id);
   }
 
+
+  /**
+   * This event is triggered once after sending a message, file chunk or
+   * lossless custom packet to the friend failed with a SENDQ error, as soon as
+   * the send queue has room again. Clients producing data faster than the
+   * connection can carry it can wait for this event instead of retrying every
+   * $iterate.
+   */
+  event send_queue_writable const {
+    /**
+     * @param friend_number The friend number of the friend whose send queue has
+     *   room again.
+     */
+    typedef void(uint32_t friend_number);
+  }
+
 }
 
 
@@ -2701,6 +2933,31 @@ namespace friend {
     bool lossless_packet(uint32_t friend_number, const uint8_t[length <= MAX_CUSTOM_PACKET_SIZE] data)
         with error for custom_packet;
 
+    /**
+     * Send a custom lossless packet to a friend, without waiting for the
+     * packets sent before it to arrive.
+     *
+     * The first byte of data must be in the range 160-191. Maximum length of a
+     * custom packet is $MAX_CUSTOM_PACKET_SIZE.
+     *
+     * Like lossless packets, the packet is resent until the friend receives it,
+     * but it is passed to the friend's `friend_lossless_packet` callback as soon
+     * as it arrives, possibly before lossless packets sent earlier. Use this for
+     * independent messages where latency matters more than order. Friends running
+     * older versions of toxcore receive it in order like any lossless packet.
+     * Packets longer than $MAX_CUSTOM_PACKET_SIZE - 3 leave no room for the
+     * header this needs, so they are also received in order.
+     *
+     * @param friend_number The friend number of the friend this lossless packet
+     *   should be sent to.
+     * @param data A byte array containing the packet data.
+     * @param length The length of the packet data byte array.
+     *
+     * @return true on success.
+     */
+    bool lossless_packet_unordered(uint32_t friend_number, const uint8_t[length <= MAX_CUSTOM_PACKET_SIZE] data)
+        with error for custom_packet;
+
   }
 
 
@@ -2818,6 +3075,7 @@ typedef TOX_ERR_GET_PORT Tox_Err_Get_Port;
 typedef TOX_USER_STATUS Tox_User_Status;
 typedef TOX_MESSAGE_TYPE Tox_Message_Type;
 typedef TOX_PROXY_TYPE Tox_Proxy_Type;
+typedef TOX_CONGESTION_CONTROL Tox_Congestion_Control;
 typedef TOX_SAVEDATA_TYPE Tox_Savedata_Type;
 typedef TOX_LOG_LEVEL Tox_Log_Level;
 typedef TOX_CONNECTION Tox_Connection;
@@ -87,6 +87,7 @@ struct Tox {
     tox_friend_connection_status_cb *friend_connection_status_callback;
     tox_friend_typing_cb *friend_typing_callback;
     tox_friend_read_receipt_cb *friend_read_receipt_callback;
+    tox_friend_send_queue_writable_cb *friend_send_queue_writable_callback;
     tox_friend_request_cb *friend_request_callback;
     tox_friend_message_cb *friend_message_callback;
     tox_file_recv_control_cb *file_recv_control_callback;
@@ -175,6 +176,15 @@ static void tox_friend_read_receipt_handler(Messenger *m, uint32_t friend_number
     }
 }
 
+static void tox_friend_send_queue_writable_handler(Messenger *m, uint32_t friend_number, void *user_data)
+{
+    struct Tox_Userdata *tox_data = (struct Tox_Userdata *)user_data;
+
+    if (tox_data->tox->friend_send_queue_writable_callback != nullptr) {
+        tox_data->tox->friend_send_queue_writable_callback(tox_data->tox, friend_number, tox_data->user_data);
+    }
+}
+
 static void tox_friend_request_handler(Messenger *m, const uint8_t *public_key, const uint8_t *message, size_t length,
                                        void *user_data)
 {
@@ -450,6 +460,21 @@ Tox *tox_new(const struct Tox_Options *options, Tox_Err_New *error)
     m_options.tcp_server_port = tox_options_get_tcp_port(opts);
     m_options.hole_punching_enabled = tox_options_get_hole_punching_enabled(opts);
     m_options.local_discovery_enabled = tox_options_get_local_discovery_enabled(opts);
+    m_options.udp_batch_size = tox_options_get_udp_batch_size(opts);
+    m_options.precompute_threads = tox_options_get_precompute_threads(opts);
+
+    switch (tox_options_get_congestion_control(opts)) {
+        case TOX_CONGESTION_CONTROL_DELAY:
+            m_options.congestion_algorithm = CONGESTION_ALGORITHM_DELAY;
+            break;
+
+        case TOX_CONGESTION_CONTROL_QUEUE:
+        default:
+            m_options.congestion_algorithm = CONGESTION_ALGORITHM_QUEUE;
+            break;
+    }
+
+    m_options.coalescing_delay = tox_options_get_coalescing_delay(opts);
 
     m_options.log_callback = (logger_cb *)tox_options_get_log_callback(opts);
     m_options.log_context = tox;
@@ -549,6 +574,7 @@ Tox *tox_new(const struct Tox_Options *options, Tox_Err_New *error)
     m_callback_connectionstatus(m, tox_friend_connection_status_handler);
     m_callback_typingchange(m, tox_friend_typing_handler);
     m_callback_read_receipt(m, tox_friend_read_receipt_handler);
+    m_callback_send_queue_writable(m, tox_friend_send_queue_writable_handler);
     m_callback_friendrequest(m, tox_friend_request_handler);
     m_callback_friendmessage(m, tox_friend_message_handler);
     callback_file_control(m, tox_file_recv_control_handler);
@@ -738,6 +764,75 @@ uint32_t tox_iteration_interval(const Tox *tox)
     return messenger_run_interval(m);
 }
 
+uint32_t tox_iteration_timeout(const Tox *tox)
+{
+    const Messenger *m = tox->m;
+    return messenger_poll_interval(m);
+}
+
+/* Copy the sockets of the Tox instance into out, optionally only the ones with
+ * pending writes.
+ *
+ * return the number of sockets.
+ */
+static uint32_t get_fds(const Tox *tox, int32_t *out, bool write_only)
+{
+    const uint32_t num_fds = messenger_get_fds(tox->m, nullptr, 0);
+
+    if (num_fds == 0) {
+        return 0;
+    }
+
+    Net_Poll_Fd *fds = (Net_Poll_Fd *)calloc(num_fds, sizeof(Net_Poll_Fd));
+
+    if (fds == nullptr) {
+        return 0;
+    }
+
+    messenger_get_fds(tox->m, fds, num_fds);
+
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < num_fds; ++i) {
+        if (write_only && !fds[i].want_write) {
+            continue;
+        }
+
+        if (out != nullptr) {
+            out[count] = fds[i].sock.socket;
+        }
+
+        ++count;
+    }
+
+    free(fds);
+    return count;
+}
+
+size_t tox_get_fds_size(const Tox *tox)
+{
+    return messenger_get_fds(tox->m, nullptr, 0);
+}
+
+void tox_get_fds(const Tox *tox, int32_t *fds)
+{
+    if (fds) {
+        get_fds(tox, fds, false);
+    }
+}
+
+size_t tox_get_write_fds_size(const Tox *tox)
+{
+    return get_fds(tox, nullptr, true);
+}
+
+void tox_get_write_fds(const Tox *tox, int32_t *write_fds)
+{
+    if (write_fds) {
+        get_fds(tox, write_fds, true);
+    }
+}
+
 void tox_iterate(Tox *tox, void *user_data)
 {
     mono_time_update(tox->mono_time);
@@ -1149,6 +1244,48 @@ void tox_callback_friend_connection_status(Tox *tox, tox_friend_connection_statu
     tox->friend_connection_status_callback = callback;
 }
 
+static uint32_t clamp_to_u32(double value)
+{
+    return value < (double)UINT32_MAX ? (uint32_t)value : UINT32_MAX;
+}
+
+bool tox_friend_get_transport_stats(const Tox *tox, uint32_t friend_number, struct Tox_Transport_Stats *stats,
+                                    Tox_Err_Friend_Query *error)
+{
+    if (!stats) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_QUERY_NULL);
+        return 0;
+    }
+
+    const Messenger *m = tox->m;
+    Crypto_Connection_Stats conn_stats;
+    const int connection = m_get_friend_connectionstatus(m, friend_number);
+
+    if (connection == -1 || m_get_friend_transport_stats(m, friend_number, &conn_stats) == -1) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND);
+        return 0;
+    }
+
+    memset(stats, 0, sizeof(struct Tox_Transport_Stats));
+
+    if (connection != CONNECTION_NONE) {
+        stats->connection = connection == CONNECTION_UDP ? TOX_CONNECTION_UDP : TOX_CONNECTION_TCP;
+        stats->rtt = clamp_to_u32(conn_stats.rtt);
+        stats->send_rate = clamp_to_u32(conn_stats.send_rate);
+        stats->recv_rate = clamp_to_u32(conn_stats.recv_rate);
+        stats->send_queue_size = conn_stats.send_queue_size;
+        stats->recv_queue_size = conn_stats.recv_queue_size;
+        stats->packets_sent = conn_stats.packets_sent;
+        stats->packets_resent = conn_stats.packets_resent;
+        stats->bytes_sent = conn_stats.bytes_sent;
+        stats->bytes_received = conn_stats.bytes_received;
+        stats->path_mtu = conn_stats.path_mtu;
+    }
+
+    SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_QUERY_OK);
+    return 1;
+}
+
 bool tox_friend_get_typing(const Tox *tox, uint32_t friend_number, Tox_Err_Friend_Query *error)
 {
     const Messenger *m = tox->m;
@@ -1239,6 +1376,11 @@ void tox_callback_friend_read_receipt(Tox *tox, tox_friend_read_receipt_cb *call
     tox->friend_read_receipt_callback = callback;
 }
 
+void tox_callback_friend_send_queue_writable(Tox *tox, tox_friend_send_queue_writable_cb *callback)
+{
+    tox->friend_send_queue_writable_callback = callback;
+}
+
 void tox_callback_friend_request(Tox *tox, tox_friend_request_cb *callback)
 {
     tox->friend_request_callback = callback;
@@ -2072,6 +2214,32 @@ bool tox_friend_send_lossless_packet(Tox *tox, uint32_t friend_number, const uin
     return 0;
 }
 
+bool tox_friend_send_lossless_packet_unordered(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length,
+        Tox_Err_Friend_Custom_Packet *error)
+{
+    if (!data) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_CUSTOM_PACKET_NULL);
+        return 0;
+    }
+
+    Messenger *m = tox->m;
+
+    if (length == 0) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_CUSTOM_PACKET_EMPTY);
+        return 0;
+    }
+
+    const int ret = send_custom_lossless_packet_unordered(m, friend_number, data, length);
+
+    set_custom_packet_error(ret, error);
+
+    if (ret == 0) {
+        return 1;
+    }
+
+    return 0;
+}
+
 void tox_callback_friend_lossless_packet(Tox *tox, tox_friend_lossless_packet_cb *callback)
 {
     tox->friend_lossless_packet_callback = callback;
@@ -458,6 +458,31 @@ typedef enum TOX_PROXY_TYPE {
 } TOX_PROXY_TYPE;
 
 
+/**
+ * Algorithm deciding how fast data is sent to a friend.
+ *
+ * @deprecated All UPPER_CASE enum type names are deprecated. Use the
+ *   Camel_Snake_Case versions, instead.
+ */
+typedef enum TOX_CONGESTION_CONTROL {
+
+    /**
+     * Infer the link speed from how many packets are waiting to be sent and
+     * how many had to be resent.
+     */
+    TOX_CONGESTION_CONTROL_QUEUE,
+
+    /**
+     * Estimate the bandwidth of the slowest link to the friend from the rate
+     * at which packets arrive, send at that rate and slow down as soon as the
+     * round trip time grows. Keeps queues on routers short, so it is faster
+     * on links with large buffers or a long round trip time.
+     */
+    TOX_CONGESTION_CONTROL_DELAY,
+
+} TOX_CONGESTION_CONTROL;
+
+
 /**
  * Type of savedata to create the Tox instance from.
  *
@@ -690,6 +715,60 @@ struct Tox_Options {
      */
     void *log_user_data;
 
+
+    /**
+     * Maximum number of UDP packets to send or receive per system call.
+     *
+     * If this is greater than 1 and the platform supports it (currently
+     * Linux), Tox reads up to this many packets at once and queues outgoing
+     * UDP packets until the end of tox_iterate. This greatly reduces the number
+     * of system calls on busy nodes. Packets sent from other API functions are
+     * put on the wire at the next tox_iterate. Values above 64 are capped.
+     *
+     * If this is 0 or 1 (the default), every packet is sent and received with
+     * its own system call.
+     */
+    uint16_t udp_batch_size;
+
+
+    /**
+     * Number of threads computing shared keys for new peers.
+     *
+     * The first packet from a DHT node or onion path we haven't talked to
+     * recently needs an expensive key exchange. If this is greater than 0,
+     * that is done by this many background threads, and the packet is handled
+     * in a later tox_iterate once the key is ready, so a burst of new peers
+     * doesn't delay everything else tox_iterate does.
+     *
+     * If this is 0 (the default), or the threads can't be started (at most
+     * 64 are allowed), the keys are computed inside tox_iterate.
+     */
+    uint8_t precompute_threads;
+
+
+    /**
+     * Algorithm deciding how fast data is sent to friends.
+     *
+     * The default is TOX_CONGESTION_CONTROL_QUEUE. Unknown values are
+     * treated as the default.
+     */
+    TOX_CONGESTION_CONTROL congestion_control;
+
+
+    /**
+     * Milliseconds small packets to a friend may wait to be sent together.
+     *
+     * If this is greater than 0, small packets such as typing notifications,
+     * read receipts and small custom packets are held back for up to this
+     * long and sent to the friend in a single encrypted packet, which reduces
+     * the number of packets sent and their processing cost for busy clients
+     * and bots. Only friends running a version of toxcore that supports this
+     * receive packets this way. Values above 100 are capped.
+     *
+     * If this is 0 (the default), every packet is sent right away.
+     */
+    uint16_t coalescing_delay;
+
 };
 
 
@@ -753,6 +832,22 @@ void *tox_options_get_log_user_data(const struct Tox_Options *options);
 
 void tox_options_set_log_user_data(struct Tox_Options *options, void *user_data);
 
+uint16_t tox_options_get_udp_batch_size(const struct Tox_Options *options);
+
+void tox_options_set_udp_batch_size(struct Tox_Options *options, uint16_t udp_batch_size);
+
+uint8_t tox_options_get_precompute_threads(const struct Tox_Options *options);
+
+void tox_options_set_precompute_threads(struct Tox_Options *options, uint8_t precompute_threads);
+
+TOX_CONGESTION_CONTROL tox_options_get_congestion_control(const struct Tox_Options *options);
+
+void tox_options_set_congestion_control(struct Tox_Options *options, TOX_CONGESTION_CONTROL congestion_control);
+
+uint16_t tox_options_get_coalescing_delay(const struct Tox_Options *options);
+
+void tox_options_set_coalescing_delay(struct Tox_Options *options, uint16_t coalescing_delay);
+
 /**
  * Initialises a Tox_Options object with the default options.
  *
@@ -1051,12 +1146,65 @@ void tox_callback_self_connection_status(Tox *tox, tox_self_connection_status_cb
  */
 uint32_t tox_iteration_interval(const Tox *tox);
 
+/**
+ * Return the time in milliseconds an event loop watching the descriptors from
+ * tox_get_fds and tox_get_write_fds may wait for them before calling
+ * tox_iterate again.
+ *
+ * Unlike tox_iteration_interval this is not capped at 50 milliseconds, so an
+ * idle instance may wait up to a second. A loop that doesn't watch the
+ * descriptors must use tox_iteration_interval instead, since packets arriving
+ * would otherwise wait that long.
+ */
+uint32_t tox_iteration_timeout(const Tox *tox);
+
 /**
  * The main loop that needs to be run in intervals of tox_iteration_interval()
  * milliseconds.
  */
 void tox_iterate(Tox *tox, void *user_data);
 
+/**
+ * Return the number of file descriptors Tox currently reads from.
+ *
+ * The set of file descriptors changes as TCP connections come and go, so
+ * it should be fetched again after each call to tox_iterate.
+ */
+size_t tox_get_fds_size(const Tox *tox);
+
+/**
+ * Copy the file descriptors Tox currently reads from into an array.
+ *
+ * Instead of calling tox_iterate on a fixed schedule, an event loop can wait
+ * until one of these file descriptors becomes readable, one of the
+ * descriptors returned by tox_get_write_fds becomes writable, or
+ * tox_iteration_timeout milliseconds have passed, whichever comes first,
+ * and then call tox_iterate. This allows many Tox instances to be driven by
+ * a single epoll or poll loop.
+ *
+ * POSIX only: a Windows SOCKET does not fit in int32_t. Windows clients
+ * should call tox_iterate every tox_iteration_interval milliseconds instead.
+ *
+ * @param fds A memory region large enough to store tox_get_fds_size file
+ *   descriptors. If this parameter is NULL, this function has no effect.
+ */
+void tox_get_fds(const Tox *tox, int32_t *fds);
+
+/**
+ * Return the number of file descriptors Tox has pending outgoing data for.
+ */
+size_t tox_get_write_fds_size(const Tox *tox);
+
+/**
+ * Copy the file descriptors Tox has pending outgoing data for into an
+ * array. These are a subset of the descriptors returned by tox_get_fds, and
+ * should additionally be watched for becoming writable.
+ *
+ * @param write_fds A memory region large enough to store tox_get_write_fds_size file
+ *   descriptors. If this parameter is NULL, this function has no effect.
+ */
+void tox_get_write_fds(const Tox *tox, int32_t *write_fds);
+
 
 /*******************************************************************************
  *
@@ -1682,6 +1830,100 @@ typedef void tox_friend_typing_cb(Tox *tox, uint32_t friend_number, bool is_typi
 void tox_callback_friend_typing(Tox *tox, tox_friend_typing_cb *callback);
 
 
+/**
+ * Statistics about the connection to a friend, see tox_friend_get_transport_stats.
+ */
+struct Tox_Transport_Stats {
+
+    /**
+     * How the friend is connected: TOX_CONNECTION_UDP for a direct connection,
+     * TOX_CONNECTION_TCP through a TCP relay, TOX_CONNECTION_NONE if offline.
+     * If offline, all other fields are 0.
+     */
+    TOX_CONNECTION connection;
+
+
+    /**
+     * Round trip time in milliseconds: the lowest seen on the connection.
+     */
+    uint32_t rtt;
+
+
+    /**
+     * Number of data packets per second that may currently be sent to the
+     * friend. This is how much bandwidth congestion control thinks is
+     * available; each packet carries at most TOX_MAX_CUSTOM_PACKET_SIZE bytes.
+     */
+    uint32_t send_rate;
+
+
+    /**
+     * Number of data packets per second recently received from the friend.
+     */
+    uint32_t recv_rate;
+
+
+    /**
+     * Number of packets sent but not acknowledged by the friend yet. A queue
+     * that keeps growing means we are sending faster than the path allows.
+     */
+    uint32_t send_queue_size;
+
+
+    /**
+     * Number of packets received out of order, waiting for earlier packets
+     * that were lost.
+     */
+    uint32_t recv_queue_size;
+
+
+    /**
+     * Number of reliable packets sent since the connection was established,
+     * not counting resent ones.
+     */
+    uint64_t packets_sent;
+
+
+    /**
+     * Number of reliable packets that had to be resent because they were lost.
+     * packets_resent / packets_sent estimates the loss rate of the path.
+     */
+    uint64_t packets_resent;
+
+
+    /**
+     * Number of bytes sent to and received from the friend on the wire,
+     * including encryption overhead and handshake packets sent.
+     */
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+
+
+    /**
+     * Largest packet in bytes sent to the friend. Above 1400 once the direct
+     * UDP path was found to carry larger packets.
+     */
+    uint32_t path_mtu;
+
+};
+
+
+/**
+ * Get statistics about the connection to a friend, to find out why transfers
+ * are slow.
+ *
+ * The values are a snapshot; call this periodically, e.g. once a second, to
+ * see how they change.
+ *
+ * @param friend_number The friend number for which to query the statistics.
+ * @param stats A struct to fill with the statistics. Must not be NULL.
+ *
+ * @return true on success.
+ */
+bool tox_friend_get_transport_stats(const Tox *tox, uint32_t friend_number, struct Tox_Transport_Stats *stats,
+                                    TOX_ERR_FRIEND_QUERY *error);
+
+
 /*******************************************************************************
  *
  * :: Sending private messages
@@ -1799,6 +2041,24 @@ typedef void tox_friend_read_receipt_cb(Tox *tox, uint32_t friend_number, uint32
  */
 void tox_callback_friend_read_receipt(Tox *tox, tox_friend_read_receipt_cb *callback);
 
+/**
+ * @param friend_number The friend number of the friend whose send queue has
+ *   room again.
+ */
+typedef void tox_friend_send_queue_writable_cb(Tox *tox, uint32_t friend_number, void *user_data);
+
+
+/**
+ * Set the callback for the `friend_send_queue_writable` event. Pass NULL to unset.
+ *
+ * This event is triggered once after sending a message, file chunk or
+ * lossless custom packet to the friend failed with a SENDQ error, as soon as
+ * the send queue has room again. Clients producing data faster than the
+ * connection can carry it can wait for this event instead of retrying every
+ * tox_iterate.
+ */
+void tox_callback_friend_send_queue_writable(Tox *tox, tox_friend_send_queue_writable_cb *callback);
+
 
 /*******************************************************************************
  *
@@ -3088,6 +3348,31 @@ bool tox_friend_send_lossy_packet(Tox *tox, uint32_t friend_number, const uint8_
 bool tox_friend_send_lossless_packet(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length,
                                      TOX_ERR_FRIEND_CUSTOM_PACKET *error);
 
+/**
+ * Send a custom lossless packet to a friend, without waiting for the
+ * packets sent before it to arrive.
+ *
+ * The first byte of data must be in the range 160-191. Maximum length of a
+ * custom packet is TOX_MAX_CUSTOM_PACKET_SIZE.
+ *
+ * Like lossless packets, the packet is resent until the friend receives it,
+ * but it is passed to the friend's `friend_lossless_packet` callback as soon
+ * as it arrives, possibly before lossless packets sent earlier. Use this for
+ * independent messages where latency matters more than order. Friends running
+ * older versions of toxcore receive it in order like any lossless packet.
+ * Packets longer than TOX_MAX_CUSTOM_PACKET_SIZE - 3 leave no room for the
+ * header this needs, so they are also received in order.
+ *
+ * @param friend_number The friend number of the friend this lossless packet
+ *   should be sent to.
+ * @param data A byte array containing the packet data.
+ * @param length The length of the packet data byte array.
+ *
+ * @return true on success.
+ */
+bool tox_friend_send_lossless_packet_unordered(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length,
+        TOX_ERR_FRIEND_CUSTOM_PACKET *error);
+
 /**
  * @param friend_number The friend number of the friend who sent a lossy packet.
  * @param data A byte array containing the received packet data.
@@ -3203,6 +3488,7 @@ typedef TOX_ERR_GET_PORT Tox_Err_Get_Port;
 typedef TOX_USER_STATUS Tox_User_Status;
 typedef TOX_MESSAGE_TYPE Tox_Message_Type;
 typedef TOX_PROXY_TYPE Tox_Proxy_Type;
+typedef TOX_CONGESTION_CONTROL Tox_Congestion_Control;
 typedef TOX_SAVEDATA_TYPE Tox_Savedata_Type;
 typedef TOX_LOG_LEVEL Tox_Log_Level;
 typedef TOX_CONNECTION Tox_Connection;
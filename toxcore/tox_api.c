@@ -58,6 +58,10 @@ ACCESSORS(size_t, savedata_, length)
 ACCESSORS(tox_log_cb *, log_, callback)
 ACCESSORS(void *, log_, user_data)
 ACCESSORS(bool,, local_discovery_enabled)
+ACCESSORS(uint16_t,, udp_batch_size)
+ACCESSORS(uint8_t,, precompute_threads)
+ACCESSORS(TOX_CONGESTION_CONTROL,, congestion_control)
+ACCESSORS(uint16_t,, coalescing_delay)
 
 const uint8_t *tox_options_get_savedata_data(const struct Tox_Options *options)
 {
@@ -80,6 +84,7 @@ void tox_options_default(struct Tox_Options *options)
         tox_options_set_proxy_type(options, TOX_PROXY_TYPE_NONE);
         tox_options_set_hole_punching_enabled(options, true);
         tox_options_set_local_discovery_enabled(options, true);
+        tox_options_set_congestion_control(options, TOX_CONGESTION_CONTROL_QUEUE);
     }
 }
 